@@ -1,5 +1,9 @@
 #include "ViewerApplication.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
 #include <iostream>
 #include <numeric>
 
@@ -8,9 +12,27 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/io.hpp>
 
+#include "utils/animation.hpp"
 #include "utils/cameras.hpp"
+#include "utils/dynamic_resolution.hpp"
+#include "utils/frame_uniforms.hpp"
+#include "utils/gl_state_cache.hpp"
 #include "utils/gltf.hpp"
 #include "utils/images.hpp"
+#include "utils/indirect_commands.hpp"
+#include "utils/lights.hpp"
+#include "utils/lod.hpp"
+#include "utils/materials.hpp"
+#include "utils/meshopt.hpp"
+#include "utils/morph.hpp"
+#include "utils/occlusion.hpp"
+#include "utils/parallel.hpp"
+#include "utils/render_jobs.hpp"
+#include "utils/shader_variants.hpp"
+#include "utils/shadows.hpp"
+#include "utils/skinning.hpp"
+#include "utils/sort.hpp"
+#include "utils/vertex_pulling.hpp"
 
 #include <stb_image_write.h>
 #include <tiny_gltf.h>
@@ -20,6 +42,59 @@ using namespace std;
 const GLuint VERTEX_ATTRIB_POSITION_IDX = 0;
 const GLuint VERTEX_ATTRIB_NORMAL_IDX = 1;
 const GLuint VERTEX_ATTRIB_TEXCOORD0_IDX = 2;
+// Per instance attributes, a mat4 takes 4 consecutive locations
+const GLuint VERTEX_ATTRIB_MATERIAL_IDX = 3;
+const GLuint VERTEX_ATTRIB_MODEL_MATRIX_IDX = 4;
+const GLuint VERTEX_ATTRIB_NORMAL_MATRIX_IDX = 8;
+const GLuint VERTEX_ATTRIB_PRIMITIVE_IDX = 12;
+const GLuint VERTEX_ATTRIB_DEFORMATION_OFFSETS_IDX = 13; // Skin and morph offsets
+// Skinning attributes of the primitives, they use the last of the 16 locations
+const GLuint VERTEX_ATTRIB_JOINTS_IDX = 14;
+const GLuint VERTEX_ATTRIB_WEIGHTS_IDX = 15;
+
+// Draw sort key layout, from most to least significant bits: states that are
+// the most expensive to change come first so that draws sharing them are
+// grouped, the remaining bits order draws front to back
+const uint64_t SORT_KEY_PROGRAM_BITS = 12;
+const uint64_t SORT_KEY_MATERIAL_BITS = 16;
+const uint64_t SORT_KEY_PRIMITIVE_BITS = 24;
+const uint64_t SORT_KEY_DEPTH_BITS = 12;
+static_assert(SORT_KEY_PROGRAM_BITS + SORT_KEY_MATERIAL_BITS + SORT_KEY_PRIMITIVE_BITS + SORT_KEY_DEPTH_BITS == 64,
+			  "Draw sort key must use 64 bits");
+static_assert(SHADER_FEATURE_COUNT <= SORT_KEY_PROGRAM_BITS, "Shader features must fit in the program field");
+
+// Primitives are identified by the index of their selected level of detail, draws of a same level
+// are consecutive and each primitive has its own VAO unless geometry is merged
+uint64_t makeDrawSortKey(uint32_t program, uint32_t materialIndex, uint32_t primitive, float normalizedDepth) {
+	const auto field = [](uint64_t value, uint64_t bits, uint64_t shift) {
+		return (value & ((uint64_t(1) << bits) - 1)) << shift;
+	};
+	const uint64_t depth = uint64_t(glm::clamp(normalizedDepth, 0.f, 1.f) * ((1 << SORT_KEY_DEPTH_BITS) - 1));
+	return field(program, SORT_KEY_PROGRAM_BITS, SORT_KEY_MATERIAL_BITS + SORT_KEY_PRIMITIVE_BITS + SORT_KEY_DEPTH_BITS) |
+		   field(materialIndex, SORT_KEY_MATERIAL_BITS, SORT_KEY_PRIMITIVE_BITS + SORT_KEY_DEPTH_BITS) |
+		   field(primitive, SORT_KEY_PRIMITIVE_BITS, SORT_KEY_DEPTH_BITS) |
+		   field(depth, SORT_KEY_DEPTH_BITS, 0);
+}
+
+// Software occlusion culling: width of the CPU depth buffer (its height follows the window
+// aspect ratio) and largest number of occluders rasterized per frame
+const size_t OCCLUSION_BUFFER_WIDTH = 320;
+const size_t MAX_OCCLUDER_COUNT = 32;
+
+// Instances visible at their last occlusion query are queried again once every this number of frames
+const uint32_t OCCLUSION_QUERY_VISIBLE_INTERVAL = 8;
+
+// In automatic mode, the depth prepass is enabled above this overdraw (depth test passes per pixel, the
+// samples of a multisampled framebuffer count as one pass) and disabled below the second value
+const double AUTO_DEPTH_PREPASS_ENABLE_OVERDRAW = 1.5;
+const double AUTO_DEPTH_PREPASS_DISABLE_OVERDRAW = 1.2;
+
+// Cascaded shadow maps: size of each cascade, blend between logarithmic and uniform cascade splits,
+// and depth bias of the casters (slope factor and constant units of glPolygonOffset)
+const GLsizei SHADOW_MAP_RESOLUTION = 2048;
+const float SHADOW_CASCADE_SPLIT_LAMBDA = 0.75f;
+const float SHADOW_SLOPE_BIAS = 2.f;
+const float SHADOW_CONSTANT_BIAS = 4.f;
 
 void keyCallback(
 		GLFWwindow * window, int key, int scancode, int action, int mods) {
@@ -29,75 +104,111 @@ void keyCallback(
 }
 
 int ViewerApplication::run() {
-	// Loader shaders
-	const auto glslProgram =
-			compileProgram({m_ShadersRootPath / m_AppName / m_vertexShader,
-							m_ShadersRootPath / m_AppName / m_fragmentShader});
-
-	const auto modelViewProjMatrixLocation =
-			glGetUniformLocation(glslProgram.glId(), "uModelViewProjMatrix");
-	const auto modelViewMatrixLocation =
-			glGetUniformLocation(glslProgram.glId(), "uModelViewMatrix");
-	const auto normalMatrixLocation =
-			glGetUniformLocation(glslProgram.glId(), "uNormalMatrix");
-	const auto baseColorTextureLocation =
-			glGetUniformLocation(glslProgram.glId(), "uBaseColorTexture");
-	const auto baseColorFactorLocation =
-			glGetUniformLocation(glslProgram.glId(), "uBaseColorFactor");
-	const auto metallicFactorLocation =
-			glGetUniformLocation(glslProgram.glId(), "uMetallicFactor");
-	const auto roughnessFactorLocation =
-			glGetUniformLocation(glslProgram.glId(), "uRoughnessFactor");
-	const auto metallicRoughnessTextureLocation =
-			glGetUniformLocation(glslProgram.glId(), "uMetallicRoughnessTexture");
-	const auto emissiveFactorLocation =
-			glGetUniformLocation(glslProgram.glId(), "uEmissiveFactor");
-	const auto emissiveTextureLocation =
-			glGetUniformLocation(glslProgram.glId(), "uEmissiveTexture");
-	const auto occlusionStrengthLocation =
-			glGetUniformLocation(glslProgram.glId(), "uOcclusionStrength");
-	const auto occlusionTextureLocation =
-			glGetUniformLocation(glslProgram.glId(), "uOcclusionTexture");
-	// Directional light		
-	const auto lightDirectionLocation =
-			glGetUniformLocation(glslProgram.glId(), "dirLight.uLightDirection");
-	const auto lightIntensityLocation =
-			glGetUniformLocation(glslProgram.glId(), "dirLight.uLightIntensity");
-	// Point light 
-	const auto pointLightPositionLocation =
-			glGetUniformLocation(glslProgram.glId(), "pointLight.position");
-	const auto pointLightColorLocation =
-			glGetUniformLocation(glslProgram.glId(), "pointLight.color");
-	const auto pointLightConstantLocation =
-			glGetUniformLocation(glslProgram.glId(), "pointLight.constant");
-	const auto pointLightQuadraticLocation =
-			glGetUniformLocation(glslProgram.glId(), "pointLight.quadratic");
-	const auto pointLightLinearLocation =
-			glGetUniformLocation(glslProgram.glId(), "pointLight.linear");
-	
-	// Spot light
-	const auto spotLightPositionLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.position");
-	const auto spotLightDirectionLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.direction");
-	const auto spotLightColorLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.color");
-	const auto spotLightCutOffLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.cutOff");
-	const auto spotLightOuterCutOffLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.outerCutOff");
-	const auto spotLightConstantLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.constant");
-	const auto spotLightLinearLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.linear");
-	const auto spotLightQuadraticLocation =
-			glGetUniformLocation(glslProgram.glId(), "spotLight.quadratic");
+	// Each texture map has its own unit, samplers never change
+	const GLuint BASE_COLOR_TEXTURE_UNIT = 0;
+	const GLuint METALLIC_ROUGHNESS_TEXTURE_UNIT = 1;
+	const GLuint EMISSIVE_TEXTURE_UNIT = 2;
+	const GLuint OCCLUSION_TEXTURE_UNIT = 3;
+	const GLuint SHADOW_MAP_TEXTURE_UNIT = 4;
+	// Texture buffer of the joint matrices or of the CPU skinned vertices
+	const GLuint SKINNING_TEXTURE_UNIT = 5;
+	// Texture buffers of the morph target deltas and of the active weights of each instance
+	const GLuint MORPH_DELTAS_TEXTURE_UNIT = 6;
+	const GLuint MORPH_WEIGHTS_TEXTURE_UNIT = 7;
+
+	// Camera and lights are read from uniform buffers written once per frame
+	const auto bindUniformBlock = [&](const GLProgram & program, const char * blockName, GLuint binding) {
+		const GLuint blockIndex = glGetUniformBlockIndex(program.glId(), blockName);
+		if (blockIndex != GL_INVALID_INDEX) {
+			glUniformBlockBinding(program.glId(), blockIndex, binding);
+		}
+	};
+
+	// Loader shaders, vertex pulling has its own vertex shader. Shading programs are variants
+	// compiled for the textures of the materials and the lights in use.
+	ShaderVariantCache shadingPrograms(
+			{m_ShadersRootPath / m_AppName / (m_vertexPulling ? "vertex_pulling.vs.glsl" : m_vertexShader),
+			 m_ShadersRootPath / m_AppName / m_fragmentShader},
+			[&](const GLProgram & program) {
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uBaseColorTexture"),
+								   BASE_COLOR_TEXTURE_UNIT);
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uMetallicRoughnessTexture"),
+								   METALLIC_ROUGHNESS_TEXTURE_UNIT);
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uEmissiveTexture"),
+								   EMISSIVE_TEXTURE_UNIT);
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uOcclusionTexture"),
+								   OCCLUSION_TEXTURE_UNIT);
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uShadowMap"),
+								   SHADOW_MAP_TEXTURE_UNIT);
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uSkinningBuffer"),
+								   SKINNING_TEXTURE_UNIT);
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uMorphDeltas"),
+								   MORPH_DELTAS_TEXTURE_UNIT);
+				glProgramUniform1i(program.glId(), program.getUniformLocation("uMorphWeights"),
+								   MORPH_WEIGHTS_TEXTURE_UNIT);
+				bindUniformBlock(program, "CameraUniforms", CAMERA_UNIFORMS_BINDING);
+				bindUniformBlock(program, "LightUniforms", LIGHT_UNIFORMS_BINDING);
+			});
+	// Depth and shadow programs only have vertex feature variants
+	const auto setupDepthProgram = [&](const GLProgram & program) {
+		glProgramUniform1i(program.glId(), program.getUniformLocation("uSkinningBuffer"), SKINNING_TEXTURE_UNIT);
+		glProgramUniform1i(program.glId(), program.getUniformLocation("uMorphDeltas"), MORPH_DELTAS_TEXTURE_UNIT);
+		glProgramUniform1i(program.glId(), program.getUniformLocation("uMorphWeights"), MORPH_WEIGHTS_TEXTURE_UNIT);
+		bindUniformBlock(program, "CameraUniforms", CAMERA_UNIFORMS_BINDING);
+	};
+	// Same vertex shader with an empty fragment shader, for the depth prepass
+	ShaderVariantCache depthPrograms(
+			{m_ShadersRootPath / m_AppName / (m_vertexPulling ? "vertex_pulling.vs.glsl" : m_vertexShader),
+			 m_ShadersRootPath / m_AppName / "depth_only.fs.glsl"},
+			setupDepthProgram);
+	// Bounding boxes drawn for GPU occlusion queries
+	const auto occlusionBoxProgram =
+			compileProgram({m_ShadersRootPath / m_AppName / "occlusion_box.vs.glsl",
+							m_ShadersRootPath / m_AppName / "occlusion_box.fs.glsl"});
+	const auto boxMinLocation = glGetUniformLocation(occlusionBoxProgram.glId(), "uBoxMin");
+	const auto boxMaxLocation = glGetUniformLocation(occlusionBoxProgram.glId(), "uBoxMax");
+	// Shadow casters are drawn with the vertex shader of the scene, a geometry shader writes them to
+	// the layers of the cascades
+	ShaderVariantCache shadowPrograms(
+			{m_ShadersRootPath / m_AppName / (m_vertexPulling ? "vertex_pulling.vs.glsl" : m_vertexShader),
+			 m_ShadersRootPath / m_AppName / "shadow_cascades.gs.glsl",
+			 m_ShadersRootPath / m_AppName / "depth_only.fs.glsl"},
+			setupDepthProgram);
+	bindUniformBlock(occlusionBoxProgram, "CameraUniforms", CAMERA_UNIFORMS_BINDING);
 
 	tinygltf::Model model;
 	if(!loadGltfFile(model)) {
 		return 1;
 	}
 
+	// Index and vertex order of the primitives are optimized before any GL upload
+	MeshOptimizationStats meshOptimizationStats;
+	if (m_optimizeMeshes) {
+		meshOptimizationStats = optimizeMeshes(model, m_overdrawThreshold);
+		std::cout << "Optimized " << meshOptimizationStats.primitiveCount << " primitives ("
+				  << meshOptimizationStats.triangleCount << " triangles), ACMR "
+				  << meshOptimizationStats.acmrBefore << " -> " << meshOptimizationStats.acmrAfter << std::endl;
+	}
+
+	// Simplified index buffers of the primitives, one level is selected per instance at draw time
+	std::vector<PrimitiveLods> primitiveLods;
+	if (m_generateLods) {
+		primitiveLods = generateLods(model);
+		size_t simplifiedCount = 0, levelCount = 0;
+		for (const auto & lods : primitiveLods) {
+			simplifiedCount += lods.indexAccessors.empty() ? 0 : 1;
+			levelCount += lods.indexAccessors.size();
+		}
+		std::cout << "Generated " << levelCount << " levels of detail for " << simplifiedCount << " primitives"
+				  << std::endl;
+	}
+
+	// CPU copies of the occluder triangles, for software occlusion culling
+	std::vector<OccluderMesh> occluderMeshes;
+	if (m_softwareOcclusion) {
+		occluderMeshes = buildOccluderMeshes(model, primitiveLods);
+	}
+
 	glm::vec3 bboxMin, bboxMax;
 	computeSceneBounds(model, bboxMin, bboxMax);
 
@@ -121,9 +232,17 @@ int ViewerApplication::run() {
 	// Build projection matrix
 	float maxDistance = glm::length(diagonal);
 	maxDistance = maxDistance > 0.f ? maxDistance : 100.f;
+	const float nearPlane = 0.001f * maxDistance;
+	const float farPlane = 1.5f * maxDistance;
 	const glm::mat4 projMatrix =
 			glm::perspective(70.f, float(m_nWindowWidth) / m_nWindowHeight,
-							 0.001f * maxDistance, 1.5f * maxDistance);
+							 nearPlane, farPlane);
+	// Size of the rendered image, a fraction of the window with dynamic resolution
+	GLsizei renderWidth = m_nWindowWidth;
+	GLsizei renderHeight = m_nWindowHeight;
+	// Offset of the projection in pixels, for the supersampling passes of render to image. It only
+	// moves the rasterized image, culling and shadows use the projection matrix.
+	glm::vec2 projectionPixelOffset(0);
 
 	std::unique_ptr<CameraController> cameraController = std::make_unique<TrackballCameraController>(m_GLFWHandle.window(), 1.f * maxDistance);
 	if (m_hasUserCamera) {
@@ -133,11 +252,115 @@ int ViewerApplication::run() {
 				Camera{eye, center, up});
 	}
 
-	std::vector<GLuint> vbos = createBufferObjects(model);
+	// Draw arguments of all primitives, primitiveDraws[indexToVaoRange[meshIdx].begin + primitiveIdx]
+	std::vector<GLuint> vbos;
 	std::vector<VaoRange> indexToVaoRange;
-	std::vector<GLuint> vaos = createVertexArrayObjects(model, vbos, indexToVaoRange);
+	std::vector<GLuint> vaos;
+	std::vector<PrimitiveDraw> primitiveDraws;
+	// Offset of the indices of a level of detail from those of LOD 0, the levels of a primitive are
+	// contiguous in the same glTF buffer
+	const auto getLodIndexOffset = [&](const PrimitiveLods & lods, size_t lod) {
+		const auto byteOffset = [&](int accessorIdx) {
+			const tinygltf::Accessor & accessor = model.accessors[accessorIdx];
+			return accessor.byteOffset + model.bufferViews[accessor.bufferView].byteOffset;
+		};
+		return GLuint((byteOffset(lods.indexAccessors[lod]) - byteOffset(lods.indexAccessors[0])) / sizeof(uint32_t));
+	};
+	// When all primitives share a VAO, ranges only index primitiveDraws
+	const auto computePrimitiveRanges = [&]() {
+		for (const auto & mesh : model.meshes) {
+			const auto primitiveOffset = indexToVaoRange.empty() ? 0 :
+					indexToVaoRange.back().begin + indexToVaoRange.back().count;
+			indexToVaoRange.push_back(VaoRange{primitiveOffset, GLsizei(mesh.primitives.size())});
+		}
+	};
+	if (m_vertexPulling) {
+		// Vertex attributes and indices are read by the vertex shader from storage buffers, in their
+		// original format. The only VAO holds the instance attributes.
+		const VertexPullingData pullingData = buildVertexPullingData(model);
+		vbos.resize(2);
+		glGenBuffers(2, vbos.data());
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, vbos[0]);
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, pullingData.vertexData.size() * sizeof(uint32_t),
+						pullingData.vertexData.data(), 0);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, vbos[1]);
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, pullingData.primitives.size() * sizeof(PulledPrimitiveFormat),
+						pullingData.primitives.data(), 0);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, VERTEX_DATA_BINDING, vbos[0]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PRIMITIVE_FORMATS_BINDING, vbos[1]);
+
+		vaos.resize(1);
+		glGenVertexArrays(1, vaos.data());
+		computePrimitiveRanges();
+		for (const auto & mesh : model.meshes) {
+			for (const auto & prim : mesh.primitives) {
+				const PulledPrimitiveFormat & format = pullingData.primitives[primitiveDraws.size()];
+				primitiveDraws.push_back(PrimitiveDraw{vaos.front(), GLenum(prim.mode), GL_NONE, format.vertexCount, 0, 0});
+			}
+		}
+	} else if (m_mergeGeometry) {
+		// All primitives share one VAO and are drawn with a base vertex
+		PackedGeometry geometry = packGeometry(model);
+		// LOD 0 is replaced by the index data of all levels of detail, to keep their offsets
+		for (size_t primitive = 0; primitive < primitiveLods.size(); ++primitive) {
+			const PrimitiveLods & lods = primitiveLods[primitive];
+			if (lods.indexAccessors.empty()) {
+				continue;
+			}
+			const tinygltf::Accessor & accessor = model.accessors[lods.indexAccessors.front()];
+			const tinygltf::BufferView & bufferView = model.bufferViews[accessor.bufferView];
+			const auto * lodIndices = reinterpret_cast<const uint32_t *>(
+					model.buffers[bufferView.buffer].data.data() + bufferView.byteOffset + accessor.byteOffset);
+			const size_t lodIndexCount = getLodIndexOffset(lods, lods.indexAccessors.size() - 1) +
+										 model.accessors[lods.indexAccessors.back()].count;
+			geometry.primitives[primitive].firstIndex = uint32_t(geometry.indices.size());
+			geometry.indices.insert(end(geometry.indices), lodIndices, lodIndices + lodIndexCount);
+		}
+		vaos.push_back(createPackedVertexArrayObject(geometry, vbos));
+		for (const auto & packed : geometry.primitives) {
+			primitiveDraws.push_back(PrimitiveDraw{vaos.front(), GLenum(packed.mode), GL_UNSIGNED_INT,
+												   packed.indexCount, packed.firstIndex, packed.baseVertex});
+		}
+		computePrimitiveRanges();
+	} else {
+		vbos = createBufferObjects(model);
+		vaos = createVertexArrayObjects(model, vbos, indexToVaoRange);
+		primitiveDraws = getPrimitiveDraws(model, vaos);
+	}
+
+	// Draw arguments of the levels of detail, primitiveLodRanges[primitive] indexes lodDraws and
+	// lodErrors. Primitives without generated levels only have their LOD 0.
+	std::vector<VaoRange> primitiveLodRanges;
+	std::vector<PrimitiveDraw> lodDraws;
+	std::vector<float> lodErrors;
+	for (size_t primitive = 0; primitive < primitiveDraws.size(); ++primitive) {
+		const PrimitiveDraw & draw = primitiveDraws[primitive];
+		primitiveLodRanges.push_back(VaoRange{GLsizei(lodDraws.size()), 1});
+		lodDraws.push_back(draw);
+		lodErrors.push_back(0.f);
+		if (primitive >= primitiveLods.size()) {
+			continue;
+		}
+		const PrimitiveLods & lods = primitiveLods[primitive];
+		for (size_t lod = 1; lod < lods.indexAccessors.size(); ++lod) {
+			PrimitiveDraw lodDraw = draw;
+			lodDraw.count = GLsizei(model.accessors[lods.indexAccessors[lod]].count);
+			lodDraw.first = draw.first + getLodIndexOffset(lods, lod);
+			lodDraws.push_back(lodDraw);
+			lodErrors.push_back(lods.errors[lod]);
+			++primitiveLodRanges.back().count;
+		}
+	}
 	std::vector<GLuint> tos = createTextureObjects(model);
 
+	// Transforms and materials of the drawn instances, refilled every frame
+	GLuint instanceBuffer;
+	glGenBuffers(1, &instanceBuffer);
+	for (const GLuint vao : vaos) {
+		setInstanceAttributes(vao, instanceBuffer);
+	}
+
 	GLuint whiteTexture;
 	float white[4] = {1, 1, 1, 1};
 	// Generate the texture object
@@ -156,6 +379,18 @@ int ViewerApplication::run() {
 
 	glBindTexture(GL_TEXTURE_2D, 0);
 
+	const auto createUniformBuffer = [](GLsizeiptr size, GLuint binding) {
+		GLuint ubo;
+		glGenBuffers(1, &ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+		glBufferData(GL_UNIFORM_BUFFER, size, nullptr, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		return ubo;
+	};
+	const GLuint cameraUbo = createUniformBuffer(sizeof(CameraUniforms), CAMERA_UNIFORMS_BINDING);
+	const GLuint lightUbo = createUniformBuffer(sizeof(LightUniforms), LIGHT_UNIFORMS_BINDING);
+
 	glm::vec3 lightDirection(1, 1, 1);
 	glm::vec3 lightIntensity(1, 1, 1);
 	
@@ -170,202 +405,1007 @@ int ViewerApplication::run() {
 	float spotLightConstant = 1.f;
 	float spotLightLinear = 0.09f;
 	float spotLightQuadratic = 0.032f;
-	
-	
+
 	bool lightFromCamera = false;
 
+	// Punctual lights of the file are assigned to the clusters of the view frustum every frame and
+	// the PBR shader only evaluates the lights of the cluster of each fragment. The hardcoded point
+	// light is only on by default for files without lights. Lights follow their nodes when the scene
+	// transforms change.
+	std::vector<PunctualLight> punctualLights = readPunctualLights(model);
+	const auto directionalLightCount = std::count_if(begin(punctualLights), end(punctualLights),
+			[](const PunctualLight & light) { return light.type == LIGHT_TYPE_DIRECTIONAL; });
+	std::cout << "Found " << punctualLights.size() << " punctual lights" << std::endl;
+	bool defaultPointLight = punctualLights.empty();
+	std::vector<GPUPunctualLight> gpuPunctualLights;
+	LightClusterGrid lightClusterGrid;
+	double lightClusteringTime = 0.;
+	GLuint punctualLightsBuffer, lightClustersBuffer, lightClusterIndicesBuffer;
+	glGenBuffers(1, &punctualLightsBuffer);
+	glGenBuffers(1, &lightClustersBuffer);
+	glGenBuffers(1, &lightClusterIndicesBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PUNCTUAL_LIGHTS_BINDING, punctualLightsBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_CLUSTERS_BINDING, lightClustersBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_CLUSTER_INDICES_BINDING, lightClusterIndicesBuffer);
+	// Storage buffers are reallocated every frame, with at least one element so that empty lists
+	// are still backed by memory
+	const auto uploadStorageBuffer = [](GLuint buffer, GLsizeiptr size, const void * data) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, std::max(size, GLsizeiptr(sizeof(GPUPunctualLight))), nullptr,
+					 GL_STREAM_DRAW);
+		if (size) {
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, size, data);
+		}
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	};
+
+	// Cascaded shadow maps of the directional light. A cascade is only rendered again when its light
+	// or its footprint change, or when an instance moves in or out of it.
+	bool shadows = true;
+	ShadowRenderer shadowRenderer(SHADOW_MAP_RESOLUTION, SHADOW_CASCADE_SPLIT_LAMBDA, SHADOW_SLOPE_BIAS,
+								  SHADOW_CONSTANT_BIAS);
+	std::vector<uint32_t> shadowCasterMasks; // Per instance, cascades to render it in
+	std::vector<SortItem> shadowCasters; // Key is the draw in lodDraws, value the instance
+	uint32_t shadowUpdateMask = 0;
+	size_t shadowDrawCallCount = 0;
+
 	// Setup OpenGL state for rendering
 	glEnable(GL_DEPTH_TEST);
-	glslProgram.use();
-
-	// Lambda function to bind material
-	const auto bindMaterial = [&](const int materialIndex) {
-		GLuint sourceBaseColor = whiteTexture;
-		GLuint sourceMetallicRoughness = 0;
-		if (materialIndex >= 0) {
-			const tinygltf::Material & material = model.materials[materialIndex];
-			const tinygltf::PbrMetallicRoughness & pbrMetallicRoughness = material.pbrMetallicRoughness;
-			if(pbrMetallicRoughness.baseColorTexture.index >= 0) {
-				const tinygltf::Texture & texture = model.textures[pbrMetallicRoughness.baseColorTexture.index];
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_2D, tos[texture.source]);
-				glUniform1i(baseColorTextureLocation, 0);
-				glUniform4f(baseColorFactorLocation,
-							(float)pbrMetallicRoughness.baseColorFactor[0],
-							(float)pbrMetallicRoughness.baseColorFactor[1],
-							(float)pbrMetallicRoughness.baseColorFactor[2],
-							(float)pbrMetallicRoughness.baseColorFactor[3]);
-			}
-			else {
-				glBindTexture(GL_TEXTURE_2D, whiteTexture);
-				glActiveTexture(GL_TEXTURE0);
-				glUniform1i(baseColorTextureLocation, 0);
-				glUniform4f(baseColorFactorLocation, 1., 1., 1., 1.);
-			}
-			if(pbrMetallicRoughness.metallicRoughnessTexture.index >= 0) {
-				const tinygltf::Texture & texture = model.textures[pbrMetallicRoughness.metallicRoughnessTexture.index];
-				glActiveTexture(GL_TEXTURE1);
-				glBindTexture(GL_TEXTURE_2D, tos[texture.source]);
-				glUniform1i(metallicRoughnessTextureLocation, 1);
-				glUniform1f(metallicFactorLocation,
-							(float)pbrMetallicRoughness.metallicFactor);
-				glUniform1f(roughnessFactorLocation,
-							(float)pbrMetallicRoughness.roughnessFactor);
-			}
-			else {
-				glActiveTexture(GL_TEXTURE1);
-				glBindTexture(GL_TEXTURE_2D, whiteTexture);
-				glUniform1i(metallicRoughnessTextureLocation, 1);
-				glUniform1f(metallicFactorLocation, 0);
-				glUniform1f(roughnessFactorLocation, 0);
-			}
-			if(material.emissiveTexture.index >= 0) {
-				const tinygltf::Texture & texture = model.textures[material.emissiveTexture.index];
-				glActiveTexture(GL_TEXTURE2);
-				glBindTexture(GL_TEXTURE_2D, tos[texture.source]);
-				glUniform1i(emissiveTextureLocation, 2);
-				glUniform3f(emissiveFactorLocation,
-							(float)material.emissiveFactor[0],
-							(float)material.emissiveFactor[1],
-							(float)material.emissiveFactor[2]);
-			}
-			else {
-				glActiveTexture(GL_TEXTURE2);
-				glBindTexture(GL_TEXTURE_2D, 0);
-				glUniform1i(emissiveTextureLocation, 2);
-				glUniform3f(emissiveFactorLocation, 0, 0, 0);
-			}
-			if(material.occlusionTexture.index >= 0) {
-				const tinygltf::Texture & texture = model.textures[material.occlusionTexture.index];
-				glActiveTexture(GL_TEXTURE3);
-				glBindTexture(GL_TEXTURE_2D, tos[texture.source]);
-				glUniform1i(occlusionTextureLocation, 3);
-				glUniform1f(occlusionStrengthLocation, material.occlusionTexture.strength);
-			}
-			else {
-				glActiveTexture(GL_TEXTURE3);
-				glBindTexture(GL_TEXTURE_2D, 0);
-				glUniform1i(occlusionTextureLocation, 3);
-				glUniform1f(occlusionStrengthLocation, 0);
+
+	// All GL state changes of the scene rendering go through this cache
+	GLStateCache glState;
+
+	// Factors of all materials are read by the shaders from a storage buffer,
+	// indexed by the material vertex attribute
+	const std::vector<GPUMaterial> materialTable = buildMaterialTable(model);
+	GLuint materialTableBuffer;
+	glGenBuffers(1, &materialTableBuffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialTableBuffer);
+	glBufferStorage(GL_SHADER_STORAGE_BUFFER, materialTable.size() * sizeof(GPUMaterial), materialTable.data(), 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_TABLE_BINDING, materialTableBuffer);
+	std::vector<uint32_t> materialShaderFeatures(materialTable.size());
+	std::transform(begin(materialTable), end(materialTable), begin(materialShaderFeatures),
+				   getMaterialShaderFeatures);
+
+	// Light features of the shading programs, lights that don't contribute are not compiled in
+	const auto getLightShaderFeatures = [&]() {
+		uint32_t features = 0;
+		if (lightIntensity != glm::vec3(0)) {
+			features |= SHADER_FEATURE_DIRECTIONAL_LIGHT;
+			if (shadows) {
+				features |= SHADER_FEATURE_DIRECTIONAL_SHADOWS;
 			}
 		}
+		if (defaultPointLight && pointLightColor != glm::vec3(0)) {
+			features |= SHADER_FEATURE_POINT_LIGHT;
+		}
+		if (spotLightColor != glm::vec3(0)) {
+			features |= SHADER_FEATURE_SPOT_LIGHT;
+		}
+		if (!punctualLights.empty()) {
+			features |= SHADER_FEATURE_PUNCTUAL_LIGHTS;
+		}
+		return features;
+	};
+	// Without variants, all draws use the program with every feature and missing textures are
+	// sampled from the white texture
+	bool shaderVariants = true;
+	uint32_t lightShaderFeatures = getLightShaderFeatures();
+	const auto getShaderFeatures = [&](uint32_t materialTableIndex) {
+		return shaderVariants ? materialShaderFeatures[materialTableIndex] | lightShaderFeatures : SHADER_FEATURE_ALL;
+	};
+	// Variants of the scene materials are compiled before the first frame, others on first use
+	for (uint32_t materialTableIndex = 0; materialTableIndex < materialTable.size(); ++materialTableIndex) {
+		shadingPrograms.get(getShaderFeatures(materialTableIndex));
+	}
+
+	// Lambda function to bind material, missing textures are replaced by the white texture
+	const auto bindMaterial = [&](const uint32_t materialTableIndex) {
+		const GPUMaterial & material = materialTable[materialTableIndex];
+		const auto bindMaterialTexture = [&](GLuint unit, int textureIndex) {
+			glState.bindTexture(unit, GL_TEXTURE_2D,
+								textureIndex >= 0 ? tos[textureIndex] : whiteTexture);
+		};
+		bindMaterialTexture(BASE_COLOR_TEXTURE_UNIT, material.baseColorTexture);
+		bindMaterialTexture(METALLIC_ROUGHNESS_TEXTURE_UNIT, material.metallicRoughnessTexture);
+		bindMaterialTexture(EMISSIVE_TEXTURE_UNIT, material.emissiveTexture);
+		bindMaterialTexture(OCCLUSION_TEXTURE_UNIT, material.occlusionTexture);
+	};
+	// Material factors are per instance attributes, only textures need to be bound
+	const auto haveSameTextures = [&](uint32_t lhs, uint32_t rhs) {
+		const GPUMaterial & a = materialTable[lhs];
+		const GPUMaterial & b = materialTable[rhs];
+		return a.baseColorTexture == b.baseColorTexture &&
+			   a.metallicRoughnessTexture == b.metallicRoughnessTexture &&
+			   a.emissiveTexture == b.emissiveTexture && a.occlusionTexture == b.occlusionTexture;
+	};
+
+	// Scene BVH over all drawn primitives, used for culling and picking
+	std::vector<DrawInstance> instances = createDrawInstances(model);
+	BVH sceneBvh;
+	const auto getInstanceBounds = [&]() {
+		std::vector<AABB> bounds(instances.size());
+		for (size_t i = 0; i < instances.size(); ++i) {
+			bounds[i] = instances[i].worldBounds;
+		}
+		return bounds;
+	};
+	sceneBvh.build(getInstanceBounds());
+	// Set when node transforms are modified, the BVH is refit at the next frame. World matrices are
+	// cached, only the subtrees of the nodes in changedNodes are recomputed.
+	bool sceneTransformsChanged = false;
+	SceneTransforms sceneTransforms(model);
+	std::vector<int> changedNodes;
+	std::vector<MovedInstance> movedInstances; // Instances moved by the last transform change
+
+	// Morph targets are blended in the vertex shader from the active weights of each instance
+	MorphSystem morphSystem(model, instances);
+	std::cout << "Found " << morphSystem.instanceCount() << " morphed instances (" << morphSystem.primitiveCount()
+			  << " primitives with targets)" << std::endl;
+
+	// Merged geometry and vertex pulling have no per-primitive skinning attributes, their skinned
+	// instances are skinned on the CPU
+	SkinningSystem skinningSystem(model, instances, !m_mergeGeometry && !m_vertexPulling);
+	std::cout << "Found " << skinningSystem.instanceCount() << " skinned instances ("
+			  << skinningSystem.vertexCount() << " vertices)" << std::endl;
+	// The GPU skinning shader variant reads the joints and weights sanitized by the skinning system
+	if (!m_mergeGeometry && !m_vertexPulling) {
+		for (uint32_t instanceIdx = 0; instanceIdx < instances.size(); ++instanceIdx) {
+			if (skinningSystem.isSkinned(instanceIdx)) {
+				const uint32_t primitive = instances[instanceIdx].primitive;
+				glBindVertexArray(primitiveDraws[primitive].vao);
+				skinningSystem.setJointAttributes(primitive, VERTEX_ATTRIB_JOINTS_IDX, VERTEX_ATTRIB_WEIGHTS_IDX);
+			}
+		}
+		glBindVertexArray(0);
+	}
+	double skinningTime = 0.;
+	// CPU skinned vertices are already morphed
+	const auto getVertexFeatures = [&](uint32_t instanceIdx) -> uint32_t {
+		const uint32_t morphFeatures = morphSystem.isMorphed(instanceIdx) ? uint32_t(SHADER_FEATURE_MORPH_TARGETS) : 0u;
+		if (!skinningSystem.isSkinned(instanceIdx)) {
+			return morphFeatures;
+		}
+		return skinningSystem.gpuSkinning() ? SHADER_FEATURE_SKINNING | morphFeatures :
+											  uint32_t(SHADER_FEATURE_SKINNED_VERTICES);
+	};
+	// Variants of the skinned and morphed materials are compiled before the first frame too, the
+	// first frame poses the skins and gathers the morph weights
+	for (uint32_t instanceIdx = 0; instanceIdx < instances.size(); ++instanceIdx) {
+		if (const uint32_t vertexFeatures = getVertexFeatures(instanceIdx)) {
+			const DrawInstance & instance = instances[instanceIdx];
+			const tinygltf::Primitive & prim = model.meshes[instance.meshIdx].primitives[instance.primitiveIdx];
+			shadingPrograms.get(getShaderFeatures(getMaterialTableIndex(model, prim.material)) | vertexFeatures);
+		}
+	}
+	sceneTransformsChanged = !skinningSystem.empty() || !morphSystem.empty();
+
+	// Animations of the model, the selected clip is played in a loop and writes the transforms of the
+	// nodes it animates
+	const std::vector<AnimationClip> animationClips = readAnimations(model);
+	std::vector<AnimationPlayer> animationPlayers;
+	for (const auto & clip : animationClips) {
+		animationPlayers.emplace_back(clip);
+	}
+	int animationIdx = animationClips.empty() ? -1 : 0;
+	bool animationPlaying = true;
+	float animationSpeed = 1.f;
+	float animationTime = 0.f;
+	double animationSamplingTime = 0.;
+	const auto updateAnimation = [&]() {
+		if (animationIdx < 0) {
+			return;
+		}
+		const auto startTime = glfwGetTime();
+		AnimationPlayer & player = animationPlayers[animationIdx];
+		player.sample(animationTime);
+		player.apply(model);
+		changedNodes.insert(end(changedNodes), begin(player.transformedNodes()), end(player.transformedNodes()));
+		sceneTransformsChanged = true;
+		animationSamplingTime = glfwGetTime() - startTime;
+	};
+	updateAnimation();
+	bool frustumCulling = true;
+	std::vector<uint32_t> visibleInstances;
+
+	// Level of detail of each visible instance, as an index in lodDraws: the coarsest level whose
+	// error projects to less than maxLodPixelError. Instances smaller than minPixelSize are culled.
+	bool lodSelection = true;
+	float maxLodPixelError = 1.f;
+	bool subPixelCulling = true;
+	float minPixelSize = 1.f;
+	std::vector<uint32_t> instanceLodDraws(instances.size());
+	std::vector<float> instancePixelSizes(instances.size());
+	size_t subPixelCulledCount = 0;
+	size_t triangleCount = 0;
+
+	// The largest visible instances are rasterized as occluders in a CPU depth buffer, then
+	// visible instances are tested against its depth hierarchy
+	bool occlusionCulling = m_softwareOcclusion;
+	float minOccluderPixelSize = 0.1f * m_nWindowHeight;
+	OcclusionBuffer occlusionBuffer(OCCLUSION_BUFFER_WIDTH,
+									std::max(size_t(1), OCCLUSION_BUFFER_WIDTH * m_nWindowHeight / m_nWindowWidth));
+	std::vector<uint32_t> occluderCandidates;
+	std::vector<Occluder> occluders;
+	std::vector<uint8_t> instanceOccluded;
+	size_t occluderTriangleCount = 0;
+	size_t occlusionCulledCount = 0;
+	double occlusionCullingTime = 0.;
+
+	// GPU occlusion queries with temporal coherence (after CHC++): instances visible at their last
+	// query are drawn normally. The others, and visible instances once every
+	// OCCLUSION_QUERY_VISIBLE_INTERVAL frames, are queried with their bounding box after the main
+	// pass and drawn under conditional rendering. Results are read in later frames when available.
+	bool occlusionQueries = false;
+	GLuint occlusionBoxVao; // Box vertices are generated in the vertex shader
+	glGenVertexArrays(1, &occlusionBoxVao);
+	std::vector<OcclusionQueryState> occlusionQueryStates(instances.size());
+	std::vector<uint32_t> queriedInstances;
+	uint32_t occlusionQueryFrameIdx = 0;
+	size_t occlusionQueryCount = 0;
+	size_t queryOccludedCount = 0;
+
+	// Visible and queried draws sorted by state, reused from one frame to the next
+	bool sortDraws = true;
+	std::vector<SortItem> sortedDraws, queriedDraws, sortScratch;
+	size_t materialBindCount = 0;
+
+	// Consecutive sorted draws of the same primitive are merged in one instanced draw call
+	bool instancing = true;
+	std::vector<InstanceAttributes> instanceAttributes;
+	size_t drawCallCount = 0;
+
+	// Multi draw indirect path: each group of draws becomes an indirect command, commands are
+	// written to a single buffer and submitted in batches sharing the same GL state
+	bool multiDrawIndirect = true;
+	std::vector<DrawElementsIndirectCommand> elementsCommands;
+	std::vector<DrawArraysIndirectCommand> arraysCommands;
+	std::vector<IndirectBatch> indirectBatches;
+	GLuint indirectBuffer;
+	glGenBuffers(1, &indirectBuffer);
+
+	// Samples passing the depth test while drawing the scene, divided by the number of pixels and samples
+	// per pixel of the framebuffer the query was issued on. Two queries are used alternately, a result is only read once available
+	// and no query is issued while both are pending, the previous value is kept meanwhile.
+	GLuint overdrawQueries[2];
+	glGenQueries(2, overdrawQueries);
+	bool overdrawQueryPending[2] = {false, false};
+	double overdrawQueryPixels[2] = {0., 0.};
+	GLint overdrawQuerySamples[2] = {1, 1};
+	size_t overdrawFrameIdx = 0;
+	double overdraw = 0.;
+
+	// With a depth prepass the shading pass runs once per pixel, the overdraw query then measures
+	// the prepass
+	int depthPrepassMode = int(m_depthPrepassMode);
+	bool autoDepthPrepass = false;
+	bool depthPrepass = false;
+
+	// Lambda function to draw instances of a primitive with its VAO bound, baseInstance is
+	// the index of the first instance in the instance buffer
+	const auto drawPrimitive = [&](const PrimitiveDraw & draw, GLsizei instanceCount, GLuint baseInstance) {
+		if(draw.indexType != GL_NONE) {
+			// glDrawElements
+			const size_t byteOffset = draw.first * size_t(tinygltf::GetComponentSizeInBytes(draw.indexType));
+			glDrawElementsInstancedBaseVertexBaseInstance(draw.mode, draw.count, draw.indexType, (GLvoid *) byteOffset,
+														  instanceCount, draw.baseVertex, baseInstance);
+		}
+		else {
+			// glDrawArrays
+			glDrawArraysInstancedBaseInstance(draw.mode, draw.first, draw.count, instanceCount, baseInstance);
+		}
+	};
+
+	// Lambda function to bind the program, material textures and VAO of a draw. The depth prepass
+	// doesn't bind material textures and only has skinning variants. Consecutive draws sharing
+	// material textures don't rebind them, glState drops the redundant program and VAO binds.
+	uint32_t boundMaterial = std::numeric_limits<uint32_t>::max(); // Reset by each pass
+	const auto bindDrawState = [&](bool depthOnly, uint32_t vertexFeatures, uint32_t materialTableIndex, GLuint vao) {
+		// Materials with the same textures have the same shading program, up to skinning
+		const GLuint program = depthOnly ? depthPrograms.get(vertexFeatures).glId() :
+								shadingPrograms.get(getShaderFeatures(materialTableIndex) | vertexFeatures).glId();
+		glState.useProgram(program);
+		if (!depthOnly && (boundMaterial == std::numeric_limits<uint32_t>::max() ||
+						   !haveSameTextures(materialTableIndex, boundMaterial))) {
+			bindMaterial(materialTableIndex);
+			boundMaterial = materialTableIndex;
+			++materialBindCount;
+		}
+		glState.bindVertexArray(vao);
+	};
+
+	// Lambda function to submit the visible instances, in sorted order
+	const auto drawSortedInstances = [&](bool depthOnly) {
+		boundMaterial = std::numeric_limits<uint32_t>::max();
+		elementsCommands.clear();
+		arraysCommands.clear();
+		indirectBatches.clear();
+		for (size_t drawIdx = 0; drawIdx < sortedDraws.size();) {
+			const DrawInstance & instance = instances[sortedDraws[drawIdx].value];
+			const uint32_t vertexFeatures = getVertexFeatures(sortedDraws[drawIdx].value);
+			size_t groupEnd = drawIdx + 1;
+			while (instancing && groupEnd < sortedDraws.size() &&
+				   instanceLodDraws[sortedDraws[groupEnd].value] == instanceLodDraws[sortedDraws[drawIdx].value] &&
+				   getVertexFeatures(sortedDraws[groupEnd].value) == vertexFeatures) {
+				++groupEnd;
+			}
+
+			const tinygltf::Primitive & prim = model.meshes[instance.meshIdx].primitives[instance.primitiveIdx];
+			const uint32_t materialTableIndex = getMaterialTableIndex(model, prim.material);
+			const PrimitiveDraw & draw = lodDraws[instanceLodDraws[sortedDraws[drawIdx].value]];
+			const auto instanceCount = uint32_t(groupEnd - drawIdx);
+			const auto baseInstance = uint32_t(drawIdx);
+			drawIdx = groupEnd;
+			if (draw.mode == GL_TRIANGLES) {
+				triangleCount += size_t(draw.count / 3) * instanceCount;
+			}
+
+			if (!multiDrawIndirect) {
+				bindDrawState(depthOnly, vertexFeatures, materialTableIndex, draw.vao);
+				drawPrimitive(draw, instanceCount, baseInstance);
+				++drawCallCount;
+				continue;
+			}
+
+			const size_t firstCommand = draw.indexType != GL_NONE ? elementsCommands.size() : arraysCommands.size();
+			if (indirectBatches.empty() || indirectBatches.back().vao != draw.vao ||
+				indirectBatches.back().mode != draw.mode || indirectBatches.back().indexType != draw.indexType ||
+				indirectBatches.back().vertexFeatures != vertexFeatures ||
+				(!depthOnly && !haveSameTextures(indirectBatches.back().materialTableIndex, materialTableIndex))) {
+				indirectBatches.push_back(IndirectBatch{draw.vao, draw.mode, draw.indexType, materialTableIndex,
+														vertexFeatures, firstCommand, 0});
+			}
+			++indirectBatches.back().commandCount;
+			if (draw.indexType != GL_NONE) {
+				elementsCommands.push_back(DrawElementsIndirectCommand{draw.count, instanceCount, draw.first,
+																	   draw.baseVertex, baseInstance});
+			} else {
+				arraysCommands.push_back(DrawArraysIndirectCommand{draw.count, instanceCount, draw.first,
+																   baseInstance});
+			}
+		}
+
+		if (indirectBatches.empty()) {
+			return;
+		}
+		// Elements commands are followed by arrays commands in the indirect buffer
+		const size_t elementsCommandsSize = elementsCommands.size() * sizeof(DrawElementsIndirectCommand);
+		const size_t arraysCommandsSize = arraysCommands.size() * sizeof(DrawArraysIndirectCommand);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirectBuffer);
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, elementsCommandsSize + arraysCommandsSize, nullptr, GL_STREAM_DRAW);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, elementsCommandsSize, elementsCommands.data());
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, elementsCommandsSize, arraysCommandsSize, arraysCommands.data());
+		for (const auto & batch : indirectBatches) {
+			bindDrawState(depthOnly, batch.vertexFeatures, batch.materialTableIndex, batch.vao);
+			if (batch.indexType != GL_NONE) {
+				glMultiDrawElementsIndirect(batch.mode, batch.indexType,
+											(const GLvoid *) (batch.firstCommand * sizeof(DrawElementsIndirectCommand)),
+											batch.commandCount, 0);
+			} else {
+				glMultiDrawArraysIndirect(batch.mode, (const GLvoid *) (elementsCommandsSize +
+											batch.firstCommand * sizeof(DrawArraysIndirectCommand)),
+										  batch.commandCount, 0);
+			}
+			++drawCallCount;
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	};
+
+	// Lambda function to query the boxes of queriedInstances against the depth of the main pass, then
+	// draw each instance only if its box passed. Queried instances are in sort key order and follow
+	// the shading pass, so their state changes are dropped like those of the sorted draws.
+	const auto drawQueriedInstances = [&]() {
+		if (queriedInstances.empty()) {
+			return;
+		}
+		glState.useProgram(occlusionBoxProgram.glId());
+		glState.bindVertexArray(occlusionBoxVao);
+		glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+		glDepthMask(GL_FALSE);
+		for (const auto instanceIdx : queriedInstances) {
+			OcclusionQueryState & state = occlusionQueryStates[instanceIdx];
+			if (!state.query) {
+				glGenQueries(1, &state.query);
+			}
+			glState.uniform3f(boxMinLocation, instances[instanceIdx].worldBounds.min);
+			glState.uniform3f(boxMaxLocation, instances[instanceIdx].worldBounds.max);
+			glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, state.query);
+			glDrawArrays(GL_TRIANGLE_STRIP, 0, 14);
+			glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+			state.pending = true;
+		}
+		glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+		glDepthMask(GL_TRUE);
+		occlusionQueryCount = queriedInstances.size();
+
+		for (size_t i = 0; i < queriedInstances.size(); ++i) {
+			const uint32_t instanceIdx = queriedInstances[i];
+			const DrawInstance & instance = instances[instanceIdx];
+			const tinygltf::Primitive & prim = model.meshes[instance.meshIdx].primitives[instance.primitiveIdx];
+			const PrimitiveDraw & draw = lodDraws[instanceLodDraws[instanceIdx]];
+			bindDrawState(false, getVertexFeatures(instanceIdx), getMaterialTableIndex(model, prim.material), draw.vao);
+			glBeginConditionalRender(occlusionQueryStates[instanceIdx].query, GL_QUERY_WAIT);
+			drawPrimitive(draw, 1, GLuint(sortedDraws.size() + i));
+			glEndConditionalRender();
+			++drawCallCount;
+		}
+	};
+
+	// Lambda function to draw the casters of the cascades of shadowUpdateMask, with the shadow
+	// framebuffer bound. Shadow casters follow the sorted and queried draws in the instance buffer.
+	const auto drawShadowCasters = [&](const glm::mat4 * cascadeMatrices) {
+		// Caster keys hold the skinning features in their high bits, uniform locations are only looked
+		// up when the variant changes
+		uint32_t boundVertexFeatures = std::numeric_limits<uint32_t>::max();
+		const auto firstInstance = GLuint(sortedDraws.size() + queriedInstances.size());
+		for (size_t casterIdx = 0; casterIdx < shadowCasters.size();) {
+			size_t groupEnd = casterIdx + 1;
+			while (groupEnd < shadowCasters.size() && shadowCasters[groupEnd].key == shadowCasters[casterIdx].key) {
+				++groupEnd;
+			}
+			const auto vertexFeatures = uint32_t(shadowCasters[casterIdx].key >> 32);
+			if (vertexFeatures != boundVertexFeatures) {
+				const GLProgram & program = shadowPrograms.get(vertexFeatures);
+				glState.useProgram(program.glId());
+				glState.uniformMatrix4fv(program.getUniformLocation("uCascadeMatrices"), SHADOW_CASCADE_COUNT,
+										 cascadeMatrices);
+				glState.uniform1ui(program.getUniformLocation("uCascadeUpdateMask"), shadowUpdateMask);
+				boundVertexFeatures = vertexFeatures;
+			}
+			const PrimitiveDraw & draw = lodDraws[uint32_t(shadowCasters[casterIdx].key)];
+			glState.bindVertexArray(draw.vao);
+			drawPrimitive(draw, GLsizei(groupEnd - casterIdx), firstInstance + GLuint(casterIdx));
+			++shadowDrawCallCount;
+			casterIdx = groupEnd;
+		}
 	};
 
 	// Lambda function to draw the scene
 	const auto drawScene = [&](const Camera & camera) {
-		glViewport(0, 0, m_nWindowWidth, m_nWindowHeight);
+		glViewport(0, 0, renderWidth, renderHeight);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
 		const auto viewMatrix = camera.getViewMatrix();
-		// The recursive function that should draw a node
-		// We use a std::function because a simple lambda cannot be recursive
-		const std::function<void(int, const glm::mat4 &)> drawNode =
-			[&](int nodeIdx, const glm::mat4 & parentMatrix) {
-				tinygltf::Node & node = model.nodes[nodeIdx];
-				glm::mat4 modelMatrix = getLocalToWorldMatrix(node, parentMatrix);
-				if (node.mesh >= 0) {
-					glm::mat4 modelViewMatrix = viewMatrix * modelMatrix;
-					glm::mat4 modelViewProjMatrix = projMatrix * modelViewMatrix;
-					glm::mat4 normalMatrix = transpose(inverse(modelViewMatrix));
-
-					glUniformMatrix4fv(modelViewMatrixLocation, 1, GL_FALSE, glm::value_ptr(modelViewMatrix));
-					glUniformMatrix4fv(modelViewProjMatrixLocation, 1, GL_FALSE, glm::value_ptr(modelViewProjMatrix));
-					glUniformMatrix4fv(normalMatrixLocation, 1, GL_FALSE, glm::value_ptr(normalMatrix));
-					if (lightDirectionLocation >= 0){
-						if (lightFromCamera) {
-							glUniform3f(lightDirectionLocation, 0, 0, 1);
-						} else {
-							glm::vec3 lightDirectionInViewSpace = glm::normalize(glm::vec3(viewMatrix * glm::vec4(lightDirection, 0.)));
-							glUniform3f(lightDirectionLocation, lightDirectionInViewSpace[0], lightDirectionInViewSpace[1], lightDirectionInViewSpace[2]);
-						}
-					}
-					if (lightIntensityLocation >= 0) {
-						glUniform3f(lightIntensityLocation, lightIntensity[0], lightIntensity[1], lightIntensity[2]);
-					}
-					
-					//TODO : mettre la spot light ici
-					
-					//glm::vec3 eye = camera.eye();
-					glm::vec3 eye = glm::vec3(0, 0, 0);
-					//eye = glm::normalize(glm::vec3(viewMatrix * glm::vec4(eye, 0.)));
-					glUniform3f(spotLightPositionLocation, eye.x, eye.y, eye.z);				
-					//glm::vec3 front = camera.front();
-					glm::vec3 front = glm::vec3(0, 0, -1);
-					//front = glm::normalize(glm::vec3(viewMatrix * glm::vec4(front, 0.)));
-					glUniform3f(spotLightDirectionLocation, front.x, front.y, front.z);				
-					glUniform3f(spotLightColorLocation, spotLightColor.x, spotLightColor.y, spotLightColor.z);
-					glUniform1f(spotLightCutOffLocation, spotLightCutOff);
-					glUniform1f(spotLightOuterCutOffLocation, spotLightOuterCutOff);
-					glUniform1f(spotLightConstantLocation, spotLightConstant);
-					glUniform1f(spotLightLinearLocation, spotLightLinear);
-					glUniform1f(spotLightQuadraticLocation, spotLightQuadratic);
-					
-					// TODO : mettre une ou des point lights ici
-					glm::vec3 pos(-10.f, 5.f, 0.f);
-					//glm::vec3 pos(10.f, 13.f, 1.f);
-					glm::vec3 posViewSpace = glm::vec3(viewMatrix * glm::vec4(pos, 1.));					
-					//std::cout << pos << std::endl;
-					glUniform3f(pointLightPositionLocation, posViewSpace.x, posViewSpace.y, posViewSpace.z);
-					glUniform3f(pointLightColorLocation, pointLightColor.x, pointLightColor.y, pointLightColor.z);
-					glUniform1f(pointLightConstantLocation, pointLightConstant);
-					glUniform1f(pointLightLinearLocation, pointLightLinear);
-					glUniform1f(pointLightQuadraticLocation, pointLightQuadratic);
-					
-
-					tinygltf::Mesh & mesh = model.meshes[node.mesh];
-					VaoRange & range = indexToVaoRange[node.mesh];
-					for(int i = 0; i < mesh.primitives.size(); i++) {
-						GLuint vao = vaos[range.begin + i];
-						const tinygltf::Primitive & prim = mesh.primitives[i];
-						bindMaterial(prim.material);
-						glBindVertexArray(vao);
-
-						if(prim.indices >= 0) {
-							// glDrawElements
-							const tinygltf::Accessor accessor = model.accessors[prim.indices];
-							const tinygltf::BufferView bufferView = model.bufferViews[accessor.bufferView];
-							const size_t byteOffset = accessor.byteOffset + bufferView.byteOffset;
-							glDrawElements(prim.mode, accessor.count, accessor.componentType, (GLvoid *) byteOffset);
-						}
-						else {
-							// glDrawArrays
-							const int accessorIdx = (*begin(prim.attributes)).second;
-							const tinygltf::Accessor &accessor = model.accessors[accessorIdx];
-							glDrawArrays(prim.mode, 0, accessor.count);
-						}
+
+		// Other GL code (ImGui, render to image) may have changed bindings since last frame
+		glState.invalidateBindings();
+		glState.resetCounters();
+		lightShaderFeatures = getLightShaderFeatures();
+
+		if (sceneTransformsChanged) {
+			sceneTransforms.update(model, changedNodes);
+			changedNodes.clear();
+			updatePunctualLights(sceneTransforms, punctualLights);
+			movedInstances.clear();
+			updateDrawInstances(sceneTransforms, instances, movedInstances);
+			// Morph weights first, CPU skinning reads them
+			if (!morphSystem.empty()) {
+				morphSystem.update(model, primitiveDraws, instances, movedInstances);
+			}
+			if (!skinningSystem.empty()) {
+				const auto startTime = glfwGetTime();
+				skinningSystem.update(sceneTransforms.worldMatrices(), morphSystem, instances, movedInstances);
+				skinningTime = glfwGetTime() - startTime;
+			}
+			if (!movedInstances.empty()) {
+				sceneBvh.refit(getInstanceBounds());
+				// Only the cascades a moved instance casts in, before or after the move, are rendered again
+				const uint32_t allCascades = (1u << SHADOW_CASCADE_COUNT) - 1;
+				uint32_t movedCascades = 0;
+				for (size_t i = 0; i < movedInstances.size() && movedCascades != allCascades; ++i) {
+					AABB bounds = movedInstances[i].previousBounds;
+					bounds.expand(instances[movedInstances[i].instanceIdx].worldBounds);
+					movedCascades |= getShadowCasterMask(bounds, shadowRenderer.cascades().data(), SHADOW_CASCADE_COUNT);
+				}
+				shadowRenderer.invalidate(movedCascades);
+			}
+			sceneTransformsChanged = false;
+		}
+
+		visibleInstances.clear();
+		if (frustumCulling) {
+			sceneBvh.cullFrustum(extractFrustum(projMatrix * viewMatrix), visibleInstances);
+		} else {
+			visibleInstances.resize(instances.size());
+			std::iota(begin(visibleInstances), end(visibleInstances), 0);
+		}
+
+		// Sizes in pixels of a length at distance 1 from the camera
+		const float pixelsPerUnit = 0.5f * projMatrix[1][1] * renderHeight;
+		subPixelCulledCount = 0;
+		size_t visibleCount = 0;
+		for (const auto instanceIdx : visibleInstances) {
+			const DrawInstance & instance = instances[instanceIdx];
+			const float radius = 0.5f * glm::length(instance.worldBounds.max - instance.worldBounds.min);
+			const glm::vec3 viewCenter = glm::vec3(viewMatrix * glm::vec4(instance.worldBounds.center(), 1));
+			const float distance = std::max(glm::length(viewCenter) - radius, nearPlane);
+			instancePixelSizes[instanceIdx] = 2.f * radius * pixelsPerUnit / distance;
+			if (subPixelCulling && instancePixelSizes[instanceIdx] < minPixelSize) {
+				++subPixelCulledCount;
+				continue;
+			}
+			const VaoRange & lodRange =
+					primitiveLodRanges[indexToVaoRange[instance.meshIdx].begin + instance.primitiveIdx];
+			GLsizei lod = 0;
+			if (lodSelection && lodRange.count > 1) {
+				// Errors are in local space, the largest axis scale bounds them in world space
+				const glm::mat3 linear(instance.modelMatrix);
+				const float scale = std::sqrt(std::max({glm::dot(linear[0], linear[0]),
+														glm::dot(linear[1], linear[1]),
+														glm::dot(linear[2], linear[2])}));
+				const float errorToPixels = scale * pixelsPerUnit / distance;
+				while (lod + 1 < lodRange.count &&
+					   lodErrors[lodRange.begin + lod + 1] * errorToPixels <= maxLodPixelError) {
+					++lod;
+				}
+			}
+			instanceLodDraws[instanceIdx] = uint32_t(lodRange.begin + lod);
+			visibleInstances[visibleCount++] = instanceIdx;
+		}
+		visibleInstances.resize(visibleCount);
+
+		occluders.clear();
+		occluderTriangleCount = 0;
+		occlusionCulledCount = 0;
+		if (occlusionCulling) {
+			const auto startTime = glfwGetTime();
+			occluderCandidates.clear();
+			for (const auto instanceIdx : visibleInstances) {
+				const DrawInstance & instance = instances[instanceIdx];
+				const OccluderMesh & mesh = occluderMeshes[indexToVaoRange[instance.meshIdx].begin + instance.primitiveIdx];
+				// Occluder meshes are not skinned
+				if (!mesh.indices.empty() && instancePixelSizes[instanceIdx] >= minOccluderPixelSize &&
+					!skinningSystem.isSkinned(instanceIdx)) {
+					occluderCandidates.push_back(instanceIdx);
+				}
+			}
+			const size_t occluderCount = std::min(occluderCandidates.size(), MAX_OCCLUDER_COUNT);
+			std::partial_sort(begin(occluderCandidates), begin(occluderCandidates) + occluderCount,
+							  end(occluderCandidates), [&](uint32_t a, uint32_t b) {
+								  return instancePixelSizes[a] > instancePixelSizes[b];
+							  });
+			const glm::mat4 viewProjMatrix = projMatrix * viewMatrix;
+			for (size_t i = 0; i < occluderCount; ++i) {
+				const DrawInstance & instance = instances[occluderCandidates[i]];
+				occluders.push_back(Occluder{&occluderMeshes[indexToVaoRange[instance.meshIdx].begin + instance.primitiveIdx],
+											 viewProjMatrix * instance.modelMatrix});
+			}
+
+			occlusionBuffer.clear();
+			occluderTriangleCount = occlusionBuffer.rasterize(occluders);
+			occlusionBuffer.buildHierarchy();
+			instanceOccluded.resize(visibleInstances.size());
+			parallelFor(visibleInstances.size(), 256, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					const AABB & bounds = instances[visibleInstances[i]].worldBounds;
+					instanceOccluded[i] = !occlusionBuffer.isVisible(bounds, viewProjMatrix);
+				}
+			});
+			visibleCount = 0;
+			for (size_t i = 0; i < visibleInstances.size(); ++i) {
+				if (instanceOccluded[i]) {
+					++occlusionCulledCount;
+				} else {
+					visibleInstances[visibleCount++] = visibleInstances[i];
+				}
+			}
+			visibleInstances.resize(visibleCount);
+			occlusionCullingTime = glfwGetTime() - startTime;
+		}
+
+		queriedInstances.clear();
+		occlusionQueryCount = 0;
+		queryOccludedCount = 0;
+		if (occlusionQueries) {
+			const glm::vec3 cameraPosition = camera.eye();
+			visibleCount = 0;
+			for (const auto instanceIdx : visibleInstances) {
+				OcclusionQueryState & state = occlusionQueryStates[instanceIdx];
+				if (state.pending) {
+					GLuint available = GL_FALSE;
+					glGetQueryObjectuiv(state.query, GL_QUERY_RESULT_AVAILABLE, &available);
+					if (available) {
+						GLuint anySamplesPassed;
+						glGetQueryObjectuiv(state.query, GL_QUERY_RESULT, &anySamplesPassed);
+						state.visible = anySamplesPassed != GL_FALSE;
+						state.pending = false;
 					}
 				}
-				for (const auto & child : node.children) {
-					drawNode(child, modelMatrix);
+				// The box of an instance containing the camera would be clipped by the near plane
+				const AABB & bounds = instances[instanceIdx].worldBounds;
+				const bool cameraInside = glm::all(glm::greaterThanEqual(cameraPosition, bounds.min - nearPlane)) &&
+										  glm::all(glm::lessThanEqual(cameraPosition, bounds.max + nearPlane));
+				const bool queryVisible = !state.pending &&
+										  (occlusionQueryFrameIdx + instanceIdx) % OCCLUSION_QUERY_VISIBLE_INTERVAL == 0;
+				if (cameraInside || (state.visible && !queryVisible)) {
+					visibleInstances[visibleCount++] = instanceIdx;
+				} else {
+					queryOccludedCount += state.visible ? 0 : 1;
+					queriedInstances.push_back(instanceIdx);
 				}
-			};
+			}
+			visibleInstances.resize(visibleCount);
+			++occlusionQueryFrameIdx;
+		}
 
-		// Draw the scene referenced by gltf file
-		if (model.defaultScene >= 0) {
-			for (const auto & node : model.scenes[model.defaultScene].nodes) {
-				drawNode(node, glm::mat4(1));
+		// Without sorting, keys only contain the instance index to keep scene graph order
+		const auto getDrawSortKey = [&](uint32_t instanceIdx) -> uint64_t {
+			if (!sortDraws) {
+				return instanceIdx;
 			}
+			const DrawInstance & instance = instances[instanceIdx];
+			const tinygltf::Primitive & prim = model.meshes[instance.meshIdx].primitives[instance.primitiveIdx];
+			const float viewDepth = -(viewMatrix * glm::vec4(instance.worldBounds.center(), 1)).z;
+			const uint32_t materialTableIndex = getMaterialTableIndex(model, prim.material);
+			return makeDrawSortKey(getShaderFeatures(materialTableIndex) | getVertexFeatures(instanceIdx),
+								   materialTableIndex, instanceLodDraws[instanceIdx], viewDepth / farPlane);
+		};
+		sortedDraws.resize(visibleInstances.size());
+		for (size_t i = 0; i < visibleInstances.size(); ++i) {
+			sortedDraws[i] = SortItem{getDrawSortKey(visibleInstances[i]), visibleInstances[i]};
 		}
+		radixSort(sortedDraws, sortScratch);
+		// Queried instances are drawn one by one in the same order, so that consecutive draws share
+		// their program and material textures too
+		if (!queriedInstances.empty()) {
+			queriedDraws.resize(queriedInstances.size());
+			for (size_t i = 0; i < queriedInstances.size(); ++i) {
+				queriedDraws[i] = SortItem{getDrawSortKey(queriedInstances[i]), queriedInstances[i]};
+			}
+			radixSort(queriedDraws, sortScratch);
+			for (size_t i = 0; i < queriedInstances.size(); ++i) {
+				queriedInstances[i] = queriedDraws[i].value;
+			}
+		}
+
+		// Cascades follow slices of the view frustum. Those whose light, footprint or casters changed
+		// are rendered again with all the instances overlapping them, including culled ones.
+		const glm::mat4 cameraToWorldMatrix = glm::inverse(viewMatrix);
+		shadowCasters.clear();
+		shadowUpdateMask = 0;
+		if (shadows) {
+			const glm::vec3 shadowLightDirection = lightFromCamera ? glm::normalize(glm::vec3(cameraToWorldMatrix[2])) :
+												   glm::normalize(lightDirection);
+			shadowUpdateMask =
+					shadowRenderer.fitCascades(shadowLightDirection, cameraToWorldMatrix, projMatrix, nearPlane, farPlane);
+		}
+		const auto & shadowCascades = shadowRenderer.cascades();
+		if (shadowUpdateMask) {
+			shadowCasterMasks.resize(instances.size());
+			parallelFor(instances.size(), 256, [&](size_t begin, size_t end) {
+				for (size_t i = begin; i < end; ++i) {
+					shadowCasterMasks[i] = shadowUpdateMask & getShadowCasterMask(instances[i].worldBounds,
+																				  shadowCascades.data(),
+																				  SHADOW_CASCADE_COUNT);
+				}
+			});
+			for (uint32_t instanceIdx = 0; instanceIdx < instances.size(); ++instanceIdx) {
+				const uint32_t mask = shadowCasterMasks[instanceIdx];
+				if (!mask) {
+					continue;
+				}
+				// Level of detail for the finest cascade, errors below a shadow map texel are invisible
+				uint32_t finestCascade = 0;
+				while (!(mask & (1u << finestCascade))) {
+					++finestCascade;
+				}
+				const float texelSize = shadowCascades[finestCascade].texelSize(SHADOW_MAP_RESOLUTION);
+				const DrawInstance & instance = instances[instanceIdx];
+				const VaoRange & lodRange =
+						primitiveLodRanges[indexToVaoRange[instance.meshIdx].begin + instance.primitiveIdx];
+				const glm::mat3 linear(instance.modelMatrix);
+				const float scale = std::sqrt(std::max({glm::dot(linear[0], linear[0]),
+														glm::dot(linear[1], linear[1]),
+														glm::dot(linear[2], linear[2])}));
+				GLsizei lod = 0;
+				while (lod + 1 < lodRange.count && lodErrors[lodRange.begin + lod + 1] * scale <= texelSize) {
+					++lod;
+				}
+				// The geometry shader takes triangles
+				const GLenum mode = lodDraws[lodRange.begin + lod].mode;
+				if (mode == GL_TRIANGLES || mode == GL_TRIANGLE_STRIP || mode == GL_TRIANGLE_FAN) {
+					shadowCasters.push_back(SortItem{uint64_t(getVertexFeatures(instanceIdx)) << 32 |
+														 uint64_t(lodRange.begin + lod), instanceIdx});
+				}
+			}
+			radixSort(shadowCasters, sortScratch);
+		}
+
+		// Instance attributes are stored in draw order, so that each group of draws is a range.
+		// Queried instances follow the sorted draws, then shadow casters whose material index is
+		// replaced by their cascade mask.
+		const size_t queriedEnd = sortedDraws.size() + queriedInstances.size();
+		instanceAttributes.resize(queriedEnd + shadowCasters.size());
+		parallelFor(instanceAttributes.size(), 1024, [&](size_t begin, size_t end) {
+			for (size_t i = begin; i < end; ++i) {
+				const uint32_t instanceIdx = i < sortedDraws.size() ? sortedDraws[i].value :
+											 i < queriedEnd ? queriedInstances[i - sortedDraws.size()] :
+											 shadowCasters[i - queriedEnd].value;
+				const DrawInstance & instance = instances[instanceIdx];
+				const tinygltf::Primitive & prim = model.meshes[instance.meshIdx].primitives[instance.primitiveIdx];
+				const auto primitive = GLuint(indexToVaoRange[instance.meshIdx].begin + instance.primitiveIdx);
+				const GLuint materialIndex = i < queriedEnd ? getMaterialTableIndex(model, prim.material) :
+											 shadowCasterMasks[instanceIdx];
+				const GLuint morphOffset = morphSystem.getWeightsTexel(instanceIdx);
+				if (!skinningSystem.isSkinned(instanceIdx)) {
+					instanceAttributes[i] = InstanceAttributes{instance.modelMatrix, instance.normalMatrix, materialIndex,
+															   primitive, 0, morphOffset};
+					continue;
+				}
+				const GLuint skinOffset = skinningSystem.getSkinOffset(instanceIdx, primitiveDraws[primitive].baseVertex);
+				instanceAttributes[i] = InstanceAttributes{glm::mat4(1), glm::mat4(1), materialIndex, primitive,
+														   skinOffset, morphOffset};
+			}
+		});
+		if (!instanceAttributes.empty()) {
+			glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+			glBufferData(GL_ARRAY_BUFFER, instanceAttributes.size() * sizeof(InstanceAttributes),
+						 instanceAttributes.data(), GL_STREAM_DRAW);
+			glBindBuffer(GL_ARRAY_BUFFER, 0);
+		}
+
+		// Camera and lights are constant for the whole frame: one upload each
+		CameraUniforms cameraUniforms;
+		cameraUniforms.viewMatrix = viewMatrix;
+		cameraUniforms.projMatrix =
+				glm::translate(glm::mat4(1), glm::vec3(2.f * projectionPixelOffset.x / renderWidth,
+													   2.f * projectionPixelOffset.y / renderHeight, 0.f)) *
+				projMatrix;
+		glBindBuffer(GL_UNIFORM_BUFFER, cameraUbo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(cameraUniforms), &cameraUniforms);
+
+		LightUniforms lightUniforms = {};
+		lightUniforms.dirLight.uLightDirection = lightFromCamera ? glm::vec3(0, 0, 1) :
+				glm::normalize(glm::vec3(viewMatrix * glm::vec4(lightDirection, 0.)));
+		lightUniforms.dirLight.uLightIntensity = lightIntensity;
+
+		// Hardcoded point light, the lights of the file are clustered below
+		glm::vec3 pos(-10.f, 5.f, 0.f);
+		lightUniforms.pointLight.position = glm::vec3(viewMatrix * glm::vec4(pos, 1.));
+		lightUniforms.pointLight.color = defaultPointLight ? pointLightColor : glm::vec3(0);
+		lightUniforms.pointLight.constant = pointLightConstant;
+		lightUniforms.pointLight.linear = pointLightLinear;
+		lightUniforms.pointLight.quadratic = pointLightQuadratic;
+
+		// The spot light is attached to the camera: position and direction are constant in view space
+		lightUniforms.spotLight.position = glm::vec3(0, 0, 0);
+		lightUniforms.spotLight.direction = glm::vec3(0, 0, -1);
+		lightUniforms.spotLight.color = spotLightColor;
+		lightUniforms.spotLight.cutOff = spotLightCutOff;
+		lightUniforms.spotLight.outerCutOff = spotLightOuterCutOff;
+		lightUniforms.spotLight.constant = spotLightConstant;
+		lightUniforms.spotLight.linear = spotLightLinear;
+		lightUniforms.spotLight.quadratic = spotLightQuadratic;
+
+		const auto clusteringStartTime = glfwGetTime();
+		packPunctualLights(punctualLights, viewMatrix, gpuPunctualLights);
+		buildLightClusters(gpuPunctualLights, projMatrix, nearPlane, farPlane, lightClusterGrid);
+		lightClusteringTime = glfwGetTime() - clusteringStartTime;
+		uploadStorageBuffer(punctualLightsBuffer, gpuPunctualLights.size() * sizeof(GPUPunctualLight),
+							gpuPunctualLights.data());
+		uploadStorageBuffer(lightClustersBuffer, lightClusterGrid.clusters.size() * sizeof(glm::uvec2),
+							lightClusterGrid.clusters.data());
+		uploadStorageBuffer(lightClusterIndicesBuffer, lightClusterGrid.lightIndices.size() * sizeof(uint32_t),
+							lightClusterGrid.lightIndices.data());
+		const glm::uvec3 clusterCounts = lightClusterGrid.counts;
+		lightUniforms.clusterCounts = clusterCounts;
+		lightUniforms.directionalLightCount = uint32_t(directionalLightCount);
+		lightUniforms.clusterTileSize = glm::vec2(float(renderWidth) / clusterCounts.x,
+												  float(renderHeight) / clusterCounts.y);
+		lightUniforms.clusterNear = lightClusterGrid.nearPlane;
+		lightUniforms.clusterDepthScale = clusterCounts.z / std::log(lightClusterGrid.farPlane / lightClusterGrid.nearPlane);
+
+		// Shadow map coordinates and depth are in [0, 1]
+		const glm::mat4 shadowTextureMatrix =
+				glm::scale(glm::translate(glm::mat4(1), glm::vec3(0.5f)), glm::vec3(0.5f));
+		for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; ++i) {
+			lightUniforms.cascadeMatrices[i] = shadowTextureMatrix * shadowCascades[i].viewProjMatrix * cameraToWorldMatrix;
+			lightUniforms.cascadeSplits[i] = shadowRenderer.splits()[i + 1];
+			lightUniforms.cascadeTexelSizes[i] = shadowCascades[i].texelSize(SHADOW_MAP_RESOLUTION);
+		}
+		glBindBuffer(GL_UNIFORM_BUFFER, lightUbo);
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(lightUniforms), &lightUniforms);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+		// The oldest query is the one of the current slot
+		for (size_t i = 0; i < 2; ++i) {
+			const size_t slot = (overdrawFrameIdx + i) % 2;
+			if (!overdrawQueryPending[slot]) {
+				continue;
+			}
+			GLuint available = GL_FALSE;
+			glGetQueryObjectuiv(overdrawQueries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available) {
+				break;
+			}
+			GLuint64 samplesPassed;
+			glGetQueryObjectui64v(overdrawQueries[slot], GL_QUERY_RESULT, &samplesPassed);
+			overdrawQueryPending[slot] = false;
+			overdraw = double(samplesPassed) / (overdrawQueryPixels[slot] * overdrawQuerySamples[slot]);
+			if (overdraw > AUTO_DEPTH_PREPASS_ENABLE_OVERDRAW) {
+				autoDepthPrepass = true;
+			} else if (overdraw < AUTO_DEPTH_PREPASS_DISABLE_OVERDRAW) {
+				autoDepthPrepass = false;
+			}
+		}
+		// Statistics add up over the passes
+		materialBindCount = 0;
+		drawCallCount = 0;
+		triangleCount = 0;
+		shadowRenderer.readTimer();
+		shadowDrawCallCount = 0;
+		glState.bindTexture(SKINNING_TEXTURE_UNIT, GL_TEXTURE_BUFFER, skinningSystem.texture());
+		glState.bindTexture(MORPH_DELTAS_TEXTURE_UNIT, GL_TEXTURE_BUFFER, morphSystem.deltasTexture());
+		glState.bindTexture(MORPH_WEIGHTS_TEXTURE_UNIT, GL_TEXTURE_BUFFER, morphSystem.weightsTexture());
+		if (shadowUpdateMask) {
+			shadowRenderer.render(shadowUpdateMask, cameraToWorldMatrix, drawShadowCasters);
+		}
+		glState.bindTexture(SHADOW_MAP_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, shadowRenderer.texture());
+
+		depthPrepass = DepthPrepassMode(depthPrepassMode) == DepthPrepassMode::On ||
+					   (DepthPrepassMode(depthPrepassMode) == DepthPrepassMode::Auto && autoDepthPrepass);
+		const size_t overdrawSlot = overdrawFrameIdx % 2;
+		const bool measureOverdraw = !overdrawQueryPending[overdrawSlot];
+		if (measureOverdraw) {
+			glBeginQuery(GL_SAMPLES_PASSED, overdrawQueries[overdrawSlot]);
+			overdrawQueryPending[overdrawSlot] = true;
+			overdrawQueryPixels[overdrawSlot] = double(renderWidth) * renderHeight;
+			// Every sample passing the depth test is counted, GL_SAMPLES is 0 without multisampling
+			GLint samples = 0;
+			glGetIntegerv(GL_SAMPLES, &samples);
+			overdrawQuerySamples[overdrawSlot] = std::max(samples, 1);
+			++overdrawFrameIdx;
+		}
+		if (depthPrepass) {
+			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+			drawSortedInstances(true);
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			if (measureOverdraw) {
+				glEndQuery(GL_SAMPLES_PASSED);
+			}
+
+			// Only the nearest fragment of each pixel is shaded
+			glDepthFunc(GL_EQUAL);
+			glDepthMask(GL_FALSE);
+			drawSortedInstances(false);
+			glDepthFunc(GL_LESS);
+			glDepthMask(GL_TRUE);
+		} else {
+			drawSortedInstances(false);
+			if (measureOverdraw) {
+				glEndQuery(GL_SAMPLES_PASSED);
+			}
+		}
+		drawQueriedInstances();
 	};
 
-	if (!m_OutputPath.empty()) {
-		std::vector<unsigned char> pixels(m_nWindowWidth * m_nWindowHeight * 3);
-		renderToImage(m_nWindowWidth, m_nWindowHeight, 3, pixels.data(), [&]() {
-			drawScene(cameraController -> getCamera());
+	// Cast a ray against the scene, return the index of the closest instance hit or -1
+	const auto pickScene = [&](const Ray & ray, float & tHit) {
+		uint32_t hitInstance = 0;
+		tHit = std::numeric_limits<float>::max();
+		std::vector<glm::vec3> positions;
+		std::vector<uint32_t> triangles;
+		const bool hit = sceneBvh.intersectRay(ray, tHit, hitInstance, [&](uint32_t instanceIdx, float & t) {
+			const DrawInstance & instance = instances[instanceIdx];
+			const tinygltf::Primitive & prim = model.meshes[instance.meshIdx].primitives[instance.primitiveIdx];
+			if (!readPrimitiveTriangles(model, prim, triangles)) {
+				return false;
+			}
+			// Skinned vertices are posed in world space, other instances are tested in local space with their
+			// morph targets blended, t is preserved by the affine transform
+			glm::mat4 worldToLocal(1);
+			if (skinningSystem.isSkinned(instanceIdx)) {
+				skinningSystem.getPosedPositions(instanceIdx, morphSystem, positions);
+			} else {
+				if (!readPrimitivePositions(model, prim, positions)) {
+					return false;
+				}
+				const MorphWeight * morphWeights;
+				size_t morphWeightCount;
+				if (const MorphTargets * targets =
+						morphSystem.getActiveWeights(instanceIdx, morphWeights, morphWeightCount)) {
+					morphPositions(*targets, morphWeights, morphWeightCount, positions);
+				}
+				worldToLocal = inverse(instance.modelMatrix);
+			}
+			const Ray localRay{glm::vec3(worldToLocal * glm::vec4(ray.origin, 1)),
+							   glm::vec3(worldToLocal * glm::vec4(ray.direction, 0))};
+			bool hitTriangle = false;
+			for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+				float tTriangle;
+				if (intersectRayTriangle(localRay, positions[triangles[i]], positions[triangles[i + 1]],
+										 positions[triangles[i + 2]], tTriangle) && tTriangle < t) {
+					t = tTriangle;
+					hitTriangle = true;
+				}
+			}
+			return hitTriangle;
 		});
-		flipImageYAxis(m_nWindowWidth, m_nWindowHeight, 3, pixels.data());
+		return hit ? int(hitInstance) : -1;
+	};
+
+	// Ray going through the cursor position, in world space
+	const auto getCursorRay = [&](const Camera & camera) {
+		double cursorX, cursorY;
+		glfwGetCursorPos(m_GLFWHandle.window(), &cursorX, &cursorY);
+		const glm::vec2 ndc(2. * cursorX / m_nWindowWidth - 1., 1. - 2. * cursorY / m_nWindowHeight);
+		const glm::mat4 invViewProj = inverse(projMatrix * camera.getViewMatrix());
+		const glm::vec4 nearPoint = invViewProj * glm::vec4(ndc, -1, 1);
+		const glm::vec4 farPoint = invViewProj * glm::vec4(ndc, 1, 1);
+		const glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+		return Ray{origin, glm::normalize(glm::vec3(farPoint) / farPoint.w - origin)};
+	};
+
+	// Last two picked points, for distance measurement
+	std::vector<glm::vec3> pickedPoints;
+	int pickedInstance = -1;
+	bool rightButtonPressed = false;
+
+	if (!m_OutputPath.empty() && m_renderJob.viewCount) {
+		const auto views = generateJobViews(m_renderJob, center, maxDistance);
+		const bool succeeded = runRenderJob(views, m_OutputPath, m_nWindowWidth, m_nWindowHeight, m_imageOptions,
+											projMatrix, [&](const Camera & view, const glm::vec2 & pixelOffset) {
+												projectionPixelOffset = pixelOffset;
+												drawScene(view);
+											});
+		projectionPixelOffset = glm::vec2(0);
+		return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	if (!m_OutputPath.empty()) {
+		// Rows are read back top first, the image is encoded straight from the mapped pixel buffer
+		ImageRenderer imageRenderer(m_nWindowWidth, m_nWindowHeight, 3, m_imageOptions, 1);
 		const auto strPath = m_OutputPath.string();
-		stbi_write_png(strPath.c_str(), m_nWindowWidth, m_nWindowHeight, 3, pixels.data(), 0);
+		imageRenderer.render([&](const glm::vec2 & pixelOffset) {
+								 projectionPixelOffset = pixelOffset;
+								 drawScene(cameraController -> getCamera());
+							 },
+							 [&](const unsigned char * pixels) {
+								 stbi_write_png(strPath.c_str(), m_nWindowWidth, m_nWindowHeight, 3, pixels, 0);
+							 });
+		imageRenderer.finish();
+		projectionPixelOffset = glm::vec2(0);
 		return EXIT_SUCCESS;
 	}
 
+	// Dynamic resolution: the scene is rendered offscreen at a scale chosen from the measured GPU time
+	// of the frames, then upscaled to the window before the GUI is drawn
+	bool dynamicResolution = m_frameBudget > 0.f;
+	float frameBudget = m_frameBudget > 0.f ? m_frameBudget : 16.6f; // In milliseconds
+	DynamicResolutionTarget resolutionTarget(m_nWindowWidth, m_nWindowHeight, 1e-3 * frameBudget,
+											 m_ShadersRootPath / m_AppName / "upscale.vs.glsl",
+											 m_ShadersRootPath / m_AppName / "upscale.fs.glsl");
+	if (!resolutionTarget.isComplete()) {
+		std::cerr << "Dynamic resolution framebuffer is incomplete, it is disabled" << std::endl;
+		dynamicResolution = false;
+	}
+
 	// Loop until the user closes the window
+	auto previousFrameSeconds = glfwGetTime();
 	for (auto iterationCount = 0u; !m_GLFWHandle.shouldClose();
 		 ++iterationCount) {
 		const auto seconds = glfwGetTime();
+		if (animationIdx >= 0 && animationPlaying) {
+			const float duration = animationClips[animationIdx].duration;
+			animationTime += animationSpeed * float(seconds - previousFrameSeconds);
+			animationTime = duration > 0.f ? animationTime - duration * std::floor(animationTime / duration) : 0.f;
+			updateAnimation();
+		}
+		previousFrameSeconds = seconds;
 
 		const auto camera = cameraController -> getCamera();
-		drawScene(camera);
+		resolutionTarget.beginFrame(dynamicResolution);
+		renderWidth = resolutionTarget.renderWidth();
+		renderHeight = resolutionTarget.renderHeight();
+		if (dynamicResolution) {
+			resolutionTarget.bind();
+			drawScene(camera);
+			resolutionTarget.upscale();
+		} else {
+			drawScene(camera);
+		}
+		resolutionTarget.endFrame();
 
 		// GUI code:
 		imguiNewFrame();
@@ -439,6 +1479,7 @@ int ViewerApplication::run() {
 				}
 			}
 			if (ImGui::CollapsingHeader("Point light", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Checkbox("PL enabled", &defaultPointLight);
 				if (ImGui::ColorEdit3("PL color", (float *)&pointLightColor)) {
 				}				
 				if(ImGui::InputFloat("PL constant", &pointLightConstant)) {				
@@ -464,6 +1505,161 @@ int ViewerApplication::run() {
 			}
 
 			ImGui::Checkbox("light from camera", &lightFromCamera);
+
+			if (ImGui::CollapsingHeader("Shadows", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Checkbox("Cascaded shadow maps", &shadows);
+				size_t updatedCascadeCount = 0;
+				for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; ++i) {
+					updatedCascadeCount += (shadowUpdateMask >> i) & 1;
+				}
+				ImGui::Text("updated cascades: %zu / %u", updatedCascadeCount, SHADOW_CASCADE_COUNT);
+				ImGui::Text("casters: %zu, draw calls: %zu", shadowCasters.size(), shadowDrawCallCount);
+				ImGui::Text("last shadow pass (GPU): %.3f ms", 1000. * shadowRenderer.lastPassTime());
+			}
+
+			if (ImGui::CollapsingHeader("Punctual lights", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Text("lights: %zu (%zu directional)", punctualLights.size(), size_t(directionalLightCount));
+				ImGui::Text("clusters: %u x %u x %u", lightClusterGrid.counts.x, lightClusterGrid.counts.y,
+							lightClusterGrid.counts.z);
+				ImGui::Text("light list entries: %zu", lightClusterGrid.lightIndices.size());
+				ImGui::Text("clustering: %.3f ms", 1000. * lightClusteringTime);
+			}
+
+			if (!animationClips.empty() && ImGui::CollapsingHeader("Animation", ImGuiTreeNodeFlags_DefaultOpen)) {
+				const auto getClipName = [](void * data, int idx, const char ** outText) {
+					const auto & clips = *static_cast<const std::vector<AnimationClip> *>(data);
+					*outText = clips[idx].name.empty() ? "(unnamed)" : clips[idx].name.c_str();
+					return true;
+				};
+				if (ImGui::Combo("clip", &animationIdx, getClipName, (void *)&animationClips, int(animationClips.size()))) {
+					animationTime = 0.f;
+					updateAnimation();
+				}
+				ImGui::Checkbox("Play", &animationPlaying);
+				ImGui::SliderFloat("speed", &animationSpeed, 0.f, 4.f);
+				if (ImGui::SliderFloat("time", &animationTime, 0.f, animationClips[animationIdx].duration)) {
+					updateAnimation();
+				}
+				ImGui::Text("tracks: %zu", animationClips[animationIdx].tracks.size());
+				ImGui::Text("sampling: %.3f ms", 1000. * animationSamplingTime);
+			}
+
+			if (!skinningSystem.empty() && ImGui::CollapsingHeader("Skinning", ImGuiTreeNodeFlags_DefaultOpen)) {
+				// Merged geometry and vertex pulling have no per-primitive skinning attributes
+				bool gpuSkinning = skinningSystem.gpuSkinning();
+				if (!m_mergeGeometry && !m_vertexPulling && ImGui::Checkbox("GPU skinning", &gpuSkinning)) {
+					skinningSystem.setGpuSkinning(gpuSkinning);
+					sceneTransformsChanged = true;
+				}
+				ImGui::Text("instances: %zu", skinningSystem.instanceCount());
+				ImGui::Text("vertices: %zu", skinningSystem.vertexCount());
+				ImGui::Text("joints: %zu", skinningSystem.jointCount());
+				ImGui::Text("%s skinning: %.3f ms", gpuSkinning ? "palette" : "CPU", 1000. * skinningTime);
+			}
+
+			if (!morphSystem.empty() && ImGui::CollapsingHeader("Morph targets", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Text("instances: %zu", morphSystem.instanceCount());
+				ImGui::Text("primitives: %zu", morphSystem.primitiveCount());
+				ImGui::Text("active targets: %zu", morphSystem.activeWeightCount());
+				ImGui::Text("weight texels: %zu", morphSystem.weightTexelCount());
+			}
+
+			if (ImGui::CollapsingHeader("Dynamic resolution", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Checkbox("Dynamic resolution", &dynamicResolution);
+				if (ImGui::SliderFloat("budget (ms)", &frameBudget, 1.f, 100.f)) {
+					resolutionTarget.controller().setBudget(1e-3 * frameBudget);
+				}
+				ImGui::Text("GPU frame: %.3f ms", 1000. * resolutionTarget.gpuFrameTime());
+				ImGui::Text("render size: %dx%d (%.0f%%)", renderWidth, renderHeight, 100. * resolutionTarget.scale());
+			}
+
+			if (ImGui::CollapsingHeader("Culling", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Checkbox("Frustum culling", &frustumCulling);
+				ImGui::Text("visible instances: %zu / %zu", visibleInstances.size(), instances.size());
+				ImGui::Text("BVH nodes: %zu", sceneBvh.nodeCount());
+			}
+
+			if (ImGui::CollapsingHeader("Level of detail", ImGuiTreeNodeFlags_DefaultOpen)) {
+				if (m_generateLods) {
+					ImGui::Checkbox("LOD selection", &lodSelection);
+					ImGui::SliderFloat("max error (pixels)", &maxLodPixelError, 0.1f, 16.f);
+				}
+				ImGui::Checkbox("Sub-pixel culling", &subPixelCulling);
+				ImGui::SliderFloat("min size (pixels)", &minPixelSize, 0.f, 8.f);
+				ImGui::Text("sub-pixel culled: %zu", subPixelCulledCount);
+				ImGui::Text("triangles: %zu", triangleCount);
+			}
+
+			if (m_softwareOcclusion && ImGui::CollapsingHeader("Software occlusion", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Checkbox("Occlusion culling", &occlusionCulling);
+				ImGui::SliderFloat("min occluder size (pixels)", &minOccluderPixelSize, 1.f, float(m_nWindowHeight));
+				ImGui::Text("occluders: %zu (%zu triangles)", occluders.size(), occluderTriangleCount);
+				ImGui::Text("occluded instances: %zu", occlusionCulledCount);
+				ImGui::Text("CPU time: %.2f ms", occlusionCullingTime * 1000.);
+			}
+
+			if (ImGui::CollapsingHeader("Occlusion queries", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Checkbox("GPU occlusion queries", &occlusionQueries);
+				ImGui::Text("queries: %zu", occlusionQueryCount);
+				ImGui::Text("occluded instances: %zu", queryOccludedCount);
+			}
+
+			if (ImGui::CollapsingHeader("Draw ordering", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Checkbox("Sort draws by state", &sortDraws);
+				ImGui::Checkbox("Instancing", &instancing);
+				ImGui::Text("draws: %zu", sortedDraws.size());
+				ImGui::Checkbox("Multi draw indirect", &multiDrawIndirect);
+				ImGui::Text("draw calls: %zu", drawCallCount);
+				if (m_optimizeMeshes) {
+					ImGui::Text("ACMR: %.3f -> %.3f (%zu triangles)", meshOptimizationStats.acmrBefore,
+								meshOptimizationStats.acmrAfter, meshOptimizationStats.triangleCount);
+				}
+				if (multiDrawIndirect) {
+					ImGui::Text("indirect commands: %zu", elementsCommands.size() + arraysCommands.size());
+				}
+				ImGui::Checkbox("Shader variants", &shaderVariants);
+				ImGui::Text("compiled variants: %zu", shadingPrograms.size());
+				ImGui::Text("program binds: %zu", glState.programBindCount());
+				ImGui::Text("material binds: %zu", materialBindCount);
+				ImGui::Text("VAO binds: %zu", glState.vertexArrayBindCount());
+			}
+
+			if (ImGui::CollapsingHeader("Overdraw", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Text("depth test passes per pixel: %.2f", overdraw);
+				ImGui::Text("Depth prepass:");
+				ImGui::RadioButton("off", &depthPrepassMode, int(DepthPrepassMode::Off));
+				ImGui::SameLine();
+				ImGui::RadioButton("on", &depthPrepassMode, int(DepthPrepassMode::On));
+				ImGui::SameLine();
+				ImGui::RadioButton("auto", &depthPrepassMode, int(DepthPrepassMode::Auto));
+				ImGui::Text("depth prepass: %s", depthPrepass ? "active" : "inactive");
+			}
+
+			if (ImGui::CollapsingHeader("GL state cache", ImGuiTreeNodeFlags_DefaultOpen)) {
+				const auto issued = glState.issuedCallCount();
+				const auto skipped = glState.skippedCallCount();
+				ImGui::Text("GL calls issued: %zu", issued);
+				ImGui::Text("GL calls removed: %zu (%.1f%%)", skipped,
+							issued + skipped ? 100. * skipped / (issued + skipped) : 0.);
+			}
+
+			if (ImGui::CollapsingHeader("Picking", ImGuiTreeNodeFlags_DefaultOpen)) {
+				ImGui::Text("Right click to pick a point");
+				if (pickedInstance >= 0) {
+					const DrawInstance & instance = instances[pickedInstance];
+					ImGui::Text("node: %d %s, primitive %d", instance.nodeIdx,
+								model.nodes[instance.nodeIdx].name.c_str(), instance.primitiveIdx);
+				}
+				if (!pickedPoints.empty()) {
+					const glm::vec3 & point = pickedPoints.back();
+					ImGui::Text("point: %.3f %.3f %.3f", point.x, point.y, point.z);
+					ImGui::Text("distance to eye: %.3f", glm::distance(camera.eye(), point));
+				}
+				if (pickedPoints.size() == 2) {
+					ImGui::Text("distance between last two points: %.3f",
+								glm::distance(pickedPoints[0], pickedPoints[1]));
+				}
+			}
 			ImGui::End();
 		}
 
@@ -478,6 +1674,20 @@ int ViewerApplication::run() {
 			cameraController -> update(float(ellapsedTime));
 		}
 
+		const bool rightButtonDown = glfwGetMouseButton(m_GLFWHandle.window(), GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+		if (rightButtonDown && !rightButtonPressed && !guiHasFocus) {
+			const Ray ray = getCursorRay(cameraController -> getCamera());
+			float tHit;
+			pickedInstance = pickScene(ray, tHit);
+			if (pickedInstance >= 0) {
+				if (pickedPoints.size() == 2) {
+					pickedPoints.erase(begin(pickedPoints));
+				}
+				pickedPoints.push_back(ray.origin + tHit * ray.direction);
+			}
+		}
+		rightButtonPressed = rightButtonDown;
+
 		m_GLFWHandle.swapBuffers(); // Swap front and back buffers
 	}
 
@@ -489,7 +1699,11 @@ int ViewerApplication::run() {
 ViewerApplication::ViewerApplication(const fs::path & appPath, uint32_t width,
 									 uint32_t height, const fs::path & gltfFile,
 									 const std::vector<float> & lookatArgs, const std::string & vertexShader,
-									 const std::string & fragmentShader, const fs::path & output) :
+									 const std::string & fragmentShader, const fs::path & output, bool mergeGeometry,
+									 bool vertexPulling, bool optimizeMeshes, float overdrawThreshold,
+									 bool generateLods, bool softwareOcclusion, DepthPrepassMode depthPrepassMode,
+									 float frameBudget, const RenderToImageOptions & imageOptions,
+									 const RenderJob & renderJob) :
 		m_nWindowWidth(width),
 		m_nWindowHeight(height),
 		m_AppPath{appPath},
@@ -497,7 +1711,17 @@ ViewerApplication::ViewerApplication(const fs::path & appPath, uint32_t width,
 		m_ImGuiIniFilename{m_AppName + ".imgui.ini"},
 		m_ShadersRootPath{m_AppPath.parent_path() / "shaders"},
 		m_gltfFilePath{gltfFile},
-		m_OutputPath{output} {
+		m_OutputPath{output},
+		m_mergeGeometry{mergeGeometry},
+		m_vertexPulling{vertexPulling},
+		m_optimizeMeshes{optimizeMeshes},
+		m_overdrawThreshold{overdrawThreshold},
+		m_generateLods{generateLods},
+		m_softwareOcclusion{softwareOcclusion},
+		m_depthPrepassMode{depthPrepassMode},
+		m_frameBudget{frameBudget},
+		m_imageOptions{imageOptions},
+		m_renderJob{renderJob} {
 	if (!lookatArgs.empty()) {
 		m_hasUserCamera = true;
 		m_userCamera =
@@ -563,9 +1787,9 @@ ViewerApplication::createVertexArrayObjects(const tinygltf::Model & model, const
 		const int vaoOffset = vaos.size();
 		const int primitivesSize = model.meshes[i].primitives.size();
 		vaos.resize(vaoOffset + primitivesSize);
-		meshIndexToVaoRange.push_back(VaoRange{vaoOffset, primitivesSize});
+		meshIndexToVaoRange[i] = VaoRange{vaoOffset, primitivesSize};
 
-		glGenVertexArrays(primitivesSize, &vaos[i]);
+		glGenVertexArrays(primitivesSize, &vaos[vaoOffset]);
 		for(int j = 0; j < model.meshes[i].primitives.size(); j++) {
 			GLuint vao = vaos[vaoOffset + j];
 			glBindVertexArray(vao);
@@ -648,6 +1872,92 @@ ViewerApplication::createVertexArrayObjects(const tinygltf::Model & model, const
 	return vaos;
 }
 
+std::vector<PrimitiveDraw>
+ViewerApplication::getPrimitiveDraws(const tinygltf::Model & model, const std::vector<GLuint> & vaos) const {
+	std::vector<PrimitiveDraw> draws;
+	draws.reserve(vaos.size());
+	for (const auto & mesh : model.meshes) {
+		for (const auto & prim : mesh.primitives) {
+			PrimitiveDraw draw{vaos[draws.size()], GLenum(prim.mode), GL_NONE, 0, 0, 0};
+			if (prim.indices >= 0) {
+				const tinygltf::Accessor & accessor = model.accessors[prim.indices];
+				const tinygltf::BufferView & bufferView = model.bufferViews[accessor.bufferView];
+				const size_t byteOffset = accessor.byteOffset + bufferView.byteOffset;
+				// glTF aligns accessors on their component size
+				draw.indexType = accessor.componentType;
+				draw.count = accessor.count;
+				draw.first = GLuint(byteOffset / tinygltf::GetComponentSizeInBytes(accessor.componentType));
+			} else {
+				draw.count = model.accessors[(*begin(prim.attributes)).second].count;
+			}
+			draws.push_back(draw);
+		}
+	}
+	return draws;
+}
+
+GLuint ViewerApplication::createPackedVertexArrayObject(const PackedGeometry & geometry,
+														std::vector<GLuint> & bufferObjects) const {
+	GLuint buffers[2];
+	glGenBuffers(2, buffers);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+	glBufferStorage(GL_ARRAY_BUFFER, geometry.vertices.size() * sizeof(PackedVertex), geometry.vertices.data(), 0);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+	glBufferStorage(GL_ARRAY_BUFFER, geometry.indices.size() * sizeof(uint32_t), geometry.indices.data(), 0);
+	bufferObjects.insert(end(bufferObjects), buffers, buffers + 2);
+
+	GLuint vao;
+	glGenVertexArrays(1, &vao);
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+	glEnableVertexAttribArray(VERTEX_ATTRIB_POSITION_IDX);
+	glVertexAttribPointer(VERTEX_ATTRIB_POSITION_IDX, 3, GL_FLOAT, GL_FALSE, sizeof(PackedVertex),
+						  (const GLvoid *) offsetof(PackedVertex, position));
+	glEnableVertexAttribArray(VERTEX_ATTRIB_NORMAL_IDX);
+	glVertexAttribPointer(VERTEX_ATTRIB_NORMAL_IDX, 3, GL_FLOAT, GL_FALSE, sizeof(PackedVertex),
+						  (const GLvoid *) offsetof(PackedVertex, normal));
+	glEnableVertexAttribArray(VERTEX_ATTRIB_TEXCOORD0_IDX);
+	glVertexAttribPointer(VERTEX_ATTRIB_TEXCOORD0_IDX, 2, GL_FLOAT, GL_FALSE, sizeof(PackedVertex),
+						  (const GLvoid *) offsetof(PackedVertex, texCoords));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffers[1]);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	return vao;
+}
+
+void ViewerApplication::setInstanceAttributes(GLuint vao, GLuint instanceBuffer) const {
+	glBindVertexArray(vao);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	glEnableVertexAttribArray(VERTEX_ATTRIB_MATERIAL_IDX);
+	glVertexAttribIPointer(VERTEX_ATTRIB_MATERIAL_IDX, 1, GL_UNSIGNED_INT, sizeof(InstanceAttributes),
+						   (const GLvoid *) offsetof(InstanceAttributes, materialIndex));
+	glVertexAttribDivisor(VERTEX_ATTRIB_MATERIAL_IDX, 1);
+	glEnableVertexAttribArray(VERTEX_ATTRIB_PRIMITIVE_IDX);
+	glVertexAttribIPointer(VERTEX_ATTRIB_PRIMITIVE_IDX, 1, GL_UNSIGNED_INT, sizeof(InstanceAttributes),
+						   (const GLvoid *) offsetof(InstanceAttributes, primitiveIndex));
+	glVertexAttribDivisor(VERTEX_ATTRIB_PRIMITIVE_IDX, 1);
+	// Skin and morph offsets are read as one uvec2
+	static_assert(offsetof(InstanceAttributes, morphOffset) == offsetof(InstanceAttributes, skinOffset) + sizeof(GLuint),
+				  "Skin and morph offsets must be contiguous");
+	glEnableVertexAttribArray(VERTEX_ATTRIB_DEFORMATION_OFFSETS_IDX);
+	glVertexAttribIPointer(VERTEX_ATTRIB_DEFORMATION_OFFSETS_IDX, 2, GL_UNSIGNED_INT, sizeof(InstanceAttributes),
+						   (const GLvoid *) offsetof(InstanceAttributes, skinOffset));
+	glVertexAttribDivisor(VERTEX_ATTRIB_DEFORMATION_OFFSETS_IDX, 1);
+	// One vec4 attribute per matrix column
+	for (GLuint column = 0; column < 4; ++column) {
+		glEnableVertexAttribArray(VERTEX_ATTRIB_MODEL_MATRIX_IDX + column);
+		glVertexAttribPointer(VERTEX_ATTRIB_MODEL_MATRIX_IDX + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceAttributes),
+							  (const GLvoid *) (offsetof(InstanceAttributes, modelMatrix) + column * sizeof(glm::vec4)));
+		glVertexAttribDivisor(VERTEX_ATTRIB_MODEL_MATRIX_IDX + column, 1);
+		glEnableVertexAttribArray(VERTEX_ATTRIB_NORMAL_MATRIX_IDX + column);
+		glVertexAttribPointer(VERTEX_ATTRIB_NORMAL_MATRIX_IDX + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceAttributes),
+							  (const GLvoid *) (offsetof(InstanceAttributes, normalMatrix) + column * sizeof(glm::vec4)));
+		glVertexAttribDivisor(VERTEX_ATTRIB_NORMAL_MATRIX_IDX + column, 1);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+}
+
 std::vector<GLuint> ViewerApplication::createTextureObjects(const tinygltf::Model & model) const {
 	std::vector<GLuint> textureObjects(model.textures.size(), 0);
 	glGenTextures(textureObjects.size(), textureObjects.data());
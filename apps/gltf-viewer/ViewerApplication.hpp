@@ -2,24 +2,58 @@
 
 #include <tiny_gltf.h>
 #include "utils/GLFWHandle.hpp"
+#include "utils/bvh.hpp"
 #include "utils/cameras.hpp"
+#include "utils/draw_instances.hpp"
 #include "utils/filesystem.hpp"
+#include "utils/geometry.hpp"
+#include "utils/images.hpp"
+#include "utils/render_jobs.hpp"
 #include "utils/shaders.hpp"
 
 class ViewerApplication {
 public:
+	// Depth only pass before shading: never, always, or when the measured overdraw is high
+	enum class DepthPrepassMode { Off, On, Auto };
+
 	ViewerApplication(const fs::path & appPath, uint32_t width, uint32_t height,
 					  const fs::path & gltfFile, const std::vector<float> & lookatArgs,
 					  const std::string & vertexShader, const std::string & fragmentShader,
-					  const fs::path & output);
+					  const fs::path & output, bool mergeGeometry, bool vertexPulling,
+					  bool optimizeMeshes, float overdrawThreshold, bool generateLods,
+					  bool softwareOcclusion, DepthPrepassMode depthPrepassMode, float frameBudget,
+					  const RenderToImageOptions & imageOptions, const RenderJob & renderJob);
 
 	int run();
 
 private:
-	// A range of indices in a vector containing Vertex Array Objects
-	struct VaoRange {
-		GLsizei begin; // Index of first element in vertexArrayObjects
-		GLsizei count; // Number of elements in range
+	// Last GPU occlusion query of a draw instance
+	struct OcclusionQueryState {
+		GLuint query = 0; // Generated on first use
+		bool visible = true; // Result of the last query read
+		bool pending = false; // A query was issued and its result has not been read
+	};
+
+	// Vertex attributes of a drawn instance, read from the instance buffer with a divisor of 1
+	struct InstanceAttributes {
+		glm::mat4 modelMatrix;
+		glm::mat4 normalMatrix;
+		GLuint materialIndex;
+		GLuint primitiveIndex; // Only read by the vertex pulling shader
+		GLuint skinOffset; // First joint matrix or CPU skinned vertex of skinned instances
+		GLuint morphOffset; // Header texel of the active morph weights of morphed instances
+	};
+
+	// Consecutive indirect commands submitted with one glMultiDraw*Indirect call. They share the
+	// VAO, primitive mode, index type (GL_NONE for non indexed draws) and material textures.
+	struct IndirectBatch {
+		GLuint vao;
+		GLenum mode;
+		GLenum indexType;
+		uint32_t materialTableIndex; // Any material of the batch, used to bind textures
+		uint32_t vertexFeatures; // Skinning and morph shader features of all draws of the batch
+		size_t firstCommand; // In the commands array of the batch kind (elements or arrays)
+		GLsizei commandCount;
 	};
 
 	GLsizei m_nWindowWidth = 1280;
@@ -38,6 +72,17 @@ private:
 
 	fs::path m_OutputPath;
 
+	bool m_mergeGeometry = false;
+	bool m_vertexPulling = false;
+	bool m_optimizeMeshes = false;
+	float m_overdrawThreshold = 1.05f;
+	bool m_generateLods = false;
+	bool m_softwareOcclusion = false;
+	DepthPrepassMode m_depthPrepassMode = DepthPrepassMode::Auto;
+	float m_frameBudget = 0.f; // GPU time of a frame in milliseconds held by dynamic resolution, 0 to disable
+	RenderToImageOptions m_imageOptions; // Antialiasing of the output image
+	RenderJob m_renderJob; // Views rendered with an output path
+
 	// Order is important here, see comment below
 	const std::string m_ImGuiIniFilename;
 	// Last to be initialized, first to be destroyed:
@@ -59,5 +104,11 @@ private:
 	bool loadGltfFile(tinygltf::Model & model);
 	std::vector<GLuint> createBufferObjects( const tinygltf::Model &model);
 	std::vector<GLuint> createVertexArrayObjects( const tinygltf::Model &model, const std::vector<GLuint> &bufferObjects, std::vector<VaoRange> & meshIndexToVaoRange);
+	// Draw arguments of each primitive using its own VAO, in the same order as the VAOs
+	std::vector<PrimitiveDraw> getPrimitiveDraws(const tinygltf::Model &model, const std::vector<GLuint> &vaos) const;
+	// Single VAO reading interleaved vertices and uint32 indices, its two buffers are appended to bufferObjects
+	GLuint createPackedVertexArrayObject(const PackedGeometry &geometry, std::vector<GLuint> &bufferObjects) const;
+	// Per instance attributes are sourced from instanceBuffer in every VAO
+	void setInstanceAttributes(GLuint vao, GLuint instanceBuffer) const;
 	std::vector<GLuint> createTextureObjects(const tinygltf::Model &model) const;
 };
\ No newline at end of file
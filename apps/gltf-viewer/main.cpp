@@ -25,9 +25,10 @@ int main(int argc, char **argv)
       commands, "viewer", "Run glTF viewer", [&](args::Subparser &parser) {
         args::Positional<std::string> file{
             parser, "file", "Path to file", args::Options::Required};
-        args::ValueFlag<std::string> lookat{parser, "lookat",
+        args::ValueFlagList<std::string> lookat{parser, "lookat",
             "Look at parameters for the Camera with format "
-            "eye_x,eye_y,eye_z,center_x,center_y,center_z,up_x,up_y,up_z",
+            "eye_x,eye_y,eye_z,center_x,center_y,center_z,up_x,up_y,up_z. "
+            "Repeated, keyframes of --view-mode path",
             {"lookat"}};
         args::ValueFlag<std::string> vertexShader{
             parser, "vs", "Vertex shader to use", {"vs"}};
@@ -43,20 +44,141 @@ int main(int argc, char **argv)
             "Output path to render the image. If specified no window is shown. "
             "Only png is supported.",
             {"o", "output"}};
+        args::Flag mergeGeometry{parser, "merge-geometry",
+            "Repack all meshes in a single interleaved vertex buffer and index "
+            "buffer, drawn from one VAO",
+            {"merge-geometry"}};
+        args::Flag vertexPulling{parser, "vertex-pulling",
+            "Read vertex attributes from storage buffers in the vertex shader, "
+            "in their original format (replaces the vertex shader)",
+            {"vertex-pulling"}};
+        args::Flag optimizeMeshes{parser, "optimize-meshes",
+            "Reorder triangles for the post-transform vertex cache and vertices "
+            "for fetch locality at load time",
+            {"optimize-meshes"}};
+        args::ValueFlag<float> overdrawThreshold{parser, "threshold",
+            "With --optimize-meshes, maximum ACMR increase allowed to reorder "
+            "triangles for less overdraw (default 1.05, below 1 disables it)",
+            {"overdraw-threshold"}};
+        args::Flag generateLods{parser, "generate-lods",
+            "Generate simplified levels of detail of the meshes at load time, "
+            "selected from their projected error at draw time",
+            {"generate-lods"}};
+        args::Flag softwareOcclusion{parser, "software-occlusion",
+            "Cull instances hidden behind the largest visible objects with a "
+            "CPU rasterized depth buffer",
+            {"software-occlusion"}};
+        args::ValueFlag<std::string> depthPrepass{parser, "mode",
+            "Depth only pass before shading: off, on or auto (default, enabled "
+            "when the measured overdraw is high)",
+            {"depth-prepass"}};
+        args::ValueFlag<float> frameBudget{parser, "ms",
+            "Scale the render resolution from the measured GPU time of the "
+            "frames to hold this frame time in milliseconds (e.g. 16.6)",
+            {"frame-budget"}};
+        args::ValueFlag<int> samples{parser, "samples",
+            "With -o, MSAA samples per pixel of the output image (default 4)",
+            {"samples"}};
+        args::ValueFlag<int> supersampling{parser, "factor",
+            "With -o, render the output image factor^2 times with sub-pixel "
+            "offsets and average them (default 1)",
+            {"supersampling"}};
+        args::ValueFlag<size_t> views{parser, "count",
+            "With -o, render count views in one run to numbered images "
+            "(out.png gives out_0000.png...) and write their cameras to "
+            "out.json",
+            {"views"}};
+        args::ValueFlag<std::string> viewMode{parser, "mode",
+            "Cameras of --views: turntable (default) around the scene, path "
+            "through the --lookat keyframes, or random around the scene",
+            {"view-mode"}};
+        args::ValueFlag<float> elevation{parser, "degrees",
+            "Angle of the turntable cameras above the horizon (default 20)",
+            {"elevation"}};
+        args::ValueFlag<uint32_t> seed{
+            parser, "seed", "Seed of the random views (default 0)", {"seed"}};
         parser.Parse();
 
+        if (mergeGeometry && vertexPulling) {
+          throw args::ValidationError(
+              "--merge-geometry and --vertex-pulling are exclusive");
+        }
+
+        auto depthPrepassMode = ViewerApplication::DepthPrepassMode::Auto;
+        if (depthPrepass) {
+          const std::string &mode = args::get(depthPrepass);
+          if (mode == "off") {
+            depthPrepassMode = ViewerApplication::DepthPrepassMode::Off;
+          } else if (mode == "on") {
+            depthPrepassMode = ViewerApplication::DepthPrepassMode::On;
+          } else if (mode != "auto") {
+            throw args::ValidationError("Unknown --depth-prepass mode " +
+                                        mode + " (expected off, on or auto)");
+          }
+        }
+
+        if (frameBudget && args::get(frameBudget) <= 0.f) {
+          throw args::ValidationError("--frame-budget must be positive");
+        }
+
+        RenderToImageOptions imageOptions;
+        imageOptions.samples = samples ? args::get(samples) : 4;
+        imageOptions.supersampling = supersampling ? args::get(supersampling) : 1;
+        if (imageOptions.samples < 1 || imageOptions.supersampling < 1) {
+          throw args::ValidationError(
+              "--samples and --supersampling must be at least 1");
+        }
+
+        // The first --lookat is the camera of the viewer and of single images
         std::vector<float> lookatParams;
-        if (lookat) {
-          const std::string &lookatArgs = args::get(lookat);
+        RenderJob renderJob;
+        for (const std::string &lookatArgs : args::get(lookat)) {
           const auto tokens = split(lookatArgs, ",");
           if (tokens.size() != 9) {
             throw args::ValidationError("Unable to parse --lookat argument "
                                         "(expected 9 numbers, got " +
                                         std::to_string(tokens.size()) + ")");
           }
+          std::vector<float> params;
           for (const auto &arg : tokens) {
-            lookatParams.emplace_back(std::stof(arg));
+            params.emplace_back(std::stof(arg));
+          }
+          renderJob.keyframes.emplace_back(
+              glm::vec3(params[0], params[1], params[2]),
+              glm::vec3(params[3], params[4], params[5]),
+              glm::vec3(params[6], params[7], params[8]));
+          if (lookatParams.empty()) {
+            lookatParams = params;
+          }
+        }
+
+        if (views) {
+          if (!output) {
+            throw args::ValidationError("--views requires an output path");
+          }
+          if (args::get(views) == 0) {
+            throw args::ValidationError("--views must be positive");
+          }
+          renderJob.viewCount = args::get(views);
+          const std::string mode = viewMode ? args::get(viewMode) : "turntable";
+          if (mode == "turntable") {
+            renderJob.mode = RenderJob::Mode::Turntable;
+          } else if (mode == "path") {
+            renderJob.mode = RenderJob::Mode::Path;
+            if (renderJob.keyframes.size() < 2) {
+              throw args::ValidationError(
+                  "--view-mode path requires at least two --lookat keyframes");
+            }
+          } else if (mode == "random") {
+            renderJob.mode = RenderJob::Mode::Random;
+          } else {
+            throw args::ValidationError("Unknown --view-mode " + mode +
+                                        " (expected turntable, path or random)");
+          }
+          if (elevation) {
+            renderJob.elevation = glm::radians(args::get(elevation));
           }
+          renderJob.seed = seed ? args::get(seed) : 0;
         }
 
         uint32_t width = imageWidth ? args::get(imageWidth) : 1280;
@@ -64,7 +186,12 @@ int main(int argc, char **argv)
 
         ViewerApplication app{fs::path{argv[0]}, width, height, args::get(file),
             lookatParams, args::get(vertexShader), args::get(fragmentShader),
-            args::get(output)};
+            args::get(output), args::get(mergeGeometry),
+            args::get(vertexPulling), args::get(optimizeMeshes),
+            overdrawThreshold ? args::get(overdrawThreshold) : 1.05f,
+            args::get(generateLods), args::get(softwareOcclusion),
+            depthPrepassMode, frameBudget ? args::get(frameBudget) : 0.f,
+            imageOptions, renderJob};
         returnCode = app.run();
       }};
 
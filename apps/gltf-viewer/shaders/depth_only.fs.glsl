@@ -0,0 +1,6 @@
+#version 330
+
+// Depth prepass: only depth is written, the shading pass then tests with GL_EQUAL
+void main()
+{
+}
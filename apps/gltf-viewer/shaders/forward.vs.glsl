@@ -3,21 +3,75 @@
 layout(location = 0) in vec3 aPosition;
 layout(location = 1) in vec3 aNormal;
 layout(location = 2) in vec2 aTexCoords;
+// Per instance attributes, see InstanceAttributes in ViewerApplication.hpp
+layout(location = 3) in uint aMaterialIndex; // Index in the material table
+layout(location = 4) in mat4 aModelMatrix;
+layout(location = 8) in mat4 aNormalMatrix;
+#if defined(USE_SKINNING) || defined(USE_SKINNED_VERTICES) || defined(USE_MORPH_TARGETS)
+// x: first joint matrix or skinned vertex, y: header texel of the morph weights
+layout(location = 13) in uvec2 aDeformationOffsets;
+#endif
+#if defined(USE_SKINNING) || defined(USE_SKINNED_VERTICES)
+// Skinned instances have identity matrices, joint matrices and skinned
+// vertices are in world space (see utils/skinning.hpp)
+uniform samplerBuffer uSkinningBuffer;
+#endif
+#ifdef USE_MORPH_TARGETS
+#include "morph.glsl"
+#endif
+#ifdef USE_SKINNING
+layout(location = 14) in uvec4 aJoints;
+layout(location = 15) in vec4 aWeights;
+#endif
 
 out vec3 vViewSpacePosition;
 out vec3 vViewSpaceNormal;
 out vec2 vTexCoords;
 out vec3 vFragPos; 
+flat out uint vMaterialIndex;
+// The depth prepass uses this shader too, its depths must match exactly
+invariant gl_Position;
 
-uniform mat4 uModelViewProjMatrix;
-uniform mat4 uModelViewMatrix;
-uniform mat4 uNormalMatrix;
+// Written once per frame, see utils/frame_uniforms.hpp
+layout(std140) uniform CameraUniforms {
+    mat4 uViewMatrix;
+    mat4 uProjMatrix;
+};
+
+#ifdef USE_SKINNING
+// Joint matrices take 4 texels
+mat4 getJointMatrix(uint joint)
+{
+    int texel = int(4u * (aDeformationOffsets.x + joint));
+    return mat4(texelFetch(uSkinningBuffer, texel), texelFetch(uSkinningBuffer, texel + 1),
+                texelFetch(uSkinningBuffer, texel + 2), texelFetch(uSkinningBuffer, texel + 3));
+}
+#endif
 
 void main()
 {
-    vViewSpacePosition = vec3(uModelViewMatrix * vec4(aPosition, 1));
-	vViewSpaceNormal = normalize(vec3(uNormalMatrix * vec4(aNormal, 0)));
+    vec4 position = vec4(aPosition, 1);
+    vec3 normal = aNormal;
+#ifdef USE_MORPH_TARGETS
+    morph(uint(gl_VertexID), position.xyz, normal);
+#endif
+#if defined(USE_SKINNING)
+    mat4 skinMatrix = aWeights.x * getJointMatrix(aJoints.x) + aWeights.y * getJointMatrix(aJoints.y) +
+                      aWeights.z * getJointMatrix(aJoints.z) + aWeights.w * getJointMatrix(aJoints.w);
+    position = skinMatrix * position;
+    normal = mat3(skinMatrix) * normal;
+#elif defined(USE_SKINNED_VERTICES)
+    // Position and normal pairs, the offset includes the base vertex of the draw
+    int texel = int(2u * (aDeformationOffsets.x + uint(gl_VertexID)));
+    position = texelFetch(uSkinningBuffer, texel);
+    normal = texelFetch(uSkinningBuffer, texel + 1).xyz;
+#endif
+    vec4 viewSpacePosition = uViewMatrix * aModelMatrix * position;
+    vViewSpacePosition = vec3(viewSpacePosition);
+	// The view matrix is a rigid transform, its rotation part is enough for normals
+	vViewSpaceNormal = normalize(mat3(uViewMatrix) * vec3(aNormalMatrix * vec4(normal, 0)));
 	vTexCoords = aTexCoords;
 	vFragPos = aPosition;
-    gl_Position =  uModelViewProjMatrix * vec4(aPosition, 1);
+	vMaterialIndex = aMaterialIndex;
+    gl_Position =  uProjMatrix * viewSpacePosition;
 }
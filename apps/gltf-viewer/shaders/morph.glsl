@@ -0,0 +1,25 @@
+// Morph target blending shared by forward.vs.glsl and vertex_pulling.vs.glsl,
+// included after the declaration of aDeformationOffsets when USE_MORPH_TARGETS
+// is defined.
+
+uniform samplerBuffer uMorphDeltas; // (position, normal) pairs, see utils/morph.hpp
+uniform usamplerBuffer uMorphWeights;
+
+// Add the deltas of the active targets of the instance to a vertex. Its header
+// texel holds the first delta texel, the vertex count, the active target count
+// and the offset from vertexId to the vertex index of the primitive, then
+// (target, weight) pairs are packed two per texel.
+void morph(uint vertexId, inout vec3 position, inout vec3 normal)
+{
+    int headerTexel = int(aDeformationOffsets.y);
+    uvec4 header = texelFetch(uMorphWeights, headerTexel);
+    uint vertex = vertexId + header.w;
+    for (uint i = 0u; i < header.z; ++i) {
+        uvec4 texel = texelFetch(uMorphWeights, headerTexel + 1 + int(i >> 1));
+        uvec2 target = (i & 1u) == 0u ? texel.xy : texel.zw;
+        float weight = uintBitsToFloat(target.y);
+        int delta = int(header.x + 2u * (target.x * header.y + vertex));
+        position += weight * texelFetch(uMorphDeltas, delta).xyz;
+        normal += weight * texelFetch(uMorphDeltas, delta + 1).xyz;
+    }
+}
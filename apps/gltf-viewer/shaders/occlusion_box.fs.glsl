@@ -0,0 +1,6 @@
+#version 330
+
+// Occlusion query boxes only pass the depth test, color writes are disabled
+void main()
+{
+}
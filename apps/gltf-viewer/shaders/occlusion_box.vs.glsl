@@ -0,0 +1,19 @@
+#version 330
+
+// Bounding box of an instance for occlusion queries, drawn as a triangle strip
+// of 14 vertices generated from gl_VertexID
+uniform vec3 uBoxMin;
+uniform vec3 uBoxMax;
+
+// Written once per frame, see utils/frame_uniforms.hpp
+layout(std140) uniform CameraUniforms {
+    mat4 uViewMatrix;
+    mat4 uProjMatrix;
+};
+
+void main()
+{
+    int vertexBit = 1 << gl_VertexID;
+    vec3 corner = vec3((0x287a & vertexBit) != 0, (0x02af & vertexBit) != 0, (0x31e3 & vertexBit) != 0);
+    gl_Position = uProjMatrix * uViewMatrix * vec4(mix(uBoxMin, uBoxMax, corner), 1);
+}
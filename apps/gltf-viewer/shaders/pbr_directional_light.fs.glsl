@@ -1,55 +1,119 @@
-#version 330
+#version 430
 
 in vec3 vViewSpaceNormal;
 in vec3 vViewSpacePosition;
 in vec2 vTexCoords;
+flat in uint vMaterialIndex;
+
+// Variants of this shader are compiled with the defines of the textures of the
+// material and of the lights in use, see utils/shader_variants.hpp:
+// HAS_BASE_COLOR_TEXTURE, HAS_METALLIC_ROUGHNESS_TEXTURE, HAS_EMISSIVE_TEXTURE,
+// HAS_OCCLUSION_TEXTURE, USE_DIRECTIONAL_LIGHT, USE_POINT_LIGHT,
+// USE_SPOT_LIGHT, USE_PUNCTUAL_LIGHTS and USE_DIRECTIONAL_SHADOWS
+
+// Lights, written once per frame, see utils/frame_uniforms.hpp
+// Members are ordered so that floats fill the padding after vec3 in std140
 
 // Directional Light
 struct DirLight {
     vec3 uLightDirection;
 	vec3 uLightIntensity;
 };  
-uniform DirLight dirLight;
 
-// Point lights (TODO)
+// Point light
 
 struct PointLight {    
     vec3 position;
-    vec3  color;
-    
     float constant;
+    vec3  color;
     float linear;
     float quadratic;  
 };
-uniform PointLight pointLight;
 
-// Spot light (TODO)
+// Spot light attached to the camera
 
 struct SpotLight {    
     vec3  position;
-    vec3  direction;
-    vec3  color;
     float cutOff;
+    vec3  direction;
     float outerCutOff;
-	
+    vec3  color;
     float constant;
     float linear;
     float quadratic;
 };
-uniform SpotLight spotLight;
 
-// Materials factors
-uniform vec4 uBaseColorFactor;
-uniform float uMetallicFactor;
-uniform float uRoughnessFactor;
-uniform vec3 uEmissiveFactor;
-uniform float uOcclusionStrength;
+const int SHADOW_CASCADE_COUNT = 4;
+
+layout(std140) uniform LightUniforms {
+    DirLight dirLight;
+    PointLight pointLight;
+    SpotLight spotLight;
+    // Cluster grid of the punctual lights, see utils/lights.hpp
+    uvec3 clusterCounts;
+    uint directionalLightCount;
+    vec2 clusterTileSize; // In pixels
+    float clusterNear;
+    float clusterDepthScale; // clusterCounts.z / log(far / near)
+    // Shadow cascades of the directional light, see utils/shadows.hpp
+    mat4 cascadeMatrices[SHADOW_CASCADE_COUNT]; // View space to shadow map
+    vec4 cascadeSplits; // Far view depth of each cascade
+    vec4 cascadeTexelSizes;
+};
+
+// Punctual lights of the scene (KHR_lights_punctual) in view space,
+// directional lights first. The other lights are only evaluated by the
+// fragments of the clusters they reach.
+const int LIGHT_TYPE_DIRECTIONAL = 0;
+const int LIGHT_TYPE_POINT = 1;
+const int LIGHT_TYPE_SPOT = 2;
+
+struct PunctualLight {
+    vec3 position;
+    float range;
+    vec3 direction;
+    float spotScale;
+    vec3 color;
+    float spotOffset;
+    int type;
+};
+
+layout(std430, binding = 3) readonly buffer PunctualLights {
+    PunctualLight punctualLights[];
+};
+
+// (offset, count) of the lights of each cluster in lightClusterIndices
+layout(std430, binding = 4) readonly buffer LightClusters {
+    uvec2 lightClusters[];
+};
+
+layout(std430, binding = 5) readonly buffer LightClusterIndices {
+    uint lightClusterIndices[];
+};
+
+// Materials factors, see utils/materials.hpp
+struct Material {
+    vec4 baseColorFactor;
+    vec3 emissiveFactor;
+    float metallicFactor;
+    float roughnessFactor;
+    float occlusionStrength;
+    int baseColorTexture;
+    int metallicRoughnessTexture;
+    int emissiveTexture;
+    int occlusionTexture;
+};
+
+layout(std430, binding = 0) readonly buffer MaterialTable {
+    Material materials[];
+};
 
 // Textures maps
 uniform sampler2D uMetallicRoughnessTexture;
 uniform sampler2D uBaseColorTexture;
 uniform sampler2D uEmissiveTexture;
 uniform sampler2D uOcclusionTexture;
+uniform sampler2DArrayShadow uShadowMap;
 
 out vec3 fColor;
 
@@ -77,33 +141,55 @@ vec4 SRGBtoLINEAR(vec4 srgbIn) {
     return vec4(pow(srgbIn.xyz, vec3(GAMMA)), srgbIn.w);
 }
 
-vec3 calculateDirLight(DirLight light) {
-	vec3 N = normalize(vViewSpaceNormal);
-    vec3 L = light.uLightDirection;
-    vec3 V = normalize(-vViewSpacePosition);
-    vec3 H = normalize(L + V);
+// Surface parameters shared by all lights, textures are sampled once per fragment
+struct Surface {
+    vec3 N;
+    vec3 V;
+    vec3 cDiff;
+    vec3 f0;
+    float a2;
+};
 
-    vec4 baseColorFromTexture = SRGBtoLINEAR(texture(uBaseColorTexture, vTexCoords));
-    vec4 baseColor = baseColorFromTexture * uBaseColorFactor;
-    float NdotL = clamp(dot(N, L), 0, 1);
-    float NdotV = clamp(dot(N, V), 0, 1);
-    float NdotH = clamp(dot(N, H), 0, 1);
-    float VdotH = clamp(dot(V, H), 0, 1);
+Surface getSurface(Material material) {
+    Surface surface;
+    surface.N = normalize(vViewSpaceNormal);
+    surface.V = normalize(-vViewSpacePosition);
+
+    vec4 baseColor = material.baseColorFactor;
+#ifdef HAS_BASE_COLOR_TEXTURE
+    baseColor *= SRGBtoLINEAR(texture(uBaseColorTexture, vTexCoords));
+#endif
+    float metallic = material.metallicFactor;
+    float roughness = material.roughnessFactor;
+#ifdef HAS_METALLIC_ROUGHNESS_TEXTURE
+    vec4 metallicRoughness = texture(uMetallicRoughnessTexture, vTexCoords);
+    metallic *= metallicRoughness.z;
+    roughness *= metallicRoughness.y;
+#endif
+
+    surface.cDiff = mix(baseColor.rgb * (1 - dielectricSpecular.r), black, metallic);
+    surface.f0 = mix(dielectricSpecular, baseColor.rgb, metallic);
+    float a = material.roughnessFactor * roughness;
+    surface.a2 = a * a;
+    return surface;
+}
 
-    float metallic = texture(uMetallicRoughnessTexture, vTexCoords).z * uMetallicFactor;
-    float roughness = texture(uMetallicRoughnessTexture, vTexCoords).y * uRoughnessFactor;
+// Linear radiance reflected toward the camera from light coming from direction L
+vec3 evaluateBRDF(Surface surface, vec3 L, vec3 radiance) {
+    vec3 H = normalize(L + surface.V);
 
-    vec3 cDiff = mix(baseColor.rgb * (1 - dielectricSpecular.r), black, metallic);
-    vec3 f0 = mix(dielectricSpecular, baseColor.rgb, metallic);
-    float a = uRoughnessFactor * roughness;
-    float a2 = a * a;
+    float NdotL = clamp(dot(surface.N, L), 0, 1);
+    float NdotV = clamp(dot(surface.N, surface.V), 0, 1);
+    float NdotH = clamp(dot(surface.N, H), 0, 1);
+    float VdotH = clamp(dot(surface.V, H), 0, 1);
+    float a2 = surface.a2;
 
     // You need to compute baseShlickFactor first
     float baseShlickFactor = (1 - VdotH);
     float shlickFactor = baseShlickFactor * baseShlickFactor; // power 2
     shlickFactor *= shlickFactor; // power 4
     shlickFactor *= baseShlickFactor; // power 5
-    vec3 F = f0 + (1 - f0) * shlickFactor;
+    vec3 F = surface.f0 + (1 - surface.f0) * shlickFactor;
 
     float deno = NdotL * sqrt(NdotV * NdotV * (1 - a2) + a2) + NdotV * sqrt(NdotL* NdotL * (1 - a2) + a2);
     float Vis;
@@ -123,163 +209,123 @@ vec3 calculateDirLight(DirLight light) {
         D = a2 / deno;
     }
 
-    vec3 diffuse = cDiff * M_1_PI;
+    vec3 diffuse = surface.cDiff * M_1_PI;
     vec3 f_diffuse = (1 - F) * diffuse;
     vec3 f_specular = F * Vis * D;
-
-    vec4 emissive = texture(uEmissiveTexture, vTexCoords) * vec4(uEmissiveFactor, 1);
-
-    vec4 occlusion = texture(uOcclusionTexture, vTexCoords);
-
-    vec3 color = (f_diffuse + f_specular) * light.uLightIntensity * NdotL + emissive.xyz;
-    color = mix(color, color * occlusion.x, uOcclusionStrength);
-    color = LINEARtoSRGB(color);
-    return color;
+    return (f_diffuse + f_specular) * radiance * NdotL;
 }
 
-vec3 calculatePointLight(PointLight light) {
-	vec3 N = normalize(vViewSpaceNormal);
-    vec3 L = normalize(light.position - vViewSpacePosition);
-    vec3 V = normalize(-vViewSpacePosition);
-    vec3 H = normalize(L + V);
-
-    vec4 baseColorFromTexture = SRGBtoLINEAR(texture(uBaseColorTexture, vTexCoords));
-    vec4 baseColor = baseColorFromTexture * uBaseColorFactor;
-    float NdotL = clamp(dot(N, L), 0, 1);
-    float NdotV = clamp(dot(N, V), 0, 1);
-    float NdotH = clamp(dot(N, H), 0, 1);
-    float VdotH = clamp(dot(V, H), 0, 1);
-
-    float metallic = texture(uMetallicRoughnessTexture, vTexCoords).z * uMetallicFactor;
-    float roughness = texture(uMetallicRoughnessTexture, vTexCoords).y * uRoughnessFactor;
-
-    vec3 cDiff = mix(baseColor.rgb * (1 - dielectricSpecular.r), black, metallic);
-    vec3 f0 = mix(dielectricSpecular, baseColor.rgb, metallic);
-    float a = uRoughnessFactor * roughness;
-    float a2 = a * a;
-
-    // You need to compute baseShlickFactor first
-    float baseShlickFactor = (1 - VdotH);
-    float shlickFactor = baseShlickFactor * baseShlickFactor; // power 2
-    shlickFactor *= shlickFactor; // power 4
-    shlickFactor *= baseShlickFactor; // power 5
-    vec3 F = f0 + (1 - f0) * shlickFactor;
-
-    float deno = NdotL * sqrt(NdotV * NdotV * (1 - a2) + a2) + NdotV * sqrt(NdotL* NdotL * (1 - a2) + a2);
-    float Vis;
-    if (deno == 0.) {
-        Vis = 0;
-    }
-    else {
-        Vis = 0.5 / deno;
-    }
+vec3 calculateDirLight(DirLight light, Surface surface) {
+    return evaluateBRDF(surface, light.uLightDirection, light.uLightIntensity);
+}
 
-    deno = M_PI * (NdotH * NdotH * (a2 - 1) + 1) * (NdotH * NdotH * (a2 - 1) + 1);
-    float D;
-    if (deno == 0.) {
-        D = 0;
+// Fraction of the directional light reaching the fragment, from the first
+// cascade containing it. Four bilinear depth comparisons filter the edges.
+float getDirectionalShadow(vec3 N) {
+    float depth = -vViewSpacePosition.z;
+    int cascade = 0;
+    while (cascade < SHADOW_CASCADE_COUNT && depth > cascadeSplits[cascade]) {
+        ++cascade;
     }
-    else {
-        D = a2 / deno;
+    if (cascade == SHADOW_CASCADE_COUNT) {
+        return 1.0;
     }
+    // Offset along the normal against acne on surfaces parallel to the light
+    vec3 position = vViewSpacePosition + N * (1.5 * cascadeTexelSizes[cascade]);
+    vec4 coords = cascadeMatrices[cascade] * vec4(position, 1);
+    vec4 shadowCoords = vec4(coords.xy, float(cascade), coords.z);
+    float shadow = textureOffset(uShadowMap, shadowCoords, ivec2(-1, -1)) +
+                   textureOffset(uShadowMap, shadowCoords, ivec2(1, -1)) +
+                   textureOffset(uShadowMap, shadowCoords, ivec2(-1, 1)) +
+                   textureOffset(uShadowMap, shadowCoords, ivec2(1, 1));
+    return 0.25 * shadow;
+}
 
-    vec3 diffuse = cDiff * M_1_PI;
-    vec3 f_diffuse = (1 - F) * diffuse;
-    vec3 f_specular = F * Vis * D;
-
-    vec4 emissive = texture(uEmissiveTexture, vTexCoords) * vec4(uEmissiveFactor, 1);
-
-    vec4 occlusion = texture(uOcclusionTexture, vTexCoords);
-    
-    // attenuation
-    float distance    = length(light.position - vViewSpacePosition);
-    float attenuation = 1.0 / (light.constant + light.linear * distance + 
-  			     light.quadratic * (distance * distance));
-  			     
-	f_diffuse *= attenuation;
-    f_specular *= attenuation;
-
-    vec3 color = (f_diffuse + f_specular) * light.color * NdotL + emissive.xyz;
-    color = mix(color, color * occlusion.x, uOcclusionStrength);
-    color = LINEARtoSRGB(color);
-    return color;
+vec3 calculatePointLight(PointLight light, Surface surface) {
+    vec3 toLight = light.position - vViewSpacePosition;
+    float distance = length(toLight);
+    float attenuation = 1.0 / (light.constant + light.linear * distance +
+                               light.quadratic * (distance * distance));
+    return evaluateBRDF(surface, toLight / distance, light.color * attenuation);
 }
 
-vec3 calculateSpotLight(SpotLight light) {
-	vec3 N = normalize(vViewSpaceNormal);
-    vec3 L = normalize(light.position - vViewSpacePosition);
-    vec3 V = normalize(-vViewSpacePosition);
-    vec3 H = normalize(L + V);
-    
-    float theta = dot(L, normalize(-light.direction)); 
+vec3 calculateSpotLight(SpotLight light, Surface surface) {
+    vec3 toLight = light.position - vViewSpacePosition;
+    float distance = length(toLight);
+    vec3 L = toLight / distance;
+
+    float theta = dot(L, normalize(-light.direction));
     float epsilon = (light.cutOff - light.outerCutOff);
     float intensity = clamp((theta - light.outerCutOff) / epsilon, 0.0, 1.0);
 
-    vec4 baseColorFromTexture = SRGBtoLINEAR(texture(uBaseColorTexture, vTexCoords));
-    vec4 baseColor = baseColorFromTexture * uBaseColorFactor;
-    float NdotL = clamp(dot(N, L), 0, 1);
-    float NdotV = clamp(dot(N, V), 0, 1);
-    float NdotH = clamp(dot(N, H), 0, 1);
-    float VdotH = clamp(dot(V, H), 0, 1);
-
-    float metallic = texture(uMetallicRoughnessTexture, vTexCoords).z * uMetallicFactor;
-    float roughness = texture(uMetallicRoughnessTexture, vTexCoords).y * uRoughnessFactor;
-
-    vec3 cDiff = mix(baseColor.rgb * (1 - dielectricSpecular.r), black, metallic);
-    vec3 f0 = mix(dielectricSpecular, baseColor.rgb, metallic);
-    float a = uRoughnessFactor * roughness;
-    float a2 = a * a;
-
-    // You need to compute baseShlickFactor first
-    float baseShlickFactor = (1 - VdotH);
-    float shlickFactor = baseShlickFactor * baseShlickFactor; // power 2
-    shlickFactor *= shlickFactor; // power 4
-    shlickFactor *= baseShlickFactor; // power 5
-    vec3 F = f0 + (1 - f0) * shlickFactor;
+    float attenuation = 1.0 / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
+    return evaluateBRDF(surface, L, light.color * intensity * attenuation);
+}
 
-    float deno = NdotL * sqrt(NdotV * NdotV * (1 - a2) + a2) + NdotV * sqrt(NdotL* NdotL * (1 - a2) + a2);
-    float Vis;
-    if (deno == 0.) {
-        Vis = 0;
-    }
-    else {
-        Vis = 0.5 / deno;
+// Range window and cone attenuation of the KHR_lights_punctual specification
+vec3 calculatePunctualLight(PunctualLight light, Surface surface) {
+    if (light.type == LIGHT_TYPE_DIRECTIONAL) {
+        return evaluateBRDF(surface, -light.direction, light.color);
     }
+    vec3 toLight = light.position - vViewSpacePosition;
+    float distance2 = dot(toLight, toLight);
+    vec3 L = toLight * inversesqrt(distance2);
+    float rangeRatio2 = distance2 / (light.range * light.range);
+    float window = clamp(1 - rangeRatio2 * rangeRatio2, 0, 1);
+    float cone = clamp(dot(-L, light.direction) * light.spotScale + light.spotOffset, 0, 1);
+    return evaluateBRDF(surface, L, light.color * window * window * cone * cone / max(distance2, 1e-4));
+}
 
-    deno = M_PI * (NdotH * NdotH * (a2 - 1) + 1) * (NdotH * NdotH * (a2 - 1) + 1);
-    float D;
-    if (deno == 0.) {
-        D = 0;
+uint getClusterIndex() {
+    uvec2 tile = uvec2(min(gl_FragCoord.xy / clusterTileSize, vec2(clusterCounts.xy - 1)));
+    float slice = log(-vViewSpacePosition.z / clusterNear) * clusterDepthScale;
+    uint z = uint(clamp(slice, 0, float(clusterCounts.z - 1)));
+    return (z * clusterCounts.y + tile.y) * clusterCounts.x + tile.x;
+}
+
+vec3 calculatePunctualLights(Surface surface) {
+    vec3 color = vec3(0);
+    for (uint i = 0; i < directionalLightCount; ++i) {
+        color += calculatePunctualLight(punctualLights[i], surface);
     }
-    else {
-        D = a2 / deno;
+    uvec2 cluster = lightClusters[getClusterIndex()];
+    for (uint i = 0; i < cluster.y; ++i) {
+        color += calculatePunctualLight(punctualLights[lightClusterIndices[cluster.x + i]], surface);
     }
-
-    vec3 diffuse = cDiff * M_1_PI;
-    vec3 f_diffuse = (1 - F) * diffuse;
-    vec3 f_specular = F * Vis * D;
-
-    vec4 emissive = texture(uEmissiveTexture, vTexCoords) * vec4(uEmissiveFactor, 1);
-    vec4 occlusion = texture(uOcclusionTexture, vTexCoords);
-    
-    f_diffuse *= intensity;
-    f_specular *= intensity;
-    
-    // attenuation
-    float distance = length(light.position - vViewSpacePosition);
-    float attenuation = 1.0 / (light.constant + light.linear * distance + light.quadratic * (distance * distance));
-    f_diffuse *= attenuation;
-    f_specular *= attenuation;
-
-    vec3 color = (f_diffuse + f_specular) * light.color * NdotL + emissive.xyz;
-    color = mix(color, color * occlusion.x, uOcclusionStrength);
-    color = LINEARtoSRGB(color);
     return color;
 }
 
 void main() {
-	fColor = vec3(0.0f);
-    fColor += calculateDirLight(dirLight);
-    fColor += calculatePointLight(pointLight);
-    fColor += calculateSpotLight(spotLight);
+    Material material = materials[vMaterialIndex];
+    Surface surface = getSurface(material);
+
+    // Lights add up in linear space, the sum is converted to sRGB once
+    vec3 color = vec3(0);
+#ifdef USE_DIRECTIONAL_LIGHT
+#ifdef USE_DIRECTIONAL_SHADOWS
+    color += calculateDirLight(dirLight, surface) * getDirectionalShadow(surface.N);
+#else
+    color += calculateDirLight(dirLight, surface);
+#endif
+#endif
+#ifdef USE_POINT_LIGHT
+    color += calculatePointLight(pointLight, surface);
+#endif
+#ifdef USE_SPOT_LIGHT
+    color += calculateSpotLight(spotLight, surface);
+#endif
+#ifdef USE_PUNCTUAL_LIGHTS
+    color += calculatePunctualLights(surface);
+#endif
+
+    vec3 emissive = material.emissiveFactor;
+#ifdef HAS_EMISSIVE_TEXTURE
+    emissive *= texture(uEmissiveTexture, vTexCoords).rgb;
+#endif
+    color += emissive;
+#ifdef HAS_OCCLUSION_TEXTURE
+    float occlusion = texture(uOcclusionTexture, vTexCoords).x;
+    color = mix(color, color * occlusion, material.occlusionStrength);
+#endif
+    fColor = LINEARtoSRGB(color);
 }
@@ -0,0 +1,31 @@
+#version 430
+
+// Renders the shadow casters in all cascades at once: each invocation writes
+// the triangle to the layer of its cascade. Casters are drawn with the
+// vertex shader of the scene, see utils/shadows.hpp.
+// A define since the layout qualifier needs a constant before GLSL 4.40
+#define SHADOW_CASCADE_COUNT 4
+
+layout(triangles, invocations = SHADOW_CASCADE_COUNT) in;
+layout(triangle_strip, max_vertices = 3) out;
+
+in vec3 vViewSpacePosition[];
+// The shadow pass stores the cascade mask of the caster in the material index
+flat in uint vMaterialIndex[];
+
+uniform mat4 uCascadeMatrices[SHADOW_CASCADE_COUNT]; // View to cascade clip space
+uniform uint uCascadeUpdateMask; // Cascades rendered in this pass
+
+void main()
+{
+    uint cascadeBit = 1u << gl_InvocationID;
+    if ((vMaterialIndex[0] & uCascadeUpdateMask & cascadeBit) == 0u) {
+        return;
+    }
+    for (int i = 0; i < 3; ++i) {
+        gl_Layer = gl_InvocationID;
+        gl_Position = uCascadeMatrices[gl_InvocationID] * vec4(vViewSpacePosition[i], 1);
+        EmitVertex();
+    }
+    EndPrimitive();
+}
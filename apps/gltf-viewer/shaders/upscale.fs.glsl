@@ -0,0 +1,17 @@
+#version 330
+
+// Dynamic resolution: the scene is rendered in the bottom left corner of a
+// window sized texture, its bilinear upscale covers the window
+in vec2 vTexCoords;
+
+out vec4 fColor;
+
+uniform sampler2D uTexture;
+uniform vec2 uTexCoordsScale; // Rendered size over texture size
+// Center of the last rendered texel, texels outside are never filtered in
+uniform vec2 uTexCoordsMax;
+
+void main()
+{
+    fColor = texture(uTexture, min(vTexCoords * uTexCoordsScale, uTexCoordsMax));
+}
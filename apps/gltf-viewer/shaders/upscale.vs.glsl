@@ -0,0 +1,11 @@
+#version 330
+
+// Fullscreen triangle generated from gl_VertexID, drawn without vertex
+// attributes. Texture coordinates are in [0, 1] on the window.
+out vec2 vTexCoords;
+
+void main()
+{
+    vTexCoords = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(2 * vTexCoords - 1, 0, 1);
+}
@@ -0,0 +1,154 @@
+#version 430
+
+// Same outputs as forward.vs.glsl, but vertex attributes are read from storage
+// buffers in their original glTF encoding. Vertices are drawn with glDrawArrays
+// and gl_VertexID is mapped to an index of the primitive.
+
+// Per instance attributes, see InstanceAttributes in ViewerApplication.hpp
+layout(location = 3) in uint aMaterialIndex; // Index in the material table
+layout(location = 4) in mat4 aModelMatrix;
+layout(location = 8) in mat4 aNormalMatrix;
+layout(location = 12) in uint aPrimitiveIndex; // Index in the primitive formats
+#if defined(USE_SKINNED_VERTICES) || defined(USE_MORPH_TARGETS)
+// x: first skinned vertex, y: header texel of the morph weights
+layout(location = 13) in uvec2 aDeformationOffsets;
+#endif
+#ifdef USE_SKINNED_VERTICES
+// Skinned on the CPU, in world space with an identity model matrix
+uniform samplerBuffer uSkinningBuffer;
+#endif
+#ifdef USE_MORPH_TARGETS
+// The offset of the header is zero, draws have no base vertex
+#include "morph.glsl"
+#endif
+
+out vec3 vViewSpacePosition;
+out vec3 vViewSpaceNormal;
+out vec2 vTexCoords;
+out vec3 vFragPos;
+flat out uint vMaterialIndex;
+// The depth prepass uses this shader too, its depths must match exactly
+invariant gl_Position;
+
+// Written once per frame, see utils/frame_uniforms.hpp
+layout(std140) uniform CameraUniforms {
+    mat4 uViewMatrix;
+    mat4 uProjMatrix;
+};
+
+// Formats of the primitives, see utils/vertex_pulling.hpp
+const uint NO_DATA = 0xFFFFFFFFu;
+
+struct AttributeFormat {
+    uint offset;
+    uint stride;
+    uint componentType;
+    uint normalized;
+};
+
+struct PrimitiveFormat {
+    uint indexOffset;
+    uint indexSize;
+    uint vertexCount;
+    uint pad;
+    AttributeFormat position;
+    AttributeFormat normal;
+    AttributeFormat texCoords;
+};
+
+layout(std430, binding = 1) readonly buffer VertexData {
+    uint vertexData[];
+};
+
+layout(std430, binding = 2) readonly buffer PrimitiveFormats {
+    PrimitiveFormat primitives[];
+};
+
+const uint GL_BYTE = 0x1400u;
+const uint GL_UNSIGNED_BYTE = 0x1401u;
+const uint GL_SHORT = 0x1402u;
+const uint GL_UNSIGNED_SHORT = 0x1403u;
+const uint GL_UNSIGNED_INT = 0x1405u;
+const uint GL_FLOAT = 0x1406u;
+
+// Components are aligned on their size, they never cross a 32-bit word
+uint readBits(uint offset, uint bitCount)
+{
+    const uint word = vertexData[offset >> 2];
+    return bitCount == 32u ? word : bitfieldExtract(word, int((offset & 3u) * 8u), int(bitCount));
+}
+
+float readComponent(uint offset, uint componentType, bool normalized)
+{
+    switch (componentType) {
+    case GL_BYTE: {
+        const float value = float(bitfieldExtract(int(readBits(offset, 8u)), 0, 8));
+        return normalized ? max(value / 127.0, -1.0) : value;
+    }
+    case GL_UNSIGNED_BYTE: {
+        const float value = float(readBits(offset, 8u));
+        return normalized ? value / 255.0 : value;
+    }
+    case GL_SHORT: {
+        const float value = float(bitfieldExtract(int(readBits(offset, 16u)), 0, 16));
+        return normalized ? max(value / 32767.0, -1.0) : value;
+    }
+    case GL_UNSIGNED_SHORT: {
+        const float value = float(readBits(offset, 16u));
+        return normalized ? value / 65535.0 : value;
+    }
+    case GL_UNSIGNED_INT:
+        return float(readBits(offset, 32u));
+    default: // GL_FLOAT
+        return uintBitsToFloat(readBits(offset, 32u));
+    }
+}
+
+uint getComponentSize(uint componentType)
+{
+    return componentType == GL_BYTE || componentType == GL_UNSIGNED_BYTE ? 1u :
+           componentType == GL_SHORT || componentType == GL_UNSIGNED_SHORT ? 2u : 4u;
+}
+
+vec3 readAttribute(AttributeFormat format, uint vertexIndex, uint componentCount)
+{
+    vec3 value = vec3(0);
+    if (format.offset == NO_DATA) {
+        return value;
+    }
+    const uint componentSize = getComponentSize(format.componentType);
+    const uint offset = format.offset + vertexIndex * format.stride;
+    for (uint c = 0u; c < componentCount; ++c) {
+        value[c] = readComponent(offset + c * componentSize, format.componentType, format.normalized != 0u);
+    }
+    return value;
+}
+
+void main()
+{
+    const PrimitiveFormat primitive = primitives[aPrimitiveIndex];
+    const uint vertexIndex = primitive.indexOffset == NO_DATA ? uint(gl_VertexID) :
+        readBits(primitive.indexOffset + uint(gl_VertexID) * primitive.indexSize, primitive.indexSize * 8u);
+
+#ifdef USE_SKINNED_VERTICES
+    const int texel = int(2u * (aDeformationOffsets.x + vertexIndex));
+    const vec3 position = texelFetch(uSkinningBuffer, texel).xyz;
+    const vec3 normal = texelFetch(uSkinningBuffer, texel + 1).xyz;
+#else
+    vec3 position = readAttribute(primitive.position, vertexIndex, 3u);
+    vec3 normal = readAttribute(primitive.normal, vertexIndex, 3u);
+#ifdef USE_MORPH_TARGETS
+    morph(vertexIndex, position, normal);
+#endif
+#endif
+    const vec2 texCoords = readAttribute(primitive.texCoords, vertexIndex, 2u).xy;
+
+    vec4 viewSpacePosition = uViewMatrix * aModelMatrix * vec4(position, 1);
+    vViewSpacePosition = vec3(viewSpacePosition);
+    // The view matrix is a rigid transform, its rotation part is enough for normals
+    vViewSpaceNormal = normalize(mat3(uViewMatrix) * vec3(aNormalMatrix * vec4(normal, 0)));
+    vTexCoords = texCoords;
+    vFragPos = position;
+    vMaterialIndex = aMaterialIndex;
+    gl_Position = uProjMatrix * viewSpacePosition;
+}
@@ -0,0 +1,354 @@
+#include "animation.hpp"
+
+#include "gltf.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Batches of 4 tracks sampled by each task of the thread pool
+static const size_t ANIMATION_BATCHES_PER_TASK = 64;
+
+static bool readAnimationPath(const std::string &name, AnimationPath &path)
+{
+  if (name == "translation") {
+    path = AnimationPath::Translation;
+  } else if (name == "rotation") {
+    path = AnimationPath::Rotation;
+  } else if (name == "scale") {
+    path = AnimationPath::Scale;
+  } else if (name == "weights") {
+    path = AnimationPath::Weights;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::vector<AnimationClip> readAnimations(const tinygltf::Model &model)
+{
+  std::vector<AnimationClip> clips;
+  std::vector<float> times;
+  std::vector<float> values;
+  for (const auto &animation : model.animations) {
+    AnimationClip clip;
+    clip.name = animation.name;
+    for (const auto &channel : animation.channels) {
+      AnimationTrack track;
+      if (channel.target_node < 0 ||
+          size_t(channel.target_node) >= model.nodes.size() ||
+          channel.sampler < 0 ||
+          size_t(channel.sampler) >= animation.samplers.size() ||
+          !readAnimationPath(channel.target_path, track.path)) {
+        continue;
+      }
+      const auto &sampler = animation.samplers[channel.sampler];
+      if (readAccessorAsFloats(model, sampler.input, times) != 1 ||
+          times.empty()) {
+        continue;
+      }
+      const int outputComponents =
+          readAccessorAsFloats(model, sampler.output, values);
+
+      track.nodeIdx = channel.target_node;
+      track.interpolation = AnimationInterpolation::Linear;
+      if (sampler.interpolation == "STEP") {
+        track.interpolation = AnimationInterpolation::Step;
+      } else if (sampler.interpolation == "CUBICSPLINE") {
+        track.interpolation = AnimationInterpolation::CubicSpline;
+      }
+      track.keyCount = uint32_t(times.size());
+      const size_t elementsPerKey =
+          track.interpolation == AnimationInterpolation::CubicSpline ? 3 : 1;
+      const size_t elementCount = track.keyCount * elementsPerKey;
+
+      switch (track.path) {
+      case AnimationPath::Translation:
+      case AnimationPath::Scale:
+        track.componentCount = outputComponents == 3 ? 3 : 0;
+        break;
+      case AnimationPath::Rotation:
+        track.componentCount = outputComponents == 4 ? 4 : 0;
+        break;
+      case AnimationPath::Weights:
+        track.componentCount =
+            outputComponents == 1 ? uint32_t(values.size() / elementCount) : 0;
+        break;
+      }
+      if (!track.componentCount ||
+          values.size() != elementCount * track.componentCount) {
+        continue;
+      }
+      track.elementCount = uint32_t(elementCount);
+      track.firstTime = uint32_t(clip.times.size());
+      track.firstValue = uint32_t(clip.values.size());
+
+      clip.times.insert(end(clip.times), begin(times), end(times));
+      for (uint32_t c = 0; c < track.componentCount; ++c) {
+        for (size_t i = 0; i < elementCount; ++i) {
+          clip.values.push_back(values[i * track.componentCount + c]);
+        }
+      }
+      clip.duration = std::max(clip.duration, times.back());
+      clip.tracks.push_back(track);
+    }
+
+    std::stable_sort(begin(clip.tracks), end(clip.tracks),
+        [](const AnimationTrack &lhs, const AnimationTrack &rhs) {
+          if (lhs.interpolation != rhs.interpolation) {
+            return lhs.interpolation < rhs.interpolation;
+          }
+          if (lhs.path != rhs.path) {
+            return lhs.path < rhs.path;
+          }
+          return lhs.componentCount < rhs.componentCount;
+        });
+    // A batch ends after 4 tracks or before a track sampled differently
+    for (uint32_t i = 0; i < clip.tracks.size(); ++i) {
+      auto &track = clip.tracks[i];
+      const AnimationTrack &previous = clip.tracks[i ? i - 1 : 0];
+      if (clip.batches.empty() || clip.batches.back().trackCount == 4 ||
+          previous.interpolation != track.interpolation ||
+          previous.path != track.path ||
+          previous.componentCount != track.componentCount) {
+        clip.batches.push_back(AnimationBatch{i, 0, clip.outputSize});
+        clip.outputSize += 4 * track.componentCount;
+      }
+      auto &batch = clip.batches.back();
+      track.firstOutput = batch.firstOutput + batch.trackCount++;
+    }
+    clips.push_back(std::move(clip));
+  }
+  return clips;
+}
+
+AnimationPlayer::AnimationPlayer(const AnimationClip &clip)
+    : m_pClip(&clip), m_cursors(clip.tracks.size(), 0),
+      m_output(clip.outputSize, 0.f)
+{
+  for (const auto &track : clip.tracks) {
+    if (track.path != AnimationPath::Weights) {
+      m_transformedNodes.push_back(track.nodeIdx);
+    }
+  }
+  std::sort(begin(m_transformedNodes), end(m_transformedNodes));
+  m_transformedNodes.erase(
+      std::unique(begin(m_transformedNodes), end(m_transformedNodes)),
+      end(m_transformedNodes));
+}
+
+// Index k of the key such that times[k] <= time < times[k + 1]. The time must
+// be inside the keys. The cursor key or the next one are tried first.
+static uint32_t findKey(
+    const float *times, uint32_t keyCount, float time, uint32_t cursor)
+{
+  const uint32_t lastTried = std::min(cursor + 2, keyCount - 1);
+  for (uint32_t k = cursor; k < lastTried; ++k) {
+    if (times[k] <= time && time < times[k + 1]) {
+      return k;
+    }
+  }
+  return uint32_t(std::upper_bound(times, times + keyCount, time) - times) - 1;
+}
+
+// Scale the quaternions held in the lanes of 4 registers (x, y, z, w) to unit
+// length
+static void normalizeQuaternions(float4 *q)
+{
+  float lengths2[4];
+  store4(lengths2, add4(add4(mul4(q[0], q[0]), mul4(q[1], q[1])),
+                       add4(mul4(q[2], q[2]), mul4(q[3], q[3]))));
+  float scales[4];
+  for (int lane = 0; lane < 4; ++lane) {
+    scales[lane] = lengths2[lane] > 0.f ? 1.f / std::sqrt(lengths2[lane]) : 1.f;
+  }
+  const float4 scale = set4(scales[0], scales[1], scales[2], scales[3]);
+  for (int c = 0; c < 4; ++c) {
+    q[c] = mul4(q[c], scale);
+  }
+}
+
+// Sample the tracks of a batch, one per lane: the keys around time are found
+// for each track, then the same component of their values is gathered in one
+// register and interpolated for the 4 tracks at once. Unused lanes repeat the
+// first track.
+static void sampleBatch(const AnimationClip &clip, const AnimationBatch &batch,
+    float time, uint32_t *cursors, float *output)
+{
+  const AnimationTrack &firstTrack = clip.tracks[batch.firstTrack];
+  const bool cubic =
+      firstTrack.interpolation == AnimationInterpolation::CubicSpline;
+  const float *values[4];
+  uint32_t elementCounts[4];
+  // Elements of the values of the keys around time, after the in-tangent of
+  // cubic spline keys. Both are the same key when time is outside the keys.
+  uint32_t elements0[4], elements1[4];
+  float ts[4], dts[4];
+  for (uint32_t lane = 0; lane < 4; ++lane) {
+    const uint32_t trackIdx =
+        batch.firstTrack + std::min(lane, batch.trackCount - 1);
+    const AnimationTrack &track = clip.tracks[trackIdx];
+    const float *times = clip.times.data() + track.firstTime;
+    values[lane] = clip.values.data() + track.firstValue;
+    elementCounts[lane] = track.elementCount;
+    const uint32_t lastKey = track.keyCount - 1;
+    uint32_t key0, key1;
+    if (time <= times[0] || time >= times[lastKey]) {
+      key0 = key1 = time <= times[0] ? 0 : lastKey;
+      cursors[trackIdx] = std::min(key0, lastKey ? lastKey - 1 : 0);
+      ts[lane] = 0.f;
+      dts[lane] = 0.f;
+    } else {
+      key0 = findKey(times, track.keyCount, time, cursors[trackIdx]);
+      key1 = key0 + 1;
+      cursors[trackIdx] = key0;
+      dts[lane] = times[key1] - times[key0];
+      ts[lane] = (time - times[key0]) / dts[lane];
+    }
+    elements0[lane] = cubic ? 3 * key0 + 1 : key0;
+    elements1[lane] = cubic ? 3 * key1 + 1 : key1;
+  }
+  // Component c of the elements of the 4 lanes, offset by -1 for in-tangents
+  // and +1 for out-tangents
+  const auto gather = [&](uint32_t c, const uint32_t *elements, int offset) {
+    float lanes[4];
+    for (int lane = 0; lane < 4; ++lane) {
+      lanes[lane] = values[lane][c * elementCounts[lane] +
+                                 uint32_t(int(elements[lane]) + offset)];
+    }
+    return set4(lanes[0], lanes[1], lanes[2], lanes[3]);
+  };
+
+  const uint32_t componentCount = firstTrack.componentCount;
+  const bool rotation = firstTrack.path == AnimationPath::Rotation;
+  const float4 t = set4(ts[0], ts[1], ts[2], ts[3]);
+  switch (firstTrack.interpolation) {
+  case AnimationInterpolation::Step:
+    for (uint32_t c = 0; c < componentCount; ++c) {
+      store4(output + 4 * c, gather(c, elements0, 0));
+    }
+    break;
+  case AnimationInterpolation::Linear:
+    if (rotation) {
+      // Spherical interpolation along the shortest arc, normalized linear
+      // interpolation when the quaternions are almost equal
+      float4 q0[4], q1[4];
+      float4 dot = splat4(0.f);
+      for (int c = 0; c < 4; ++c) {
+        q0[c] = gather(c, elements0, 0);
+        q1[c] = gather(c, elements1, 0);
+        dot = add4(dot, mul4(q0[c], q1[c]));
+      }
+      float cosThetas[4], weights0[4], weights1[4];
+      store4(cosThetas, dot);
+      for (int lane = 0; lane < 4; ++lane) {
+        const float sign = cosThetas[lane] < 0.f ? -1.f : 1.f;
+        const float cosTheta = sign * cosThetas[lane];
+        weights0[lane] = 1.f - ts[lane];
+        weights1[lane] = ts[lane];
+        if (cosTheta < 0.9995f) {
+          const float theta = std::acos(cosTheta);
+          const float invSinTheta = 1.f / std::sin(theta);
+          weights0[lane] = std::sin(weights0[lane] * theta) * invSinTheta;
+          weights1[lane] = std::sin(weights1[lane] * theta) * invSinTheta;
+        }
+        weights1[lane] *= sign;
+      }
+      const float4 w0 =
+          set4(weights0[0], weights0[1], weights0[2], weights0[3]);
+      const float4 w1 =
+          set4(weights1[0], weights1[1], weights1[2], weights1[3]);
+      for (int c = 0; c < 4; ++c) {
+        q0[c] = add4(mul4(w0, q0[c]), mul4(w1, q1[c]));
+      }
+      normalizeQuaternions(q0);
+      for (int c = 0; c < 4; ++c) {
+        store4(output + 4 * c, q0[c]);
+      }
+      break;
+    }
+    for (uint32_t c = 0; c < componentCount; ++c) {
+      const float4 a = gather(c, elements0, 0);
+      store4(output + 4 * c,
+          add4(a, mul4(t, sub4(gather(c, elements1, 0), a))));
+    }
+    break;
+  case AnimationInterpolation::CubicSpline: {
+    // Hermite basis, tangents are scaled by the key interval
+    float bases[4][4];
+    for (int lane = 0; lane < 4; ++lane) {
+      const float t1 = ts[lane];
+      const float t2 = t1 * t1;
+      const float t3 = t2 * t1;
+      bases[0][lane] = 2.f * t3 - 3.f * t2 + 1.f;
+      bases[1][lane] = (t3 - 2.f * t2 + t1) * dts[lane];
+      bases[2][lane] = -2.f * t3 + 3.f * t2;
+      bases[3][lane] = (t3 - t2) * dts[lane];
+    }
+    float4 h[4];
+    for (int i = 0; i < 4; ++i) {
+      h[i] = set4(bases[i][0], bases[i][1], bases[i][2], bases[i][3]);
+    }
+    float4 q[4];
+    for (uint32_t c = 0; c < componentCount; ++c) {
+      const float4 p =
+          add4(add4(mul4(h[0], gather(c, elements0, 0)),
+                   mul4(h[1], gather(c, elements0, 1))),
+              add4(mul4(h[2], gather(c, elements1, 0)),
+                  mul4(h[3], gather(c, elements1, -1))));
+      if (rotation) {
+        q[c] = p;
+      } else {
+        store4(output + 4 * c, p);
+      }
+    }
+    if (rotation) {
+      normalizeQuaternions(q);
+      for (int c = 0; c < 4; ++c) {
+        store4(output + 4 * c, q[c]);
+      }
+    }
+    break;
+  }
+  }
+}
+
+void AnimationPlayer::sample(float time)
+{
+  const auto &clip = *m_pClip;
+  parallelFor(clip.batches.size(), ANIMATION_BATCHES_PER_TASK,
+      [&](size_t beginBatch, size_t endBatch) {
+        for (size_t i = beginBatch; i < endBatch; ++i) {
+          const AnimationBatch &batch = clip.batches[i];
+          sampleBatch(clip, batch, time, m_cursors.data(),
+              m_output.data() + batch.firstOutput);
+        }
+      });
+}
+
+void AnimationPlayer::apply(tinygltf::Model &model) const
+{
+  for (const auto &track : m_pClip->tracks) {
+    auto &node = model.nodes[track.nodeIdx];
+    std::vector<double> *pProperty = nullptr;
+    switch (track.path) {
+    case AnimationPath::Translation:
+      pProperty = &node.translation;
+      break;
+    case AnimationPath::Rotation:
+      pProperty = &node.rotation;
+      break;
+    case AnimationPath::Scale:
+      pProperty = &node.scale;
+      break;
+    case AnimationPath::Weights:
+      pProperty = &node.weights;
+      break;
+    }
+    pProperty->resize(track.componentCount);
+    for (uint32_t c = 0; c < track.componentCount; ++c) {
+      (*pProperty)[c] = m_output[track.firstOutput + 4 * c];
+    }
+  }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <tiny_gltf.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class AnimationPath : uint8_t
+{
+  Translation,
+  Rotation,
+  Scale,
+  Weights
+};
+
+enum class AnimationInterpolation : uint8_t
+{
+  Step,
+  Linear,
+  CubicSpline
+};
+
+// Keyframes of one channel. Keys are stored in the arrays of the clip: times
+// from firstTime, values from firstValue component by component (all x, then
+// all y...), so that the same component of the keys of several tracks can be
+// gathered in one SIMD register. Cubic spline keys are (in-tangent, value,
+// out-tangent) triplets.
+struct AnimationTrack
+{
+  int nodeIdx;
+  AnimationPath path;
+  AnimationInterpolation interpolation;
+  uint32_t componentCount; // 3, 4 for rotations, target count for weights
+  uint32_t keyCount;
+  uint32_t elementCount; // Values per component, 3 per key for cubic splines
+  uint32_t firstTime;
+  uint32_t firstValue;
+  // Sampled value in the player output, components are 4 floats apart
+  uint32_t firstOutput;
+};
+
+// Up to 4 consecutive tracks with the same interpolation, path and component
+// count, sampled together: each lane of a SIMD register holds one track
+struct AnimationBatch
+{
+  uint32_t firstTrack;
+  uint32_t trackCount;
+  uint32_t firstOutput; // 4 floats per component, one per track
+};
+
+// Channels of a glTF animation converted to structure of arrays keyframe
+// tracks. Tracks are sorted by interpolation, path and component count, then
+// grouped in batches of 4 that take the same code path when sampled.
+struct AnimationClip
+{
+  std::string name;
+  float duration = 0.f;
+  std::vector<AnimationTrack> tracks;
+  std::vector<AnimationBatch> batches;
+  std::vector<float> times;
+  std::vector<float> values;
+  uint32_t outputSize = 0; // Floats written by a player for all batches
+};
+
+// Clips of all animations of the model, channels that cannot be read are
+// skipped
+std::vector<AnimationClip> readAnimations(const tinygltf::Model &model);
+
+// Sampling state of a clip. Each track keeps a cursor on its last key, so
+// that playing forward finds the keys in constant time; a binary search is
+// only needed when the time jumps (loop, seek).
+class AnimationPlayer
+{
+public:
+  explicit AnimationPlayer(const AnimationClip &clip);
+
+  const AnimationClip &clip() const { return *m_pClip; }
+
+  // Evaluate all tracks at time (in seconds, clamped to the keys of each
+  // track), one batch of 4 tracks at a time. Large clips are sampled in
+  // parallel on the thread pool.
+  void sample(float time);
+
+  // Write the last sampled values to the translation, rotation, scale or
+  // weights of the animated nodes, other nodes are not touched
+  void apply(tinygltf::Model &model) const;
+
+  // Nodes whose translation, rotation or scale apply() writes, once each
+  const std::vector<int> &transformedNodes() const
+  {
+    return m_transformedNodes;
+  }
+
+private:
+  const AnimationClip *m_pClip;
+  std::vector<uint32_t> m_cursors;
+  std::vector<float> m_output;
+  std::vector<int> m_transformedNodes;
+};
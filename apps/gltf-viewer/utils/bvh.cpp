@@ -0,0 +1,269 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+
+// Maximum number of leaves stored in a BVH leaf node
+static const uint32_t BVH_MAX_LEAF_SIZE = 4;
+
+AABB transformAABB(const AABB &box, const glm::mat4 &matrix)
+{
+  if (box.isEmpty()) {
+    return box;
+  }
+  // Each column of the matrix contributes to the min or max depending on its
+  // sign
+  const auto translation = glm::vec3(matrix[3]);
+  AABB result(translation, translation);
+  for (int i = 0; i < 3; ++i) {
+    const glm::vec3 a = glm::vec3(matrix[i]) * box.min[i];
+    const glm::vec3 b = glm::vec3(matrix[i]) * box.max[i];
+    result.min += glm::min(a, b);
+    result.max += glm::max(a, b);
+  }
+  return result;
+}
+
+Frustum extractFrustum(const glm::mat4 &viewProjMatrix)
+{
+  const auto m = glm::transpose(viewProjMatrix);
+  Frustum frustum;
+  frustum.planes[0] = m[3] + m[0]; // left
+  frustum.planes[1] = m[3] - m[0]; // right
+  frustum.planes[2] = m[3] + m[1]; // bottom
+  frustum.planes[3] = m[3] - m[1]; // top
+  frustum.planes[4] = m[3] + m[2]; // near
+  frustum.planes[5] = m[3] - m[2]; // far
+  for (auto &plane : frustum.planes) {
+    plane /= glm::length(glm::vec3(plane));
+  }
+  return frustum;
+}
+
+FrustumTest testAABB(const Frustum &frustum, const AABB &box)
+{
+  const auto center = box.center();
+  const auto halfExtent = 0.5f * box.extent();
+  auto result = FrustumTest::Inside;
+  for (const auto &plane : frustum.planes) {
+    const auto normal = glm::vec3(plane);
+    const float distance = glm::dot(normal, center) + plane.w;
+    const float radius = glm::dot(halfExtent, glm::abs(normal));
+    if (distance < -radius) {
+      return FrustumTest::Outside;
+    }
+    if (distance < radius) {
+      result = FrustumTest::Intersects;
+    }
+  }
+  return result;
+}
+
+bool intersectRayAABB(const Ray &ray, const glm::vec3 &invDirection,
+    const AABB &box, float tMax, float &tNear)
+{
+  const auto t0 = (box.min - ray.origin) * invDirection;
+  const auto t1 = (box.max - ray.origin) * invDirection;
+  const auto tSmall = glm::min(t0, t1);
+  const auto tBig = glm::max(t0, t1);
+  const float tEnter = glm::max(glm::max(tSmall.x, tSmall.y), tSmall.z);
+  const float tExit = glm::min(glm::min(tBig.x, tBig.y), tBig.z);
+  if (tExit < glm::max(tEnter, 0.f) || tEnter > tMax) {
+    return false;
+  }
+  tNear = glm::max(tEnter, 0.f);
+  return true;
+}
+
+bool intersectRayTriangle(const Ray &ray, const glm::vec3 &v0,
+    const glm::vec3 &v1, const glm::vec3 &v2, float &t)
+{
+  const auto edge1 = v1 - v0;
+  const auto edge2 = v2 - v0;
+  const auto p = glm::cross(ray.direction, edge2);
+  const float det = glm::dot(edge1, p);
+  if (glm::abs(det) < 1e-12f) {
+    return false;
+  }
+  const float invDet = 1.f / det;
+  const auto s = ray.origin - v0;
+  const float u = glm::dot(s, p) * invDet;
+  if (u < 0.f || u > 1.f) {
+    return false;
+  }
+  const auto q = glm::cross(s, edge1);
+  const float v = glm::dot(ray.direction, q) * invDet;
+  if (v < 0.f || u + v > 1.f) {
+    return false;
+  }
+  t = glm::dot(edge2, q) * invDet;
+  return t >= 0.f;
+}
+
+void BVH::build(const std::vector<AABB> &leafBounds)
+{
+  m_nodes.clear();
+  m_leafBounds = leafBounds;
+  m_leafIndices.resize(leafBounds.size());
+  if (leafBounds.empty()) {
+    return;
+  }
+  std::vector<glm::vec3> centroids(leafBounds.size());
+  for (uint32_t i = 0; i < leafBounds.size(); ++i) {
+    m_leafIndices[i] = i;
+    centroids[i] = leafBounds[i].center();
+  }
+  m_nodes.reserve(2 * leafBounds.size());
+  buildRecursive(leafBounds, centroids, 0, uint32_t(leafBounds.size()));
+}
+
+uint32_t BVH::buildRecursive(const std::vector<AABB> &leafBounds,
+    const std::vector<glm::vec3> &centroids, uint32_t begin, uint32_t end)
+{
+  const auto nodeIdx = uint32_t(m_nodes.size());
+  m_nodes.emplace_back();
+
+  AABB bounds, centroidBounds;
+  for (auto i = begin; i < end; ++i) {
+    bounds.expand(leafBounds[m_leafIndices[i]]);
+    centroidBounds.expand(centroids[m_leafIndices[i]]);
+  }
+  m_nodes[nodeIdx].bounds = bounds;
+
+  const auto extent = centroidBounds.extent();
+  if (end - begin <= BVH_MAX_LEAF_SIZE || glm::max(glm::max(extent.x, extent.y),
+                                              extent.z) <= 0.f) {
+    m_nodes[nodeIdx].offset = begin;
+    m_nodes[nodeIdx].count = end - begin;
+    return nodeIdx;
+  }
+
+  // Median split along the largest axis of the centroids bounds
+  const int axis =
+      extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                          : (extent.y > extent.z ? 1 : 2);
+  const auto middle = begin + (end - begin) / 2;
+  std::nth_element(m_leafIndices.begin() + begin,
+      m_leafIndices.begin() + middle, m_leafIndices.begin() + end,
+      [&](uint32_t lhs, uint32_t rhs) {
+        return centroids[lhs][axis] < centroids[rhs][axis];
+      });
+
+  buildRecursive(leafBounds, centroids, begin, middle);
+  const auto rightIdx = buildRecursive(leafBounds, centroids, middle, end);
+  m_nodes[nodeIdx].offset = rightIdx;
+  m_nodes[nodeIdx].count = 0;
+  return nodeIdx;
+}
+
+void BVH::refit(const std::vector<AABB> &leafBounds)
+{
+  m_leafBounds = leafBounds;
+  for (auto nodeIdx = m_nodes.size(); nodeIdx-- > 0;) {
+    auto &node = m_nodes[nodeIdx];
+    if (node.count) {
+      node.bounds = AABB();
+      for (auto i = node.offset; i < node.offset + node.count; ++i) {
+        node.bounds.expand(leafBounds[m_leafIndices[i]]);
+      }
+    } else {
+      node.bounds = m_nodes[nodeIdx + 1].bounds;
+      node.bounds.expand(m_nodes[node.offset].bounds);
+    }
+  }
+}
+
+void BVH::appendSubtree(uint32_t nodeIdx, std::vector<uint32_t> &leaves) const
+{
+  // Leaves of a subtree are contiguous in m_leafIndices: find the first and
+  // last leaf nodes of the subtree
+  auto first = nodeIdx;
+  while (!m_nodes[first].count) {
+    ++first;
+  }
+  auto last = nodeIdx;
+  while (!m_nodes[last].count) {
+    last = m_nodes[last].offset;
+  }
+  leaves.insert(end(leaves), m_leafIndices.begin() + m_nodes[first].offset,
+      m_leafIndices.begin() + m_nodes[last].offset + m_nodes[last].count);
+}
+
+void BVH::cullFrustum(
+    const Frustum &frustum, std::vector<uint32_t> &visibleLeaves) const
+{
+  if (m_nodes.empty()) {
+    return;
+  }
+  uint32_t stack[64];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize) {
+    const auto nodeIdx = stack[--stackSize];
+    const auto &node = m_nodes[nodeIdx];
+    const auto test = testAABB(frustum, node.bounds);
+    if (test == FrustumTest::Outside) {
+      continue;
+    }
+    if (test == FrustumTest::Inside) {
+      appendSubtree(nodeIdx, visibleLeaves);
+      continue;
+    }
+    if (node.count) {
+      for (auto i = node.offset; i < node.offset + node.count; ++i) {
+        if (testAABB(frustum, m_leafBounds[m_leafIndices[i]]) !=
+            FrustumTest::Outside) {
+          visibleLeaves.push_back(m_leafIndices[i]);
+        }
+      }
+      continue;
+    }
+    stack[stackSize++] = node.offset;
+    stack[stackSize++] = nodeIdx + 1;
+  }
+}
+
+bool BVH::intersectRay(const Ray &ray, float &tHit, uint32_t &hitLeaf,
+    const std::function<bool(uint32_t, float &)> &leafTest) const
+{
+  if (m_nodes.empty()) {
+    return false;
+  }
+  const auto invDirection = 1.f / ray.direction;
+  bool hit = false;
+  uint32_t stack[64];
+  uint32_t stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize) {
+    const auto &node = m_nodes[stack[--stackSize]];
+    float tNode;
+    if (!intersectRayAABB(ray, invDirection, node.bounds, tHit, tNode)) {
+      continue;
+    }
+    if (node.count) {
+      for (auto i = node.offset; i < node.offset + node.count; ++i) {
+        if (leafTest(m_leafIndices[i], tHit)) {
+          hitLeaf = m_leafIndices[i];
+          hit = true;
+        }
+      }
+      continue;
+    }
+    // Visit the closest child first
+    const auto leftIdx = uint32_t(&node - m_nodes.data()) + 1;
+    const auto rightIdx = node.offset;
+    float tLeft, tRight;
+    const bool hitLeft = intersectRayAABB(
+        ray, invDirection, m_nodes[leftIdx].bounds, tHit, tLeft);
+    const bool hitRight = intersectRayAABB(
+        ray, invDirection, m_nodes[rightIdx].bounds, tHit, tRight);
+    if (hitLeft && hitRight) {
+      stack[stackSize++] = tLeft < tRight ? rightIdx : leftIdx;
+      stack[stackSize++] = tLeft < tRight ? leftIdx : rightIdx;
+    } else if (hitLeft) {
+      stack[stackSize++] = leftIdx;
+    } else if (hitRight) {
+      stack[stackSize++] = rightIdx;
+    }
+  }
+  return hit;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+// Axis aligned bounding box, empty by default
+struct AABB
+{
+  glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+  glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+
+  AABB() = default;
+
+  AABB(const glm::vec3 &bmin, const glm::vec3 &bmax) : min(bmin), max(bmax) {}
+
+  bool isEmpty() const
+  {
+    return min.x > max.x || min.y > max.y || min.z > max.z;
+  }
+
+  glm::vec3 center() const { return 0.5f * (min + max); }
+
+  glm::vec3 extent() const { return max - min; }
+
+  void expand(const glm::vec3 &p)
+  {
+    min = glm::min(min, p);
+    max = glm::max(max, p);
+  }
+
+  void expand(const AABB &other)
+  {
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+  }
+};
+
+// Bounds of the box transformed by an affine matrix (Arvo's method)
+AABB transformAABB(const AABB &box, const glm::mat4 &matrix);
+
+// Planes are stored as (normal, d) with normals pointing inside the frustum
+struct Frustum
+{
+  glm::vec4 planes[6];
+};
+
+// Extract the 6 clipping planes of a view projection matrix (Gribb/Hartmann)
+Frustum extractFrustum(const glm::mat4 &viewProjMatrix);
+
+enum class FrustumTest
+{
+  Outside,
+  Intersects,
+  Inside
+};
+
+FrustumTest testAABB(const Frustum &frustum, const AABB &box);
+
+struct Ray
+{
+  glm::vec3 origin;
+  glm::vec3 direction;
+};
+
+// Slab test, tNear is the entry distance along the ray (0 if origin inside)
+bool intersectRayAABB(const Ray &ray, const glm::vec3 &invDirection,
+    const AABB &box, float tMax, float &tNear);
+
+// Moller-Trumbore, t is expressed in units of ray.direction
+bool intersectRayTriangle(const Ray &ray, const glm::vec3 &v0,
+    const glm::vec3 &v1, const glm::vec3 &v2, float &t);
+
+// Bounding volume hierarchy over a set of leaf bounds (typically one per drawn
+// instance). Leaves are referenced by their index in the array given to
+// build(). When leaf bounds move, refit() updates the hierarchy without
+// rebuilding its topology.
+class BVH
+{
+public:
+  void build(const std::vector<AABB> &leafBounds);
+
+  void refit(const std::vector<AABB> &leafBounds);
+
+  // Append to visibleLeaves the indices of leaves intersecting the frustum.
+  // Subtrees fully inside the frustum are accepted without further tests.
+  void cullFrustum(
+      const Frustum &frustum, std::vector<uint32_t> &visibleLeaves) const;
+
+  // Find the closest hit along the ray. leafTest is called for each leaf
+  // whose bounds are hit closer than the current tHit: it must return true
+  // and update t if the leaf content is hit closer than t.
+  bool intersectRay(const Ray &ray, float &tHit, uint32_t &hitLeaf,
+      const std::function<bool(uint32_t, float &)> &leafTest) const;
+
+  bool empty() const { return m_nodes.empty(); }
+
+  size_t nodeCount() const { return m_nodes.size(); }
+
+  const AABB &bounds() const { return m_nodes.front().bounds; }
+
+private:
+  struct Node
+  {
+    AABB bounds;
+    // Leaf: index of the first leaf in m_leafIndices. Inner node: index of the
+    // right child (the left child is always the next node).
+    uint32_t offset;
+    uint32_t count; // Number of leaves, 0 for inner nodes
+  };
+
+  uint32_t buildRecursive(const std::vector<AABB> &leafBounds,
+      const std::vector<glm::vec3> &centroids, uint32_t begin, uint32_t end);
+
+  void appendSubtree(uint32_t nodeIdx, std::vector<uint32_t> &leaves) const;
+
+  // Nodes are stored in depth first order: children always come after their
+  // parent, so a reverse traversal of the array is a valid bottom-up order
+  std::vector<Node> m_nodes;
+  std::vector<uint32_t> m_leafIndices;
+  std::vector<AABB> m_leafBounds;
+};
@@ -0,0 +1,61 @@
+#include "draw_instances.hpp"
+
+std::vector<DrawInstance> createDrawInstances(const tinygltf::Model &model)
+{
+  std::vector<uint32_t> meshPrimitiveOffsets;
+  uint32_t primitiveCount = 0;
+  for (const auto &mesh : model.meshes) {
+    meshPrimitiveOffsets.push_back(primitiveCount);
+    primitiveCount += uint32_t(mesh.primitives.size());
+  }
+
+  std::vector<DrawInstance> instances;
+  visitScene(model, [&](int nodeIdx, const glm::mat4 &modelMatrix) {
+    const tinygltf::Node &node = model.nodes[nodeIdx];
+    if (node.mesh < 0) {
+      return;
+    }
+    // Nodes using EXT_mesh_gpu_instancing draw their mesh once per instance
+    // transform
+    std::vector<glm::mat4> gpuInstanceMatrices;
+    if (!readMeshGpuInstances(model, node, gpuInstanceMatrices)) {
+      gpuInstanceMatrices.assign(1, glm::mat4(1));
+    }
+    // Instances of a same primitive are consecutive to be grouped even when
+    // draws are not sorted
+    const tinygltf::Mesh &mesh = model.meshes[node.mesh];
+    for (int i = 0; i < int(mesh.primitives.size()); i++) {
+      const AABB localBounds = computePrimitiveBounds(model, mesh.primitives[i]);
+      for (const auto &gpuInstanceMatrix : gpuInstanceMatrices) {
+        const glm::mat4 instanceMatrix = modelMatrix * gpuInstanceMatrix;
+        instances.push_back(DrawInstance{nodeIdx, node.mesh, i,
+            meshPrimitiveOffsets[node.mesh] + uint32_t(i), gpuInstanceMatrix,
+            instanceMatrix, transpose(inverse(instanceMatrix)), localBounds,
+            transformAABB(localBounds, instanceMatrix)});
+      }
+    }
+  });
+  return instances;
+}
+
+void updateDrawInstances(const SceneTransforms &transforms,
+    std::vector<DrawInstance> &instances, std::vector<MovedInstance> &moved)
+{
+  for (uint32_t instanceIdx = 0; instanceIdx < instances.size();
+       ++instanceIdx) {
+    DrawInstance &instance = instances[instanceIdx];
+    if (!transforms.isUpdated(instance.nodeIdx)) {
+      continue;
+    }
+    const glm::mat4 instanceMatrix =
+        transforms.worldMatrices()[instance.nodeIdx] *
+        instance.gpuInstanceMatrix;
+    if (instance.modelMatrix != instanceMatrix) {
+      moved.push_back(MovedInstance{instanceIdx, instance.worldBounds});
+      instance.modelMatrix = instanceMatrix;
+      instance.normalMatrix = transpose(inverse(instanceMatrix));
+      instance.worldBounds =
+          transformAABB(instance.localBounds, instanceMatrix);
+    }
+  }
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "gltf.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstdint>
+#include <vector>
+
+// A range of indices in a vector containing Vertex Array Objects (or one
+// element per primitive)
+struct VaoRange
+{
+  GLsizei begin; // Index of first element in vertexArrayObjects
+  GLsizei count; // Number of elements in range
+};
+
+// VAO and draw call arguments of a primitive
+struct PrimitiveDraw
+{
+  GLuint vao;
+  GLenum mode;
+  GLenum indexType; // GL_NONE for non indexed primitives
+  GLuint count; // Number of indices or vertices
+  GLuint first; // First index or vertex
+  GLint baseVertex;
+};
+
+// A primitive of a mesh referenced by a node of the scene, leaf of the scene
+// BVH
+struct DrawInstance
+{
+  int nodeIdx;
+  int meshIdx;
+  int primitiveIdx;
+  // Index of the primitive among the primitives of all meshes, in mesh order
+  uint32_t primitive;
+  // Local transform from EXT_mesh_gpu_instancing, identity otherwise
+  glm::mat4 gpuInstanceMatrix;
+  glm::mat4 modelMatrix;
+  glm::mat4 normalMatrix; // Inverse transpose of modelMatrix
+  AABB localBounds;
+  AABB worldBounds;
+};
+
+// Draw instance whose world bounds or geometry changed, with its world bounds
+// before the change
+struct MovedInstance
+{
+  uint32_t instanceIdx;
+  AABB previousBounds;
+};
+
+// Instances of the primitives of the default scene, in scene traversal order.
+// Instances of a same node and primitive are consecutive.
+std::vector<DrawInstance> createDrawInstances(const tinygltf::Model &model);
+
+// Recompute the world matrices and bounds of the instances of the nodes
+// updated by the last transforms.update(), append those that moved to moved
+void updateDrawInstances(const SceneTransforms &transforms,
+    std::vector<DrawInstance> &instances, std::vector<MovedInstance> &moved);
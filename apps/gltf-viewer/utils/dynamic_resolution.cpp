@@ -0,0 +1,153 @@
+#include "dynamic_resolution.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Fraction of the budget aimed at, the margin absorbs frame to frame noise
+static const double TARGET_BUDGET_FRACTION = 0.9;
+// Weight of a new measure in the smoothed cost
+static const double COST_SMOOTHING = 0.2;
+// Largest scale increase per update, decreases are applied at once so that a
+// frame over budget is corrected on the next measure
+static const float MAX_SCALE_INCREASE = 0.05f;
+// Relative change under which the scale is kept, so that it does not oscillate
+static const float SCALE_DEAD_BAND = 0.03f;
+
+DynamicResolution::DynamicResolution(
+    double budgetSeconds, float minScale, float maxScale)
+    : m_budget(budgetSeconds), m_minScale(minScale), m_maxScale(maxScale),
+      m_scale(maxScale)
+{
+}
+
+void DynamicResolution::update(double gpuSeconds, float renderScale)
+{
+  if (gpuSeconds <= 0. || renderScale <= 0.f) {
+    return;
+  }
+  const double cost = gpuSeconds / (double(renderScale) * renderScale);
+  m_costPerArea = m_costPerArea > 0.
+                      ? m_costPerArea + COST_SMOOTHING * (cost - m_costPerArea)
+                      : cost;
+  const auto targetScale = std::clamp(
+      float(std::sqrt(TARGET_BUDGET_FRACTION * m_budget / m_costPerArea)),
+      m_minScale, m_maxScale);
+  if (std::abs(targetScale - m_scale) < SCALE_DEAD_BAND * m_scale &&
+      targetScale != m_minScale && targetScale != m_maxScale) {
+    return;
+  }
+  m_scale = std::min(targetScale, m_scale + MAX_SCALE_INCREASE);
+}
+
+DynamicResolutionTarget::DynamicResolutionTarget(GLsizei width, GLsizei height,
+    double budgetSeconds, const fs::path &upscaleVsPath,
+    const fs::path &upscaleFsPath) :
+    m_width(width),
+    m_height(height),
+    m_controller(budgetSeconds),
+    m_renderWidth(width),
+    m_renderHeight(height)
+{
+  glGenQueries(2 * FRAME_TIMER_COUNT, m_timerQueries);
+
+  glGenTextures(2, m_textures);
+  glBindTexture(GL_TEXTURE_2D, m_textures[0]);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, m_width, m_height);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glBindTexture(GL_TEXTURE_2D, m_textures[1]);
+  glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, m_width, m_height);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glGenFramebuffers(1, &m_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glFramebufferTexture(
+      GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, m_textures[0], 0);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_textures[1], 0);
+  m_complete =
+      glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  m_upscaleProgram = compileProgram({upscaleVsPath, upscaleFsPath});
+  m_texCoordsScaleLocation =
+      glGetUniformLocation(m_upscaleProgram.glId(), "uTexCoordsScale");
+  m_texCoordsMaxLocation =
+      glGetUniformLocation(m_upscaleProgram.glId(), "uTexCoordsMax");
+  glProgramUniform1i(m_upscaleProgram.glId(),
+      glGetUniformLocation(m_upscaleProgram.glId(), "uTexture"), 0);
+  glGenVertexArrays(1, &m_upscaleVao);
+}
+
+DynamicResolutionTarget::~DynamicResolutionTarget()
+{
+  glDeleteVertexArrays(1, &m_upscaleVao);
+  glDeleteFramebuffers(1, &m_framebuffer);
+  glDeleteTextures(2, m_textures);
+  glDeleteQueries(2 * FRAME_TIMER_COUNT, m_timerQueries);
+}
+
+void DynamicResolutionTarget::beginFrame(bool adaptive)
+{
+  if (m_timerPending[m_timerIdx]) {
+    GLuint available = GL_FALSE;
+    glGetQueryObjectuiv(m_timerQueries[2 * m_timerIdx + 1],
+        GL_QUERY_RESULT_AVAILABLE, &available);
+    if (available) {
+      GLuint64 frameStart, frameEnd;
+      glGetQueryObjectui64v(
+          m_timerQueries[2 * m_timerIdx], GL_QUERY_RESULT, &frameStart);
+      glGetQueryObjectui64v(
+          m_timerQueries[2 * m_timerIdx + 1], GL_QUERY_RESULT, &frameEnd);
+      m_timerPending[m_timerIdx] = false;
+      m_gpuFrameTime = (frameEnd - frameStart) * 1e-9;
+      if (adaptive) {
+        m_controller.update(m_gpuFrameTime, m_timerScales[m_timerIdx]);
+      }
+    }
+  }
+
+  m_scale = adaptive ? m_controller.scale() : 1.f;
+  m_renderWidth =
+      std::max(GLsizei(1), GLsizei(std::lround(m_scale * m_width)));
+  m_renderHeight =
+      std::max(GLsizei(1), GLsizei(std::lround(m_scale * m_height)));
+  // Timers still pending after a full ring are skipped rather than waited for
+  m_timeFrame = !m_timerPending[m_timerIdx];
+  if (m_timeFrame) {
+    glQueryCounter(m_timerQueries[2 * m_timerIdx], GL_TIMESTAMP);
+  }
+}
+
+void DynamicResolutionTarget::endFrame()
+{
+  if (m_timeFrame) {
+    glQueryCounter(m_timerQueries[2 * m_timerIdx + 1], GL_TIMESTAMP);
+    m_timerPending[m_timerIdx] = true;
+    m_timerScales[m_timerIdx] = m_scale;
+  }
+  m_timerIdx = (m_timerIdx + 1) % FRAME_TIMER_COUNT;
+}
+
+void DynamicResolutionTarget::bind() const
+{
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_framebuffer);
+}
+
+void DynamicResolutionTarget::upscale() const
+{
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glViewport(0, 0, m_width, m_height);
+  glDisable(GL_DEPTH_TEST);
+  glUseProgram(m_upscaleProgram.glId());
+  glUniform2f(m_texCoordsScaleLocation, float(m_renderWidth) / m_width,
+      float(m_renderHeight) / m_height);
+  glUniform2f(m_texCoordsMaxLocation, (m_renderWidth - 0.5f) / m_width,
+      (m_renderHeight - 0.5f) / m_height);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, m_textures[0]);
+  glBindVertexArray(m_upscaleVao);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glBindVertexArray(0);
+  glEnable(GL_DEPTH_TEST);
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "filesystem.hpp"
+#include "shaders.hpp"
+
+#include <glad/glad.h>
+
+#include <cstddef>
+
+// Chooses the render scale (fraction of the window width and height) of the
+// next frames so that the measured GPU time of a frame stays under a budget.
+// The cost of a frame is assumed proportional to its pixel count, ie. to the
+// square of its scale.
+class DynamicResolution
+{
+public:
+  explicit DynamicResolution(
+      double budgetSeconds, float minScale = 0.25f, float maxScale = 1.f);
+
+  void setBudget(double budgetSeconds) { m_budget = budgetSeconds; }
+
+  double budget() const { return m_budget; }
+
+  float scale() const { return m_scale; }
+
+  // Record the GPU time of a frame rendered at renderScale. Timer results
+  // arrive a few frames late, so that scale may differ from the current one.
+  void update(double gpuSeconds, float renderScale);
+
+private:
+  double m_budget;
+  float m_minScale;
+  float m_maxScale;
+  float m_scale;
+  double m_costPerArea = 0.; // Smoothed GPU time of a frame at scale 1
+};
+
+// Window sized offscreen target of dynamic resolution: the scene is rendered
+// in its corner at the scale chosen by a DynamicResolution controller from the
+// measured GPU time of the frames, then upscaled to the window. Frames are
+// timed with timestamps, time elapsed queries would nest with the shadow pass
+// timer, and results are read a few frames later so that the CPU never waits.
+class DynamicResolutionTarget
+{
+public:
+  DynamicResolutionTarget(GLsizei width, GLsizei height, double budgetSeconds,
+      const fs::path &upscaleVsPath, const fs::path &upscaleFsPath);
+
+  ~DynamicResolutionTarget();
+
+  DynamicResolutionTarget(const DynamicResolutionTarget &) = delete;
+
+  DynamicResolutionTarget &operator=(const DynamicResolutionTarget &) = delete;
+
+  // False if the framebuffer is not supported, the scene must then be
+  // rendered to the window at full size
+  bool isComplete() const { return m_complete; }
+
+  // Read the GPU time of the oldest timed frame if available, choose the
+  // render size and start timing the frame. The controller only adapts the
+  // scale if adaptive is true, otherwise frames are rendered at full size.
+  void beginFrame(bool adaptive);
+
+  // Stop timing the frame started by beginFrame()
+  void endFrame();
+
+  // Bind the offscreen framebuffer as GL_DRAW_FRAMEBUFFER
+  void bind() const;
+
+  // Draw the render size corner of the offscreen target over the window
+  void upscale() const;
+
+  GLsizei renderWidth() const { return m_renderWidth; }
+
+  GLsizei renderHeight() const { return m_renderHeight; }
+
+  float scale() const { return m_scale; }
+
+  // GPU time of the last frame read, in seconds
+  double gpuFrameTime() const { return m_gpuFrameTime; }
+
+  DynamicResolution &controller() { return m_controller; }
+
+private:
+  static const size_t FRAME_TIMER_COUNT = 4;
+
+  GLsizei m_width;
+  GLsizei m_height;
+  DynamicResolution m_controller;
+  float m_scale = 1.f;
+  GLsizei m_renderWidth;
+  GLsizei m_renderHeight;
+
+  // Start and end timestamps of each frame of the ring
+  GLuint m_timerQueries[2 * FRAME_TIMER_COUNT] = {};
+  bool m_timerPending[FRAME_TIMER_COUNT] = {};
+  float m_timerScales[FRAME_TIMER_COUNT] = {};
+  size_t m_timerIdx = 0;
+  bool m_timeFrame = false;
+  double m_gpuFrameTime = 0.;
+
+  GLuint m_framebuffer = 0;
+  GLuint m_textures[2] = {}; // Color and depth
+  bool m_complete = false;
+
+  // The window framebuffer is multisampled, so the upscale is a draw rather
+  // than a blit
+  GLProgram m_upscaleProgram;
+  GLint m_texCoordsScaleLocation = -1;
+  GLint m_texCoordsMaxLocation = -1;
+  GLuint m_upscaleVao = 0;
+};
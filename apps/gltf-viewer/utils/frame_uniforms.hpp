@@ -0,0 +1,114 @@
+#pragma once
+
+#include "shadows.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+
+// C++ mirrors of the std140 uniform blocks declared in the shaders. They are
+// written once per frame into uniform buffer objects. Any change here must be
+// reflected in the GLSL declarations, the static_asserts below check the
+// std140 offsets.
+
+// Uniform buffer binding points
+const unsigned int CAMERA_UNIFORMS_BINDING = 0;
+const unsigned int LIGHT_UNIFORMS_BINDING = 1;
+
+// layout(std140) uniform CameraUniforms
+struct CameraUniforms
+{
+  glm::mat4 viewMatrix;
+  glm::mat4 projMatrix;
+};
+
+static_assert(offsetof(CameraUniforms, viewMatrix) == 0, "std140 mismatch");
+static_assert(offsetof(CameraUniforms, projMatrix) == 64, "std140 mismatch");
+static_assert(sizeof(CameraUniforms) == 128, "std140 mismatch");
+
+// struct DirLight, directions and positions are in view space
+struct DirLightStd140
+{
+  glm::vec3 uLightDirection;
+  float pad0;
+  glm::vec3 uLightIntensity;
+  float pad1;
+};
+
+static_assert(offsetof(DirLightStd140, uLightIntensity) == 16, "std140 mismatch");
+static_assert(sizeof(DirLightStd140) == 32, "std140 mismatch");
+
+// struct PointLight
+struct PointLightStd140
+{
+  glm::vec3 position;
+  float constant;
+  glm::vec3 color;
+  float linear;
+  float quadratic;
+  float pad[3];
+};
+
+static_assert(offsetof(PointLightStd140, constant) == 12, "std140 mismatch");
+static_assert(offsetof(PointLightStd140, color) == 16, "std140 mismatch");
+static_assert(offsetof(PointLightStd140, linear) == 28, "std140 mismatch");
+static_assert(offsetof(PointLightStd140, quadratic) == 32, "std140 mismatch");
+static_assert(sizeof(PointLightStd140) == 48, "std140 mismatch");
+
+// struct SpotLight
+struct SpotLightStd140
+{
+  glm::vec3 position;
+  float cutOff;
+  glm::vec3 direction;
+  float outerCutOff;
+  glm::vec3 color;
+  float constant;
+  float linear;
+  float quadratic;
+  float pad[2];
+};
+
+static_assert(offsetof(SpotLightStd140, cutOff) == 12, "std140 mismatch");
+static_assert(offsetof(SpotLightStd140, direction) == 16, "std140 mismatch");
+static_assert(offsetof(SpotLightStd140, outerCutOff) == 28, "std140 mismatch");
+static_assert(offsetof(SpotLightStd140, color) == 32, "std140 mismatch");
+static_assert(offsetof(SpotLightStd140, constant) == 44, "std140 mismatch");
+static_assert(offsetof(SpotLightStd140, linear) == 48, "std140 mismatch");
+static_assert(offsetof(SpotLightStd140, quadratic) == 52, "std140 mismatch");
+static_assert(sizeof(SpotLightStd140) == 64, "std140 mismatch");
+
+// layout(std140) uniform LightUniforms
+struct LightUniforms
+{
+  DirLightStd140 dirLight;
+  PointLightStd140 pointLight;
+  SpotLightStd140 spotLight;
+  // Cluster grid of the punctual lights, see utils/lights.hpp
+  glm::uvec3 clusterCounts;
+  uint32_t directionalLightCount;
+  glm::vec2 clusterTileSize;
+  float clusterNear;
+  float clusterDepthScale;
+  // Shadow cascades of the directional light, matrices transform view space to
+  // shadow map texture coordinates and depth
+  glm::mat4 cascadeMatrices[SHADOW_CASCADE_COUNT];
+  glm::vec4 cascadeSplits; // Far view depth of each cascade
+  glm::vec4 cascadeTexelSizes; // World size of a shadow map texel
+};
+
+static_assert(offsetof(LightUniforms, dirLight) == 0, "std140 mismatch");
+static_assert(offsetof(LightUniforms, pointLight) == 32, "std140 mismatch");
+static_assert(offsetof(LightUniforms, spotLight) == 80, "std140 mismatch");
+static_assert(offsetof(LightUniforms, clusterCounts) == 144, "std140 mismatch");
+static_assert(
+    offsetof(LightUniforms, directionalLightCount) == 156, "std140 mismatch");
+static_assert(offsetof(LightUniforms, clusterTileSize) == 160, "std140 mismatch");
+static_assert(offsetof(LightUniforms, clusterNear) == 168, "std140 mismatch");
+static_assert(offsetof(LightUniforms, cascadeMatrices) == 176, "std140 mismatch");
+static_assert(offsetof(LightUniforms, cascadeSplits) == 432, "std140 mismatch");
+static_assert(
+    offsetof(LightUniforms, cascadeTexelSizes) == 448, "std140 mismatch");
+static_assert(sizeof(LightUniforms) == 464, "std140 mismatch");
+static_assert(SHADOW_CASCADE_COUNT == 4, "cascadeSplits holds 4 cascades");
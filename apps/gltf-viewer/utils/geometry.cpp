@@ -0,0 +1,111 @@
+#include "geometry.hpp"
+
+#include "gltf.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+
+namespace {
+
+struct PrimitiveData
+{
+  int mode = TINYGLTF_MODE_TRIANGLES;
+  std::vector<PackedVertex> vertices;
+  std::vector<uint32_t> indices;
+};
+
+// Copy numComponents components of each element of an accessor into vertices
+template <int numComponents, typename VecType>
+void readAttribute(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, const char *name,
+    std::vector<PackedVertex> &vertices, VecType PackedVertex::*member)
+{
+  const auto it = primitive.attributes.find(name);
+  if (it == end(primitive.attributes)) {
+    return;
+  }
+  std::vector<float> values;
+  const auto accessorComponents =
+      readAccessorAsFloats(model, (*it).second, values);
+  if (accessorComponents < numComponents) {
+    return;
+  }
+  const auto count =
+      std::min(vertices.size(), values.size() / accessorComponents);
+  for (size_t i = 0; i < count; ++i) {
+    for (int c = 0; c < numComponents; ++c) {
+      (vertices[i].*member)[c] = values[i * accessorComponents + c];
+    }
+  }
+}
+
+void convertPrimitive(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, PrimitiveData &data)
+{
+  std::vector<glm::vec3> positions;
+  if (!readPrimitivePositions(model, primitive, positions)) {
+    return;
+  }
+  data.vertices.resize(positions.size(), PackedVertex{});
+  for (size_t i = 0; i < positions.size(); ++i) {
+    data.vertices[i].position = positions[i];
+  }
+  readAttribute<3>(
+      model, primitive, "NORMAL", data.vertices, &PackedVertex::normal);
+  readAttribute<2>(
+      model, primitive, "TEXCOORD_0", data.vertices, &PackedVertex::texCoords);
+
+  if (readPrimitiveTriangles(model, primitive, data.indices)) {
+    data.mode = TINYGLTF_MODE_TRIANGLES;
+    return;
+  }
+  // Points and lines keep their mode
+  data.mode = primitive.mode;
+  if (primitive.indices >= 0) {
+    readAccessorAsIndices(model, primitive.indices, data.indices);
+  } else {
+    data.indices.resize(positions.size());
+    for (uint32_t i = 0; i < data.indices.size(); ++i) {
+      data.indices[i] = i;
+    }
+  }
+}
+
+} // namespace
+
+PackedGeometry packGeometry(const tinygltf::Model &model)
+{
+  std::vector<const tinygltf::Primitive *> primitives;
+  for (const auto &mesh : model.meshes) {
+    for (const auto &primitive : mesh.primitives) {
+      primitives.push_back(&primitive);
+    }
+  }
+
+  std::vector<PrimitiveData> converted(primitives.size());
+  parallelFor(primitives.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      convertPrimitive(model, *primitives[i], converted[i]);
+    }
+  });
+
+  PackedGeometry geometry;
+  size_t vertexCount = 0, indexCount = 0;
+  for (const auto &data : converted) {
+    vertexCount += data.vertices.size();
+    indexCount += data.indices.size();
+  }
+  geometry.vertices.reserve(vertexCount);
+  geometry.indices.reserve(indexCount);
+  geometry.primitives.reserve(converted.size());
+  for (const auto &data : converted) {
+    geometry.primitives.push_back(PackedPrimitive{data.mode,
+        uint32_t(geometry.indices.size()), uint32_t(data.indices.size()),
+        int32_t(geometry.vertices.size())});
+    geometry.vertices.insert(
+        end(geometry.vertices), begin(data.vertices), end(data.vertices));
+    geometry.indices.insert(
+        end(geometry.indices), begin(data.indices), end(data.indices));
+  }
+  return geometry;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Canonical interleaved vertex of the packed scene geometry. Missing
+// attributes are set to zero.
+struct PackedVertex
+{
+  glm::vec3 position;
+  glm::vec3 normal;
+  glm::vec2 texCoords;
+};
+
+static_assert(sizeof(PackedVertex) == 32, "PackedVertex must be tightly packed");
+
+// Location of a glTF primitive in the packed buffers
+struct PackedPrimitive
+{
+  int mode; // Triangle strips and fans are converted to TRIANGLES
+  uint32_t firstIndex;
+  uint32_t indexCount;
+  int32_t baseVertex; // Indices are relative to the primitive vertices
+};
+
+// All primitives of a model repacked in a single vertex array and a single
+// uint32 index array, to be drawn from one VAO with base vertex draw calls
+struct PackedGeometry
+{
+  std::vector<PackedVertex> vertices;
+  std::vector<uint32_t> indices;
+  // Primitives of all meshes, ordered by mesh then by primitive
+  std::vector<PackedPrimitive> primitives;
+};
+
+// Primitives are converted in parallel on the thread pool
+PackedGeometry packGeometry(const tinygltf::Model &model);
@@ -0,0 +1,149 @@
+#include "gl_state_cache.hpp"
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include <cstring>
+
+void GLStateCache::useProgram(GLuint program)
+{
+  if (program == m_program) {
+    ++m_skippedCallCount;
+    return;
+  }
+  glUseProgram(program);
+  ++m_issuedCallCount;
+  ++m_programBindCount;
+  m_program = program;
+  m_pCurrentUniforms = &m_uniforms[program];
+}
+
+void GLStateCache::bindVertexArray(GLuint vao)
+{
+  if (vao == m_vao) {
+    ++m_skippedCallCount;
+    return;
+  }
+  glBindVertexArray(vao);
+  ++m_issuedCallCount;
+  ++m_vertexArrayBindCount;
+  m_vao = vao;
+}
+
+void GLStateCache::bindTexture(GLuint unit, GLenum target, GLuint texture)
+{
+  if (unit >= m_textureUnits.size()) {
+    m_textureUnits.resize(unit + 1);
+  }
+  auto &binding = m_textureUnits[unit];
+  if (binding.known && binding.target == target &&
+      binding.texture == texture) {
+    ++m_skippedCallCount;
+    return;
+  }
+  if (unit != m_activeTextureUnit) {
+    glActiveTexture(GL_TEXTURE0 + unit);
+    ++m_issuedCallCount;
+    m_activeTextureUnit = unit;
+  }
+  glBindTexture(target, texture);
+  ++m_issuedCallCount;
+  binding.target = target;
+  binding.texture = texture;
+  binding.known = true;
+}
+
+bool GLStateCache::updateUniform(GLint location, const void *value, size_t size)
+{
+  // Uniforms of inactive variables are silently ignored by GL
+  if (location < 0) {
+    ++m_skippedCallCount;
+    return false;
+  }
+  // Current program is unknown, the value cannot be shadowed
+  if (!m_pCurrentUniforms) {
+    ++m_issuedCallCount;
+    return true;
+  }
+  auto &values = *m_pCurrentUniforms;
+  if (size_t(location) >= values.size()) {
+    values.resize(location + 1);
+  }
+  auto &shadow = values[location];
+  if (shadow.size == size && !std::memcmp(shadow.data.data(), value, size)) {
+    ++m_skippedCallCount;
+    return false;
+  }
+  shadow.size = uint32_t(size);
+  shadow.data.resize((size + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+  std::memcpy(shadow.data.data(), value, size);
+  ++m_issuedCallCount;
+  return true;
+}
+
+void GLStateCache::uniform1i(GLint location, GLint value)
+{
+  if (updateUniform(location, &value, sizeof(value))) {
+    glUniform1i(location, value);
+  }
+}
+
+void GLStateCache::uniform1ui(GLint location, GLuint value)
+{
+  if (updateUniform(location, &value, sizeof(value))) {
+    glUniform1ui(location, value);
+  }
+}
+
+void GLStateCache::uniform1f(GLint location, float value)
+{
+  if (updateUniform(location, &value, sizeof(value))) {
+    glUniform1f(location, value);
+  }
+}
+
+void GLStateCache::uniform3f(GLint location, const glm::vec3 &value)
+{
+  if (updateUniform(location, glm::value_ptr(value), sizeof(value))) {
+    glUniform3f(location, value.x, value.y, value.z);
+  }
+}
+
+void GLStateCache::uniform4f(GLint location, const glm::vec4 &value)
+{
+  if (updateUniform(location, glm::value_ptr(value), sizeof(value))) {
+    glUniform4f(location, value.x, value.y, value.z, value.w);
+  }
+}
+
+void GLStateCache::uniformMatrix4f(GLint location, const glm::mat4 &value)
+{
+  if (updateUniform(location, glm::value_ptr(value), sizeof(value))) {
+    glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+  }
+}
+
+void GLStateCache::uniformMatrix4fv(
+    GLint location, GLsizei count, const glm::mat4 *values)
+{
+  if (updateUniform(location, values, count * sizeof(glm::mat4))) {
+    glUniformMatrix4fv(location, count, GL_FALSE, glm::value_ptr(values[0]));
+  }
+}
+
+void GLStateCache::invalidateBindings()
+{
+  m_program = UNKNOWN;
+  m_vao = UNKNOWN;
+  m_activeTextureUnit = UNKNOWN;
+  m_textureUnits.clear();
+  m_pCurrentUniforms = nullptr;
+}
+
+void GLStateCache::invalidateUniforms(GLuint program)
+{
+  m_uniforms.erase(program);
+  if (program == m_program) {
+    m_program = UNKNOWN;
+    m_pCurrentUniforms = nullptr;
+  }
+}
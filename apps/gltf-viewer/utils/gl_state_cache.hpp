@@ -0,0 +1,88 @@
+#pragma once
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Shadow copy of the GL state changed by the renderer: bound program, VAO,
+// textures per unit and uniform values per program. Calls that would not
+// change the current state are dropped and counted.
+//
+// The cache assumes it sees every change of the state it tracks. Code that
+// changes bindings behind its back must call invalidateBindings() afterwards.
+class GLStateCache
+{
+public:
+  void useProgram(GLuint program);
+
+  void bindVertexArray(GLuint vao);
+
+  // Bind texture on the given unit, glActiveTexture is only called if needed
+  void bindTexture(GLuint unit, GLenum target, GLuint texture);
+
+  void uniform1i(GLint location, GLint value);
+  void uniform1ui(GLint location, GLuint value);
+  void uniform1f(GLint location, float value);
+  void uniform3f(GLint location, const glm::vec3 &value);
+  void uniform4f(GLint location, const glm::vec4 &value);
+  void uniformMatrix4f(GLint location, const glm::mat4 &value);
+  // Array of count matrices
+  void uniformMatrix4fv(GLint location, GLsizei count, const glm::mat4 *values);
+
+  // Forget bindings (program, VAO, textures). Uniform
+  // values are kept since they are owned by the programs.
+  void invalidateBindings();
+
+  // Forget the uniform values of a program (e.g. after it has been relinked)
+  void invalidateUniforms(GLuint program);
+
+  size_t issuedCallCount() const { return m_issuedCallCount; }
+  size_t skippedCallCount() const { return m_skippedCallCount; }
+  // Issued glUseProgram and glBindVertexArray calls, included in the issued
+  // call count
+  size_t programBindCount() const { return m_programBindCount; }
+  size_t vertexArrayBindCount() const { return m_vertexArrayBindCount; }
+
+  void resetCounters()
+  {
+    m_issuedCallCount = 0;
+    m_skippedCallCount = 0;
+    m_programBindCount = 0;
+    m_vertexArrayBindCount = 0;
+  }
+
+private:
+  // Return true if the uniform must be uploaded, and update the shadow value
+  bool updateUniform(GLint location, const void *value, size_t size);
+
+  struct UniformValue
+  {
+    uint32_t size = 0; // In bytes, 0 means unknown value
+    std::vector<uint32_t> data;
+  };
+
+  struct TextureBinding
+  {
+    GLenum target = 0;
+    GLuint texture = 0;
+    bool known = false;
+  };
+
+  static constexpr GLuint UNKNOWN = ~0u;
+
+  GLuint m_program = UNKNOWN;
+  GLuint m_vao = UNKNOWN;
+  GLuint m_activeTextureUnit = UNKNOWN;
+  std::vector<TextureBinding> m_textureUnits;
+  // Uniform values of each program, indexed by location
+  std::unordered_map<GLuint, std::vector<UniformValue>> m_uniforms;
+  std::vector<UniformValue> *m_pCurrentUniforms = nullptr;
+
+  size_t m_issuedCallCount = 0;
+  size_t m_skippedCallCount = 0;
+  size_t m_programBindCount = 0;
+  size_t m_vertexArrayBindCount = 0;
+};
@@ -3,6 +3,7 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 
+#include <algorithm>
 #include <iostream>
 
 glm::mat4 getLocalToWorldMatrix(
@@ -150,4 +151,396 @@ void computeSceneBounds(
       updateBounds(nodeIdx, glm::mat4(1));
     }
   }
-}
\ No newline at end of file
+}
+
+void visitScene(const tinygltf::Model &model,
+    const std::function<void(int, const glm::mat4 &)> &visitor)
+{
+  if (model.defaultScene < 0) {
+    return;
+  }
+  const std::function<void(int, const glm::mat4 &)> visitNode =
+      [&](int nodeIdx, const glm::mat4 &parentMatrix) {
+        const auto &node = model.nodes[nodeIdx];
+        const glm::mat4 modelMatrix = getLocalToWorldMatrix(node, parentMatrix);
+        visitor(nodeIdx, modelMatrix);
+        for (const auto childNodeIdx : node.children) {
+          visitNode(childNodeIdx, modelMatrix);
+        }
+      };
+  for (const auto nodeIdx : model.scenes[model.defaultScene].nodes) {
+    visitNode(nodeIdx, glm::mat4(1));
+  }
+}
+
+SceneTransforms::SceneTransforms(const tinygltf::Model &model) :
+    m_parents(model.nodes.size(), -1),
+    m_depths(model.nodes.size(), -1),
+    m_worldMatrices(model.nodes.size(), glm::mat4(1)),
+    m_updated(model.nodes.size(), 0)
+{
+  if (model.defaultScene < 0) {
+    return;
+  }
+  std::vector<int> stack(begin(model.scenes[model.defaultScene].nodes),
+      end(model.scenes[model.defaultScene].nodes));
+  for (const auto nodeIdx : stack) {
+    m_depths[nodeIdx] = 0;
+  }
+  while (!stack.empty()) {
+    const int nodeIdx = stack.back();
+    stack.pop_back();
+    for (const auto childNodeIdx : model.nodes[nodeIdx].children) {
+      m_parents[childNodeIdx] = nodeIdx;
+      m_depths[childNodeIdx] = m_depths[nodeIdx] + 1;
+      stack.push_back(childNodeIdx);
+    }
+  }
+  for (const auto nodeIdx : model.scenes[model.defaultScene].nodes) {
+    updateSubtree(model, nodeIdx, glm::mat4(1));
+  }
+}
+
+void SceneTransforms::update(
+    const tinygltf::Model &model, const std::vector<int> &changedNodes)
+{
+  for (const auto nodeIdx : m_updatedNodes) {
+    m_updated[nodeIdx] = 0;
+  }
+  m_updatedNodes.clear();
+
+  // Ancestors first, so that the subtree of a changed node already updated
+  // with one of its ancestors is skipped
+  m_sortedNodes.clear();
+  for (const auto nodeIdx : changedNodes) {
+    if (nodeIdx >= 0 && size_t(nodeIdx) < m_depths.size() &&
+        m_depths[nodeIdx] >= 0) {
+      m_sortedNodes.push_back(nodeIdx);
+    }
+  }
+  std::sort(begin(m_sortedNodes), end(m_sortedNodes),
+      [&](int a, int b) { return m_depths[a] < m_depths[b]; });
+  for (const auto nodeIdx : m_sortedNodes) {
+    if (m_updated[nodeIdx]) {
+      continue;
+    }
+    const int parentIdx = m_parents[nodeIdx];
+    updateSubtree(model, nodeIdx,
+        parentIdx >= 0 ? m_worldMatrices[parentIdx] : glm::mat4(1));
+  }
+}
+
+void SceneTransforms::updateSubtree(const tinygltf::Model &model, int nodeIdx,
+    const glm::mat4 &parentMatrix)
+{
+  const auto &node = model.nodes[nodeIdx];
+  m_worldMatrices[nodeIdx] = getLocalToWorldMatrix(node, parentMatrix);
+  if (!m_updated[nodeIdx]) {
+    m_updated[nodeIdx] = 1;
+    m_updatedNodes.push_back(nodeIdx);
+  }
+  for (const auto childNodeIdx : node.children) {
+    updateSubtree(model, childNodeIdx, m_worldMatrices[nodeIdx]);
+  }
+}
+
+static float readComponent(
+    const unsigned char *data, int componentType, bool normalized)
+{
+  switch (componentType) {
+  case TINYGLTF_COMPONENT_TYPE_BYTE: {
+    const auto value = *((const int8_t *)data);
+    return normalized ? glm::max(value / 127.f, -1.f) : float(value);
+  }
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE: {
+    const auto value = *((const uint8_t *)data);
+    return normalized ? value / 255.f : float(value);
+  }
+  case TINYGLTF_COMPONENT_TYPE_SHORT: {
+    const auto value = *((const int16_t *)data);
+    return normalized ? glm::max(value / 32767.f, -1.f) : float(value);
+  }
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT: {
+    const auto value = *((const uint16_t *)data);
+    return normalized ? value / 65535.f : float(value);
+  }
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+    return float(*((const uint32_t *)data));
+  case TINYGLTF_COMPONENT_TYPE_FLOAT:
+    return *((const float *)data);
+  }
+  return 0.f;
+}
+
+static uint32_t readIndex(const unsigned char *data, int componentType)
+{
+  switch (componentType) {
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+    return *((const uint8_t *)data);
+  case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+    return *((const uint16_t *)data);
+  default:
+    return *((const uint32_t *)data);
+  }
+}
+
+int readAccessorAsFloats(const tinygltf::Model &model, int accessorIdx,
+    std::vector<float> &values)
+{
+  values.clear();
+  if (accessorIdx < 0) {
+    return 0;
+  }
+  const auto &accessor = model.accessors[accessorIdx];
+  const auto &sparse = accessor.sparse;
+  if (accessor.bufferView < 0 && !sparse.isSparse) {
+    return 0;
+  }
+  const auto numComponents = tinygltf::GetNumComponentsInType(accessor.type);
+  const auto componentSize =
+      tinygltf::GetComponentSizeInBytes(accessor.componentType);
+  if (numComponents <= 0 || componentSize <= 0) {
+    return 0;
+  }
+  // Sparse accessors without a buffer view are initialized with zeros
+  values.assign(accessor.count * numComponents, 0.f);
+  if (accessor.bufferView >= 0) {
+    const auto &bufferView = model.bufferViews[accessor.bufferView];
+    const auto &buffer = model.buffers[bufferView.buffer];
+    const auto byteStride = accessor.ByteStride(bufferView);
+    if (byteStride <= 0) {
+      values.clear();
+      return 0;
+    }
+    const auto byteOffset = accessor.byteOffset + bufferView.byteOffset;
+    for (size_t i = 0; i < accessor.count; ++i) {
+      const auto *element = &buffer.data[byteOffset + byteStride * i];
+      for (int c = 0; c < numComponents; ++c) {
+        values[i * numComponents + c] = readComponent(
+            element + c * componentSize, accessor.componentType,
+            accessor.normalized);
+      }
+    }
+  }
+  // Sparse elements are tightly packed and replace the elements they index
+  // (morph targets usually only move a few vertices)
+  if (sparse.isSparse) {
+    const auto &indicesView = model.bufferViews[sparse.indices.bufferView];
+    const auto &valuesView = model.bufferViews[sparse.values.bufferView];
+    const auto *indices = &model.buffers[indicesView.buffer]
+                               .data[indicesView.byteOffset +
+                                     sparse.indices.byteOffset];
+    const auto *sparseValues =
+        &model.buffers[valuesView.buffer]
+             .data[valuesView.byteOffset + sparse.values.byteOffset];
+    const auto indexSize =
+        tinygltf::GetComponentSizeInBytes(sparse.indices.componentType);
+    for (int i = 0; i < sparse.count; ++i) {
+      const uint32_t index =
+          readIndex(indices + i * indexSize, sparse.indices.componentType);
+      if (index >= accessor.count) {
+        continue;
+      }
+      for (int c = 0; c < numComponents; ++c) {
+        values[index * numComponents + c] = readComponent(
+            sparseValues + (i * numComponents + c) * componentSize,
+            accessor.componentType, accessor.normalized);
+      }
+    }
+  }
+  return numComponents;
+}
+
+bool readAccessorAsIndices(const tinygltf::Model &model, int accessorIdx,
+    std::vector<uint32_t> &indices)
+{
+  indices.clear();
+  if (accessorIdx < 0 || model.accessors[accessorIdx].bufferView < 0) {
+    return false;
+  }
+  const auto &accessor = model.accessors[accessorIdx];
+  const auto &bufferView = model.bufferViews[accessor.bufferView];
+  const auto &buffer = model.buffers[bufferView.buffer];
+  const auto byteStride = accessor.ByteStride(bufferView);
+  if (accessor.type != TINYGLTF_TYPE_SCALAR || byteStride <= 0) {
+    return false;
+  }
+  const auto byteOffset = accessor.byteOffset + bufferView.byteOffset;
+  indices.resize(accessor.count);
+  for (size_t i = 0; i < accessor.count; ++i) {
+    const auto *element = &buffer.data[byteOffset + byteStride * i];
+    switch (accessor.componentType) {
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+      indices[i] = *((const uint8_t *)element);
+      break;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+      indices[i] = *((const uint16_t *)element);
+      break;
+    case TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT:
+      indices[i] = *((const uint32_t *)element);
+      break;
+    default:
+      indices.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool readPrimitivePositions(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, std::vector<glm::vec3> &positions)
+{
+  positions.clear();
+  const auto it = primitive.attributes.find("POSITION");
+  if (it == end(primitive.attributes)) {
+    return false;
+  }
+  std::vector<float> values;
+  if (readAccessorAsFloats(model, (*it).second, values) != 3) {
+    return false;
+  }
+  positions.resize(values.size() / 3);
+  for (size_t i = 0; i < positions.size(); ++i) {
+    positions[i] =
+        glm::vec3(values[3 * i], values[3 * i + 1], values[3 * i + 2]);
+  }
+  return true;
+}
+
+bool readPrimitiveTriangles(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, std::vector<uint32_t> &indices)
+{
+  indices.clear();
+  const auto mode = primitive.mode < 0 ? TINYGLTF_MODE_TRIANGLES : primitive.mode;
+  if (mode != TINYGLTF_MODE_TRIANGLES && mode != TINYGLTF_MODE_TRIANGLE_STRIP &&
+      mode != TINYGLTF_MODE_TRIANGLE_FAN) {
+    return false;
+  }
+
+  std::vector<uint32_t> elements;
+  if (primitive.indices >= 0) {
+    if (!readAccessorAsIndices(model, primitive.indices, elements)) {
+      return false;
+    }
+  } else {
+    const auto it = primitive.attributes.find("POSITION");
+    if (it == end(primitive.attributes)) {
+      return false;
+    }
+    elements.resize(model.accessors[(*it).second].count);
+    for (uint32_t i = 0; i < elements.size(); ++i) {
+      elements[i] = i;
+    }
+  }
+
+  if (mode == TINYGLTF_MODE_TRIANGLES) {
+    indices = std::move(elements);
+    indices.resize(indices.size() - indices.size() % 3);
+    return true;
+  }
+  for (size_t i = 2; i < elements.size(); ++i) {
+    if (mode == TINYGLTF_MODE_TRIANGLE_FAN) {
+      indices.insert(end(indices), {elements[0], elements[i - 1], elements[i]});
+    } else if (i % 2) {
+      indices.insert(end(indices), {elements[i - 1], elements[i - 2], elements[i]});
+    } else {
+      indices.insert(end(indices), {elements[i - 2], elements[i - 1], elements[i]});
+    }
+  }
+  return true;
+}
+
+AABB computePrimitiveBounds(
+    const tinygltf::Model &model, const tinygltf::Primitive &primitive)
+{
+  AABB bounds;
+  const auto it = primitive.attributes.find("POSITION");
+  if (it == end(primitive.attributes)) {
+    return bounds;
+  }
+  const auto &accessor = model.accessors[(*it).second];
+  if (accessor.minValues.size() == 3 && accessor.maxValues.size() == 3) {
+    return AABB(glm::vec3(accessor.minValues[0], accessor.minValues[1],
+                    accessor.minValues[2]),
+        glm::vec3(accessor.maxValues[0], accessor.maxValues[1],
+            accessor.maxValues[2]));
+  }
+  std::vector<glm::vec3> positions;
+  readPrimitivePositions(model, primitive, positions);
+  for (const auto &position : positions) {
+    bounds.expand(position);
+  }
+  return bounds;
+}
+
+bool readMeshGpuInstances(const tinygltf::Model &model,
+    const tinygltf::Node &node, std::vector<glm::mat4> &instanceMatrices)
+{
+  instanceMatrices.clear();
+  const auto extensionIt = node.extensions.find("EXT_mesh_gpu_instancing");
+  if (extensionIt == end(node.extensions) ||
+      !(*extensionIt).second.Has("attributes")) {
+    return false;
+  }
+  const auto &attributes = (*extensionIt).second.Get("attributes");
+  const auto readAttribute = [&](const char *name, int numComponents,
+                                 std::vector<float> &values) {
+    values.clear();
+    if (!attributes.Has(name) || !attributes.Get(name).IsInt()) {
+      return true;
+    }
+    return readAccessorAsFloats(model, attributes.Get(name).Get<int>(),
+               values) == numComponents;
+  };
+  std::vector<float> translations, rotations, scales;
+  if (!readAttribute("TRANSLATION", 3, translations) ||
+      !readAttribute("ROTATION", 4, rotations) ||
+      !readAttribute("SCALE", 3, scales)) {
+    std::cerr << "Invalid EXT_mesh_gpu_instancing attributes, ignoring them"
+              << std::endl;
+    return false;
+  }
+  const auto count = std::max(translations.size() / 3,
+      std::max(rotations.size() / 4, scales.size() / 3));
+  if (!count) {
+    return false;
+  }
+  // All attributes have the same count, missing ones take default values
+  instanceMatrices.resize(count);
+  for (size_t i = 0; i < count; ++i) {
+    auto matrix = glm::mat4(1);
+    if (i < translations.size() / 3) {
+      matrix = glm::translate(matrix, glm::vec3(translations[3 * i],
+                                          translations[3 * i + 1],
+                                          translations[3 * i + 2]));
+    }
+    if (i < rotations.size() / 4) {
+      matrix *= glm::mat4_cast(
+          glm::quat(rotations[4 * i + 3], rotations[4 * i],
+              rotations[4 * i + 1], rotations[4 * i + 2]));
+    }
+    if (i < scales.size() / 3) {
+      matrix = glm::scale(matrix,
+          glm::vec3(scales[3 * i], scales[3 * i + 1], scales[3 * i + 2]));
+    }
+    instanceMatrices[i] = matrix;
+  }
+  return true;
+}
+
+int appendBufferView(tinygltf::Model &model, int bufferIdx, const void *data,
+    size_t size, size_t byteStride, int target)
+{
+  auto &buffer = model.buffers[bufferIdx].data;
+  buffer.resize((buffer.size() + 3) & ~size_t(3));
+  tinygltf::BufferView bufferView;
+  bufferView.buffer = bufferIdx;
+  bufferView.byteOffset = buffer.size();
+  bufferView.byteLength = size;
+  bufferView.byteStride = byteStride;
+  bufferView.target = target;
+  const auto *bytes = static_cast<const unsigned char *>(data);
+  buffer.insert(end(buffer), bytes, bytes + size);
+  model.bufferViews.push_back(bufferView);
+  return int(model.bufferViews.size() - 1);
+}
@@ -1,10 +1,93 @@
 #pragma once
 
+#include "bvh.hpp"
+
 #include <glm/glm.hpp>
 #include <tiny_gltf.h>
 
+#include <cstdint>
+#include <functional>
+#include <vector>
+
 glm::mat4 getLocalToWorldMatrix(
     const tinygltf::Node &node, const glm::mat4 &parentMatrix);
 
 void computeSceneBounds(
-    const tinygltf::Model &model, glm::vec3 &bboxMin, glm::vec3 &bboxMax);
\ No newline at end of file
+    const tinygltf::Model &model, glm::vec3 &bboxMin, glm::vec3 &bboxMax);
+
+// Call visitor(nodeIdx, localToWorldMatrix) for each node of the default scene,
+// parents before children
+void visitScene(const tinygltf::Model &model,
+    const std::function<void(int, const glm::mat4 &)> &visitor);
+
+// World matrices of the nodes of the default scene, kept from one update to
+// the next so that a transform change only recomputes the subtrees of the
+// changed nodes. Nodes outside the scene keep the identity.
+class SceneTransforms
+{
+public:
+  explicit SceneTransforms(const tinygltf::Model &model);
+
+  // Recompute the world matrices of changedNodes and of their descendants from
+  // the node properties. Subtrees are visited once even if several of their
+  // nodes changed.
+  void update(
+      const tinygltf::Model &model, const std::vector<int> &changedNodes);
+
+  const std::vector<glm::mat4> &worldMatrices() const
+  {
+    return m_worldMatrices;
+  }
+
+  // Nodes whose world matrix was recomputed by the last update()
+  const std::vector<int> &updatedNodes() const { return m_updatedNodes; }
+
+  bool isUpdated(int nodeIdx) const { return m_updated[nodeIdx] != 0; }
+
+private:
+  // Compute the world matrices of the subtree of nodeIdx, parents first
+  void updateSubtree(const tinygltf::Model &model, int nodeIdx,
+      const glm::mat4 &parentMatrix);
+
+  std::vector<int> m_parents; // -1 for the roots and the nodes outside the scene
+  std::vector<int> m_depths; // -1 for the nodes outside the scene
+  std::vector<glm::mat4> m_worldMatrices;
+  std::vector<int> m_updatedNodes;
+  std::vector<uint8_t> m_updated; // Per node, set for m_updatedNodes
+  std::vector<int> m_sortedNodes; // Changed nodes sorted by depth
+};
+
+// Read the elements of an accessor as floats (normalized integers are mapped to
+// [0, 1] or [-1, 1]), sparse elements applied. Return the number of components
+// per element, or 0 if the accessor cannot be read.
+int readAccessorAsFloats(const tinygltf::Model &model, int accessorIdx,
+    std::vector<float> &values);
+
+// Read an accessor of integer scalars. Return false if it cannot be read.
+bool readAccessorAsIndices(const tinygltf::Model &model, int accessorIdx,
+    std::vector<uint32_t> &indices);
+
+bool readPrimitivePositions(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, std::vector<glm::vec3> &positions);
+
+// Fill indices with a triangle list (strips and fans are converted, non
+// indexed primitives get generated indices). Return false for points and
+// lines.
+bool readPrimitiveTriangles(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, std::vector<uint32_t> &indices);
+
+// Local space bounds of a primitive, from the POSITION accessor min/max when
+// available
+AABB computePrimitiveBounds(
+    const tinygltf::Model &model, const tinygltf::Primitive &primitive);
+
+// Local transforms of the instances of a node with the EXT_mesh_gpu_instancing
+// extension (applied before the node transform). Return false if the node
+// does not use the extension.
+bool readMeshGpuInstances(const tinygltf::Model &model,
+    const tinygltf::Node &node, std::vector<glm::mat4> &instanceMatrices);
+
+// Append data to a buffer of the model (4-byte aligned) and create a buffer
+// view on it. Return the index of the buffer view.
+int appendBufferView(tinygltf::Model &model, int bufferIdx, const void *data,
+    size_t size, size_t byteStride, int target);
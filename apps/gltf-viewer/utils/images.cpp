@@ -1,78 +1,307 @@
 #include "images.hpp"
 
+#include <algorithm>
 #include <cassert>
-#include <glad/glad.h>
 #include <iostream>
 
-void renderToImage(size_t width, size_t height, size_t numComponents,
-    unsigned char *outPixels, std::function<void()> drawScene)
+// Supersampling passes are added to an accumulation texture with their weight,
+// by a fullscreen triangle generated from gl_VertexID
+static const char *const ACCUMULATE_VERTEX_SHADER = R"(#version 330
+void main()
+{
+    gl_Position = vec4(2 * vec2((gl_VertexID << 1) & 2, gl_VertexID & 2) - 1, 0, 1);
+}
+)";
+
+static const char *const ACCUMULATE_FRAGMENT_SHADER = R"(#version 330
+uniform sampler2D uPass;
+uniform float uWeight;
+out vec4 fColor;
+void main()
+{
+    fColor = uWeight * texelFetch(uPass, ivec2(gl_FragCoord.xy), 0);
+}
+)";
+
+// Texture storage for a render target, multisampled when samples > 1
+static GLuint createRenderTexture(
+    GLenum format, GLsizei width, GLsizei height, GLsizei samples)
+{
+  GLuint texture = 0;
+  glGenTextures(1, &texture);
+  if (samples > 1) {
+    glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, texture);
+    glTexStorage2DMultisample(
+        GL_TEXTURE_2D_MULTISAMPLE, samples, format, width, height, GL_TRUE);
+    glBindTexture(GL_TEXTURE_2D_MULTISAMPLE, 0);
+  } else {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, format, width, height);
+  }
+  return texture;
+}
+
+// Framebuffer with a color and an optional depth attachment, left bound to
+// GL_DRAW_FRAMEBUFFER
+static GLuint createFramebuffer(GLuint colorTexture, GLuint depthTexture)
+{
+  GLuint framebufferObject = 0;
+  glGenFramebuffers(1, &framebufferObject);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebufferObject);
+  glFramebufferTexture(
+      GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, colorTexture, 0);
+  if (depthTexture) {
+    glFramebufferTexture(
+        GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0);
+  }
+  GLenum drawBuffers[1] = {GL_COLOR_ATTACHMENT0};
+  glDrawBuffers(1, drawBuffers);
+
+  const auto framebufferStatus = glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER);
+  assert(framebufferStatus == GL_FRAMEBUFFER_COMPLETE);
+  (void)framebufferStatus;
+  return framebufferObject;
+}
+
+ImageRenderer::ImageRenderer(size_t width, size_t height,
+    size_t numComponents, const RenderToImageOptions &options,
+    size_t readbackBufferCount) :
+    m_width(GLsizei(width)),
+    m_height(GLsizei(height)),
+    m_numComponents(numComponents),
+    m_readbacks(std::max(readbackBufferCount, size_t(1)))
 {
   GLint previousTextureObject = 0;
   GLint previousFramebufferObject = 0;
-
-  // Save previous GL state that we will change in order to put it back after
+  GLint previousPixelPackBuffer = 0;
   glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTextureObject);
   glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFramebufferObject);
+  glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previousPixelPackBuffer);
 
-  GLuint textureObject = 0;
-
-  glGenTextures(1, &textureObject);
+  GLint maxSamples = 1;
+  glGetIntegerv(GL_MAX_SAMPLES, &maxSamples);
+  m_samples = std::clamp(options.samples, 1, int(maxSamples));
+  m_supersampling = std::max(options.supersampling, 1);
 
-  glBindTexture(GL_TEXTURE_2D, textureObject);
-
-  // Lets avoid warnings
-  const auto w = GLsizei(width);
-  const auto h = GLsizei(height);
+  // The scene is drawn in a multisampled target resolved with a blit in a
+  // single sample one
+  m_sceneTextures[0] =
+      createRenderTexture(GL_RGBA8, m_width, m_height, m_samples);
+  m_sceneTextures[1] =
+      createRenderTexture(GL_DEPTH_COMPONENT32F, m_width, m_height, m_samples);
+  m_sceneFramebuffer = createFramebuffer(m_sceneTextures[0], m_sceneTextures[1]);
+  if (m_samples > 1) {
+    m_resolveTexture = createRenderTexture(GL_RGBA8, m_width, m_height, 1);
+    m_resolveFramebuffer = createFramebuffer(m_resolveTexture, 0);
+  }
+  if (m_supersampling > 1) {
+    // Float, so that the small weights of the passes are not quantized
+    m_accumulationTexture =
+        createRenderTexture(GL_RGBA32F, m_width, m_height, 1);
+    m_accumulationFramebuffer = createFramebuffer(m_accumulationTexture, 0);
+    m_accumulationProgram =
+        buildProgram(ACCUMULATE_VERTEX_SHADER, ACCUMULATE_FRAGMENT_SHADER);
+    glGenVertexArrays(1, &m_accumulationVao);
+  }
+  m_readbackTexture = createRenderTexture(GL_RGBA8, m_width, m_height, 1);
+  m_readbackFramebuffer = createFramebuffer(m_readbackTexture, 0);
 
-  // if we want better quality, we can use multisampling, but for testing
-  // purpose it is useless todo replace with glTexStorage2DMultisample (in that
-  // case need to todo glBlitFramebuffer in another one in order to be able to
-  // glGetTexImage)
-  // https://stackoverflow.com/questions/14019910/how-does-glteximage2dmultisample-work
-  glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA32F, w, h);
+  const auto imageSize = GLsizeiptr(m_width) * m_height * m_numComponents;
+  for (auto &readback : m_readbacks) {
+    glGenBuffers(1, &readback.buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, imageSize, nullptr, GL_STREAM_READ);
+  }
 
-  GLuint depthTexture;
-  glGenTextures(1, &depthTexture);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, previousPixelPackBuffer);
+  glBindTexture(GL_TEXTURE_2D, previousTextureObject);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previousFramebufferObject);
+}
 
-  glBindTexture(GL_TEXTURE_2D, depthTexture);
+ImageRenderer::~ImageRenderer()
+{
+  // Pending images are dropped, finish() must be called to get them
+  for (auto &readback : m_readbacks) {
+    if (readback.fence) {
+      glDeleteSync(readback.fence);
+    }
+    glDeleteBuffers(1, &readback.buffer);
+  }
+  const GLuint framebuffers[] = {m_sceneFramebuffer, m_resolveFramebuffer,
+      m_accumulationFramebuffer, m_readbackFramebuffer};
+  glDeleteFramebuffers(4, framebuffers);
+  const GLuint textures[] = {m_sceneTextures[0], m_sceneTextures[1],
+      m_resolveTexture, m_accumulationTexture, m_readbackTexture};
+  glDeleteTextures(5, textures);
+  glDeleteVertexArrays(1, &m_accumulationVao);
+}
 
-  glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, w, h);
+void ImageRenderer::render(
+    const std::function<void(const glm::vec2 &)> &drawScene,
+    ImageCallback onImage)
+{
+  // Make room for the new image, in rendering order
+  poll();
+  if (m_pendingCount == m_readbacks.size()) {
+    completeOldest(true);
+  }
 
-  glBindTexture(GL_TEXTURE_2D, previousTextureObject);
+  GLint previousTextureObject = 0;
+  GLint previousFramebufferObject = 0;
+  GLint previousReadFramebufferObject = 0;
+  GLint previousPixelPackBuffer = 0;
+  GLint previousPackAlignment = 4;
 
-  GLuint framebufferObject = 0;
-  glGenFramebuffers(1, &framebufferObject);
-  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebufferObject);
+  // Save previous GL state that we will change in order to put it back after
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &previousTextureObject);
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFramebufferObject);
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &previousReadFramebufferObject);
+  glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previousPixelPackBuffer);
+  glGetIntegerv(GL_PACK_ALIGNMENT, &previousPackAlignment);
 
-  glFramebufferTexture(
-      GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, textureObject, 0);
-  glFramebufferTexture(
-      GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0);
+  const auto w = m_width;
+  const auto h = m_height;
+  if (m_accumulationFramebuffer) {
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_accumulationFramebuffer);
+    const float clearColor[4] = {0.f, 0.f, 0.f, 0.f};
+    glClearBufferfv(GL_COLOR, 0, clearColor);
+  }
+  const GLuint resolveFramebuffer =
+      m_resolveFramebuffer ? m_resolveFramebuffer : m_sceneFramebuffer;
+  const GLuint resolveTexture =
+      m_resolveTexture ? m_resolveTexture : m_sceneTextures[0];
 
-  GLenum drawBuffers[1] = {GL_COLOR_ATTACHMENT0};
-  glDrawBuffers(1, drawBuffers);
+  for (int passIdx = 0; passIdx < m_supersampling * m_supersampling;
+       ++passIdx) {
+    const glm::vec2 pixelOffset(
+        (passIdx % m_supersampling + 0.5f) / m_supersampling - 0.5f,
+        (passIdx / m_supersampling + 0.5f) / m_supersampling - 0.5f);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_sceneFramebuffer);
+    drawScene(pixelOffset);
 
-  const auto framebufferStatus = glCheckFramebufferStatus(GL_DRAW_FRAMEBUFFER);
-  assert(framebufferStatus == GL_FRAMEBUFFER_COMPLETE);
+    GLint currentlyBoundFBO = 0;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &currentlyBoundFBO);
+    if (GLuint(currentlyBoundFBO) != m_sceneFramebuffer) {
+      // Display a warning on clog
+      // It may not be an error because the drawScene() function might have
+      // render to the framebuffer but unbound it after.
+      std::clog
+          << "Warning: ImageRenderer - GL_DRAW_FRAMEBUFFER_BINDING has "
+             "changed during drawScene. It might lead to unexpected behavior."
+          << std::endl;
+    }
 
-  drawScene();
-
-  GLint currentlyBoundFBO = 0;
-  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &currentlyBoundFBO);
-  if (currentlyBoundFBO != framebufferObject) {
-    // Display a warning on clog
-    // It may not be an error because the drawScene() function might have render
-    // to the framebuffer but unbound it after.
-    std::clog
-        << "Warning: renderToImage - GL_DRAW_FRAMEBUFFER_BINDING has "
-           "changed during drawScene. It might lead to unexpected behavior."
-        << std::endl;
+    if (m_resolveFramebuffer) {
+      glBindFramebuffer(GL_READ_FRAMEBUFFER, m_sceneFramebuffer);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_resolveFramebuffer);
+      glBlitFramebuffer(
+          0, 0, w, h, 0, 0, w, h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+    if (m_accumulationFramebuffer) {
+      GLint previousViewport[4];
+      glGetIntegerv(GL_VIEWPORT, previousViewport);
+      const GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+      const GLboolean blend = glIsEnabled(GL_BLEND);
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_accumulationFramebuffer);
+      glViewport(0, 0, w, h);
+      glDisable(GL_DEPTH_TEST);
+      glEnable(GL_BLEND);
+      glBlendFunc(GL_ONE, GL_ONE);
+      m_accumulationProgram.use();
+      glUniform1i(m_accumulationProgram.getUniformLocation("uPass"), 0);
+      glUniform1f(m_accumulationProgram.getUniformLocation("uWeight"),
+          1.f / float(m_supersampling * m_supersampling));
+      glActiveTexture(GL_TEXTURE0);
+      glBindTexture(GL_TEXTURE_2D, resolveTexture);
+      glBindVertexArray(m_accumulationVao);
+      glDrawArrays(GL_TRIANGLES, 0, 3);
+      glBindVertexArray(0);
+      glUseProgram(0);
+      glBindTexture(GL_TEXTURE_2D, previousTextureObject);
+      if (!blend) {
+        glDisable(GL_BLEND);
+      }
+      if (depthTest) {
+        glEnable(GL_DEPTH_TEST);
+      }
+      glViewport(previousViewport[0], previousViewport[1],
+          previousViewport[2], previousViewport[3]);
+    }
   }
 
-  glBindTexture(GL_TEXTURE_2D, textureObject);
-  glGetTexImage(GL_TEXTURE_2D, 0, numComponents == 3 ? GL_RGB : GL_RGBA,
-      GL_UNSIGNED_BYTE, outPixels);
+  // The copy to the RGBA8 readback target flips the image, so that its rows
+  // are read top first and no CPU pass is needed. Multisampled blits cannot
+  // flip, which is why it is done after the resolve.
+  glBindFramebuffer(GL_READ_FRAMEBUFFER,
+      m_accumulationFramebuffer ? m_accumulationFramebuffer
+                                : resolveFramebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_readbackFramebuffer);
+  glBlitFramebuffer(0, 0, w, h, 0, h, w, 0, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+  // Asynchronous read in the next pixel buffer of the ring, RGB rows are
+  // packed without padding
+  auto &readback =
+      m_readbacks[(m_oldestReadback + m_pendingCount) % m_readbacks.size()];
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_readbackFramebuffer);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, w, h, m_numComponents == 3 ? GL_RGB : GL_RGBA,
+      GL_UNSIGNED_BYTE, nullptr);
+  readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  readback.onImage = std::move(onImage);
+  ++m_pendingCount;
 
+  glPixelStorei(GL_PACK_ALIGNMENT, previousPackAlignment);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, previousPixelPackBuffer);
   glBindTexture(GL_TEXTURE_2D, previousTextureObject);
   glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previousFramebufferObject);
-}
\ No newline at end of file
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, previousReadFramebufferObject);
+}
+
+void ImageRenderer::poll()
+{
+  while (m_pendingCount && completeOldest(false)) {
+  }
+}
+
+void ImageRenderer::finish()
+{
+  while (m_pendingCount) {
+    completeOldest(true);
+  }
+}
+
+bool ImageRenderer::completeOldest(bool wait)
+{
+  auto &readback = m_readbacks[m_oldestReadback];
+  // The first wait flushes the commands, so that the fence is signaled
+  GLenum status = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+      wait ? 1000000000 : 0);
+  while (wait && status == GL_TIMEOUT_EXPIRED) {
+    status = glClientWaitSync(readback.fence, 0, 1000000000);
+  }
+  if (status == GL_TIMEOUT_EXPIRED) {
+    return false;
+  }
+  glDeleteSync(readback.fence);
+  readback.fence = nullptr;
+
+  GLint previousPixelPackBuffer = 0;
+  glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &previousPixelPackBuffer);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+  const auto imageSize = GLsizeiptr(m_width) * m_height * m_numComponents;
+  const auto pixels = (const unsigned char *)glMapBufferRange(
+      GL_PIXEL_PACK_BUFFER, 0, imageSize, GL_MAP_READ_BIT);
+  if (pixels) {
+    readback.onImage(pixels);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  } else {
+    std::cerr << "Unable to map the pixels of a rendered image" << std::endl;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, previousPixelPackBuffer);
+
+  readback.onImage = nullptr;
+  m_oldestReadback = (m_oldestReadback + 1) % m_readbacks.size();
+  --m_pendingCount;
+  return true;
+}
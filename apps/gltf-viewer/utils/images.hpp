@@ -1,30 +1,102 @@
 #pragma once
 
+#include "shaders.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
 #include <functional>
+#include <vector>
 
-template <typename ComponentType>
-void flipImageYAxis(
-    size_t width, size_t height, size_t numComponent, ComponentType *pixels)
+// Antialiasing of ImageRenderer. Both are resolved on the GPU, only the final
+// image is read back.
+struct RenderToImageOptions
 {
-  auto *pFirstLine = pixels;
-  auto *pLastLine = pixels + (height - 1) * width * numComponent;
-
-  while (pFirstLine < pLastLine) {
-    for (size_t x = 0; x < width * numComponent; ++x)
-      std::swap(pFirstLine[x], pLastLine[x]);
-    pFirstLine += width * numComponent;
-    pLastLine -= width * numComponent;
-  }
-}
-
-void renderToImage(size_t width, size_t height, size_t numComponents,
-    unsigned char *outPixels, std::function<void()> drawScene);
-// Setup GL state in order to render in texture, call drawScene() then get the
-// texture from the GPU and store it on outPixels[0 : width * height *
-// numComponent]. Then restore the previous GL state.
-//
-// For this to work, drawScene must render on the currently bound
-// GL_DRAW_FRAMEBUFFER.
-// It means that if drawScene change GL_DRAW_FRAMEBUFFER, in must restore it
-// before doing final rendering (for example for deferred rendering,
-// GL_DRAW_FRAMEBUFFER must be restored before the shading pass).
\ No newline at end of file
+  // Samples per pixel of the render target, resolved with a blit
+  int samples = 1;
+  // The scene is drawn supersampling^2 times, offset by sub-pixel amounts on a
+  // regular grid, and the passes are averaged: the same samples as rendering an
+  // image supersampling times larger, without its memory
+  int supersampling = 1;
+};
+
+// Renders sequences of images of the same size. Its render targets are created
+// once and reused by every image. Pixels are read back asynchronously through
+// a ring of pixel buffer objects guarded by fences, so that the GPU renders
+// the next images while the previous ones are transferred.
+class ImageRenderer
+{
+public:
+  // Pixels of an image, top row first, numComponents bytes per pixel without
+  // row padding. They are only valid during the call.
+  using ImageCallback = std::function<void(const unsigned char *pixels)>;
+
+  ImageRenderer(size_t width, size_t height, size_t numComponents,
+      const RenderToImageOptions &options = RenderToImageOptions{},
+      size_t readbackBufferCount = 3);
+
+  ~ImageRenderer();
+
+  ImageRenderer(const ImageRenderer &) = delete;
+
+  ImageRenderer &operator=(const ImageRenderer &) = delete;
+
+  // Setup GL state in order to render in texture, call drawScene(pixelOffset)
+  // for each supersampling pass and start the readback of the image, then
+  // restore the previous GL state. onImage is called by a later call to
+  // render(), poll() or finish(). When all readback buffers are in use, the
+  // oldest image is waited for.
+  //
+  // drawScene must offset its projection by pixelOffset, in pixels in
+  // [-0.5, 0.5], and render on the currently bound GL_DRAW_FRAMEBUFFER.
+  // It means that if drawScene change GL_DRAW_FRAMEBUFFER, in must restore it
+  // before doing final rendering (for example for deferred rendering,
+  // GL_DRAW_FRAMEBUFFER must be restored before the shading pass).
+  void render(const std::function<void(const glm::vec2 &)> &drawScene,
+      ImageCallback onImage);
+
+  // Call the callbacks of the images already read back, in rendering order,
+  // without waiting
+  void poll();
+
+  // Wait for all pending images
+  void finish();
+
+  size_t pendingCount() const { return m_pendingCount; }
+
+private:
+  struct Readback
+  {
+    GLuint buffer = 0; // Pixel buffer object
+    GLsync fence = nullptr;
+    ImageCallback onImage;
+  };
+
+  // Return false if the oldest readback is not done and wait is false
+  bool completeOldest(bool wait);
+
+  GLsizei m_width;
+  GLsizei m_height;
+  size_t m_numComponents;
+  GLsizei m_samples;
+  int m_supersampling;
+
+  // Scene color and depth, multisampled with MSAA
+  GLuint m_sceneFramebuffer = 0;
+  GLuint m_sceneTextures[2] = {};
+  // Single sample resolve of the scene, with MSAA
+  GLuint m_resolveFramebuffer = 0;
+  GLuint m_resolveTexture = 0;
+  // Float sum of the supersampling passes
+  GLuint m_accumulationFramebuffer = 0;
+  GLuint m_accumulationTexture = 0;
+  GLuint m_accumulationVao = 0;
+  GLProgram m_accumulationProgram;
+  // RGBA8 image read back, upside down so that rows are read top first
+  GLuint m_readbackFramebuffer = 0;
+  GLuint m_readbackTexture = 0;
+
+  std::vector<Readback> m_readbacks; // Ring, used in rendering order
+  size_t m_oldestReadback = 0;
+  size_t m_pendingCount = 0;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Records read from GL_DRAW_INDIRECT_BUFFER by glMultiDrawElementsIndirect and
+// glMultiDrawArraysIndirect, laid out as specified by OpenGL 4.3
+
+struct DrawElementsIndirectCommand
+{
+  uint32_t count;
+  uint32_t instanceCount;
+  uint32_t firstIndex; // In indices, not bytes
+  int32_t baseVertex;
+  uint32_t baseInstance;
+};
+
+static_assert(sizeof(DrawElementsIndirectCommand) == 20, "GL layout mismatch");
+
+struct DrawArraysIndirectCommand
+{
+  uint32_t count;
+  uint32_t instanceCount;
+  uint32_t first;
+  uint32_t baseInstance;
+};
+
+static_assert(sizeof(DrawArraysIndirectCommand) == 16, "GL layout mismatch");
@@ -0,0 +1,210 @@
+#include "lights.hpp"
+
+#include "gltf.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+// Radiance under which a light without range is cut
+static const float LIGHT_MIN_INTENSITY = 1e-3f;
+
+std::vector<PunctualLight> readPunctualLights(const tinygltf::Model &model)
+{
+  std::vector<PunctualLight> lights;
+  visitScene(model, [&](int nodeIdx, const glm::mat4 &modelMatrix) {
+    const auto &node = model.nodes[nodeIdx];
+    const auto extensionIt = node.extensions.find("KHR_lights_punctual");
+    if (extensionIt == end(node.extensions) ||
+        !extensionIt->second.Has("light")) {
+      return;
+    }
+    const auto &lightValue = extensionIt->second.Get("light");
+    if (!lightValue.IsNumber()) {
+      return;
+    }
+    const int lightIdx = int(lightValue.GetNumberAsInt());
+    if (lightIdx < 0 || size_t(lightIdx) >= model.lights.size()) {
+      return;
+    }
+    const auto &gltfLight = model.lights[lightIdx];
+
+    PunctualLight light;
+    if (gltfLight.type == "directional") {
+      light.type = LIGHT_TYPE_DIRECTIONAL;
+    } else if (gltfLight.type == "point") {
+      light.type = LIGHT_TYPE_POINT;
+    } else if (gltfLight.type == "spot") {
+      light.type = LIGHT_TYPE_SPOT;
+    } else {
+      return;
+    }
+    light.nodeIdx = nodeIdx;
+    light.position = glm::vec3(modelMatrix[3]);
+    light.direction =
+        glm::normalize(glm::vec3(modelMatrix * glm::vec4(0, 0, -1, 0)));
+    light.color = glm::vec3(1);
+    if (gltfLight.color.size() >= 3) {
+      light.color = glm::vec3(float(gltfLight.color[0]),
+          float(gltfLight.color[1]), float(gltfLight.color[2]));
+    }
+    light.color *= float(gltfLight.intensity);
+    light.range = float(gltfLight.range);
+    if (light.range <= 0.f) {
+      const float maxRadiance =
+          std::max(light.color.r, std::max(light.color.g, light.color.b));
+      light.range = std::sqrt(maxRadiance / LIGHT_MIN_INTENSITY);
+    }
+    light.innerConeAngle = float(gltfLight.spot.innerConeAngle);
+    light.outerConeAngle = float(gltfLight.spot.outerConeAngle);
+    lights.push_back(light);
+  });
+
+  std::stable_partition(begin(lights), end(lights),
+      [](const PunctualLight &light) {
+        return light.type == LIGHT_TYPE_DIRECTIONAL;
+      });
+  return lights;
+}
+
+void updatePunctualLights(
+    const SceneTransforms &transforms, std::vector<PunctualLight> &lights)
+{
+  for (auto &light : lights) {
+    if (!transforms.isUpdated(light.nodeIdx)) {
+      continue;
+    }
+    const glm::mat4 &modelMatrix = transforms.worldMatrices()[light.nodeIdx];
+    light.position = glm::vec3(modelMatrix[3]);
+    light.direction =
+        glm::normalize(glm::vec3(modelMatrix * glm::vec4(0, 0, -1, 0)));
+  }
+}
+
+void packPunctualLights(const std::vector<PunctualLight> &lights,
+    const glm::mat4 &viewMatrix, std::vector<GPUPunctualLight> &gpuLights)
+{
+  gpuLights.resize(lights.size());
+  for (size_t i = 0; i < lights.size(); ++i) {
+    const auto &light = lights[i];
+    auto &gpuLight = gpuLights[i];
+    gpuLight.position = glm::vec3(viewMatrix * glm::vec4(light.position, 1));
+    gpuLight.range = light.range;
+    gpuLight.direction =
+        glm::normalize(glm::vec3(viewMatrix * glm::vec4(light.direction, 0)));
+    gpuLight.color = light.color;
+    // Point lights get a cone attenuation of 1 everywhere
+    gpuLight.spotScale = 0.f;
+    gpuLight.spotOffset = 1.f;
+    if (light.type == LIGHT_TYPE_SPOT) {
+      const float cosInner = std::cos(light.innerConeAngle);
+      const float cosOuter = std::cos(light.outerConeAngle);
+      gpuLight.spotScale = 1.f / std::max(cosInner - cosOuter, 1e-3f);
+      gpuLight.spotOffset = -cosOuter * gpuLight.spotScale;
+    }
+    gpuLight.type = light.type;
+  }
+}
+
+void buildLightClusters(const std::vector<GPUPunctualLight> &lights,
+    const glm::mat4 &projMatrix, float nearPlane, float farPlane,
+    LightClusterGrid &grid)
+{
+  const auto counts = grid.counts;
+  grid.nearPlane = nearPlane;
+  grid.farPlane = farPlane;
+  grid.clusters.assign(size_t(counts.x) * counts.y * counts.z, glm::uvec2(0));
+  grid.lightIndices.clear();
+
+  std::vector<uint32_t> localLights;
+  for (size_t i = 0; i < lights.size(); ++i) {
+    if (lights[i].type != LIGHT_TYPE_DIRECTIONAL) {
+      localLights.push_back(uint32_t(i));
+    }
+  }
+  if (localLights.empty()) {
+    return;
+  }
+
+  // View space half extents of the frustum at a depth of 1
+  const float tanHalfFovX = 1.f / projMatrix[0][0];
+  const float tanHalfFovY = 1.f / projMatrix[1][1];
+  const float depthRatio = farPlane / nearPlane;
+  const size_t clustersPerSlice = size_t(counts.x) * counts.y;
+
+  // Light indices of each slice, their offsets in the clusters are relative
+  // to the start of the slice until the slices are concatenated
+  std::vector<std::vector<uint32_t>> sliceLightIndices(counts.z);
+  parallelFor(counts.z, 1, [&](size_t beginSlice, size_t endSlice) {
+    std::vector<uint32_t> sliceLights;
+    std::vector<uint32_t> rowLights;
+    for (size_t z = beginSlice; z < endSlice; ++z) {
+      const float sliceNear =
+          nearPlane * std::pow(depthRatio, float(z) / counts.z);
+      const float sliceFar =
+          nearPlane * std::pow(depthRatio, float(z + 1) / counts.z);
+
+      sliceLights.clear();
+      for (const auto lightIdx : localLights) {
+        const auto &light = lights[lightIdx];
+        const float depth = -light.position.z;
+        if (depth + light.range >= sliceNear &&
+            depth - light.range <= sliceFar) {
+          sliceLights.push_back(lightIdx);
+        }
+      }
+
+      auto &indices = sliceLightIndices[z];
+      for (size_t y = 0; y < counts.y; ++y) {
+        const float ndcMinY = -1.f + 2.f * y / counts.y;
+        const float ndcMaxY = -1.f + 2.f * (y + 1) / counts.y;
+        const float minY = std::min(ndcMinY * sliceNear, ndcMinY * sliceFar) *
+                           tanHalfFovY;
+        const float maxY = std::max(ndcMaxY * sliceNear, ndcMaxY * sliceFar) *
+                           tanHalfFovY;
+
+        rowLights.clear();
+        for (const auto lightIdx : sliceLights) {
+          const auto &light = lights[lightIdx];
+          if (light.position.y + light.range >= minY &&
+              light.position.y - light.range <= maxY) {
+            rowLights.push_back(lightIdx);
+          }
+        }
+
+        for (size_t x = 0; x < counts.x; ++x) {
+          const float ndcMinX = -1.f + 2.f * x / counts.x;
+          const float ndcMaxX = -1.f + 2.f * (x + 1) / counts.x;
+          const glm::vec3 boxMin(
+              std::min(ndcMinX * sliceNear, ndcMinX * sliceFar) * tanHalfFovX,
+              minY, -sliceFar);
+          const glm::vec3 boxMax(
+              std::max(ndcMaxX * sliceNear, ndcMaxX * sliceFar) * tanHalfFovX,
+              maxY, -sliceNear);
+
+          const auto offset = uint32_t(indices.size());
+          for (const auto lightIdx : rowLights) {
+            const auto &light = lights[lightIdx];
+            const glm::vec3 closest =
+                glm::clamp(light.position, boxMin, boxMax);
+            const glm::vec3 delta = light.position - closest;
+            if (glm::dot(delta, delta) <= light.range * light.range) {
+              indices.push_back(lightIdx);
+            }
+          }
+          grid.clusters[z * clustersPerSlice + y * counts.x + x] =
+              glm::uvec2(offset, uint32_t(indices.size()) - offset);
+        }
+      }
+    }
+  });
+
+  for (size_t z = 0; z < counts.z; ++z) {
+    const auto sliceOffset = uint32_t(grid.lightIndices.size());
+    for (size_t i = 0; i < clustersPerSlice; ++i) {
+      grid.clusters[z * clustersPerSlice + i].x += sliceOffset;
+    }
+    grid.lightIndices.insert(end(grid.lightIndices),
+        begin(sliceLightIndices[z]), end(sliceLightIndices[z]));
+  }
+}
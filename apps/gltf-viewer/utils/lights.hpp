@@ -0,0 +1,93 @@
+#pragma once
+
+#include "gltf.hpp"
+
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Shader storage buffer binding points of the clustered lights, after
+// PRIMITIVE_FORMATS_BINDING
+const unsigned int PUNCTUAL_LIGHTS_BINDING = 3;
+const unsigned int LIGHT_CLUSTERS_BINDING = 4;
+const unsigned int LIGHT_CLUSTER_INDICES_BINDING = 5;
+
+// Light types, same values as the LIGHT_TYPE_* constants of the PBR shader
+const int32_t LIGHT_TYPE_DIRECTIONAL = 0;
+const int32_t LIGHT_TYPE_POINT = 1;
+const int32_t LIGHT_TYPE_SPOT = 2;
+
+// KHR_lights_punctual light instanced by a node, in world space
+struct PunctualLight
+{
+  int32_t type;
+  int nodeIdx;
+  glm::vec3 position;
+  glm::vec3 direction; // Normalized, the -Z axis of the node
+  glm::vec3 color; // Color multiplied by the intensity
+  float range; // Distance where the light is cut, never infinite
+  float innerConeAngle;
+  float outerConeAngle;
+};
+
+// Lights of all nodes of the default scene, directional lights first. Lights
+// without range are given the distance where their intensity becomes
+// negligible, so that every point and spot light can be clustered.
+std::vector<PunctualLight> readPunctualLights(const tinygltf::Model &model);
+
+// Move the lights of the nodes updated by the last transforms.update() to
+// the new world matrices of their nodes
+void updatePunctualLights(
+    const SceneTransforms &transforms, std::vector<PunctualLight> &lights);
+
+// C++ mirror of the std430 PunctualLight struct of the PBR fragment shader,
+// positions and directions are in view space. The spot cone attenuation is
+// clamp(dot(-L, direction) * spotScale + spotOffset, 0, 1)^2 as suggested by
+// the KHR_lights_punctual specification.
+struct GPUPunctualLight
+{
+  glm::vec3 position;
+  float range;
+  glm::vec3 direction;
+  float spotScale;
+  glm::vec3 color;
+  float spotOffset;
+  int32_t type;
+  int32_t pad[3];
+};
+
+static_assert(offsetof(GPUPunctualLight, range) == 12, "std430 mismatch");
+static_assert(offsetof(GPUPunctualLight, direction) == 16, "std430 mismatch");
+static_assert(offsetof(GPUPunctualLight, color) == 32, "std430 mismatch");
+static_assert(offsetof(GPUPunctualLight, spotOffset) == 44, "std430 mismatch");
+static_assert(offsetof(GPUPunctualLight, type) == 48, "std430 mismatch");
+static_assert(sizeof(GPUPunctualLight) == 64, "std430 mismatch");
+
+// Transform the lights to view space, in the same order
+void packPunctualLights(const std::vector<PunctualLight> &lights,
+    const glm::mat4 &viewMatrix, std::vector<GPUPunctualLight> &gpuLights);
+
+// Clusters of the view frustum: countX * countY screen tiles and countZ depth
+// slices distributed exponentially between the near and far planes, so that
+// clusters keep about the same proportions at all depths.
+struct LightClusterGrid
+{
+  glm::uvec3 counts = glm::uvec3(16, 9, 24);
+  float nearPlane = 0.f;
+  float farPlane = 0.f;
+  // (offset, count) of the lights of each cluster in lightIndices, clusters
+  // are ordered by slice, then row, then column
+  std::vector<glm::uvec2> clusters;
+  std::vector<uint32_t> lightIndices;
+};
+
+// Fill the light lists of the clusters with the point and spot lights whose
+// range sphere intersects the view space bounds of the cluster. Depth slices
+// are processed in parallel on the thread pool. projMatrix must be a
+// symmetric perspective projection; directional lights are not clustered.
+void buildLightClusters(const std::vector<GPUPunctualLight> &lights,
+    const glm::mat4 &projMatrix, float nearPlane, float farPlane,
+    LightClusterGrid &grid);
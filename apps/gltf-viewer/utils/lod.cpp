@@ -0,0 +1,416 @@
+#include "lod.hpp"
+
+#include "gltf.hpp"
+#include "meshopt.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+// Levels generated per primitive, including LOD 0
+static const size_t LOD_MAX_COUNT = 8;
+// Primitives with fewer triangles are not simplified further
+static const size_t LOD_MIN_TRIANGLE_COUNT = 32;
+// A level is dropped if it keeps more than this ratio of the previous triangles
+static const float LOD_MIN_REDUCTION = 0.8f;
+// Weight of normal and texture coordinate differences in the collapse cost
+static const float LOD_ATTRIBUTE_WEIGHT = 1e-3f;
+// Collapses moving a triangle normal by more than acos(0.25) are rejected
+static const float LOD_MAX_NORMAL_ROTATION_COS = 0.25f;
+
+namespace {
+
+// Area weighted sum of squared distances to planes (symmetric 4x4 matrix)
+struct Quadric
+{
+  double a00 = 0, a01 = 0, a02 = 0, a03 = 0;
+  double a11 = 0, a12 = 0, a13 = 0;
+  double a22 = 0, a23 = 0;
+  double a33 = 0;
+  double weight = 0;
+
+  void addPlane(const glm::dvec3 &n, double d, double w)
+  {
+    a00 += w * n.x * n.x;
+    a01 += w * n.x * n.y;
+    a02 += w * n.x * n.z;
+    a03 += w * n.x * d;
+    a11 += w * n.y * n.y;
+    a12 += w * n.y * n.z;
+    a13 += w * n.y * d;
+    a22 += w * n.z * n.z;
+    a23 += w * n.z * d;
+    a33 += w * d * d;
+    weight += w;
+  }
+
+  Quadric &operator+=(const Quadric &q)
+  {
+    a00 += q.a00;
+    a01 += q.a01;
+    a02 += q.a02;
+    a03 += q.a03;
+    a11 += q.a11;
+    a12 += q.a12;
+    a13 += q.a13;
+    a22 += q.a22;
+    a23 += q.a23;
+    a33 += q.a33;
+    weight += q.weight;
+    return *this;
+  }
+};
+
+// Mean squared distance of p to the planes of the two quadrics
+double evaluateQuadrics(const Quadric &q0, const Quadric &q1, const glm::vec3 &p)
+{
+  Quadric q = q0;
+  q += q1;
+  const double x = p.x, y = p.y, z = p.z;
+  const double error = q.a00 * x * x + q.a11 * y * y + q.a22 * z * z +
+                       2 * (q.a01 * x * y + q.a02 * x * z + q.a12 * y * z) +
+                       2 * (q.a03 * x + q.a13 * y + q.a23 * z) + q.a33;
+  return q.weight > 0 ? std::max(error / q.weight, 0.) : 0.;
+}
+
+struct Collapse
+{
+  uint32_t from;
+  uint32_t to;
+  float cost;
+};
+
+// Mark vertices that must not move: vertices of open or non-manifold edges,
+// and vertices sharing their position with other vertices
+std::vector<bool> findLockedVertices(const std::vector<uint32_t> &indices,
+    const std::vector<glm::vec3> &positions)
+{
+  const size_t vertexCount = positions.size();
+  std::vector<uint32_t> order(vertexCount);
+  std::iota(begin(order), end(order), 0);
+  const auto lessPosition = [&](uint32_t a, uint32_t b) {
+    const auto &pa = positions[a], &pb = positions[b];
+    return pa.x != pb.x ? pa.x < pb.x : pa.y != pb.y ? pa.y < pb.y : pa.z < pb.z;
+  };
+  std::sort(begin(order), end(order), lessPosition);
+
+  // Vertices are welded by position to find the topology of the surface
+  std::vector<bool> locked(vertexCount, false);
+  std::vector<uint32_t> weld(vertexCount);
+  for (size_t i = 0; i < vertexCount;) {
+    size_t end = i + 1;
+    while (end < vertexCount && positions[order[end]] == positions[order[i]]) {
+      ++end;
+    }
+    for (size_t j = i; j < end; ++j) {
+      weld[order[j]] = order[i];
+      locked[order[j]] = end - i > 1;
+    }
+    i = end;
+  }
+
+  std::vector<uint64_t> edges;
+  edges.reserve(indices.size());
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    for (size_t e = 0; e < 3; ++e) {
+      const uint32_t a = weld[indices[i + e]];
+      const uint32_t b = weld[indices[i + (e + 1) % 3]];
+      edges.push_back(uint64_t(std::min(a, b)) << 32 | std::max(a, b));
+    }
+  }
+  std::sort(begin(edges), end(edges));
+  std::vector<bool> lockedWeld(vertexCount, false);
+  for (size_t i = 0; i < edges.size();) {
+    size_t end = i + 1;
+    while (end < edges.size() && edges[end] == edges[i]) {
+      ++end;
+    }
+    if (end - i != 2) {
+      lockedWeld[edges[i] >> 32] = true;
+      lockedWeld[edges[i] & 0xFFFFFFFF] = true;
+    }
+    i = end;
+  }
+  for (size_t i = 0; i < vertexCount; ++i) {
+    locked[i] = locked[i] || lockedWeld[weld[i]];
+  }
+  return locked;
+}
+
+} // namespace
+
+float simplifyTriangles(std::vector<uint32_t> &indices,
+    const std::vector<glm::vec3> &positions,
+    const std::vector<float> &attributes, size_t attributeStride,
+    float attributeWeight, size_t targetIndexCount, float maxError)
+{
+  const size_t vertexCount = positions.size();
+  const std::vector<bool> locked = findLockedVertices(indices, positions);
+
+  glm::vec3 bboxMin(std::numeric_limits<float>::max());
+  glm::vec3 bboxMax(std::numeric_limits<float>::lowest());
+  for (const auto index : indices) {
+    bboxMin = glm::min(bboxMin, positions[index]);
+    bboxMax = glm::max(bboxMax, positions[index]);
+  }
+  const float extent = glm::length(bboxMax - bboxMin);
+  const float attributeScale = attributeWeight * extent * extent;
+
+  std::vector<Quadric> quadrics(vertexCount);
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    const glm::dvec3 p0 = positions[indices[i]];
+    const glm::dvec3 p1 = positions[indices[i + 1]];
+    const glm::dvec3 p2 = positions[indices[i + 2]];
+    const glm::dvec3 normal = glm::cross(p1 - p0, p2 - p0);
+    const double doubleArea = glm::length(normal);
+    if (doubleArea <= 0.) {
+      continue;
+    }
+    const glm::dvec3 n = normal / doubleArea;
+    for (size_t c = 0; c < 3; ++c) {
+      quadrics[indices[i + c]].addPlane(n, -glm::dot(n, p0), doubleArea);
+    }
+  }
+
+  const auto collapseCost = [&](uint32_t from, uint32_t to) {
+    double cost = evaluateQuadrics(quadrics[from], quadrics[to], positions[to]);
+    for (size_t k = 0; k < attributeStride; ++k) {
+      const float d = attributes[from * attributeStride + k] -
+                      attributes[to * attributeStride + k];
+      cost += attributeScale * d * d;
+    }
+    return float(cost);
+  };
+
+  // Triangle normal after moving vertex from to the position of vertex to
+  // must not flip nor rotate too much
+  std::vector<uint32_t> adjacencyOffsets, adjacency;
+  const auto flipsTriangles = [&](uint32_t from, uint32_t to) {
+    for (uint32_t t = adjacencyOffsets[from]; t < adjacencyOffsets[from + 1];
+         ++t) {
+      const uint32_t *triangle = &indices[adjacency[t] * 3];
+      if (triangle[0] == to || triangle[1] == to || triangle[2] == to) {
+        continue;
+      }
+      glm::vec3 p[3], q[3];
+      for (size_t c = 0; c < 3; ++c) {
+        p[c] = positions[triangle[c]];
+        q[c] = triangle[c] == from ? positions[to] : p[c];
+      }
+      const glm::vec3 n0 = glm::cross(p[1] - p[0], p[2] - p[0]);
+      const glm::vec3 n1 = glm::cross(q[1] - q[0], q[2] - q[0]);
+      if (glm::dot(n0, n1) <= LOD_MAX_NORMAL_ROTATION_COS *
+                                  std::sqrt(glm::dot(n0, n0) * glm::dot(n1, n1))) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  // Each pass collapses independent edges in order of increasing cost, then
+  // removes degenerate triangles
+  const double maxCost = double(maxError) * maxError;
+  double resultCost = 0.;
+  std::vector<Collapse> collapses;
+  std::vector<uint32_t> remap(vertexCount);
+  std::vector<bool> touched(vertexCount);
+  while (indices.size() > targetIndexCount) {
+    const size_t triangleCount = indices.size() / 3;
+    adjacencyOffsets.assign(vertexCount + 1, 0);
+    for (const auto index : indices) {
+      ++adjacencyOffsets[index + 1];
+    }
+    std::partial_sum(begin(adjacencyOffsets), end(adjacencyOffsets),
+        begin(adjacencyOffsets));
+    adjacency.resize(indices.size());
+    std::vector<uint32_t> fill(begin(adjacencyOffsets), end(adjacencyOffsets) - 1);
+    for (size_t i = 0; i < indices.size(); ++i) {
+      adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+    }
+
+    collapses.clear();
+    for (size_t i = 0; i < indices.size(); i += 3) {
+      for (size_t e = 0; e < 3; ++e) {
+        const uint32_t a = indices[i + e];
+        const uint32_t b = indices[i + (e + 1) % 3];
+        if (!locked[a]) {
+          collapses.push_back(Collapse{a, b, collapseCost(a, b)});
+        }
+        if (!locked[b]) {
+          collapses.push_back(Collapse{b, a, collapseCost(b, a)});
+        }
+      }
+    }
+    std::sort(begin(collapses), end(collapses),
+        [](const Collapse &a, const Collapse &b) { return a.cost < b.cost; });
+
+    std::iota(begin(remap), end(remap), 0);
+    std::fill(begin(touched), end(touched), false);
+    const size_t requiredRemovals = (indices.size() - targetIndexCount + 2) / 3;
+    size_t removedTriangles = 0;
+    size_t collapseCount = 0;
+    for (const auto &collapse : collapses) {
+      if (collapse.cost > maxCost || removedTriangles >= requiredRemovals) {
+        break;
+      }
+      if (touched[collapse.from] || touched[collapse.to] ||
+          flipsTriangles(collapse.from, collapse.to)) {
+        continue;
+      }
+      // Triangles around the moved vertex change: their vertices are not
+      // collapsed again in this pass so that the checks above stay valid
+      for (uint32_t t = adjacencyOffsets[collapse.from];
+           t < adjacencyOffsets[collapse.from + 1]; ++t) {
+        const uint32_t *triangle = &indices[adjacency[t] * 3];
+        for (size_t c = 0; c < 3; ++c) {
+          touched[triangle[c]] = true;
+        }
+        if (triangle[0] == collapse.to || triangle[1] == collapse.to ||
+            triangle[2] == collapse.to) {
+          ++removedTriangles;
+        }
+      }
+      remap[collapse.from] = collapse.to;
+      quadrics[collapse.to] += quadrics[collapse.from];
+      resultCost = std::max(resultCost, double(collapse.cost));
+      ++collapseCount;
+    }
+    if (!collapseCount) {
+      break;
+    }
+
+    size_t writeIdx = 0;
+    for (size_t i = 0; i < triangleCount; ++i) {
+      const uint32_t a = remap[indices[i * 3]];
+      const uint32_t b = remap[indices[i * 3 + 1]];
+      const uint32_t c = remap[indices[i * 3 + 2]];
+      if (a != b && b != c && c != a) {
+        indices[writeIdx++] = a;
+        indices[writeIdx++] = b;
+        indices[writeIdx++] = c;
+      }
+    }
+    indices.resize(writeIdx);
+  }
+  return float(std::sqrt(resultCost));
+}
+
+namespace {
+
+struct SimplifiedPrimitive
+{
+  std::vector<std::vector<uint32_t>> levels; // Index lists, LOD 0 included
+  std::vector<float> errors;
+};
+
+void simplifyPrimitive(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, SimplifiedPrimitive &result)
+{
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
+  if (!readPrimitivePositions(model, primitive, positions) ||
+      !readPrimitiveTriangles(model, primitive, indices) ||
+      indices.size() < 6 * LOD_MIN_TRIANGLE_COUNT) {
+    return;
+  }
+  for (const auto index : indices) {
+    if (index >= positions.size()) {
+      return;
+    }
+  }
+
+  // Normals and texture coordinates are interleaved for the attribute cost
+  std::vector<float> attributes;
+  size_t attributeStride = 0;
+  for (const char *name : {"NORMAL", "TEXCOORD_0"}) {
+    const auto it = primitive.attributes.find(name);
+    std::vector<float> values;
+    int componentCount = 0;
+    if (it == end(primitive.attributes) ||
+        !(componentCount = readAccessorAsFloats(model, it->second, values)) ||
+        values.size() != positions.size() * componentCount) {
+      continue;
+    }
+    std::vector<float> interleaved(
+        positions.size() * (attributeStride + componentCount));
+    for (size_t v = 0; v < positions.size(); ++v) {
+      float *dst = &interleaved[v * (attributeStride + componentCount)];
+      std::copy_n(attributes.data() + v * attributeStride, attributeStride, dst);
+      std::copy_n(values.data() + v * componentCount, componentCount,
+          dst + attributeStride);
+    }
+    attributes.swap(interleaved);
+    attributeStride += componentCount;
+  }
+
+  result.levels.push_back(indices);
+  result.errors.push_back(0.f);
+  float error = 0.f;
+  while (result.levels.size() < LOD_MAX_COUNT &&
+         indices.size() >= 6 * LOD_MIN_TRIANGLE_COUNT) {
+    const size_t previousCount = indices.size();
+    // Each level is simplified from the previous one, errors add up
+    error += simplifyTriangles(indices, positions, attributes, attributeStride,
+        LOD_ATTRIBUTE_WEIGHT, previousCount / 6 * 3,
+        std::numeric_limits<float>::max());
+    if (indices.size() > LOD_MIN_REDUCTION * previousCount) {
+      break;
+    }
+    std::vector<uint32_t> level = indices;
+    optimizeVertexCache(level, positions.size());
+    result.levels.push_back(std::move(level));
+    result.errors.push_back(error);
+  }
+  if (result.levels.size() < 2) {
+    result.levels.clear();
+    result.errors.clear();
+  }
+}
+
+} // namespace
+
+std::vector<PrimitiveLods> generateLods(tinygltf::Model &model)
+{
+  std::vector<tinygltf::Primitive *> primitives;
+  for (auto &mesh : model.meshes) {
+    for (auto &primitive : mesh.primitives) {
+      primitives.push_back(&primitive);
+    }
+  }
+  std::vector<SimplifiedPrimitive> results(primitives.size());
+  parallelFor(primitives.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      simplifyPrimitive(model, *primitives[i], results[i]);
+    }
+  });
+
+  std::vector<PrimitiveLods> lods(primitives.size());
+  const auto bufferIdx = int(model.buffers.size());
+  model.buffers.emplace_back();
+  for (size_t i = 0; i < primitives.size(); ++i) {
+    const auto &result = results[i];
+    for (const auto &level : result.levels) {
+      tinygltf::Accessor accessor;
+      accessor.type = TINYGLTF_TYPE_SCALAR;
+      accessor.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
+      accessor.count = level.size();
+      accessor.bufferView = appendBufferView(model, bufferIdx, level.data(),
+          level.size() * sizeof(uint32_t), 0,
+          TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
+      model.accessors.push_back(accessor);
+      lods[i].indexAccessors.push_back(int(model.accessors.size() - 1));
+    }
+    lods[i].errors = result.errors;
+    if (!lods[i].indexAccessors.empty()) {
+      primitives[i]->indices = lods[i].indexAccessors.front();
+      primitives[i]->mode = TINYGLTF_MODE_TRIANGLES;
+    }
+  }
+  // GL buffers cannot be empty
+  if (model.buffers.back().data.empty()) {
+    model.buffers.pop_back();
+  }
+  return lods;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Reduce the triangle count of a triangle list to targetIndexCount / 3 by
+// collapsing vertices onto their neighbors in order of quadric error (Garland
+// and Heckbert, "Surface Simplification Using Quadric Error Metrics"). Indices
+// are rewritten in place and only reference existing vertices, so the vertex
+// buffer is shared by all simplified versions. Vertices on open borders and
+// on attribute seams (several vertices at the same position) are never moved.
+// attributes holds attributeStride floats per vertex, the squared difference
+// of attributes is added to the collapse cost, scaled by attributeWeight and
+// the squared mesh extent. Collapses stop above maxError, the returned error
+// is the largest distance to the original surface estimated by the quadrics.
+float simplifyTriangles(std::vector<uint32_t> &indices,
+    const std::vector<glm::vec3> &positions,
+    const std::vector<float> &attributes, size_t attributeStride,
+    float attributeWeight, size_t targetIndexCount, float maxError);
+
+// Levels of detail of a primitive. LOD 0 is the primitive itself and each
+// level has about half the triangles of the previous one.
+struct PrimitiveLods
+{
+  std::vector<int> indexAccessors; // Unsigned int triangle lists
+  std::vector<float> errors; // Geometric error in local space, 0 for LOD 0
+};
+
+// Generate levels of detail for all triangle primitives of the model, one
+// entry per primitive ordered by mesh then primitive, primitives being
+// simplified in parallel on the thread pool. The index data of all levels of
+// a primitive is written to a new glTF buffer and the primitive is redirected
+// to its copy of LOD 0, so that the levels share the element buffer of the
+// primitive. Primitives that cannot be simplified get an empty entry.
+std::vector<PrimitiveLods> generateLods(tinygltf::Model &model);
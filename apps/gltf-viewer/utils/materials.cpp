@@ -0,0 +1,41 @@
+#include "materials.hpp"
+
+std::vector<GPUMaterial> buildMaterialTable(const tinygltf::Model &model)
+{
+  std::vector<GPUMaterial> table;
+  table.reserve(model.materials.size() + 1);
+  for (const auto &material : model.materials) {
+    const auto &pbr = material.pbrMetallicRoughness;
+    GPUMaterial entry = {};
+    entry.baseColorFactor =
+        glm::vec4(pbr.baseColorFactor[0], pbr.baseColorFactor[1],
+            pbr.baseColorFactor[2], pbr.baseColorFactor[3]);
+    entry.emissiveFactor = glm::vec3(material.emissiveFactor[0],
+        material.emissiveFactor[1], material.emissiveFactor[2]);
+    entry.metallicFactor = float(pbr.metallicFactor);
+    entry.roughnessFactor = float(pbr.roughnessFactor);
+    entry.occlusionStrength = material.occlusionTexture.index >= 0
+                                  ? float(material.occlusionTexture.strength)
+                                  : 0.f;
+    entry.baseColorTexture = pbr.baseColorTexture.index;
+    entry.metallicRoughnessTexture = pbr.metallicRoughnessTexture.index;
+    entry.emissiveTexture = material.emissiveTexture.index;
+    entry.occlusionTexture = material.occlusionTexture.index;
+    table.push_back(entry);
+  }
+
+  // Default material of the glTF specification
+  GPUMaterial defaultMaterial = {};
+  defaultMaterial.baseColorFactor = glm::vec4(1);
+  defaultMaterial.emissiveFactor = glm::vec3(0);
+  defaultMaterial.metallicFactor = 1.f;
+  defaultMaterial.roughnessFactor = 1.f;
+  defaultMaterial.occlusionStrength = 0.f;
+  defaultMaterial.baseColorTexture = -1;
+  defaultMaterial.metallicRoughnessTexture = -1;
+  defaultMaterial.emissiveTexture = -1;
+  defaultMaterial.occlusionTexture = -1;
+  table.push_back(defaultMaterial);
+
+  return table;
+}
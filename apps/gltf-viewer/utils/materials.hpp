@@ -0,0 +1,48 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Shader storage buffer binding point of the material table
+const unsigned int MATERIAL_TABLE_BINDING = 0;
+
+// C++ mirror of the std430 Material struct of the PBR fragment shader, one
+// entry per glTF material. Texture fields are glTF texture indices, -1 when
+// the material has no such texture.
+struct GPUMaterial
+{
+  glm::vec4 baseColorFactor;
+  glm::vec3 emissiveFactor;
+  float metallicFactor;
+  float roughnessFactor;
+  float occlusionStrength;
+  int32_t baseColorTexture;
+  int32_t metallicRoughnessTexture;
+  int32_t emissiveTexture;
+  int32_t occlusionTexture;
+  int32_t pad[2];
+};
+
+static_assert(offsetof(GPUMaterial, emissiveFactor) == 16, "std430 mismatch");
+static_assert(offsetof(GPUMaterial, metallicFactor) == 28, "std430 mismatch");
+static_assert(offsetof(GPUMaterial, roughnessFactor) == 32, "std430 mismatch");
+static_assert(offsetof(GPUMaterial, occlusionStrength) == 36, "std430 mismatch");
+static_assert(offsetof(GPUMaterial, baseColorTexture) == 40, "std430 mismatch");
+static_assert(offsetof(GPUMaterial, occlusionTexture) == 52, "std430 mismatch");
+static_assert(sizeof(GPUMaterial) == 64, "std430 mismatch");
+
+// Pack the factors and texture indices of all materials. An extra entry with
+// the default glTF material is appended for primitives without material, so
+// the table is indexed with getMaterialTableIndex().
+std::vector<GPUMaterial> buildMaterialTable(const tinygltf::Model &model);
+
+inline uint32_t getMaterialTableIndex(
+    const tinygltf::Model &model, int materialIndex)
+{
+  return materialIndex >= 0 ? uint32_t(materialIndex)
+                            : uint32_t(model.materials.size());
+}
@@ -0,0 +1,479 @@
+#include "meshopt.hpp"
+
+#include "gltf.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// Vertex score parameters of the Forsyth algorithm
+static const size_t FORSYTH_CACHE_SIZE = 32;
+static const float FORSYTH_CACHE_DECAY_POWER = 1.5f;
+static const float FORSYTH_LAST_TRIANGLE_SCORE = 0.75f;
+static const float FORSYTH_VALENCE_BOOST_SCALE = 2.f;
+static const float FORSYTH_VALENCE_BOOST_POWER = 0.5f;
+
+// Cache size used to find cluster boundaries for overdraw optimization
+static const size_t OVERDRAW_CACHE_SIZE = 16;
+
+// FIFO post-transform cache simulation, addTriangle() returns the number of
+// vertices transformed for the triangle
+class FIFOCacheSimulator
+{
+public:
+  FIFOCacheSimulator(size_t vertexCount, size_t cacheSize)
+      : m_pushTime(vertexCount, 0), m_cacheSize(cacheSize)
+  {
+  }
+
+  uint32_t addTriangle(const uint32_t *triangle)
+  {
+    uint32_t missCount = 0;
+    for (int i = 0; i < 3; ++i) {
+      auto &pushTime = m_pushTime[triangle[i]];
+      if (pushTime <= m_flushTime || m_time + 1 - pushTime > m_cacheSize) {
+        ++m_time;
+        pushTime = m_time;
+        ++missCount;
+      }
+    }
+    return missCount;
+  }
+
+  void flush() { m_flushTime = m_time; }
+
+private:
+  std::vector<size_t> m_pushTime;
+  size_t m_cacheSize;
+  size_t m_time = 0;
+  size_t m_flushTime = 0;
+};
+
+double computeACMR(const std::vector<uint32_t> &indices, size_t vertexCount,
+    size_t cacheSize)
+{
+  const size_t triangleCount = indices.size() / 3;
+  if (!triangleCount) {
+    return 0.;
+  }
+  FIFOCacheSimulator cache(vertexCount, cacheSize);
+  size_t missCount = 0;
+  for (size_t t = 0; t < triangleCount; ++t) {
+    missCount += cache.addTriangle(&indices[3 * t]);
+  }
+  return double(missCount) / triangleCount;
+}
+
+static float computeVertexScore(int cachePosition, uint32_t liveTriangleCount)
+{
+  // No triangle left, the vertex must never be chosen
+  if (!liveTriangleCount) {
+    return -1.f;
+  }
+  float score = 0.f;
+  if (cachePosition >= 0) {
+    // The last triangle vertices get a fixed score so that the algorithm
+    // doesn't favour strips
+    if (cachePosition < 3) {
+      score = FORSYTH_LAST_TRIANGLE_SCORE;
+    } else {
+      const float scale = 1.f / (FORSYTH_CACHE_SIZE - 3);
+      score = std::pow(1.f - (cachePosition - 3) * scale,
+          FORSYTH_CACHE_DECAY_POWER);
+    }
+  }
+  // Boost vertices with few triangles left, to finish them off
+  score += FORSYTH_VALENCE_BOOST_SCALE *
+           std::pow(float(liveTriangleCount), -FORSYTH_VALENCE_BOOST_POWER);
+  return score;
+}
+
+void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount)
+{
+  const size_t triangleCount = indices.size() / 3;
+  if (triangleCount < 2) {
+    return;
+  }
+
+  // Triangles adjacent to each vertex, live ones first in each range
+  std::vector<uint32_t> adjacencyOffsets(vertexCount + 1, 0);
+  for (const auto index : indices) {
+    ++adjacencyOffsets[index + 1];
+  }
+  for (size_t v = 0; v < vertexCount; ++v) {
+    adjacencyOffsets[v + 1] += adjacencyOffsets[v];
+  }
+  std::vector<uint32_t> liveTriangleCounts(vertexCount);
+  for (size_t v = 0; v < vertexCount; ++v) {
+    liveTriangleCounts[v] = adjacencyOffsets[v + 1] - adjacencyOffsets[v];
+  }
+  std::vector<uint32_t> adjacency(indices.size());
+  {
+    std::vector<uint32_t> fill(begin(adjacencyOffsets), end(adjacencyOffsets) - 1);
+    for (size_t i = 0; i < indices.size(); ++i) {
+      adjacency[fill[indices[i]]++] = uint32_t(i / 3);
+    }
+  }
+
+  std::vector<int> cachePositions(vertexCount, -1);
+  std::vector<float> vertexScores(vertexCount);
+  for (size_t v = 0; v < vertexCount; ++v) {
+    vertexScores[v] = computeVertexScore(-1, liveTriangleCounts[v]);
+  }
+  std::vector<float> triangleScores(triangleCount);
+  std::vector<bool> emitted(triangleCount, false);
+  uint32_t bestTriangle = 0;
+  for (size_t t = 0; t < triangleCount; ++t) {
+    triangleScores[t] = vertexScores[indices[3 * t]] +
+                        vertexScores[indices[3 * t + 1]] +
+                        vertexScores[indices[3 * t + 2]];
+    if (triangleScores[t] > triangleScores[bestTriangle]) {
+      bestTriangle = uint32_t(t);
+    }
+  }
+
+  std::vector<uint32_t> output;
+  output.reserve(indices.size());
+  std::vector<uint32_t> cache, newCache;
+  cache.reserve(FORSYTH_CACHE_SIZE + 3);
+  newCache.reserve(FORSYTH_CACHE_SIZE + 3);
+  size_t nextUnemittedTriangle = 0;
+
+  for (size_t emittedCount = 0; emittedCount < triangleCount; ++emittedCount) {
+    const auto *triangle = &indices[3 * bestTriangle];
+    output.insert(end(output), triangle, triangle + 3);
+    emitted[bestTriangle] = true;
+
+    // Remove the triangle from the live triangles of its vertices
+    for (int i = 0; i < 3; ++i) {
+      const auto v = triangle[i];
+      auto *first = &adjacency[adjacencyOffsets[v]];
+      auto *last = first + liveTriangleCounts[v] - 1;
+      std::swap(*std::find(first, last + 1, bestTriangle), *last);
+      --liveTriangleCounts[v];
+    }
+
+    // The triangle vertices move to the front of the LRU cache
+    newCache.assign(triangle, triangle + 3);
+    for (const auto v : cache) {
+      if (v != triangle[0] && v != triangle[1] && v != triangle[2]) {
+        newCache.push_back(v);
+      }
+    }
+    for (size_t i = 0; i < newCache.size(); ++i) {
+      const auto v = newCache[i];
+      cachePositions[v] = i < FORSYTH_CACHE_SIZE ? int(i) : -1;
+      vertexScores[v] = computeVertexScore(cachePositions[v], liveTriangleCounts[v]);
+    }
+
+    // Only triangles touching the cache changed their score
+    float bestScore = -1.f;
+    for (const auto v : newCache) {
+      for (uint32_t a = 0; a < liveTriangleCounts[v]; ++a) {
+        const auto t = adjacency[adjacencyOffsets[v] + a];
+        triangleScores[t] = vertexScores[indices[3 * t]] +
+                            vertexScores[indices[3 * t + 1]] +
+                            vertexScores[indices[3 * t + 2]];
+        if (triangleScores[t] > bestScore) {
+          bestScore = triangleScores[t];
+          bestTriangle = t;
+        }
+      }
+    }
+    newCache.resize(std::min(newCache.size(), FORSYTH_CACHE_SIZE));
+    std::swap(cache, newCache);
+
+    // Dead end: restart from the next triangle not emitted yet
+    if (bestScore < 0.f) {
+      while (nextUnemittedTriangle < triangleCount &&
+             emitted[nextUnemittedTriangle]) {
+        ++nextUnemittedTriangle;
+      }
+      bestTriangle = uint32_t(nextUnemittedTriangle);
+    }
+  }
+  indices.resize(output.size());
+  std::copy(begin(output), end(output), begin(indices));
+}
+
+void optimizeOverdraw(std::vector<uint32_t> &indices,
+    const std::vector<glm::vec3> &positions, float threshold)
+{
+  const size_t triangleCount = indices.size() / 3;
+  if (triangleCount < 2) {
+    return;
+  }
+
+  // Hard boundaries: triangles missing all their vertices in the cache start
+  // a new run, reordering runs does not change the ACMR
+  FIFOCacheSimulator cache(positions.size(), OVERDRAW_CACHE_SIZE);
+  std::vector<size_t> runStarts;
+  for (size_t t = 0; t < triangleCount; ++t) {
+    if (cache.addTriangle(&indices[3 * t]) == 3) {
+      runStarts.push_back(t);
+    }
+  }
+  runStarts.push_back(triangleCount);
+
+  // Soft boundaries: split runs into clusters as soon as the ACMR of the
+  // cluster is good enough compared to the one of its run
+  std::vector<size_t> clusterStarts;
+  for (size_t r = 0; r + 1 < runStarts.size(); ++r) {
+    FIFOCacheSimulator runCache(positions.size(), OVERDRAW_CACHE_SIZE);
+    uint32_t runMisses = 0;
+    for (size_t t = runStarts[r]; t < runStarts[r + 1]; ++t) {
+      runMisses += runCache.addTriangle(&indices[3 * t]);
+    }
+    const float clusterThreshold =
+        threshold * runMisses / float(runStarts[r + 1] - runStarts[r]);
+
+    FIFOCacheSimulator clusterCache(positions.size(), OVERDRAW_CACHE_SIZE);
+    clusterStarts.push_back(runStarts[r]);
+    uint32_t clusterMisses = 0;
+    for (size_t t = runStarts[r]; t < runStarts[r + 1]; ++t) {
+      clusterMisses += clusterCache.addTriangle(&indices[3 * t]);
+      const auto clusterSize = t + 1 - clusterStarts.back();
+      if (t + 1 < runStarts[r + 1] &&
+          clusterMisses <= clusterThreshold * clusterSize) {
+        clusterStarts.push_back(t + 1);
+        clusterCache.flush();
+        clusterMisses = 0;
+      }
+    }
+  }
+  clusterStarts.push_back(triangleCount);
+
+  // Sort key of a cluster: dot product of its area weighted normal with the
+  // vector from the mesh centroid to the cluster centroid
+  glm::vec3 meshCentroid(0);
+  float meshArea = 0.f;
+  const size_t clusterCount = clusterStarts.size() - 1;
+  std::vector<glm::vec3> clusterCentroids(clusterCount, glm::vec3(0));
+  std::vector<glm::vec3> clusterNormals(clusterCount, glm::vec3(0));
+  std::vector<float> clusterAreas(clusterCount, 0.f);
+  for (size_t c = 0; c < clusterCount; ++c) {
+    for (size_t t = clusterStarts[c]; t < clusterStarts[c + 1]; ++t) {
+      const auto &p0 = positions[indices[3 * t]];
+      const auto &p1 = positions[indices[3 * t + 1]];
+      const auto &p2 = positions[indices[3 * t + 2]];
+      const auto normal = glm::cross(p1 - p0, p2 - p0);
+      const float area = glm::length(normal);
+      clusterCentroids[c] += (p0 + p1 + p2) * (area / 3.f);
+      clusterNormals[c] += normal;
+      clusterAreas[c] += area;
+    }
+    meshCentroid += clusterCentroids[c];
+    meshArea += clusterAreas[c];
+  }
+  if (meshArea > 0.f) {
+    meshCentroid /= meshArea;
+  }
+  std::vector<float> sortKeys(clusterCount, 0.f);
+  for (size_t c = 0; c < clusterCount; ++c) {
+    if (clusterAreas[c] > 0.f) {
+      const auto centroid = clusterCentroids[c] / clusterAreas[c];
+      const float normalLength = glm::length(clusterNormals[c]);
+      if (normalLength > 0.f) {
+        sortKeys[c] = glm::dot(
+            centroid - meshCentroid, clusterNormals[c] / normalLength);
+      }
+    }
+  }
+
+  std::vector<uint32_t> clusterOrder(clusterCount);
+  for (uint32_t c = 0; c < clusterCount; ++c) {
+    clusterOrder[c] = c;
+  }
+  std::stable_sort(begin(clusterOrder), end(clusterOrder),
+      [&](uint32_t lhs, uint32_t rhs) { return sortKeys[lhs] > sortKeys[rhs]; });
+
+  std::vector<uint32_t> output;
+  output.reserve(indices.size());
+  for (const auto c : clusterOrder) {
+    output.insert(end(output), begin(indices) + 3 * clusterStarts[c],
+        begin(indices) + 3 * clusterStarts[c + 1]);
+  }
+  indices.resize(output.size());
+  std::copy(begin(output), end(output), begin(indices));
+}
+
+size_t optimizeVertexFetch(std::vector<uint32_t> &indices, size_t vertexCount,
+    std::vector<uint32_t> &remap)
+{
+  remap.assign(vertexCount, ~0u);
+  uint32_t nextVertex = 0;
+  for (auto &index : indices) {
+    if (remap[index] == ~0u) {
+      remap[index] = nextVertex++;
+    }
+    index = remap[index];
+  }
+  return nextVertex;
+}
+
+namespace {
+
+struct OptimizedPrimitive
+{
+  bool optimized = false;
+  std::vector<uint32_t> indices;
+  std::vector<uint32_t> remap;
+  size_t vertexCount = 0;
+  double acmrBefore = 0.;
+  double acmrAfter = 0.;
+};
+
+bool hasPlainAccessor(const tinygltf::Model &model, int accessorIdx)
+{
+  return accessorIdx >= 0 && model.accessors[accessorIdx].bufferView >= 0 &&
+         !model.accessors[accessorIdx].sparse.isSparse;
+}
+
+void optimizePrimitive(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, float overdrawThreshold,
+    OptimizedPrimitive &result)
+{
+  const auto positionIt = primitive.attributes.find("POSITION");
+  if (positionIt == end(primitive.attributes)) {
+    return;
+  }
+  for (const auto &attribute : primitive.attributes) {
+    if (!hasPlainAccessor(model, attribute.second)) {
+      return;
+    }
+  }
+  for (const auto &target : primitive.targets) {
+    for (const auto &attribute : target) {
+      if (!hasPlainAccessor(model, attribute.second)) {
+        return;
+      }
+    }
+  }
+  if (!readPrimitiveTriangles(model, primitive, result.indices) ||
+      result.indices.empty()) {
+    return;
+  }
+  const size_t vertexCount = model.accessors[(*positionIt).second].count;
+  for (const auto index : result.indices) {
+    if (index >= vertexCount) {
+      return;
+    }
+  }
+  result.acmrBefore = computeACMR(result.indices, vertexCount);
+  optimizeVertexCache(result.indices, vertexCount);
+  std::vector<glm::vec3> positions;
+  if (overdrawThreshold >= 1.f &&
+      readPrimitivePositions(model, primitive, positions)) {
+    optimizeOverdraw(result.indices, positions, overdrawThreshold);
+  }
+  result.acmrAfter = computeACMR(result.indices, vertexCount);
+  result.vertexCount =
+      optimizeVertexFetch(result.indices, vertexCount, result.remap);
+  result.optimized = true;
+}
+
+// Copy of a vertex attribute accessor with its elements reordered
+int appendRemappedAccessor(tinygltf::Model &model, int bufferIdx,
+    int accessorIdx, const std::vector<uint32_t> &remap, size_t vertexCount)
+{
+  tinygltf::Accessor accessor = model.accessors[accessorIdx];
+  const auto &bufferView = model.bufferViews[accessor.bufferView];
+  const auto &source = model.buffers[bufferView.buffer].data;
+  const size_t sourceStride = accessor.ByteStride(bufferView);
+  const size_t elementSize =
+      tinygltf::GetNumComponentsInType(accessor.type) *
+      tinygltf::GetComponentSizeInBytes(accessor.componentType);
+  // Vertex attributes must be aligned on 4 bytes
+  const size_t stride = (elementSize + 3) & ~size_t(3);
+  std::vector<unsigned char> elements(vertexCount * stride, 0);
+  const size_t sourceOffset = bufferView.byteOffset + accessor.byteOffset;
+  for (size_t v = 0; v < remap.size(); ++v) {
+    if (remap[v] != ~0u) {
+      std::memcpy(&elements[remap[v] * stride],
+          &source[sourceOffset + v * sourceStride], elementSize);
+    }
+  }
+  accessor.bufferView = appendBufferView(model, bufferIdx, elements.data(),
+      elements.size(), stride, TINYGLTF_TARGET_ARRAY_BUFFER);
+  accessor.byteOffset = 0;
+  accessor.count = vertexCount;
+  model.accessors.push_back(accessor);
+  return int(model.accessors.size() - 1);
+}
+
+} // namespace
+
+MeshOptimizationStats optimizeMeshes(
+    tinygltf::Model &model, float overdrawThreshold)
+{
+  std::vector<tinygltf::Primitive *> primitives;
+  for (auto &mesh : model.meshes) {
+    for (auto &primitive : mesh.primitives) {
+      primitives.push_back(&primitive);
+    }
+  }
+  std::vector<OptimizedPrimitive> results(primitives.size());
+  parallelFor(primitives.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      optimizePrimitive(model, *primitives[i], overdrawThreshold, results[i]);
+    }
+  });
+
+  MeshOptimizationStats stats;
+  const auto bufferIdx = int(model.buffers.size());
+  model.buffers.emplace_back();
+  for (size_t i = 0; i < primitives.size(); ++i) {
+    const auto &result = results[i];
+    if (!result.optimized) {
+      continue;
+    }
+    auto &primitive = *primitives[i];
+    for (auto &attribute : primitive.attributes) {
+      attribute.second = appendRemappedAccessor(
+          model, bufferIdx, attribute.second, result.remap, result.vertexCount);
+    }
+    for (auto &target : primitive.targets) {
+      for (auto &attribute : target) {
+        attribute.second = appendRemappedAccessor(model, bufferIdx,
+            attribute.second, result.remap, result.vertexCount);
+      }
+    }
+
+    // 16-bit indices when possible
+    tinygltf::Accessor indexAccessor;
+    indexAccessor.type = TINYGLTF_TYPE_SCALAR;
+    indexAccessor.count = result.indices.size();
+    if (result.vertexCount <= 0xFFFF) {
+      const std::vector<uint16_t> indices(
+          begin(result.indices), end(result.indices));
+      indexAccessor.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT;
+      indexAccessor.bufferView = appendBufferView(model, bufferIdx,
+          indices.data(), indices.size() * sizeof(uint16_t), 0,
+          TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
+    } else {
+      indexAccessor.componentType = TINYGLTF_COMPONENT_TYPE_UNSIGNED_INT;
+      indexAccessor.bufferView = appendBufferView(model, bufferIdx,
+          result.indices.data(), result.indices.size() * sizeof(uint32_t), 0,
+          TINYGLTF_TARGET_ELEMENT_ARRAY_BUFFER);
+    }
+    model.accessors.push_back(indexAccessor);
+    primitive.indices = int(model.accessors.size() - 1);
+    primitive.mode = TINYGLTF_MODE_TRIANGLES;
+
+    const size_t triangleCount = result.indices.size() / 3;
+    ++stats.primitiveCount;
+    stats.triangleCount += triangleCount;
+    stats.acmrBefore += result.acmrBefore * triangleCount;
+    stats.acmrAfter += result.acmrAfter * triangleCount;
+  }
+  if (stats.triangleCount) {
+    stats.acmrBefore /= stats.triangleCount;
+    stats.acmrAfter /= stats.triangleCount;
+  }
+  // GL buffers cannot be empty
+  if (model.buffers.back().data.empty()) {
+    model.buffers.pop_back();
+  }
+  return stats;
+}
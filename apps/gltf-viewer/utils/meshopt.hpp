@@ -0,0 +1,52 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Average number of vertex shader invocations per triangle (average cache miss
+// ratio) of a triangle list, simulated with a FIFO post-transform cache
+double computeACMR(const std::vector<uint32_t> &indices, size_t vertexCount,
+    size_t cacheSize = 16);
+
+// Reorder the triangles of a triangle list for post-transform cache locality
+// (Forsyth, "Linear-Speed Vertex Cache Optimisation")
+void optimizeVertexCache(std::vector<uint32_t> &indices, size_t vertexCount);
+
+// Reorder clusters of triangles so that triangles likely to occlude others
+// are drawn first (Sander et al., "Fast Triangle Reordering for Vertex
+// Locality and Reduced Overdraw"). Indices must already be optimized for the
+// vertex cache: they are split in clusters where the ACMR of a cluster stays
+// below threshold times the ACMR of the whole cache optimized run, so
+// threshold trades vertex cache efficiency (1) for overdraw (larger values).
+// Clusters facing away from the mesh center come first.
+void optimizeOverdraw(std::vector<uint32_t> &indices,
+    const std::vector<glm::vec3> &positions, float threshold);
+
+// Renumber vertices in the order of their first use by the index buffer, so
+// that vertex fetches are mostly sequential. Indices are rewritten, remap
+// receives the new index of each old vertex (~0u for unused vertices) and the
+// new vertex count is returned.
+size_t optimizeVertexFetch(std::vector<uint32_t> &indices, size_t vertexCount,
+    std::vector<uint32_t> &remap);
+
+struct MeshOptimizationStats
+{
+  size_t primitiveCount = 0; // Optimized primitives
+  size_t triangleCount = 0;
+  double acmrBefore = 0.;
+  double acmrAfter = 0.;
+};
+
+// Optimize the index and vertex order of all triangle primitives of the model,
+// primitives being processed in parallel on the thread pool. Overdraw
+// optimization runs after vertex cache optimization when overdrawThreshold
+// is >= 1, see optimizeOverdraw(). Reordered indices
+// and vertex attributes (including morph targets) are written to a new glTF
+// buffer and the primitives are redirected to new accessors. Primitives with
+// sparse accessors are left untouched.
+MeshOptimizationStats optimizeMeshes(
+    tinygltf::Model &model, float overdrawThreshold);
@@ -0,0 +1,237 @@
+#include "morph.hpp"
+
+#include "gltf.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+bool readMorphTargets(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, MorphTargets &targets)
+{
+  const auto positionIt = primitive.attributes.find("POSITION");
+  if (primitive.targets.empty() ||
+      positionIt == end(primitive.attributes)) {
+    return false;
+  }
+  targets.vertexCount = uint32_t(model.accessors[positionIt->second].count);
+  targets.targetCount = uint32_t(primitive.targets.size());
+  targets.deltas.assign(
+      2 * size_t(targets.targetCount) * targets.vertexCount, glm::vec4(0));
+  targets.deltaBounds.assign(
+      targets.targetCount, AABB(glm::vec3(0), glm::vec3(0)));
+
+  std::vector<float> values;
+  for (uint32_t t = 0; t < targets.targetCount; ++t) {
+    glm::vec4 *deltas = &targets.deltas[2 * size_t(t) * targets.vertexCount];
+    // Only positions and normals are morphed, missing deltas are zero
+    for (const int c : {0, 1}) {
+      const auto it = primitive.targets[t].find(c ? "NORMAL" : "POSITION");
+      if (it == end(primitive.targets[t]) ||
+          readAccessorAsFloats(model, it->second, values) != 3 ||
+          values.size() != 3 * size_t(targets.vertexCount)) {
+        continue;
+      }
+      for (size_t v = 0; v < targets.vertexCount; ++v) {
+        deltas[2 * v + c] =
+            glm::vec4(values[3 * v], values[3 * v + 1], values[3 * v + 2], 0);
+        if (c == 0) {
+          targets.deltaBounds[t].expand(glm::vec3(deltas[2 * v]));
+        }
+      }
+    }
+  }
+  return true;
+}
+
+void getActiveMorphWeights(const tinygltf::Node &node,
+    const tinygltf::Mesh &mesh, uint32_t targetCount,
+    std::vector<MorphWeight> &weights)
+{
+  const auto &values = node.weights.empty() ? mesh.weights : node.weights;
+  const auto count = std::min(size_t(targetCount), values.size());
+  for (uint32_t t = 0; t < count; ++t) {
+    if (values[t] != 0.) {
+      weights.push_back(MorphWeight{t, float(values[t])});
+    }
+  }
+}
+
+AABB computeMorphedBounds(const AABB &bounds, const MorphTargets &targets,
+    const MorphWeight *weights, size_t weightCount)
+{
+  // Minkowski sum of the base bounds and of each scaled delta box, a negative
+  // weight swaps the corners of its box
+  AABB morphed = bounds;
+  for (size_t i = 0; i < weightCount; ++i) {
+    const AABB &deltaBounds = targets.deltaBounds[weights[i].target];
+    const glm::vec3 a = weights[i].weight * deltaBounds.min;
+    const glm::vec3 b = weights[i].weight * deltaBounds.max;
+    morphed.min += glm::min(a, b);
+    morphed.max += glm::max(a, b);
+  }
+  return morphed;
+}
+
+void morphPositions(const MorphTargets &targets, const MorphWeight *weights,
+    size_t weightCount, std::vector<glm::vec3> &positions)
+{
+  const size_t vertexCount =
+      std::min(positions.size(), size_t(targets.vertexCount));
+  for (size_t i = 0; i < weightCount; ++i) {
+    const glm::vec4 *deltas =
+        &targets.deltas[2 * size_t(weights[i].target) * targets.vertexCount];
+    for (size_t v = 0; v < vertexCount; ++v) {
+      positions[v] += weights[i].weight * glm::vec3(deltas[2 * v]);
+    }
+  }
+}
+
+// True if both lists of active weights are equal
+static bool haveSameWeights(const MorphWeight *lhs, size_t lhsCount,
+    const MorphWeight *rhs, size_t rhsCount)
+{
+  if (lhsCount != rhsCount) {
+    return false;
+  }
+  for (size_t i = 0; i < lhsCount; ++i) {
+    if (lhs[i].target != rhs[i].target || lhs[i].weight != rhs[i].weight) {
+      return false;
+    }
+  }
+  return true;
+}
+
+MorphSystem::MorphSystem(
+    const tinygltf::Model &model, const std::vector<DrawInstance> &instances) :
+    m_instanceMorphing(instances.size(), -1)
+{
+  std::vector<int> primitiveTargets; // Index in m_targets, per primitive
+  GLuint deltaTexelCount = 0;
+  for (uint32_t instanceIdx = 0; instanceIdx < instances.size();
+       ++instanceIdx) {
+    const DrawInstance &instance = instances[instanceIdx];
+    if (instance.primitive >= primitiveTargets.size()) {
+      primitiveTargets.resize(instance.primitive + 1, -1);
+    }
+    if (primitiveTargets[instance.primitive] < 0) {
+      MorphTargets targets;
+      if (!readMorphTargets(model,
+              model.meshes[instance.meshIdx].primitives[instance.primitiveIdx],
+              targets)) {
+        continue;
+      }
+      primitiveTargets[instance.primitive] = int(m_targets.size());
+      m_deltaOffsets.push_back(deltaTexelCount);
+      deltaTexelCount += GLuint(targets.deltas.size());
+      m_targets.push_back(std::move(targets));
+    }
+    m_instanceMorphing[instanceIdx] = int(m_instances.size());
+    m_instances.push_back(MorphedInstance{instanceIdx,
+        uint32_t(primitiveTargets[instance.primitive]), instance.localBounds,
+        0, 0, 0});
+  }
+  GLint maxTexelCount = 0;
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexelCount);
+  if (deltaTexelCount > GLuint(maxTexelCount)) {
+    std::cerr << "Morph targets need " << deltaTexelCount
+              << " texels, more than GL_MAX_TEXTURE_BUFFER_SIZE ("
+              << maxTexelCount << "), they are ignored" << std::endl;
+    m_targets.clear();
+    m_instances.clear();
+    std::fill(begin(m_instanceMorphing), end(m_instanceMorphing), -1);
+  }
+
+  glGenBuffers(2, m_buffers);
+  glGenTextures(2, m_textures);
+  glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[0]);
+  {
+    std::vector<glm::vec4> deltas;
+    for (const auto &targets : m_targets) {
+      deltas.insert(end(deltas), begin(targets.deltas), end(targets.deltas));
+    }
+    deltas.resize(std::max(deltas.size(), size_t(1)));
+    glBufferData(GL_TEXTURE_BUFFER, deltas.size() * sizeof(glm::vec4),
+        deltas.data(), GL_STATIC_DRAW);
+  }
+  glBindTexture(GL_TEXTURE_BUFFER, m_textures[0]);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_buffers[0]);
+  glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[1]);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::uvec4), nullptr, GL_STREAM_DRAW);
+  glBindTexture(GL_TEXTURE_BUFFER, m_textures[1]);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32UI, m_buffers[1]);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+MorphSystem::~MorphSystem()
+{
+  glDeleteTextures(2, m_textures);
+  glDeleteBuffers(2, m_buffers);
+}
+
+void MorphSystem::update(const tinygltf::Model &model,
+    const std::vector<PrimitiveDraw> &primitiveDraws,
+    std::vector<DrawInstance> &instances, std::vector<MovedInstance> &moved)
+{
+  std::swap(m_activeWeights, m_previousWeights);
+  m_activeWeights.clear();
+  m_weightTexels.clear();
+  for (auto &morphed : m_instances) {
+    DrawInstance &instance = instances[morphed.instanceIdx];
+    const MorphTargets &targets = m_targets[morphed.targetsIdx];
+    const MorphWeight *previousWeights =
+        m_previousWeights.data() + morphed.firstWeight;
+    const uint32_t previousWeightCount = morphed.weightCount;
+    morphed.firstWeight = uint32_t(m_activeWeights.size());
+    getActiveMorphWeights(model.nodes[instance.nodeIdx],
+        model.meshes[instance.meshIdx], targets.targetCount, m_activeWeights);
+    morphed.weightCount = uint32_t(m_activeWeights.size() - morphed.firstWeight);
+    morphed.firstTexel = uint32_t(m_weightTexels.size());
+    const PrimitiveDraw &draw = primitiveDraws[instance.primitive];
+    m_weightTexels.push_back(glm::uvec4(m_deltaOffsets[morphed.targetsIdx],
+        targets.vertexCount, morphed.weightCount, GLuint(-draw.baseVertex)));
+    const MorphWeight *weights = m_activeWeights.data() + morphed.firstWeight;
+    for (uint32_t i = 0; i < morphed.weightCount; i += 2) {
+      glm::uvec4 texel(
+          weights[i].target, glm::floatBitsToUint(weights[i].weight), 0, 0);
+      if (i + 1 < morphed.weightCount) {
+        texel.z = weights[i + 1].target;
+        texel.w = glm::floatBitsToUint(weights[i + 1].weight);
+      }
+      m_weightTexels.push_back(texel);
+    }
+    if (!haveSameWeights(weights, morphed.weightCount, previousWeights,
+            previousWeightCount)) {
+      moved.push_back(MovedInstance{morphed.instanceIdx, instance.worldBounds});
+    }
+    instance.localBounds = computeMorphedBounds(
+        morphed.baseBounds, targets, weights, morphed.weightCount);
+    instance.worldBounds =
+        transformAABB(instance.localBounds, instance.modelMatrix);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, m_buffers[1]);
+  glBufferData(GL_TEXTURE_BUFFER, m_weightTexels.size() * sizeof(glm::uvec4),
+      m_weightTexels.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+GLuint MorphSystem::getWeightsTexel(uint32_t instanceIdx) const
+{
+  const int morphedIdx = m_instanceMorphing[instanceIdx];
+  return morphedIdx >= 0 ? m_instances[morphedIdx].firstTexel : 0;
+}
+
+const MorphTargets *MorphSystem::getActiveWeights(uint32_t instanceIdx,
+    const MorphWeight *&weights, size_t &weightCount) const
+{
+  weights = nullptr;
+  weightCount = 0;
+  const int morphedIdx = m_instanceMorphing[instanceIdx];
+  if (morphedIdx < 0) {
+    return nullptr;
+  }
+  const MorphedInstance &morphed = m_instances[morphedIdx];
+  weights = m_activeWeights.data() + morphed.firstWeight;
+  weightCount = morphed.weightCount;
+  return &m_targets[morphed.targetsIdx];
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "draw_instances.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstdint>
+#include <vector>
+
+// Position and normal deltas of the morph targets of a primitive, uploaded
+// once to a texture buffer and blended in the vertex shader
+struct MorphTargets
+{
+  uint32_t vertexCount = 0;
+  uint32_t targetCount = 0;
+  // (position, normal) delta pairs target by target: the deltas of vertex v
+  // for target t are at 2 * (t * vertexCount + v)
+  std::vector<glm::vec4> deltas;
+  // Bounds of the position deltas of each target
+  std::vector<AABB> deltaBounds;
+};
+
+// Return false if the primitive has no morph targets
+bool readMorphTargets(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, MorphTargets &targets);
+
+// A morph target with a non-zero weight
+struct MorphWeight
+{
+  uint32_t target;
+  float weight;
+};
+
+// Append the non-zero weights of a node: its own weights (written by
+// animations), or the default weights of its mesh
+void getActiveMorphWeights(const tinygltf::Node &node,
+    const tinygltf::Mesh &mesh, uint32_t targetCount,
+    std::vector<MorphWeight> &weights);
+
+// Local bounds of the morphed primitive: the base bounds moved by the weighted
+// delta bounds of the active targets
+AABB computeMorphedBounds(const AABB &bounds, const MorphTargets &targets,
+    const MorphWeight *weights, size_t weightCount);
+
+// Add the weighted position deltas of the active targets to the positions of
+// the primitive, for CPU work on the morphed geometry such as picking
+void morphPositions(const MorphTargets &targets, const MorphWeight *weights,
+    size_t weightCount, std::vector<glm::vec3> &positions);
+
+// Morphed instances of the scene: the deltas of the morph targets of their
+// primitives are uploaded once to a texture buffer. When weights change, only
+// the list of active targets of each instance is uploaded and the vertex
+// shader blends these targets, vertex buffers are never rewritten.
+class MorphSystem
+{
+public:
+  MorphSystem(
+      const tinygltf::Model &model, const std::vector<DrawInstance> &instances);
+
+  ~MorphSystem();
+
+  MorphSystem(const MorphSystem &) = delete;
+
+  MorphSystem &operator=(const MorphSystem &) = delete;
+
+  // Gather the active weights of the morphed instances after a transform or
+  // weight change, update their bounds and upload the weights. Each instance
+  // has a header texel (first delta texel, vertex count, active target count,
+  // offset added to gl_VertexID) followed by its (target, weight bits) pairs,
+  // two per texel. Instances whose weights changed are appended to moved.
+  void update(const tinygltf::Model &model,
+      const std::vector<PrimitiveDraw> &primitiveDraws,
+      std::vector<DrawInstance> &instances, std::vector<MovedInstance> &moved);
+
+  bool empty() const { return m_instances.empty(); }
+
+  bool isMorphed(uint32_t instanceIdx) const
+  {
+    return m_instanceMorphing[instanceIdx] >= 0;
+  }
+
+  // Header texel of the active weights of an instance, 0 if it is not morphed
+  GLuint getWeightsTexel(uint32_t instanceIdx) const;
+
+  // Targets of a morphed instance and its active weights, weightCount is 0 if
+  // the instance is not morphed
+  const MorphTargets *getActiveWeights(uint32_t instanceIdx,
+      const MorphWeight *&weights, size_t &weightCount) const;
+
+  // Texture buffers of the deltas and of the active weights
+  GLuint deltasTexture() const { return m_textures[0]; }
+
+  GLuint weightsTexture() const { return m_textures[1]; }
+
+  size_t instanceCount() const { return m_instances.size(); }
+
+  size_t primitiveCount() const { return m_targets.size(); }
+
+  size_t activeWeightCount() const { return m_activeWeights.size(); }
+
+  size_t weightTexelCount() const { return m_weightTexels.size(); }
+
+private:
+  // Draw instance of a primitive with morph targets
+  struct MorphedInstance
+  {
+    uint32_t instanceIdx;
+    uint32_t targetsIdx; // Deltas of the primitive in m_targets
+    AABB baseBounds; // Local bounds of the primitive without morphing
+    uint32_t firstWeight; // Active weights in m_activeWeights
+    uint32_t weightCount;
+    uint32_t firstTexel; // Header of the active weights in m_weightTexels
+  };
+
+  std::vector<MorphTargets> m_targets;
+  std::vector<GLuint> m_deltaOffsets; // First texel of each element of m_targets
+  std::vector<MorphedInstance> m_instances;
+  std::vector<int> m_instanceMorphing; // Per draw instance, index in m_instances
+  std::vector<MorphWeight> m_activeWeights;
+  std::vector<MorphWeight> m_previousWeights; // m_activeWeights of last update
+  std::vector<glm::uvec4> m_weightTexels;
+  GLuint m_buffers[2] = {};
+  GLuint m_textures[2] = {};
+};
@@ -0,0 +1,340 @@
+#include "occlusion.hpp"
+
+#include "gltf.hpp"
+#include "parallel.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Largest geometric error of the level used as occluder, relative to the
+// diagonal of the primitive bounds
+static const float OCCLUDER_MAX_RELATIVE_ERROR = 0.01f;
+// Minimum number of rows rasterized by a thread
+static const size_t OCCLUSION_MIN_BAND_HEIGHT = 8;
+
+std::vector<OccluderMesh> buildOccluderMeshes(
+    const tinygltf::Model &model, const std::vector<PrimitiveLods> &lods)
+{
+  std::vector<const tinygltf::Primitive *> primitives;
+  for (const auto &mesh : model.meshes) {
+    for (const auto &primitive : mesh.primitives) {
+      primitives.push_back(&primitive);
+    }
+  }
+  std::vector<OccluderMesh> meshes(primitives.size());
+  parallelFor(primitives.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      const auto &primitive = *primitives[i];
+      if (primitive.material >= 0 &&
+          model.materials[primitive.material].alphaMode != "OPAQUE") {
+        continue;
+      }
+      auto &mesh = meshes[i];
+      if (!readPrimitivePositions(model, primitive, mesh.positions)) {
+        continue;
+      }
+      size_t level = 0;
+      if (i < lods.size() && !lods[i].indexAccessors.empty()) {
+        const float diagonal =
+            glm::length(computePrimitiveBounds(model, primitive).extent());
+        while (level + 1 < lods[i].errors.size() &&
+               lods[i].errors[level + 1] <=
+                   OCCLUDER_MAX_RELATIVE_ERROR * diagonal) {
+          ++level;
+        }
+      }
+      const bool read =
+          level > 0
+              ? readAccessorAsIndices(
+                    model, lods[i].indexAccessors[level], mesh.indices)
+              : readPrimitiveTriangles(model, primitive, mesh.indices);
+      const bool valid =
+          read && std::all_of(std::begin(mesh.indices), std::end(mesh.indices),
+                      [&](uint32_t index) {
+                        return index < mesh.positions.size();
+                      });
+      if (!valid) {
+        mesh = OccluderMesh();
+      }
+    }
+  });
+  return meshes;
+}
+
+OcclusionBuffer::OcclusionBuffer(size_t width, size_t height)
+    : m_width(width), m_height(height), m_stride((width + 3) & ~size_t(3))
+{
+  auto size = glm::ivec2(width, height);
+  m_levelSizes.push_back(size);
+  m_levels.emplace_back(m_stride * height, 1.f);
+  while (size.x > 1 || size.y > 1) {
+    size = (size + 1) / 2;
+    m_levelSizes.push_back(size);
+    m_levels.emplace_back(size_t(size.x) * size.y, 1.f);
+  }
+}
+
+void OcclusionBuffer::clear()
+{
+  for (auto &level : m_levels) {
+    std::fill(begin(level), end(level), 1.f);
+  }
+}
+
+void OcclusionBuffer::addTriangle(
+    const glm::vec4 clip[3], std::vector<ScreenTriangle> &triangles) const
+{
+  ScreenTriangle triangle;
+  for (size_t i = 0; i < 3; ++i) {
+    const glm::vec3 ndc = glm::vec3(clip[i]) / clip[i].w;
+    triangle.v[i] = glm::vec2((ndc.x * 0.5f + 0.5f) * m_width,
+        (ndc.y * 0.5f + 0.5f) * m_height);
+    triangle.z[i] = ndc.z * 0.5f + 0.5f;
+  }
+  const glm::vec2 e1 = triangle.v[1] - triangle.v[0];
+  const glm::vec2 e2 = triangle.v[2] - triangle.v[0];
+  const float area = e1.x * e2.y - e1.y * e2.x;
+  if (std::abs(area) < 1e-6f) {
+    return;
+  }
+  // Both faces are drawn
+  if (area < 0.f) {
+    std::swap(triangle.v[1], triangle.v[2]);
+    std::swap(triangle.z[1], triangle.z[2]);
+  }
+  const glm::vec2 bboxMin =
+      glm::min(triangle.v[0], glm::min(triangle.v[1], triangle.v[2]));
+  const glm::vec2 bboxMax =
+      glm::max(triangle.v[0], glm::max(triangle.v[1], triangle.v[2]));
+  // Pixels whose center is inside the bounds
+  triangle.minX = std::max(int(std::ceil(bboxMin.x - 0.5f)), 0);
+  triangle.minY = std::max(int(std::ceil(bboxMin.y - 0.5f)), 0);
+  triangle.maxX = std::min(int(std::floor(bboxMax.x - 0.5f)), int(m_width) - 1);
+  triangle.maxY =
+      std::min(int(std::floor(bboxMax.y - 0.5f)), int(m_height) - 1);
+  if (triangle.minX <= triangle.maxX && triangle.minY <= triangle.maxY) {
+    triangles.push_back(triangle);
+  }
+}
+
+void OcclusionBuffer::setupTriangles(
+    const Occluder &occluder, std::vector<ScreenTriangle> &triangles) const
+{
+  triangles.clear();
+  const auto &positions = occluder.mesh->positions;
+  const auto &indices = occluder.mesh->indices;
+  std::vector<glm::vec4> clipPositions(positions.size());
+  for (size_t i = 0; i < positions.size(); ++i) {
+    clipPositions[i] = occluder.modelViewProjMatrix * glm::vec4(positions[i], 1);
+  }
+
+  for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+    const glm::vec4 clip[3] = {clipPositions[indices[i]],
+        clipPositions[indices[i + 1]], clipPositions[indices[i + 2]]};
+    // Skip triangles outside of a frustum plane
+    bool outside = false;
+    for (int axis = 0; axis < 3 && !outside; ++axis) {
+      outside = (clip[0][axis] > clip[0].w && clip[1][axis] > clip[1].w &&
+                    clip[2][axis] > clip[2].w) ||
+                (clip[0][axis] < -clip[0].w && clip[1][axis] < -clip[1].w &&
+                    clip[2][axis] < -clip[2].w);
+    }
+    if (outside) {
+      continue;
+    }
+    if (clip[0].z >= -clip[0].w && clip[1].z >= -clip[1].w &&
+        clip[2].z >= -clip[2].w) {
+      addTriangle(clip, triangles);
+      continue;
+    }
+
+    // Clip against the near plane (z = -w), the result is a fan
+    glm::vec4 polygon[4];
+    size_t vertexCount = 0;
+    for (size_t v = 0; v < 3; ++v) {
+      const glm::vec4 &a = clip[v];
+      const glm::vec4 &b = clip[(v + 1) % 3];
+      const float da = a.z + a.w;
+      const float db = b.z + b.w;
+      if (da >= 0.f) {
+        polygon[vertexCount++] = a;
+      }
+      if ((da >= 0.f) != (db >= 0.f)) {
+        polygon[vertexCount++] = a + (b - a) * (da / (da - db));
+      }
+    }
+    for (size_t v = 2; v < vertexCount; ++v) {
+      const glm::vec4 fan[3] = {polygon[0], polygon[v - 1], polygon[v]};
+      addTriangle(fan, triangles);
+    }
+  }
+}
+
+void OcclusionBuffer::rasterizeRows(
+    const ScreenTriangle &triangle, int beginRow, int endRow)
+{
+  const auto &v = triangle.v;
+  const glm::vec2 e1 = v[1] - v[0];
+  const glm::vec2 e2 = v[2] - v[0];
+  const float area = e1.x * e2.y - e1.y * e2.x;
+  const float dzdx = ((triangle.z[1] - triangle.z[0]) * e2.y -
+                         (triangle.z[2] - triangle.z[0]) * e1.y) /
+                     area;
+  const float dzdy = ((triangle.z[2] - triangle.z[0]) * e1.x -
+                         (triangle.z[1] - triangle.z[0]) * e2.x) /
+                     area;
+  // Edge functions are positive inside: E(x, y) = dEdx * x + dEdy * y + c
+  float dEdx[3], dEdy[3], c[3];
+  for (size_t i = 0; i < 3; ++i) {
+    const glm::vec2 &a = v[i];
+    const glm::vec2 &b = v[(i + 1) % 3];
+    dEdx[i] = a.y - b.y;
+    dEdy[i] = b.x - a.x;
+    c[i] = -dEdx[i] * a.x - dEdy[i] * a.y;
+  }
+
+  auto &depth = m_levels.front();
+  const int firstRow = std::max(triangle.minY, beginRow);
+  const int lastRow = std::min(triangle.maxY, endRow - 1);
+  const int firstColumn = triangle.minX & ~3;
+  for (int y = firstRow; y <= lastRow; ++y) {
+    const float yc = y + 0.5f;
+    float rowE[3];
+    for (size_t i = 0; i < 3; ++i) {
+      rowE[i] = dEdy[i] * yc + c[i];
+    }
+    const float rowZ = triangle.z[0] + dzdy * (yc - v[0].y) - dzdx * v[0].x;
+    float *row = depth.data() + size_t(y) * m_stride;
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 noDepth = _mm_set1_ps(FLT_MAX);
+    const __m128 columnOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+    for (int x = firstColumn; x <= triangle.maxX; x += 4) {
+      const __m128 xc = _mm_add_ps(_mm_set1_ps(float(x)), columnOffsets);
+      __m128 inside = _mm_cmpge_ps(
+          _mm_add_ps(_mm_set1_ps(rowE[0]), _mm_mul_ps(_mm_set1_ps(dEdx[0]), xc)),
+          zero);
+      for (size_t i = 1; i < 3; ++i) {
+        inside = _mm_and_ps(inside,
+            _mm_cmpge_ps(_mm_add_ps(_mm_set1_ps(rowE[i]),
+                             _mm_mul_ps(_mm_set1_ps(dEdx[i]), xc)),
+                zero));
+      }
+      const __m128 z =
+          _mm_add_ps(_mm_set1_ps(rowZ), _mm_mul_ps(_mm_set1_ps(dzdx), xc));
+      const __m128 masked =
+          _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, noDepth));
+      _mm_storeu_ps(row + x, _mm_min_ps(_mm_loadu_ps(row + x), masked));
+    }
+#else
+    for (int x = firstColumn; x <= triangle.maxX; ++x) {
+      const float xc = x + 0.5f;
+      if (rowE[0] + dEdx[0] * xc >= 0.f && rowE[1] + dEdx[1] * xc >= 0.f &&
+          rowE[2] + dEdx[2] * xc >= 0.f) {
+        row[x] = std::min(row[x], rowZ + dzdx * xc);
+      }
+    }
+#endif
+  }
+}
+
+size_t OcclusionBuffer::rasterize(const std::vector<Occluder> &occluders)
+{
+  m_triangles.resize(occluders.size());
+  parallelFor(occluders.size(), 1, [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      setupTriangles(occluders[i], m_triangles[i]);
+    }
+  });
+  size_t triangleCount = 0;
+  for (size_t i = 0; i < occluders.size(); ++i) {
+    triangleCount += m_triangles[i].size();
+  }
+
+  parallelFor(m_height, OCCLUSION_MIN_BAND_HEIGHT, [&](size_t begin, size_t end) {
+    for (size_t i = 0; i < occluders.size(); ++i) {
+      for (const auto &triangle : m_triangles[i]) {
+        if (triangle.maxY >= int(begin) && triangle.minY < int(end)) {
+          rasterizeRows(triangle, int(begin), int(end));
+        }
+      }
+    }
+  });
+  return triangleCount;
+}
+
+void OcclusionBuffer::buildHierarchy()
+{
+  for (size_t level = 1; level < m_levels.size(); ++level) {
+    const glm::ivec2 srcSize = m_levelSizes[level - 1];
+    const size_t srcStride = level == 1 ? m_stride : size_t(srcSize.x);
+    const glm::ivec2 dstSize = m_levelSizes[level];
+    const auto &src = m_levels[level - 1];
+    auto &dst = m_levels[level];
+    parallelFor(size_t(dstSize.y), 16, [&](size_t begin, size_t end) {
+      for (size_t y = begin; y < end; ++y) {
+        const size_t y0 = 2 * y;
+        const size_t y1 = std::min(y0 + 1, size_t(srcSize.y) - 1);
+        for (size_t x = 0; x < size_t(dstSize.x); ++x) {
+          const size_t x0 = 2 * x;
+          const size_t x1 = std::min(x0 + 1, size_t(srcSize.x) - 1);
+          dst[y * dstSize.x + x] = std::max(
+              std::max(src[y0 * srcStride + x0], src[y0 * srcStride + x1]),
+              std::max(src[y1 * srcStride + x0], src[y1 * srcStride + x1]));
+        }
+      }
+    });
+  }
+}
+
+bool OcclusionBuffer::isVisible(
+    const AABB &box, const glm::mat4 &viewProjMatrix) const
+{
+  glm::vec2 ndcMin(FLT_MAX), ndcMax(-FLT_MAX);
+  float nearestDepth = FLT_MAX;
+  for (int corner = 0; corner < 8; ++corner) {
+    const glm::vec3 p((corner & 1) ? box.max.x : box.min.x,
+        (corner & 2) ? box.max.y : box.min.y,
+        (corner & 4) ? box.max.z : box.min.z);
+    const glm::vec4 clip = viewProjMatrix * glm::vec4(p, 1);
+    if (clip.z < -clip.w || clip.w <= 0.f) {
+      return true;
+    }
+    const glm::vec3 ndc = glm::vec3(clip) / clip.w;
+    ndcMin = glm::min(ndcMin, glm::vec2(ndc));
+    ndcMax = glm::max(ndcMax, glm::vec2(ndc));
+    nearestDepth = std::min(nearestDepth, ndc.z * 0.5f + 0.5f);
+  }
+
+  const int minX = std::max(int((ndcMin.x * 0.5f + 0.5f) * m_width), 0);
+  const int minY = std::max(int((ndcMin.y * 0.5f + 0.5f) * m_height), 0);
+  const int maxX =
+      std::min(int((ndcMax.x * 0.5f + 0.5f) * m_width), int(m_width) - 1);
+  const int maxY =
+      std::min(int((ndcMax.y * 0.5f + 0.5f) * m_height), int(m_height) - 1);
+  if (minX > maxX || minY > maxY) {
+    return true;
+  }
+
+  // Level where the box covers at most 2x2 texels (3x3 when unaligned)
+  size_t level = 0;
+  const int span = std::max(maxX - minX, maxY - minY);
+  while ((span >> level) > 1 && level + 1 < m_levels.size()) {
+    ++level;
+  }
+  const auto &depth = m_levels[level];
+  const size_t stride = level == 0 ? m_stride : size_t(m_levelSizes[level].x);
+  for (int y = minY >> level; y <= (maxY >> level); ++y) {
+    for (int x = minX >> level; x <= (maxX >> level); ++x) {
+      if (depth[y * stride + x] >= nearestDepth) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
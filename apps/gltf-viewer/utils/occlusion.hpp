@@ -0,0 +1,84 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "lod.hpp"
+
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Local space triangles of a primitive used as occluder
+struct OccluderMesh
+{
+  std::vector<glm::vec3> positions;
+  std::vector<uint32_t> indices;
+};
+
+// Occluder meshes of all primitives, ordered by mesh then primitive. The
+// coarsest level of detail that stays close to the surface is used when
+// levels were generated. Primitives that cannot occlude (not triangles, not
+// opaque) get an empty mesh.
+std::vector<OccluderMesh> buildOccluderMeshes(
+    const tinygltf::Model &model, const std::vector<PrimitiveLods> &lods);
+
+struct Occluder
+{
+  const OccluderMesh *mesh;
+  glm::mat4 modelViewProjMatrix;
+};
+
+// Small depth buffer rasterized on the CPU from a few large occluders, and the
+// hierarchy of its farthest depths used to test bounding boxes. Rows are split
+// in bands rasterized in parallel on the thread pool, 4 pixels at a time with
+// SSE when available. Depths are OpenGL window depths in [0, 1]; pixels
+// are covered when their center is inside a triangle.
+class OcclusionBuffer
+{
+public:
+  OcclusionBuffer(size_t width, size_t height);
+
+  void clear();
+
+  // Draw the triangles of the occluders, both faces. Return the number of
+  // triangles rasterized after clipping.
+  size_t rasterize(const std::vector<Occluder> &occluders);
+
+  // Update the depth hierarchy after rasterize()
+  void buildHierarchy();
+
+  // False if the box is behind the occluders. Boxes crossing the near plane
+  // or outside of the viewport are visible.
+  bool isVisible(const AABB &box, const glm::mat4 &viewProjMatrix) const;
+
+  size_t width() const { return m_width; }
+
+  size_t height() const { return m_height; }
+
+private:
+  struct ScreenTriangle
+  {
+    glm::vec2 v[3]; // Counter clockwise in pixels
+    float z[3];
+    int minX, minY, maxX, maxY; // Pixel bounds, inclusive
+  };
+
+  void setupTriangles(const Occluder &occluder,
+      std::vector<ScreenTriangle> &triangles) const;
+
+  void addTriangle(const glm::vec4 clip[3],
+      std::vector<ScreenTriangle> &triangles) const;
+
+  void rasterizeRows(const ScreenTriangle &triangle, int beginRow, int endRow);
+
+  size_t m_width;
+  size_t m_height;
+  size_t m_stride; // Row size of level 0, a multiple of 4
+  // Level 0 is the depth buffer, each next level stores the farthest depth
+  // of 2x2 texels of the previous one
+  std::vector<std::vector<float>> m_levels;
+  std::vector<glm::ivec2> m_levelSizes;
+  std::vector<std::vector<ScreenTriangle>> m_triangles; // Per occluder
+};
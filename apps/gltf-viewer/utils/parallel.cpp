@@ -0,0 +1,91 @@
+#include "parallel.hpp"
+
+// True on pool worker threads, and on the thread currently inside run()
+static thread_local bool insideThreadPool = false;
+
+ThreadPool &ThreadPool::instance()
+{
+  static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+  return pool;
+}
+
+ThreadPool::ThreadPool(size_t threadCount)
+{
+  for (size_t i = 1; i < threadCount; ++i) {
+    m_workers.emplace_back([this]() { workerLoop(); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wakeCondition.notify_all();
+  for (auto &worker : m_workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::run(size_t taskCount, const std::function<void(size_t)> &task)
+{
+  if (insideThreadPool || m_workers.empty() || taskCount <= 1) {
+    for (size_t i = 0; i < taskCount; ++i) {
+      task(i);
+    }
+    return;
+  }
+
+  std::lock_guard<std::mutex> runLock(m_runMutex);
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pTask = &task;
+    m_taskCount = taskCount;
+    m_nextTask = 0;
+    m_activeWorkers = m_workers.size();
+    ++m_generation;
+  }
+  m_wakeCondition.notify_all();
+
+  insideThreadPool = true;
+  executeTasks();
+  insideThreadPool = false;
+
+  // Workers may still be running their last task
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_doneCondition.wait(lock, [this]() { return m_activeWorkers == 0; });
+  m_pTask = nullptr;
+}
+
+void ThreadPool::executeTasks()
+{
+  for (auto i = m_nextTask++; i < m_taskCount; i = m_nextTask++) {
+    (*m_pTask)(i);
+  }
+}
+
+void ThreadPool::workerLoop()
+{
+  insideThreadPool = true;
+  uint64_t lastGeneration = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wakeCondition.wait(lock,
+          [&]() { return m_stop || m_generation != lastGeneration; });
+      if (m_stop) {
+        return;
+      }
+      lastGeneration = m_generation;
+    }
+
+    executeTasks();
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      --m_activeWorkers;
+    }
+    m_doneCondition.notify_one();
+  }
+}
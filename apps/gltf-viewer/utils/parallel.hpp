@@ -0,0 +1,74 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed pool of worker threads, created on first use. The calling thread takes
+// part in the work, so a pool with N threads has N - 1 workers.
+class ThreadPool
+{
+public:
+  static ThreadPool &instance();
+
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t threadCount() const { return m_workers.size() + 1; }
+
+  // Call task(i) for each i in [0, taskCount) and wait for completion. Nested
+  // calls from inside a task run serially on the calling thread.
+  void run(size_t taskCount, const std::function<void(size_t)> &task);
+
+private:
+  explicit ThreadPool(size_t threadCount);
+
+  void workerLoop();
+  void executeTasks();
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_runMutex; // Serialize run() calls from different threads
+
+  std::mutex m_mutex;
+  std::condition_variable m_wakeCondition;
+  std::condition_variable m_doneCondition;
+  const std::function<void(size_t)> *m_pTask = nullptr;
+  size_t m_taskCount = 0;
+  std::atomic<size_t> m_nextTask{0};
+  size_t m_activeWorkers = 0;
+  uint64_t m_generation = 0;
+  bool m_stop = false;
+};
+
+// Split [0, count) in contiguous ranges of at least minRangeSize elements and
+// call f(begin, end) for each of them on the thread pool
+template <typename Function>
+void parallelFor(size_t count, size_t minRangeSize, Function &&f)
+{
+  if (!count) {
+    return;
+  }
+  auto &pool = ThreadPool::instance();
+  const size_t rangeCount = std::max(size_t(1),
+      std::min(pool.threadCount(), count / std::max(minRangeSize, size_t(1))));
+  if (rangeCount == 1) {
+    f(size_t(0), count);
+    return;
+  }
+  const size_t rangeSize = (count + rangeCount - 1) / rangeCount;
+  pool.run(rangeCount, [&](size_t rangeIdx) {
+    const size_t begin = rangeIdx * rangeSize;
+    const size_t end = std::min(count, begin + rangeSize);
+    if (begin < end) {
+      f(begin, end);
+    }
+  });
+}
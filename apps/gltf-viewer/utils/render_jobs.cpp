@@ -0,0 +1,272 @@
+#include "render_jobs.hpp"
+
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include <stb_image_write.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+// Camera looking at center from center + distance * direction, with the world
+// Y axis up unless the direction is vertical
+static Camera makeOrbitCamera(
+    const glm::vec3 &center, float distance, const glm::vec3 &direction)
+{
+  const auto up = std::abs(direction.y) > 0.999f ? glm::vec3(0, 0, 1)
+                                                 : glm::vec3(0, 1, 0);
+  return Camera{center + distance * direction, center, up};
+}
+
+std::vector<Camera> generateTurntableViews(const glm::vec3 &center,
+    float distance, float elevation, size_t viewCount)
+{
+  std::vector<Camera> views;
+  views.reserve(viewCount);
+  for (size_t i = 0; i < viewCount; ++i) {
+    const float angle = glm::two_pi<float>() * float(i) / float(viewCount);
+    const glm::vec3 direction(std::cos(elevation) * std::sin(angle),
+        std::sin(elevation), std::cos(elevation) * std::cos(angle));
+    views.push_back(makeOrbitCamera(center, distance, direction));
+  }
+  return views;
+}
+
+std::vector<Camera> generateRandomViews(const glm::vec3 &center,
+    float distance, size_t viewCount, uint32_t seed)
+{
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> distribution(0.f, 1.f);
+  std::vector<Camera> views;
+  views.reserve(viewCount);
+  for (size_t i = 0; i < viewCount; ++i) {
+    // Uniform on the sphere: uniform height and uniform angle around Y
+    const float y = 2.f * distribution(generator) - 1.f;
+    const float angle = glm::two_pi<float>() * distribution(generator);
+    const float r = std::sqrt(std::max(0.f, 1.f - y * y));
+    const glm::vec3 direction(r * std::sin(angle), y, r * std::cos(angle));
+    views.push_back(makeOrbitCamera(center, distance, direction));
+  }
+  return views;
+}
+
+static glm::vec3 catmullRom(const glm::vec3 &p0, const glm::vec3 &p1,
+    const glm::vec3 &p2, const glm::vec3 &p3, float t)
+{
+  const float t2 = t * t;
+  const float t3 = t2 * t;
+  return 0.5f * (2.f * p1 + (p2 - p0) * t +
+                    (2.f * p0 - 5.f * p1 + 4.f * p2 - p3) * t2 +
+                    (3.f * p1 - p0 - 3.f * p2 + p3) * t3);
+}
+
+std::vector<Camera> interpolateCameraPath(
+    const std::vector<Camera> &keyframes, size_t viewCount)
+{
+  std::vector<Camera> views;
+  if (keyframes.empty()) {
+    return views;
+  }
+  views.reserve(viewCount);
+  const size_t lastKeyframe = keyframes.size() - 1;
+  for (size_t i = 0; i < viewCount; ++i) {
+    const float time = viewCount > 1 ? float(i) * lastKeyframe / (viewCount - 1)
+                                     : 0.f;
+    const size_t k = std::min(size_t(time), lastKeyframe);
+    if (k == lastKeyframe) {
+      views.push_back(keyframes[k]);
+      continue;
+    }
+    const float t = time - float(k);
+    // End segments repeat their end keyframe as outer control point
+    const Camera &c0 = keyframes[k ? k - 1 : 0];
+    const Camera &c1 = keyframes[k];
+    const Camera &c2 = keyframes[k + 1];
+    const Camera &c3 = keyframes[std::min(k + 2, lastKeyframe)];
+    const auto eye = catmullRom(c0.eye(), c1.eye(), c2.eye(), c3.eye(), t);
+    const auto center =
+        catmullRom(c0.center(), c1.center(), c2.center(), c3.center(), t);
+    auto up = glm::mix(c1.up(), c2.up(), t);
+    // Opposite up vectors or a degenerate frame keep the previous keyframe up
+    if (glm::length(glm::cross(up, center - eye)) < 1e-6f) {
+      up = c1.up();
+    }
+    views.push_back(Camera{eye, center, up});
+  }
+  return views;
+}
+
+std::vector<Camera> generateJobViews(
+    const RenderJob &job, const glm::vec3 &center, float distance)
+{
+  switch (job.mode) {
+  case RenderJob::Mode::Turntable:
+    return generateTurntableViews(
+        center, distance, job.elevation, job.viewCount);
+  case RenderJob::Mode::Path:
+    return interpolateCameraPath(job.keyframes, job.viewCount);
+  case RenderJob::Mode::Random:
+    return generateRandomViews(center, distance, job.viewCount, job.seed);
+  }
+  return {};
+}
+
+fs::path getViewImagePath(const fs::path &outputPath, size_t viewIdx)
+{
+  std::ostringstream name;
+  name << outputPath.stem().string() << '_' << std::setw(4)
+       << std::setfill('0') << viewIdx << outputPath.extension().string();
+  return outputPath.parent_path() / name.str();
+}
+
+static void writeJsonArray(std::ostream &out, const float *values, size_t count)
+{
+  out << '[';
+  for (size_t i = 0; i < count; ++i) {
+    out << (i ? ", " : "") << values[i];
+  }
+  out << ']';
+}
+
+// Quoted JSON string, with quotes, backslashes and control characters escaped
+static void writeJsonString(std::ostream &out, const std::string &value)
+{
+  out << '"';
+  for (const char c : value) {
+    switch (c) {
+    case '"':
+      out << "\\\"";
+      break;
+    case '\\':
+      out << "\\\\";
+      break;
+    case '\b':
+      out << "\\b";
+      break;
+    case '\f':
+      out << "\\f";
+      break;
+    case '\n':
+      out << "\\n";
+      break;
+    case '\r':
+      out << "\\r";
+      break;
+    case '\t':
+      out << "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[7];
+        std::snprintf(escaped, sizeof(escaped), "\\u%04x", unsigned(c));
+        out << escaped;
+      } else {
+        out << c;
+      }
+    }
+  }
+  out << '"';
+}
+
+bool writeViewsMetadata(const fs::path &path, size_t width, size_t height,
+    const glm::mat4 &projMatrix, const std::vector<Camera> &views,
+    const std::vector<fs::path> &imagePaths)
+{
+  std::ofstream out(path);
+  if (!out) {
+    return false;
+  }
+  out << std::setprecision(9);
+  out << "{\n  \"width\": " << width << ",\n  \"height\": " << height
+      << ",\n  \"projMatrix\": ";
+  writeJsonArray(out, glm::value_ptr(projMatrix), 16);
+  out << ",\n  \"views\": [";
+  for (size_t i = 0; i < views.size(); ++i) {
+    const auto &camera = views[i];
+    const auto viewMatrix = camera.getViewMatrix();
+    // Paths are relative to the metadata file, as written next to it
+    out << (i ? "," : "") << "\n    {\"image\": ";
+    writeJsonString(out, imagePaths[i].filename().generic_string());
+    out << ", \"eye\": ";
+    writeJsonArray(out, glm::value_ptr(camera.eye()), 3);
+    out << ", \"center\": ";
+    writeJsonArray(out, glm::value_ptr(camera.center()), 3);
+    out << ", \"up\": ";
+    writeJsonArray(out, glm::value_ptr(camera.up()), 3);
+    out << ",\n     \"viewMatrix\": ";
+    writeJsonArray(out, glm::value_ptr(viewMatrix), 16);
+    out << "}";
+  }
+  out << "\n  ]\n}\n";
+  return bool(out);
+}
+
+bool runRenderJob(const std::vector<Camera> &views, const fs::path &outputPath,
+    size_t width, size_t height, const RenderToImageOptions &options,
+    const glm::mat4 &projMatrix,
+    const std::function<void(const Camera &, const glm::vec2 &)> &drawView)
+{
+  const auto imageSize = width * height * 3;
+  ImageRenderer imageRenderer(width, height, 3, options);
+  PngWriter pngWriter;
+  std::vector<fs::path> imagePaths;
+  for (size_t viewIdx = 0; viewIdx < views.size(); ++viewIdx) {
+    imagePaths.push_back(getViewImagePath(outputPath, viewIdx));
+    imageRenderer.render(
+        [&](const glm::vec2 &pixelOffset) {
+          drawView(views[viewIdx], pixelOffset);
+        },
+        [&, imagePath = imagePaths.back()](const unsigned char *pixels) {
+          pngWriter.write(imagePath, width, height, 3,
+              std::vector<unsigned char>(pixels, pixels + imageSize));
+        });
+  }
+  imageRenderer.finish();
+  const auto failureCount = pngWriter.finish();
+  if (failureCount) {
+    std::cerr << "Unable to write " << failureCount << " of " << views.size()
+              << " images" << std::endl;
+  }
+
+  auto metadataPath = outputPath;
+  metadataPath.replace_extension(".json");
+  if (!writeViewsMetadata(
+          metadataPath, width, height, projMatrix, views, imagePaths)) {
+    std::cerr << "Unable to write " << metadataPath << std::endl;
+    return false;
+  }
+  std::cout << "Rendered " << views.size() << " views, cameras written to "
+            << metadataPath << std::endl;
+  return failureCount == 0;
+}
+
+void PngWriter::write(const fs::path &path, size_t width, size_t height,
+    size_t numComponents, std::vector<unsigned char> pixels)
+{
+  const size_t maxPending =
+      std::max(size_t(1), size_t(std::thread::hardware_concurrency()));
+  while (m_pending.size() >= maxPending) {
+    m_failureCount += !m_pending.front().get();
+    m_pending.pop_front();
+  }
+  m_pending.push_back(std::async(std::launch::async,
+      [path, width, height, numComponents, pixels = std::move(pixels)]() {
+        return stbi_write_png(path.string().c_str(), int(width), int(height),
+                   int(numComponents), pixels.data(), 0) != 0;
+      }));
+}
+
+size_t PngWriter::finish()
+{
+  while (!m_pending.empty()) {
+    m_failureCount += !m_pending.front().get();
+    m_pending.pop_front();
+  }
+  return m_failureCount;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "cameras.hpp"
+#include "filesystem.hpp"
+#include "images.hpp"
+
+#include <glm/glm.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <string>
+#include <vector>
+
+// Several views of the scene rendered offline in one run, the model being
+// loaded and uploaded once
+struct RenderJob
+{
+  enum class Mode
+  {
+    Turntable, // Orbit around the vertical axis of the scene bounds
+    Path, // Interpolation of keyframe cameras
+    Random // Uniformly distributed directions around the scene bounds
+  };
+
+  Mode mode = Mode::Turntable;
+  size_t viewCount = 0; // 0 for a single image with the default camera
+  float elevation = 0.35f; // Turntable angle above the horizon, in radians
+  uint32_t seed = 0; // Random views
+  std::vector<Camera> keyframes; // Path
+};
+
+// viewCount cameras looking at center from distance, evenly spaced on a circle
+// around the up axis
+std::vector<Camera> generateTurntableViews(const glm::vec3 &center,
+    float distance, float elevation, size_t viewCount);
+
+// viewCount cameras looking at center from distance, in directions uniformly
+// distributed on the sphere
+std::vector<Camera> generateRandomViews(const glm::vec3 &center,
+    float distance, size_t viewCount, uint32_t seed);
+
+// viewCount cameras going through the keyframes at evenly spaced times, eye
+// and center being interpolated with Catmull-Rom splines
+std::vector<Camera> interpolateCameraPath(
+    const std::vector<Camera> &keyframes, size_t viewCount);
+
+// Cameras of the views of job, around a scene centered on center and seen
+// from distance
+std::vector<Camera> generateJobViews(
+    const RenderJob &job, const glm::vec3 &center, float distance);
+
+// Path of view viewIdx of a job writing to outputPath: the stem gets the view
+// index, out.png becomes out_0000.png
+fs::path getViewImagePath(const fs::path &outputPath, size_t viewIdx);
+
+// Write the image path, eye, center, up, view and projection matrices (column
+// major) of each view to a JSON file. Return false on failure.
+bool writeViewsMetadata(const fs::path &path, size_t width, size_t height,
+    const glm::mat4 &projMatrix, const std::vector<Camera> &views,
+    const std::vector<fs::path> &imagePaths);
+
+// Render the views back to back to PNG images named after outputPath, with
+// drawView(camera, pixelOffset) as the drawScene of ImageRenderer::render(),
+// then write their cameras next to them, see writeViewsMetadata(). The GPU
+// draws the next views while the previous ones are read back and encoded.
+// Return false if an image or the metadata could not be written.
+bool runRenderJob(const std::vector<Camera> &views, const fs::path &outputPath,
+    size_t width, size_t height, const RenderToImageOptions &options,
+    const glm::mat4 &projMatrix,
+    const std::function<void(const Camera &, const glm::vec2 &)> &drawView);
+
+// Encodes PNG files in the background, at most one per hardware thread at a
+// time, so that the images are compressed while the next ones are rendered
+class PngWriter
+{
+public:
+  ~PngWriter() { finish(); }
+
+  void write(const fs::path &path, size_t width, size_t height,
+      size_t numComponents, std::vector<unsigned char> pixels);
+
+  // Wait for all images, return the number of files that could not be written
+  size_t finish();
+
+private:
+  std::deque<std::future<bool>> m_pending;
+  size_t m_failureCount = 0;
+};
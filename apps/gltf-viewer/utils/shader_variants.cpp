@@ -0,0 +1,57 @@
+#include "shader_variants.hpp"
+
+uint32_t getMaterialShaderFeatures(const GPUMaterial &material)
+{
+  uint32_t features = 0;
+  if (material.baseColorTexture >= 0) {
+    features |= SHADER_FEATURE_BASE_COLOR_TEXTURE;
+  }
+  if (material.metallicRoughnessTexture >= 0) {
+    features |= SHADER_FEATURE_METALLIC_ROUGHNESS_TEXTURE;
+  }
+  if (material.emissiveTexture >= 0) {
+    features |= SHADER_FEATURE_EMISSIVE_TEXTURE;
+  }
+  if (material.occlusionTexture >= 0) {
+    features |= SHADER_FEATURE_OCCLUSION_TEXTURE;
+  }
+  return features;
+}
+
+std::vector<std::string> getShaderFeatureDefines(uint32_t features)
+{
+  static const char *const defines[SHADER_FEATURE_COUNT] = {
+      "HAS_BASE_COLOR_TEXTURE", "HAS_METALLIC_ROUGHNESS_TEXTURE",
+      "HAS_EMISSIVE_TEXTURE", "HAS_OCCLUSION_TEXTURE",
+      "USE_DIRECTIONAL_LIGHT", "USE_POINT_LIGHT", "USE_SPOT_LIGHT",
+      "USE_PUNCTUAL_LIGHTS", "USE_DIRECTIONAL_SHADOWS", "USE_SKINNING",
+      "USE_SKINNED_VERTICES", "USE_MORPH_TARGETS"};
+  std::vector<std::string> result;
+  for (uint32_t bit = 0; bit < SHADER_FEATURE_COUNT; ++bit) {
+    if (features & (1u << bit)) {
+      result.push_back(defines[bit]);
+    }
+  }
+  return result;
+}
+
+ShaderVariantCache::ShaderVariantCache(
+    std::vector<fs::path> shaderPaths, SetupFunction setup)
+    : m_shaderPaths(std::move(shaderPaths)), m_setup(std::move(setup))
+{
+}
+
+const GLProgram &ShaderVariantCache::get(uint32_t features)
+{
+  const auto it = m_programs.find(features);
+  if (it != end(m_programs)) {
+    return it->second;
+  }
+  const auto &program =
+      m_programs
+          .emplace(features, compileProgram(m_shaderPaths,
+                                 getShaderFeatureDefines(features)))
+          .first->second;
+  m_setup(program);
+  return program;
+}
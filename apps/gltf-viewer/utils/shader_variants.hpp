@@ -0,0 +1,69 @@
+#pragma once
+
+#include "materials.hpp"
+#include "shaders.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Features of a shading program variant. Each bit is a preprocessor define of
+// the shaders, so that a variant only samples the textures of its material
+// and only evaluates the lights in use.
+enum ShaderFeature : uint32_t
+{
+  SHADER_FEATURE_BASE_COLOR_TEXTURE = 1 << 0,
+  SHADER_FEATURE_METALLIC_ROUGHNESS_TEXTURE = 1 << 1,
+  SHADER_FEATURE_EMISSIVE_TEXTURE = 1 << 2,
+  SHADER_FEATURE_OCCLUSION_TEXTURE = 1 << 3,
+  SHADER_FEATURE_DIRECTIONAL_LIGHT = 1 << 4,
+  SHADER_FEATURE_POINT_LIGHT = 1 << 5,
+  SHADER_FEATURE_SPOT_LIGHT = 1 << 6,
+  SHADER_FEATURE_PUNCTUAL_LIGHTS = 1 << 7,
+  SHADER_FEATURE_DIRECTIONAL_SHADOWS = 1 << 8,
+  // Skinned vertices are blended with the joint matrices in the vertex shader,
+  // or read already skinned on the CPU
+  SHADER_FEATURE_SKINNING = 1 << 9,
+  SHADER_FEATURE_SKINNED_VERTICES = 1 << 10,
+  // Active morph targets are blended in the vertex shader
+  SHADER_FEATURE_MORPH_TARGETS = 1 << 11,
+};
+
+// Number of feature bits, feature sets fit in the program field of draw keys
+const uint32_t SHADER_FEATURE_COUNT = 12;
+// Features selecting how vertices are transformed, the only ones of the depth
+// and shadow programs
+const uint32_t SHADER_FEATURE_VERTEX_MASK = SHADER_FEATURE_SKINNING |
+                                            SHADER_FEATURE_SKINNED_VERTICES |
+                                            SHADER_FEATURE_MORPH_TARGETS;
+// Every shading feature, vertex features depend on the instance instead
+const uint32_t SHADER_FEATURE_ALL =
+    ((1u << SHADER_FEATURE_COUNT) - 1) & ~SHADER_FEATURE_VERTEX_MASK;
+
+// Texture features of a material
+uint32_t getMaterialShaderFeatures(const GPUMaterial &material);
+
+// Defines of a feature set: HAS_BASE_COLOR_TEXTURE, USE_POINT_LIGHT, ...
+std::vector<std::string> getShaderFeatureDefines(uint32_t features);
+
+// Programs built from the same shader files, one per feature set. Variants are
+// compiled on first use, setup() is then called once to initialize the state
+// owned by the program (sampler units, uniform block bindings).
+class ShaderVariantCache
+{
+public:
+  using SetupFunction = std::function<void(const GLProgram &)>;
+
+  ShaderVariantCache(std::vector<fs::path> shaderPaths, SetupFunction setup);
+
+  const GLProgram &get(uint32_t features);
+
+  size_t size() const { return m_programs.size(); }
+
+private:
+  std::vector<fs::path> m_shaderPaths;
+  SetupFunction m_setup;
+  std::unordered_map<uint32_t, GLProgram> m_programs;
+};
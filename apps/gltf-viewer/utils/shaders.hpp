@@ -1,6 +1,7 @@
 #pragma once
 
 #include "filesystem.hpp"
+#include <algorithm>
 #include <fstream>
 #include <glad/glad.h>
 #include <iostream>
@@ -9,7 +10,7 @@
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
-
+#include <vector>
 
 class GLShader
 {
@@ -81,6 +82,71 @@ inline std::string loadShaderSource(const fs::path &filepath)
   return buffer.str();
 }
 
+// Replace each #include "file" line by the content of the file, relative to
+// directory. GLSL has no include directive, #line directives keep the line
+// numbers of compilation errors.
+inline std::string resolveShaderIncludes(
+    const std::string &source, const fs::path &directory)
+{
+  std::string result;
+  std::istringstream input(source);
+  std::string line;
+  size_t lineNumber = 0;
+  while (std::getline(input, line)) {
+    ++lineNumber;
+    const auto directivePos = line.find_first_not_of(" \t");
+    if (directivePos == std::string::npos ||
+        line.compare(directivePos, 8, "#include") != 0) {
+      result += line + "\n";
+      continue;
+    }
+    const auto nameBegin = line.find('"', directivePos);
+    const auto nameEnd = line.find('"', nameBegin + 1);
+    if (nameBegin == std::string::npos || nameEnd == std::string::npos) {
+      throw std::runtime_error("Malformed shader include: " + line);
+    }
+    const auto includePath =
+        directory / line.substr(nameBegin + 1, nameEnd - nameBegin - 1);
+    result += "#line 1\n" +
+              resolveShaderIncludes(
+                  loadShaderSource(includePath), includePath.parent_path()) +
+              "#line " + std::to_string(lineNumber + 1) + "\n";
+  }
+  return result;
+}
+
+// Insert a #define line for each define after the #version directive, which
+// must stay the first statement. A #line directive keeps the line numbers of
+// compilation errors.
+inline std::string addShaderDefines(
+    const std::string &source, const std::vector<std::string> &defines)
+{
+  if (defines.empty()) {
+    return source;
+  }
+  std::string defineLines;
+  for (const auto &define : defines) {
+    defineLines += "#define " + define + "\n";
+  }
+
+  size_t insertPos = 0;
+  size_t nextLine = 1;
+  const auto versionPos = source.find("#version");
+  if (versionPos != std::string::npos) {
+    const auto lineEnd = source.find('\n', versionPos);
+    if (lineEnd == std::string::npos) {
+      return source + "\n" + defineLines;
+    }
+    insertPos = lineEnd + 1;
+    nextLine = 1 + std::count(begin(source), begin(source) + insertPos, '\n');
+  }
+  defineLines += "#line " + std::to_string(nextLine) + "\n";
+
+  std::string result = source;
+  result.insert(insertPos, defineLines);
+  return result;
+}
+
 template <typename StringType>
 GLShader compileShader(GLenum type, StringType &&src)
 {
@@ -98,7 +164,11 @@ GLShader compileShader(GLenum type, StringType &&src)
 // *.fs.glsl -> fragment shader
 // *.gs.glsl -> geometry shader
 // *.cs.glsl -> compute shader
-inline GLShader loadShader(const fs::path &shaderPath)
+// Includes are resolved relative to the shader, see resolveShaderIncludes(),
+// and the defines are inserted at the start of the source, see
+// addShaderDefines().
+inline GLShader loadShader(const fs::path &shaderPath,
+    const std::vector<std::string> &defines = {})
 {
   static auto extToShaderType =
       std::unordered_map<std::string, std::pair<GLenum, std::string>>(
@@ -114,11 +184,17 @@ inline GLShader loadShader(const fs::path &shaderPath)
     throw std::runtime_error("Unrecognized shader extension " + ext.string());
   }
 
-  std::clog << "Compiling " << (*it).second.second << " shader " << shaderPath
-            << "\n";
+  std::clog << "Compiling " << (*it).second.second << " shader " << shaderPath;
+  for (const auto &define : defines) {
+    std::clog << " " << define;
+  }
+  std::clog << "\n";
 
   GLShader shader{(*it).second.first};
-  shader.setSource(loadShaderSource(shaderPath));
+  shader.setSource(addShaderDefines(
+      resolveShaderIncludes(
+          loadShaderSource(shaderPath), shaderPath.parent_path()),
+      defines));
   shader.compile();
   if (!shader.getCompileStatus()) {
     std::cerr << "Shader compilation error:" << shader.getInfoLog()
@@ -244,11 +320,12 @@ template <typename CSrc> GLProgram buildComputeProgram(CSrc &&src)
   ;
 }
 
-inline GLProgram compileProgram(std::vector<fs::path> shaderPaths)
+inline GLProgram compileProgram(std::vector<fs::path> shaderPaths,
+    const std::vector<std::string> &defines = {})
 {
   GLProgram program;
   for (const auto &path : shaderPaths) {
-    auto shader = loadShader(path);
+    auto shader = loadShader(path, defines);
     program.attachShader(shader);
   }
   program.link();
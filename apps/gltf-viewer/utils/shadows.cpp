@@ -0,0 +1,214 @@
+#include "shadows.hpp"
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// Radius of a cascade relative to the sphere enclosing its frustum slice
+static const float SHADOW_CASCADE_MARGIN = 1.25f;
+
+std::array<float, SHADOW_CASCADE_COUNT + 1> computeCascadeSplits(
+    float nearPlane, float farPlane, float lambda)
+{
+  std::array<float, SHADOW_CASCADE_COUNT + 1> splits;
+  for (uint32_t i = 0; i <= SHADOW_CASCADE_COUNT; ++i) {
+    const float t = float(i) / SHADOW_CASCADE_COUNT;
+    const float logSplit = nearPlane * std::pow(farPlane / nearPlane, t);
+    const float uniformSplit = nearPlane + (farPlane - nearPlane) * t;
+    splits[i] = lambda * logSplit + (1.f - lambda) * uniformSplit;
+  }
+  return splits;
+}
+
+void fitShadowCascade(ShadowCascade &cascade, const glm::vec3 &lightDirection,
+    const glm::mat4 &cameraToWorldMatrix, const glm::mat4 &projMatrix,
+    float sliceNear, float sliceFar, uint32_t resolution)
+{
+  // Corners of the slice in view space, the center is on the view axis
+  glm::vec3 corners[8];
+  for (size_t i = 0; i < 8; ++i) {
+    const float depth = (i & 4) ? sliceFar : sliceNear;
+    const float x = (i & 1) ? 1.f : -1.f;
+    const float y = (i & 2) ? 1.f : -1.f;
+    corners[i] = glm::vec3(
+        x * depth / projMatrix[0][0], y * depth / projMatrix[1][1], -depth);
+  }
+  // Center of the sphere through the corners of both planes of the slice
+  const float nearHalf2 = glm::dot(glm::vec2(corners[3]), glm::vec2(corners[3]));
+  const float farHalf2 = glm::dot(glm::vec2(corners[7]), glm::vec2(corners[7]));
+  const float centerDepth = std::min(sliceFar,
+      0.5f * (sliceNear + sliceFar) +
+          0.5f * (farHalf2 - nearHalf2) / (sliceFar - sliceNear));
+  const glm::vec3 viewCenter(0, 0, -centerDepth);
+  float sliceRadius = 0.f;
+  for (const auto &corner : corners) {
+    sliceRadius = std::max(sliceRadius, glm::length(corner - viewCenter));
+  }
+  // The radius only depends on the projection, rounding removes float noise
+  const float radius =
+      std::ceil(sliceRadius * SHADOW_CASCADE_MARGIN * 64.f) / 64.f;
+  const glm::vec3 sliceCenter =
+      glm::vec3(cameraToWorldMatrix * glm::vec4(viewCenter, 1));
+
+  if (cascade.radius == radius && cascade.lightDirection == lightDirection &&
+      glm::length(sliceCenter - cascade.center) + sliceRadius <= radius) {
+    return;
+  }
+
+  // Light space rotation, the center moves by whole texels
+  const glm::vec3 up = std::abs(lightDirection.y) > 0.99f ? glm::vec3(1, 0, 0)
+                                                         : glm::vec3(0, 1, 0);
+  const glm::mat4 lightRotation =
+      glm::lookAt(glm::vec3(0), -lightDirection, up);
+  const float texelSize = 2.f * radius / resolution;
+  glm::vec3 lightCenter = glm::vec3(lightRotation * glm::vec4(sliceCenter, 1));
+  lightCenter.x = std::floor(lightCenter.x / texelSize) * texelSize;
+  lightCenter.y = std::floor(lightCenter.y / texelSize) * texelSize;
+
+  cascade.center =
+      glm::vec3(glm::transpose(lightRotation) * glm::vec4(lightCenter, 1));
+  cascade.radius = radius;
+  cascade.lightDirection = lightDirection;
+  cascade.viewMatrix = glm::lookAt(
+      cascade.center + radius * lightDirection, cascade.center, up);
+  cascade.viewProjMatrix =
+      glm::ortho(-radius, radius, -radius, radius, 0.f, 2.f * radius) *
+      cascade.viewMatrix;
+  cascade.dirty = true;
+}
+
+uint32_t getShadowCasterMask(
+    const AABB &bounds, const ShadowCascade *cascades, uint32_t cascadeCount)
+{
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < cascadeCount; ++i) {
+    const auto &cascade = cascades[i];
+    const AABB lightBounds = transformAABB(bounds, cascade.viewMatrix);
+    const float r = cascade.radius;
+    if (lightBounds.max.x >= -r && lightBounds.min.x <= r &&
+        lightBounds.max.y >= -r && lightBounds.min.y <= r &&
+        lightBounds.max.z >= -2.f * r) {
+      mask |= 1u << i;
+    }
+  }
+  return mask;
+}
+
+ShadowRenderer::ShadowRenderer(GLsizei resolution, float splitLambda,
+    float slopeBias, float constantBias) :
+    m_resolution(resolution),
+    m_splitLambda(splitLambda),
+    m_slopeBias(slopeBias),
+    m_constantBias(constantBias)
+{
+  glGenTextures(1, &m_texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, m_texture);
+  glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_DEPTH_COMPONENT32F, m_resolution,
+      m_resolution, SHADOW_CASCADE_COUNT);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE,
+      GL_COMPARE_REF_TO_TEXTURE);
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+  glGenFramebuffers(1, &m_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_texture, 0);
+  glDrawBuffer(GL_NONE);
+  glReadBuffer(GL_NONE);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+  glGenQueries(1, &m_timerQuery);
+}
+
+ShadowRenderer::~ShadowRenderer()
+{
+  glDeleteQueries(1, &m_timerQuery);
+  glDeleteFramebuffers(1, &m_framebuffer);
+  glDeleteTextures(1, &m_texture);
+}
+
+uint32_t ShadowRenderer::fitCascades(const glm::vec3 &lightDirection,
+    const glm::mat4 &cameraToWorldMatrix, const glm::mat4 &projMatrix,
+    float nearPlane, float farPlane)
+{
+  m_splits = computeCascadeSplits(nearPlane, farPlane, m_splitLambda);
+  uint32_t dirtyMask = 0;
+  for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; ++i) {
+    fitShadowCascade(m_cascades[i], lightDirection, cameraToWorldMatrix,
+        projMatrix, m_splits[i], m_splits[i + 1], m_resolution);
+    dirtyMask |= m_cascades[i].dirty ? 1u << i : 0u;
+  }
+  return dirtyMask;
+}
+
+void ShadowRenderer::render(uint32_t updateMask,
+    const glm::mat4 &cameraToWorldMatrix,
+    const std::function<void(const glm::mat4 *)> &drawCasters)
+{
+  GLint previousFramebuffer;
+  GLint previousViewport[4];
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFramebuffer);
+  glGetIntegerv(GL_VIEWPORT, previousViewport);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_framebuffer);
+  glViewport(0, 0, m_resolution, m_resolution);
+  // A pass whose timer is still pending is not timed
+  const bool timePass = !m_timerPending;
+  if (timePass) {
+    glBeginQuery(GL_TIME_ELAPSED, m_timerQuery);
+  }
+
+  const float farDepth = 1.f;
+  glm::mat4 cascadeMatrices[SHADOW_CASCADE_COUNT];
+  for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; ++i) {
+    cascadeMatrices[i] = m_cascades[i].viewProjMatrix * cameraToWorldMatrix;
+    if (updateMask & (1u << i)) {
+      glClearTexSubImage(m_texture, 0, 0, 0, GLint(i), m_resolution,
+          m_resolution, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &farDepth);
+      m_cascades[i].dirty = false;
+    }
+  }
+  // Casters between the light and a cascade are flattened on its near plane
+  glEnable(GL_DEPTH_CLAMP);
+  glEnable(GL_POLYGON_OFFSET_FILL);
+  glPolygonOffset(m_slopeBias, m_constantBias);
+  drawCasters(cascadeMatrices);
+  glDisable(GL_POLYGON_OFFSET_FILL);
+  glDisable(GL_DEPTH_CLAMP);
+
+  if (timePass) {
+    glEndQuery(GL_TIME_ELAPSED);
+    m_timerPending = true;
+  }
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previousFramebuffer);
+  glViewport(previousViewport[0], previousViewport[1], previousViewport[2],
+      previousViewport[3]);
+}
+
+void ShadowRenderer::invalidate(uint32_t cascadeMask)
+{
+  for (uint32_t i = 0; i < SHADOW_CASCADE_COUNT; ++i) {
+    if (cascadeMask & (1u << i)) {
+      m_cascades[i].dirty = true;
+    }
+  }
+}
+
+void ShadowRenderer::readTimer()
+{
+  if (!m_timerPending) {
+    return;
+  }
+  GLuint available = GL_FALSE;
+  glGetQueryObjectuiv(m_timerQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+  if (available) {
+    GLuint64 elapsed;
+    glGetQueryObjectui64v(m_timerQuery, GL_QUERY_RESULT, &elapsed);
+    m_passTime = elapsed * 1e-9;
+    m_timerPending = false;
+  }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "bvh.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <array>
+#include <cstdint>
+#include <functional>
+
+// Number of cascades of the directional light shadow map, also declared in the
+// shadow geometry shader and the PBR fragment shader
+const uint32_t SHADOW_CASCADE_COUNT = 4;
+
+// View depths of the cascade boundaries, from nearPlane to farPlane. Splits
+// blend logarithmic and uniform distributions with lambda in [0, 1] (Zhang et
+// al., "Parallel-Split Shadow Maps for Large-scale Virtual Environments").
+std::array<float, SHADOW_CASCADE_COUNT + 1> computeCascadeSplits(
+    float nearPlane, float farPlane, float lambda);
+
+// Orthographic shadow map of a directional light covering a sphere around a
+// slice of the view frustum. The sphere is larger than the slice so that the
+// cascade can be reused while the camera moves inside it.
+struct ShadowCascade
+{
+  glm::vec3 center = glm::vec3(0); // World space
+  float radius = 0.f; // 0 until the cascade is fitted
+  glm::vec3 lightDirection = glm::vec3(0); // Toward the light, world space
+  glm::mat4 viewMatrix = glm::mat4(1); // World to light space
+  glm::mat4 viewProjMatrix = glm::mat4(1); // World to clip space
+  bool dirty = true; // The shadow map layer must be rendered again
+
+  // Size of a shadow map texel in world units
+  float texelSize(uint32_t resolution) const
+  {
+    return 2.f * radius / resolution;
+  }
+};
+
+// Fit the cascade to the view frustum slice between two view depths. Nothing
+// changes while the light direction is the same and the slice stays inside
+// the sphere of the cascade. Otherwise the sphere is centered on the slice,
+// snapped to shadow map texels so that static shadows don't shimmer, and the
+// cascade is marked dirty. projMatrix must be a symmetric perspective.
+void fitShadowCascade(ShadowCascade &cascade, const glm::vec3 &lightDirection,
+    const glm::mat4 &cameraToWorldMatrix, const glm::mat4 &projMatrix,
+    float sliceNear, float sliceFar, uint32_t resolution);
+
+// Bit i is set if the box may cast a shadow in cascade i: it overlaps the
+// footprint of the cascade and is not behind its far plane. Boxes between the
+// light and the cascade are kept, the shadow pass clamps their depth.
+uint32_t getShadowCasterMask(
+    const AABB &bounds, const ShadowCascade *cascades, uint32_t cascadeCount);
+
+// Cascaded shadow maps of the directional light, in the layers of a depth
+// texture array. A cascade is only rendered again when its light, its
+// footprint or its casters change.
+class ShadowRenderer
+{
+public:
+  // Cascades split the view frustum with splitLambda, see
+  // computeCascadeSplits(). Casters are biased by glPolygonOffset(slopeBias,
+  // constantBias).
+  ShadowRenderer(GLsizei resolution, float splitLambda, float slopeBias,
+      float constantBias);
+
+  ~ShadowRenderer();
+
+  ShadowRenderer(const ShadowRenderer &) = delete;
+
+  ShadowRenderer &operator=(const ShadowRenderer &) = delete;
+
+  // Fit the cascades to the slices of the view frustum, return the mask of
+  // the dirty cascades
+  uint32_t fitCascades(const glm::vec3 &lightDirection,
+      const glm::mat4 &cameraToWorldMatrix, const glm::mat4 &projMatrix,
+      float nearPlane, float farPlane);
+
+  // Render the cascades of updateMask again, they are no longer dirty.
+  // drawCasters(cascadeMatrices) is called with the shadow framebuffer bound,
+  // the matrices take view space positions to the clip space of each cascade.
+  void render(uint32_t updateMask, const glm::mat4 &cameraToWorldMatrix,
+      const std::function<void(const glm::mat4 *)> &drawCasters);
+
+  // Mark the cascades of cascadeMask dirty, eg. after their casters moved
+  void invalidate(uint32_t cascadeMask);
+
+  // Read the GPU time of the last render() once available, without waiting
+  void readTimer();
+
+  const std::array<ShadowCascade, SHADOW_CASCADE_COUNT> &cascades() const
+  {
+    return m_cascades;
+  }
+
+  // View depths of the cascade boundaries of the last fit
+  const std::array<float, SHADOW_CASCADE_COUNT + 1> &splits() const
+  {
+    return m_splits;
+  }
+
+  GLsizei resolution() const { return m_resolution; }
+
+  GLuint texture() const { return m_texture; }
+
+  double lastPassTime() const { return m_passTime; }
+
+private:
+  GLsizei m_resolution;
+  float m_splitLambda;
+  float m_slopeBias;
+  float m_constantBias;
+  std::array<ShadowCascade, SHADOW_CASCADE_COUNT> m_cascades;
+  std::array<float, SHADOW_CASCADE_COUNT + 1> m_splits = {};
+  GLuint m_texture = 0;
+  GLuint m_framebuffer = 0;
+  GLuint m_timerQuery = 0;
+  bool m_timerPending = false;
+  double m_passTime = 0.; // In seconds
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Minimal 4-wide float vector: one SSE2 register when available, a scalar
+// fallback otherwise. Used for vertex data stored 4 floats at a time (vec3
+// padded with a fourth component), and for keyframes of 4 tracks gathered in
+// the lanes of a register.
+#if defined(__SSE2__)
+typedef __m128 float4;
+
+inline float4 load4(const float *p) { return _mm_loadu_ps(p); }
+inline void store4(float *p, float4 v) { _mm_storeu_ps(p, v); }
+inline float4 splat4(float s) { return _mm_set1_ps(s); }
+inline float4 set4(float a, float b, float c, float d)
+{
+  return _mm_setr_ps(a, b, c, d);
+}
+inline float4 add4(float4 a, float4 b) { return _mm_add_ps(a, b); }
+inline float4 sub4(float4 a, float4 b) { return _mm_sub_ps(a, b); }
+inline float4 mul4(float4 a, float4 b) { return _mm_mul_ps(a, b); }
+inline float4 min4(float4 a, float4 b) { return _mm_min_ps(a, b); }
+inline float4 max4(float4 a, float4 b) { return _mm_max_ps(a, b); }
+
+inline float dot4(float4 a, float4 b)
+{
+  const __m128 m = _mm_mul_ps(a, b);
+  const __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(s, s)));
+}
+#else
+struct float4
+{
+  float v[4];
+};
+
+inline float4 load4(const float *p) { return {{p[0], p[1], p[2], p[3]}}; }
+inline void store4(float *p, float4 a) { std::copy(a.v, a.v + 4, p); }
+inline float4 splat4(float s) { return {{s, s, s, s}}; }
+inline float4 set4(float a, float b, float c, float d)
+{
+  return {{a, b, c, d}};
+}
+inline float4 add4(float4 a, float4 b)
+{
+  return {{a.v[0] + b.v[0], a.v[1] + b.v[1], a.v[2] + b.v[2], a.v[3] + b.v[3]}};
+}
+inline float4 sub4(float4 a, float4 b)
+{
+  return {{a.v[0] - b.v[0], a.v[1] - b.v[1], a.v[2] - b.v[2], a.v[3] - b.v[3]}};
+}
+inline float4 mul4(float4 a, float4 b)
+{
+  return {{a.v[0] * b.v[0], a.v[1] * b.v[1], a.v[2] * b.v[2], a.v[3] * b.v[3]}};
+}
+inline float4 min4(float4 a, float4 b)
+{
+  return {{std::min(a.v[0], b.v[0]), std::min(a.v[1], b.v[1]),
+      std::min(a.v[2], b.v[2]), std::min(a.v[3], b.v[3])}};
+}
+inline float4 max4(float4 a, float4 b)
+{
+  return {{std::max(a.v[0], b.v[0]), std::max(a.v[1], b.v[1]),
+      std::max(a.v[2], b.v[2]), std::max(a.v[3], b.v[3])}};
+}
+inline float dot4(float4 a, float4 b)
+{
+  return a.v[0] * b.v[0] + a.v[1] * b.v[1] + a.v[2] * b.v[2] + a.v[3] * b.v[3];
+}
+#endif
+
+inline float4 normalize4(float4 v)
+{
+  const float length2 = dot4(v, v);
+  return length2 > 0.f ? mul4(v, splat4(1.f / std::sqrt(length2))) : v;
+}
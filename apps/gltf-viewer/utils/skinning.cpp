@@ -0,0 +1,426 @@
+#include "skinning.hpp"
+
+#include "gltf.hpp"
+#include "parallel.hpp"
+#include "simd.hpp"
+
+#include <glm/gtc/type_ptr.hpp>
+
+#include <algorithm>
+#include <limits>
+
+// Joint matrices and vertices processed by each task of the thread pool
+static const size_t JOINTS_PER_TASK = 1024;
+static const size_t SKINNED_VERTICES_PER_TASK = 4096;
+
+std::vector<Skin> readSkins(const tinygltf::Model &model)
+{
+  std::vector<Skin> skins(model.skins.size());
+  std::vector<float> values;
+  for (size_t i = 0; i < model.skins.size(); ++i) {
+    const auto &gltfSkin = model.skins[i];
+    auto &skin = skins[i];
+    skin.joints = gltfSkin.joints;
+    skin.inverseBindMatrices.assign(skin.joints.size(), glm::mat4(1));
+    if (readAccessorAsFloats(model, gltfSkin.inverseBindMatrices, values) ==
+        16) {
+      const size_t count =
+          std::min(skin.joints.size(), values.size() / 16);
+      for (size_t j = 0; j < count; ++j) {
+        skin.inverseBindMatrices[j] = glm::make_mat4(&values[16 * j]);
+      }
+    }
+    // Joints outside of the node array are bound to the scene origin
+    for (auto &joint : skin.joints) {
+      if (joint < 0 || size_t(joint) >= model.nodes.size()) {
+        joint = -1;
+      }
+    }
+  }
+  return skins;
+}
+
+void computeJointPalette(const std::vector<glm::mat4> &nodeMatrices,
+    const std::vector<Skin> &skins, JointPalette &palette)
+{
+  palette.skinOffsets.resize(skins.size());
+  uint32_t jointCount = 0;
+  for (size_t i = 0; i < skins.size(); ++i) {
+    palette.skinOffsets[i] = jointCount;
+    jointCount += uint32_t(skins[i].joints.size());
+  }
+  palette.matrices.resize(jointCount);
+
+  parallelFor(jointCount, JOINTS_PER_TASK,
+      [&](size_t beginJoint, size_t endJoint) {
+        size_t skinIdx = std::upper_bound(begin(palette.skinOffsets),
+                             end(palette.skinOffsets), uint32_t(beginJoint)) -
+                         begin(palette.skinOffsets) - 1;
+        for (size_t i = beginJoint; i < endJoint; ++i) {
+          while (skinIdx + 1 < skins.size() &&
+                 i >= palette.skinOffsets[skinIdx + 1]) {
+            ++skinIdx;
+          }
+          const auto &skin = skins[skinIdx];
+          const size_t joint = i - palette.skinOffsets[skinIdx];
+          const int nodeIdx = skin.joints[joint];
+          palette.matrices[i] =
+              (nodeIdx >= 0 ? nodeMatrices[nodeIdx] : glm::mat4(1)) *
+              skin.inverseBindMatrices[joint];
+        }
+      });
+}
+
+bool readSkinnedPrimitive(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, const Skin &skin, size_t jointCount,
+    SkinnedPrimitive &skinned)
+{
+  jointCount = std::min(jointCount, skin.joints.size());
+  const auto jointsIt = primitive.attributes.find("JOINTS_0");
+  const auto weightsIt = primitive.attributes.find("WEIGHTS_0");
+  if (jointsIt == end(primitive.attributes) ||
+      weightsIt == end(primitive.attributes) || skin.joints.empty()) {
+    return false;
+  }
+  std::vector<glm::vec3> positions;
+  std::vector<float> joints, weights, normals;
+  if (!readPrimitivePositions(model, primitive, positions) ||
+      readAccessorAsFloats(model, jointsIt->second, joints) != 4 ||
+      readAccessorAsFloats(model, weightsIt->second, weights) != 4 ||
+      joints.size() != 4 * positions.size() ||
+      weights.size() != 4 * positions.size()) {
+    return false;
+  }
+  const auto normalsIt = primitive.attributes.find("NORMAL");
+  if (normalsIt == end(primitive.attributes) ||
+      readAccessorAsFloats(model, normalsIt->second, normals) != 3 ||
+      normals.size() != 3 * positions.size()) {
+    normals.assign(3 * positions.size(), 0.f);
+  }
+
+  const size_t vertexCount = positions.size();
+  skinned.positions.resize(vertexCount);
+  skinned.normals.resize(vertexCount);
+  skinned.joints.resize(vertexCount);
+  skinned.weights.resize(vertexCount);
+  skinned.jointBounds.assign(skin.joints.size(), AABB());
+  for (size_t i = 0; i < vertexCount; ++i) {
+    const glm::vec4 position(positions[i], 1);
+    skinned.positions[i] = position;
+    skinned.normals[i] =
+        glm::vec4(normals[3 * i], normals[3 * i + 1], normals[3 * i + 2], 0);
+
+    glm::uvec4 vertexJoints(0);
+    glm::vec4 vertexWeights(0);
+    for (int c = 0; c < 4; ++c) {
+      const auto joint = uint32_t(joints[4 * i + c]);
+      if (joint < jointCount && weights[4 * i + c] > 0.f) {
+        vertexJoints[c] = joint;
+        vertexWeights[c] = weights[4 * i + c];
+        skinned.jointBounds[joint].expand(
+            glm::vec3(skin.inverseBindMatrices[joint] * position));
+      }
+    }
+    const float weightSum =
+        vertexWeights.x + vertexWeights.y + vertexWeights.z + vertexWeights.w;
+    skinned.joints[i] = vertexJoints;
+    skinned.weights[i] =
+        weightSum > 0.f ? vertexWeights / weightSum : glm::vec4(1, 0, 0, 0);
+  }
+  return true;
+}
+
+AABB computeSkinnedBounds(const SkinnedPrimitive &primitive, const Skin &skin,
+    const std::vector<glm::mat4> &nodeMatrices, const AABB &morphDeltas)
+{
+  const bool isMorphed = morphDeltas.min != glm::vec3(0) ||
+                         morphDeltas.max != glm::vec3(0);
+  AABB bounds;
+  for (size_t joint = 0; joint < primitive.jointBounds.size(); ++joint) {
+    AABB jointBounds = primitive.jointBounds[joint];
+    if (jointBounds.isEmpty()) {
+      continue;
+    }
+    if (isMorphed) {
+      // Minkowski sum with the deltas in the space of the joint
+      const AABB deltas = transformAABB(morphDeltas,
+          glm::mat4(glm::mat3(skin.inverseBindMatrices[joint])));
+      jointBounds.min += deltas.min;
+      jointBounds.max += deltas.max;
+    }
+    const int nodeIdx = skin.joints[joint];
+    bounds.expand(transformAABB(jointBounds,
+        nodeIdx >= 0 ? nodeMatrices[nodeIdx] : glm::mat4(1)));
+  }
+  return bounds;
+}
+
+// Skin vertices [first, last) of a job. The joint matrices of a vertex are
+// blended column by column, then applied to its morphed position and normal.
+static void skinVertices(const SkinningJob &job, size_t first, size_t last)
+{
+  const auto &primitive = *job.pPrimitive;
+  const float *matrices = glm::value_ptr(job.pJointMatrices[0]);
+  float *output = glm::value_ptr(job.pOutput[0]);
+  for (size_t i = first; i < last; ++i) {
+    const glm::uvec4 &joints = primitive.joints[i];
+    const glm::vec4 &weights = primitive.weights[i];
+    float4 columns[4];
+    for (int c = 0; c < 4; ++c) {
+      columns[c] = splat4(0.f);
+    }
+    for (int k = 0; k < 4; ++k) {
+      if (weights[k] == 0.f) {
+        continue;
+      }
+      const float *matrix = matrices + 16 * joints[k];
+      const float4 weight = splat4(weights[k]);
+      for (int c = 0; c < 4; ++c) {
+        columns[c] = add4(columns[c], mul4(weight, load4(matrix + 4 * c)));
+      }
+    }
+    glm::vec4 p = primitive.positions[i];
+    glm::vec4 n = primitive.normals[i];
+    for (size_t k = 0; k < job.morphWeightCount; ++k) {
+      const auto &morphWeight = job.pMorphWeights[k];
+      const glm::vec4 *deltas =
+          &job.pMorphTargets
+               ->deltas[2 * (size_t(morphWeight.target) *
+                                    job.pMorphTargets->vertexCount +
+                                i)];
+      p += morphWeight.weight * deltas[0];
+      n += morphWeight.weight * deltas[1];
+    }
+    const float4 position = add4(
+        add4(mul4(columns[0], splat4(p.x)), mul4(columns[1], splat4(p.y))),
+        add4(mul4(columns[2], splat4(p.z)), columns[3]));
+    const float4 normal = add4(
+        add4(mul4(columns[0], splat4(n.x)), mul4(columns[1], splat4(n.y))),
+        mul4(columns[2], splat4(n.z)));
+    store4(output + 8 * i, position);
+    store4(output + 8 * i + 4, normalize4(normal));
+  }
+}
+
+void runSkinningJobs(const std::vector<SkinningJob> &jobs)
+{
+  // Index of the first vertex of each job in the batch
+  std::vector<size_t> firstVertices(jobs.size());
+  size_t vertexCount = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    firstVertices[i] = vertexCount;
+    vertexCount += jobs[i].pPrimitive->positions.size();
+  }
+  parallelFor(vertexCount, SKINNED_VERTICES_PER_TASK,
+      [&](size_t beginVertex, size_t endVertex) {
+        size_t jobIdx = std::upper_bound(begin(firstVertices),
+                            end(firstVertices), beginVertex) -
+                        begin(firstVertices) - 1;
+        for (size_t vertex = beginVertex; vertex < endVertex; ++jobIdx) {
+          const auto &job = jobs[jobIdx];
+          const size_t jobEnd =
+              firstVertices[jobIdx] + job.pPrimitive->positions.size();
+          const size_t last = std::min(endVertex, jobEnd);
+          skinVertices(job, vertex - firstVertices[jobIdx],
+              last - firstVertices[jobIdx]);
+          vertex = last;
+        }
+      });
+}
+
+SkinningSystem::SkinningSystem(const tinygltf::Model &model,
+    const std::vector<DrawInstance> &instances, bool gpuSkinning) :
+    m_skins(readSkins(model)),
+    m_instanceSkinning(instances.size(), -1),
+    m_gpuSkinning(gpuSkinning)
+{
+  // Smallest joint count of the skins each draw primitive is used with
+  std::map<uint32_t, size_t> primitiveJointCounts;
+  for (const DrawInstance &instance : instances) {
+    const int skinIdx = model.nodes[instance.nodeIdx].skin;
+    if (skinIdx < 0 || size_t(skinIdx) >= m_skins.size()) {
+      continue;
+    }
+    const size_t jointCount = m_skins[skinIdx].joints.size();
+    auto it = primitiveJointCounts.emplace(instance.primitive, jointCount).first;
+    it->second = std::min(it->second, jointCount);
+  }
+
+  std::map<std::pair<uint32_t, int>, uint32_t> primitiveIndices;
+  for (uint32_t instanceIdx = 0; instanceIdx < instances.size();
+       ++instanceIdx) {
+    const DrawInstance &instance = instances[instanceIdx];
+    const int skinIdx = model.nodes[instance.nodeIdx].skin;
+    if (skinIdx < 0 || size_t(skinIdx) >= m_skins.size()) {
+      continue;
+    }
+    const auto key = std::make_pair(instance.primitive, skinIdx);
+    auto it = primitiveIndices.find(key);
+    if (it == end(primitiveIndices)) {
+      SkinnedPrimitive skinned;
+      const bool isSkinned = readSkinnedPrimitive(model,
+          model.meshes[instance.meshIdx].primitives[instance.primitiveIdx],
+          m_skins[skinIdx], primitiveJointCounts[instance.primitive], skinned);
+      it = primitiveIndices
+               .emplace(key, isSkinned ? uint32_t(m_primitives.size())
+                                       : std::numeric_limits<uint32_t>::max())
+               .first;
+      if (isSkinned) {
+        m_primitives.push_back(std::move(skinned));
+      }
+    }
+    if (it->second == std::numeric_limits<uint32_t>::max()) {
+      continue;
+    }
+    m_instanceSkinning[instanceIdx] = int(m_instances.size());
+    m_instances.push_back(SkinnedInstance{
+        instanceIdx, skinIdx, it->second, uint32_t(m_vertexCount)});
+    m_vertexCount += m_primitives[it->second].positions.size();
+  }
+  m_skinnedVertices.resize(2 * m_vertexCount);
+
+  // Joints and weights pairs, weights stored as float bits. The sanitized
+  // attributes are the same for all the skins of a primitive.
+  std::vector<glm::uvec4> attributes;
+  for (const auto &primitiveIndex : primitiveIndices) {
+    const uint32_t primitive = primitiveIndex.first.first;
+    if (primitiveIndex.second == std::numeric_limits<uint32_t>::max() ||
+        !m_attributeVertices.emplace(primitive, attributes.size() / 2)
+             .second) {
+      continue;
+    }
+    const SkinnedPrimitive &skinned = m_primitives[primitiveIndex.second];
+    for (size_t i = 0; i < skinned.joints.size(); ++i) {
+      attributes.push_back(skinned.joints[i]);
+      attributes.push_back(glm::floatBitsToUint(skinned.weights[i]));
+    }
+  }
+  glGenBuffers(1, &m_attributeBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, m_attributeBuffer);
+  glBufferData(GL_ARRAY_BUFFER, attributes.size() * sizeof(glm::uvec4),
+      attributes.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glGenBuffers(1, &m_buffer);
+  glBindBuffer(GL_TEXTURE_BUFFER, m_buffer);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(glm::mat4), nullptr, GL_STREAM_DRAW);
+  glGenTextures(1, &m_texture);
+  glBindTexture(GL_TEXTURE_BUFFER, m_texture);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, m_buffer);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+SkinningSystem::~SkinningSystem()
+{
+  glDeleteTextures(1, &m_texture);
+  glDeleteBuffers(1, &m_buffer);
+  glDeleteBuffers(1, &m_attributeBuffer);
+}
+
+void SkinningSystem::update(const std::vector<glm::mat4> &nodeMatrices,
+    const MorphSystem &morph, std::vector<DrawInstance> &instances,
+    std::vector<MovedInstance> &moved)
+{
+  std::swap(m_palette.matrices, m_previousMatrices);
+  computeJointPalette(nodeMatrices, m_skins, m_palette);
+  m_skinMoved.assign(m_skins.size(), 1);
+  if (m_previousMatrices.size() == m_palette.matrices.size()) {
+    for (size_t i = 0; i < m_skins.size(); ++i) {
+      const auto first = m_palette.skinOffsets[i];
+      const auto last = first + m_skins[i].joints.size();
+      m_skinMoved[i] = !std::equal(begin(m_palette.matrices) + first,
+          begin(m_palette.matrices) + last, begin(m_previousMatrices) + first);
+    }
+  }
+  for (const auto &skinned : m_instances) {
+    if (m_skinMoved[skinned.skinIdx]) {
+      moved.push_back(MovedInstance{
+          skinned.instanceIdx, instances[skinned.instanceIdx].worldBounds});
+    }
+  }
+  parallelFor(m_instances.size(), 64, [&](size_t beginInstance,
+                                          size_t endInstance) {
+    for (size_t i = beginInstance; i < endInstance; ++i) {
+      const SkinnedInstance &skinned = m_instances[i];
+      AABB morphDeltas(glm::vec3(0), glm::vec3(0));
+      const MorphWeight *morphWeights;
+      size_t morphWeightCount;
+      if (const MorphTargets *targets = morph.getActiveWeights(
+              skinned.instanceIdx, morphWeights, morphWeightCount)) {
+        morphDeltas = computeMorphedBounds(
+            morphDeltas, *targets, morphWeights, morphWeightCount);
+      }
+      instances[skinned.instanceIdx].worldBounds =
+          computeSkinnedBounds(m_primitives[skinned.primitiveIdx],
+              m_skins[skinned.skinIdx], nodeMatrices, morphDeltas);
+    }
+  });
+  glBindBuffer(GL_TEXTURE_BUFFER, m_buffer);
+  if (m_gpuSkinning) {
+    glBufferData(GL_TEXTURE_BUFFER, m_palette.matrices.size() * sizeof(glm::mat4),
+        m_palette.matrices.data(), GL_STREAM_DRAW);
+  } else {
+    m_jobs.clear();
+    for (const auto &skinned : m_instances) {
+      SkinningJob job{&m_primitives[skinned.primitiveIdx],
+          &m_palette.matrices[m_palette.skinOffsets[skinned.skinIdx]],
+          &m_skinnedVertices[2 * size_t(skinned.firstVertex)]};
+      job.pMorphTargets = morph.getActiveWeights(
+          skinned.instanceIdx, job.pMorphWeights, job.morphWeightCount);
+      m_jobs.push_back(job);
+    }
+    runSkinningJobs(m_jobs);
+    glBufferData(GL_TEXTURE_BUFFER, m_skinnedVertices.size() * sizeof(glm::vec4),
+        m_skinnedVertices.data(), GL_STREAM_DRAW);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+GLuint SkinningSystem::getSkinOffset(uint32_t instanceIdx, GLint baseVertex) const
+{
+  const SkinnedInstance &skinned = m_instances[m_instanceSkinning[instanceIdx]];
+  return m_gpuSkinning ? m_palette.skinOffsets[skinned.skinIdx]
+                       : skinned.firstVertex - GLuint(baseVertex);
+}
+
+void SkinningSystem::setJointAttributes(
+    uint32_t primitive, GLuint jointsIndex, GLuint weightsIndex) const
+{
+  const auto it = m_attributeVertices.find(primitive);
+  if (it == end(m_attributeVertices)) {
+    return;
+  }
+  const size_t offset = 2 * it->second * sizeof(glm::uvec4);
+  glBindBuffer(GL_ARRAY_BUFFER, m_attributeBuffer);
+  glEnableVertexAttribArray(jointsIndex);
+  glVertexAttribIPointer(jointsIndex, 4, GL_UNSIGNED_INT,
+      2 * sizeof(glm::uvec4), (const GLvoid *)offset);
+  glEnableVertexAttribArray(weightsIndex);
+  glVertexAttribPointer(weightsIndex, 4, GL_FLOAT, GL_FALSE,
+      2 * sizeof(glm::uvec4), (const GLvoid *)(offset + sizeof(glm::uvec4)));
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void SkinningSystem::getPosedPositions(uint32_t instanceIdx,
+    const MorphSystem &morph, std::vector<glm::vec3> &positions) const
+{
+  const SkinnedInstance &skinned = m_instances[m_instanceSkinning[instanceIdx]];
+  const SkinnedPrimitive &primitive = m_primitives[skinned.primitiveIdx];
+  const glm::vec4 *vertices = &m_skinnedVertices[2 * size_t(skinned.firstVertex)];
+  std::vector<glm::vec4> posedVertices;
+  if (m_gpuSkinning) {
+    posedVertices.resize(2 * primitive.positions.size());
+    SkinningJob job{&primitive,
+        &m_palette.matrices[m_palette.skinOffsets[skinned.skinIdx]],
+        posedVertices.data()};
+    job.pMorphTargets = morph.getActiveWeights(
+        instanceIdx, job.pMorphWeights, job.morphWeightCount);
+    runSkinningJobs({job});
+    vertices = posedVertices.data();
+  }
+  positions.resize(primitive.positions.size());
+  for (size_t i = 0; i < positions.size(); ++i) {
+    positions[i] = glm::vec3(vertices[2 * i]);
+  }
+}
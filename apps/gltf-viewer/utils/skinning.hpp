@@ -0,0 +1,179 @@
+#pragma once
+
+#include "bvh.hpp"
+#include "draw_instances.hpp"
+#include "morph.hpp"
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <tiny_gltf.h>
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Joints of a glTF skin, with their inverse bind matrices (identity when the
+// skin has none)
+struct Skin
+{
+  std::vector<int> joints;
+  std::vector<glm::mat4> inverseBindMatrices;
+};
+
+std::vector<Skin> readSkins(const tinygltf::Model &model);
+
+// Joint matrices of all skins concatenated in one array. A joint matrix takes
+// a vertex from mesh space to world space: world matrix of the joint times its
+// inverse bind matrix. The transform of the skinned node is ignored, as
+// required by glTF.
+struct JointPalette
+{
+  std::vector<uint32_t> skinOffsets; // First matrix of each skin
+  std::vector<glm::mat4> matrices;
+};
+
+// Compute the joint matrices of all skins in one batch from the world matrices
+// of all nodes, joints are processed in parallel on the thread pool
+void computeJointPalette(const std::vector<glm::mat4> &nodeMatrices,
+    const std::vector<Skin> &skins, JointPalette &palette);
+
+// Vertices of a primitive with JOINTS_0 and WEIGHTS_0 attributes, for CPU
+// skinning and bounds, and the joint attributes of GPU skinning. Weights are
+// normalized, influences of joints missing from the skin are removed.
+struct SkinnedPrimitive
+{
+  std::vector<glm::vec4> positions; // w = 1
+  std::vector<glm::vec4> normals; // w = 0
+  std::vector<glm::uvec4> joints;
+  std::vector<glm::vec4> weights;
+  // Per joint of the skin, bounds of the vertices it influences in the space
+  // of the joint (mesh positions transformed by its inverse bind matrix)
+  std::vector<AABB> jointBounds;
+};
+
+// Return false if the primitive has no skinning attributes. Joints at or above
+// jointCount are removed too, it is the smallest joint count of the skins the
+// primitive is used with, so that they all skin it the same way.
+bool readSkinnedPrimitive(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, const Skin &skin, size_t jointCount,
+    SkinnedPrimitive &skinned);
+
+// World space bounds of the skinned primitive in the current pose: union of
+// the joint bounds moved by the world matrices of their nodes. A skinned
+// vertex is a weighted average of its positions moved by each joint, so it
+// lies in this box. morphDeltas bounds the offsets added to the mesh positions
+// by the active morph targets, it widens each joint box before the transform.
+AABB computeSkinnedBounds(const SkinnedPrimitive &primitive, const Skin &skin,
+    const std::vector<glm::mat4> &nodeMatrices,
+    const AABB &morphDeltas = AABB(glm::vec3(0), glm::vec3(0)));
+
+// Skinned vertices of a primitive, written to output as (position, normal)
+// pairs in world space. Active morph targets are blended before skinning.
+struct SkinningJob
+{
+  const SkinnedPrimitive *pPrimitive;
+  const glm::mat4 *pJointMatrices; // First matrix of the skin in the palette
+  glm::vec4 *pOutput;
+  const MorphTargets *pMorphTargets = nullptr;
+  const MorphWeight *pMorphWeights = nullptr;
+  size_t morphWeightCount = 0;
+};
+
+// Linear blend skinning of the vertices of all jobs with SIMD. The vertices of
+// all jobs are split in ranges processed in parallel on the thread pool, so
+// that one large mesh and many small instances are balanced the same way.
+void runSkinningJobs(const std::vector<SkinningJob> &jobs);
+
+// Skinned instances of the scene: the joint matrices of all skins are computed
+// in one batch when transforms change. GPU skinning blends them in the vertex
+// shader. CPU skinning skins the vertices on the thread pool for software GL,
+// and is the only path with merged geometry or vertex pulling whose vertex
+// formats have no joints. Bounds come from the joint bounds in both cases.
+class SkinningSystem
+{
+public:
+  SkinningSystem(const tinygltf::Model &model,
+      const std::vector<DrawInstance> &instances, bool gpuSkinning);
+
+  ~SkinningSystem();
+
+  SkinningSystem(const SkinningSystem &) = delete;
+
+  SkinningSystem &operator=(const SkinningSystem &) = delete;
+
+  // Pose the skinned instances after a transform change from the world
+  // matrices of all nodes: joint matrices, world bounds, and vertices when
+  // skinning on the CPU. Bounds and CPU skinned vertices include the active
+  // morph targets, morph must be updated before. Instances whose skin moved
+  // are appended to moved.
+  void update(const std::vector<glm::mat4> &nodeMatrices,
+      const MorphSystem &morph, std::vector<DrawInstance> &instances,
+      std::vector<MovedInstance> &moved);
+
+  bool empty() const { return m_instances.empty(); }
+
+  bool isSkinned(uint32_t instanceIdx) const
+  {
+    return m_instanceSkinning[instanceIdx] >= 0;
+  }
+
+  // Skin offset attribute of a skinned instance: its first joint matrix with
+  // GPU skinning, otherwise its first CPU skinned vertex minus the base vertex
+  // of its draw, since they are indexed by gl_VertexID
+  GLuint getSkinOffset(uint32_t instanceIdx, GLint baseVertex) const;
+
+  // Point the joints and weights attributes of the bound VAO of a skinned
+  // primitive at its sanitized joints and weights, for GPU skinning. The raw
+  // JOINTS_0 values could index the palette of another skin.
+  void setJointAttributes(
+      uint32_t primitive, GLuint jointsIndex, GLuint weightsIndex) const;
+
+  // World space positions of a skinned instance in the current pose, morphed
+  // first, for picking. They are read back from the CPU skinned vertices, or
+  // skinned on demand from the joint matrices with GPU skinning.
+  void getPosedPositions(uint32_t instanceIdx, const MorphSystem &morph,
+      std::vector<glm::vec3> &positions) const;
+
+  // The next update() must be called before drawing
+  void setGpuSkinning(bool gpuSkinning) { m_gpuSkinning = gpuSkinning; }
+
+  bool gpuSkinning() const { return m_gpuSkinning; }
+
+  // Texture buffer of the joint matrices, or of the CPU skinned vertices
+  GLuint texture() const { return m_texture; }
+
+  size_t instanceCount() const { return m_instances.size(); }
+
+  size_t vertexCount() const { return m_vertexCount; }
+
+  size_t jointCount() const { return m_palette.matrices.size(); }
+
+private:
+  // Draw instance of a node with a skin. Its matrices are the identity: joint
+  // matrices and CPU skinned vertices are in world space.
+  struct SkinnedInstance
+  {
+    uint32_t instanceIdx;
+    int skinIdx;
+    uint32_t primitiveIdx; // Vertices and joint bounds in m_primitives
+    uint32_t firstVertex; // Of the instance in the CPU skinned vertices
+  };
+
+  std::vector<Skin> m_skins;
+  // A primitive is read once for each skin it is used with
+  std::vector<SkinnedPrimitive> m_primitives;
+  std::vector<SkinnedInstance> m_instances;
+  std::vector<int> m_instanceSkinning; // Per draw instance, index in m_instances
+  size_t m_vertexCount = 0;
+  // Per draw primitive, its first vertex in the joint attributes buffer
+  std::map<uint32_t, size_t> m_attributeVertices;
+  bool m_gpuSkinning;
+  JointPalette m_palette;
+  std::vector<glm::mat4> m_previousMatrices; // Palette of the last update
+  std::vector<uint8_t> m_skinMoved; // Per skin, set if its joints moved
+  std::vector<glm::vec4> m_skinnedVertices; // Position and normal pairs
+  std::vector<SkinningJob> m_jobs;
+  GLuint m_buffer = 0;
+  GLuint m_texture = 0;
+  GLuint m_attributeBuffer = 0; // Joints and weights of GPU skinning
+};
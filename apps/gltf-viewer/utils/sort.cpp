@@ -0,0 +1,80 @@
+#include "sort.hpp"
+#include "parallel.hpp"
+
+#include <array>
+
+// Below this number of items per thread, sorting is done on a single thread
+static const size_t RADIX_SORT_MIN_ITEMS_PER_THREAD = 4096;
+
+void radixSort(std::vector<SortItem> &items, std::vector<SortItem> &scratch)
+{
+  const size_t count = items.size();
+  if (count <= 1) {
+    return;
+  }
+  scratch.resize(count);
+
+  const auto &pool = ThreadPool::instance();
+  const size_t rangeCount = std::max(size_t(1),
+      std::min(pool.threadCount(), count / RADIX_SORT_MIN_ITEMS_PER_THREAD));
+  const size_t rangeSize = (count + rangeCount - 1) / rangeCount;
+
+  using Histogram = std::array<size_t, 256>;
+  std::vector<Histogram> histograms(rangeCount);
+
+  auto *pSource = &items;
+  auto *pDestination = &scratch;
+  for (uint32_t shift = 0; shift < 64; shift += 8) {
+    const auto &source = *pSource;
+    auto &destination = *pDestination;
+
+    parallelFor(rangeCount, 1, [&](size_t rangeBegin, size_t rangeEnd) {
+      for (auto rangeIdx = rangeBegin; rangeIdx < rangeEnd; ++rangeIdx) {
+        auto &histogram = histograms[rangeIdx];
+        histogram.fill(0);
+        const auto end = std::min(count, (rangeIdx + 1) * rangeSize);
+        for (auto i = rangeIdx * rangeSize; i < end; ++i) {
+          ++histogram[(source[i].key >> shift) & 0xFF];
+        }
+      }
+    });
+
+    // Skip the pass if all keys have the same digit
+    const auto firstDigit = (source[0].key >> shift) & 0xFF;
+    size_t firstDigitCount = 0;
+    for (const auto &histogram : histograms) {
+      firstDigitCount += histogram[firstDigit];
+    }
+    if (firstDigitCount == count) {
+      continue;
+    }
+
+    // Turn histograms into scatter offsets: for a given digit, items of the
+    // first range go before items of the second range, and so on, which keeps
+    // the sort stable
+    size_t offset = 0;
+    for (size_t digit = 0; digit < 256; ++digit) {
+      for (auto &histogram : histograms) {
+        const auto digitCount = histogram[digit];
+        histogram[digit] = offset;
+        offset += digitCount;
+      }
+    }
+
+    parallelFor(rangeCount, 1, [&](size_t rangeBegin, size_t rangeEnd) {
+      for (auto rangeIdx = rangeBegin; rangeIdx < rangeEnd; ++rangeIdx) {
+        auto &offsets = histograms[rangeIdx];
+        const auto end = std::min(count, (rangeIdx + 1) * rangeSize);
+        for (auto i = rangeIdx * rangeSize; i < end; ++i) {
+          destination[offsets[(source[i].key >> shift) & 0xFF]++] = source[i];
+        }
+      }
+    });
+
+    std::swap(pSource, pDestination);
+  }
+
+  if (pSource != &items) {
+    items.swap(scratch);
+  }
+}
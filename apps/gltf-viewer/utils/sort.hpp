@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+// A 64-bit sort key with its payload (typically an index in another array)
+struct SortItem
+{
+  uint64_t key;
+  uint32_t value;
+};
+
+// Stable LSD radix sort on the keys, 8 bits per pass. Histograms and scatters
+// are computed on the thread pool for large inputs, and passes on bytes that
+// are identical for all keys are skipped. scratch is used as temporary storage
+// so that it can be reused from one frame to the next.
+void radixSort(std::vector<SortItem> &items, std::vector<SortItem> &scratch);
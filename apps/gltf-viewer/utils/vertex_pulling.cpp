@@ -0,0 +1,96 @@
+#include "vertex_pulling.hpp"
+
+#include "gltf.hpp"
+
+#include <cstring>
+
+namespace {
+
+// Sparse accessors are densified as floats and appended to the vertex data,
+// the shader cannot apply their substitutions
+PulledAttributeFormat getAttributeFormat(const tinygltf::Model &model,
+    const tinygltf::Primitive &primitive, const char *name,
+    const std::vector<size_t> &bufferOffsets, std::vector<uint32_t> &vertexData)
+{
+  PulledAttributeFormat format = {VERTEX_PULLING_NO_DATA, 0, 0, 0};
+  const auto it = primitive.attributes.find(name);
+  if (it == end(primitive.attributes)) {
+    return format;
+  }
+  const auto &accessor = model.accessors[(*it).second];
+  if (accessor.sparse.isSparse || accessor.bufferView < 0) {
+    std::vector<float> values;
+    const int componentCount =
+        readAccessorAsFloats(model, (*it).second, values);
+    if (!componentCount) {
+      return format;
+    }
+    format.offset = uint32_t(vertexData.size() * sizeof(uint32_t));
+    format.stride = uint32_t(componentCount * sizeof(float));
+    format.componentType = TINYGLTF_COMPONENT_TYPE_FLOAT;
+    format.normalized = 0;
+    const size_t first = vertexData.size();
+    vertexData.resize(first + values.size());
+    std::memcpy(
+        &vertexData[first], values.data(), values.size() * sizeof(float));
+    return format;
+  }
+  const auto &bufferView = model.bufferViews[accessor.bufferView];
+  format.offset = uint32_t(bufferOffsets[bufferView.buffer] +
+                           bufferView.byteOffset + accessor.byteOffset);
+  format.stride = uint32_t(accessor.ByteStride(bufferView));
+  format.componentType = uint32_t(accessor.componentType);
+  format.normalized = accessor.normalized ? 1 : 0;
+  return format;
+}
+
+} // namespace
+
+VertexPullingData buildVertexPullingData(const tinygltf::Model &model)
+{
+  VertexPullingData data;
+
+  std::vector<size_t> bufferOffsets(model.buffers.size());
+  size_t totalSize = 0;
+  for (size_t i = 0; i < model.buffers.size(); ++i) {
+    bufferOffsets[i] = totalSize;
+    totalSize += (model.buffers[i].data.size() + 3) & ~size_t(3);
+  }
+  data.vertexData.resize(totalSize / sizeof(uint32_t));
+  for (size_t i = 0; i < model.buffers.size(); ++i) {
+    std::memcpy(reinterpret_cast<unsigned char *>(data.vertexData.data()) +
+                    bufferOffsets[i],
+        model.buffers[i].data.data(), model.buffers[i].data.size());
+  }
+
+  for (const auto &mesh : model.meshes) {
+    for (const auto &primitive : mesh.primitives) {
+      PulledPrimitiveFormat format = {};
+      format.position = getAttributeFormat(
+          model, primitive, "POSITION", bufferOffsets, data.vertexData);
+      format.normal = getAttributeFormat(
+          model, primitive, "NORMAL", bufferOffsets, data.vertexData);
+      format.texCoords = getAttributeFormat(
+          model, primitive, "TEXCOORD_0", bufferOffsets, data.vertexData);
+      format.indexOffset = VERTEX_PULLING_NO_DATA;
+      if (primitive.indices >= 0 &&
+          model.accessors[primitive.indices].bufferView >= 0) {
+        const auto &accessor = model.accessors[primitive.indices];
+        const auto &bufferView = model.bufferViews[accessor.bufferView];
+        format.indexOffset = uint32_t(bufferOffsets[bufferView.buffer] +
+                                      bufferView.byteOffset +
+                                      accessor.byteOffset);
+        format.indexSize = uint32_t(
+            tinygltf::GetComponentSizeInBytes(accessor.componentType));
+        format.vertexCount = uint32_t(accessor.count);
+      } else {
+        const auto it = primitive.attributes.find("POSITION");
+        format.vertexCount = it != end(primitive.attributes)
+                                 ? uint32_t(model.accessors[(*it).second].count)
+                                 : 0;
+      }
+      data.primitives.push_back(format);
+    }
+  }
+  return data;
+}
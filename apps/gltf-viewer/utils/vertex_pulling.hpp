@@ -0,0 +1,51 @@
+#pragma once
+
+#include <tiny_gltf.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Shader storage buffer binding points of the vertex pulling shader, after
+// MATERIAL_TABLE_BINDING
+const unsigned int VERTEX_DATA_BINDING = 1;
+const unsigned int PRIMITIVE_FORMATS_BINDING = 2;
+
+// Marks a missing attribute or a non indexed primitive
+const uint32_t VERTEX_PULLING_NO_DATA = ~0u;
+
+// C++ mirrors of the std430 structs of vertex_pulling.vs.glsl. Offsets are in
+// bytes from the start of the vertex data buffer.
+struct PulledAttributeFormat
+{
+  uint32_t offset; // VERTEX_PULLING_NO_DATA if the attribute is missing
+  uint32_t stride;
+  uint32_t componentType; // GL_BYTE, GL_UNSIGNED_BYTE, ..., GL_FLOAT
+  uint32_t normalized;
+};
+
+struct PulledPrimitiveFormat
+{
+  uint32_t indexOffset; // VERTEX_PULLING_NO_DATA for non indexed primitives
+  uint32_t indexSize; // 1, 2 or 4 bytes
+  uint32_t vertexCount; // Number of vertices to draw (indices if indexed)
+  uint32_t pad;
+  PulledAttributeFormat position;
+  PulledAttributeFormat normal;
+  PulledAttributeFormat texCoords;
+};
+
+static_assert(offsetof(PulledPrimitiveFormat, position) == 16, "std430 mismatch");
+static_assert(sizeof(PulledPrimitiveFormat) == 64, "std430 mismatch");
+
+// All glTF buffers concatenated (each one starting on a 4 bytes boundary) and
+// the format of each primitive, ordered by mesh then by primitive. Attributes
+// keep their original encoding, they are decoded by the vertex shader, except
+// sparse attributes appended as floats after the buffers.
+struct VertexPullingData
+{
+  std::vector<uint32_t> vertexData;
+  std::vector<PulledPrimitiveFormat> primitives;
+};
+
+VertexPullingData buildVertexPullingData(const tinygltf::Model &model);